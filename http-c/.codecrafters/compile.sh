@@ -8,4 +8,6 @@
 
 set -e # Exit on failure
 
-gcc -lcurl -lz -o /tmp/codecrafters-build-http-server-c app/*.c
+# Libraries go after the sources: the linker only keeps a library that
+# something before it uses (zlib for gzip, OpenSSL for TLS)
+gcc -o /tmp/codecrafters-build-http-server-c app/*.c -lz -lssl -lcrypto
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "pool.h"
+#include "log.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+void arena_init(struct arena *arena) {
+	arena->block_count = 0;
+	arena->used = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (arena->block_count > 0) {
+		size_t newest = (size_t)arena->block_count - 1;
+		if (arena->blocks[newest].size - arena->used >= size) {
+			void *at = arena->blocks[newest].base + arena->used;
+			arena->used += size;
+			return at;
+		}
+	}
+	// Start a new block; what is left of the current one goes unused until
+	// the arena is rewound
+	if (arena->block_count == ARENA_MAX_BLOCKS) {
+		log_error("Arena full (%zu bytes requested)", size);
+		return NULL;
+	}
+	size_t block_size = pool_size(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+	char *block = pool_acquire(block_size);
+	if (block == NULL) {
+		log_error("Pool allocation failed for arena: %m");
+		return NULL;
+	}
+	arena->blocks[arena->block_count].base = block;
+	arena->blocks[arena->block_count].size = block_size;
+	arena->block_count++;
+	arena->used = size;
+	return block;
+}
+
+void arena_reset(struct arena *arena) {
+	for (int i = 1; i < arena->block_count; i++) {
+		pool_release(arena->blocks[i].base);
+	}
+	if (arena->block_count > 1) {
+		arena->block_count = 1;
+	}
+	arena->used = 0;
+}
+
+void arena_release(struct arena *arena) {
+	for (int i = 0; i < arena->block_count; i++) {
+		pool_release(arena->blocks[i].base);
+	}
+	arena_init(arena);
+}
@@ -0,0 +1,36 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Blocks an arena can hold at once; a streaming deflate state takes six
+#define ARENA_MAX_BLOCKS 12
+// Smallest block taken from the pool
+#define ARENA_BLOCK_SIZE 4096
+
+// Bump allocator for the objects that live as long as one request (upload
+// state, multipart ranges, a deflate stream). Its blocks come from the
+// buffer pool; nothing is freed individually, the whole arena is rewound
+// between requests and handed back to the pool when the connection goes idle.
+struct arena {
+	struct {
+		char *base;
+		size_t size;
+	} blocks[ARENA_MAX_BLOCKS];
+	int block_count;
+	size_t used; // bytes taken from the newest block
+};
+
+void arena_init(struct arena *arena);
+
+// `size` bytes aligned for any type, or NULL if the pool is exhausted or the
+// arena is full
+void *arena_alloc(struct arena *arena, size_t size);
+
+// Forget every allocation, keeping the first block for the next request
+void arena_reset(struct arena *arena);
+
+// Give every block back to the pool
+void arena_release(struct arena *arena);
+
+#endif
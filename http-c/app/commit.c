@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commit.h"
+#include "log.h"
+#include "metrics.h"
+#include "open_files.h"
+
+// Commits that came back to one worker, newest first. The commit thread
+// pushes, the worker takes the whole list at once.
+struct commit_inbox {
+	_Atomic(struct commit *) done;
+	int event_fd;
+};
+
+// Uploads submitted since the commit thread last looked, oldest first
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t submitted;
+	struct commit *head;
+	struct commit **tail;
+	unsigned window_ms;
+	pthread_t thread;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.submitted = PTHREAD_COND_INITIALIZER,
+	.tail = &queue.head,
+};
+
+static _Thread_local struct commit_inbox *thread_inbox;
+
+struct commit_inbox *commit_inbox_new(void) {
+	struct commit_inbox *inbox = malloc(sizeof(*inbox));
+	if (inbox == NULL) {
+		log_error("Failed to allocate a commit inbox: %m");
+		return NULL;
+	}
+	atomic_init(&inbox->done, NULL);
+	inbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inbox->event_fd < 0) {
+		log_error("eventfd failed for a commit inbox: %m");
+		free(inbox);
+		return NULL;
+	}
+	return inbox;
+}
+
+int commit_inbox_fd(const struct commit_inbox *inbox) {
+	return inbox->event_fd;
+}
+
+void commit_inbox_attach(struct commit_inbox *inbox) {
+	thread_inbox = inbox;
+}
+
+struct commit *commit_submit(int fd, const char *temp_name, const char *name, struct connection *conn) {
+	if (thread_inbox == NULL) {
+		log_error("Upload finished on a thread with no commit inbox");
+		return NULL;
+	}
+	size_t name_len = strlen(name) + 1;
+	size_t temp_name_len = strlen(temp_name) + 1;
+	struct commit *commit = malloc(sizeof(*commit) + name_len + temp_name_len);
+	if (commit == NULL) {
+		log_error("Failed to allocate a commit: %m");
+		return NULL;
+	}
+	commit->next = NULL;
+	commit->inbox = thread_inbox;
+	commit->conn = conn;
+	commit->fd = fd;
+	commit->result = 0;
+	memcpy(commit->names, name, name_len);
+	memcpy(commit->names + name_len, temp_name, temp_name_len);
+	commit->name = commit->names;
+	commit->temp_name = commit->names + name_len;
+
+	pthread_mutex_lock(&queue.lock);
+	int was_empty = queue.head == NULL;
+	*queue.tail = commit;
+	queue.tail = &commit->next;
+	pthread_mutex_unlock(&queue.lock);
+	if (was_empty) {
+		pthread_cond_signal(&queue.submitted);
+	}
+	return commit;
+}
+
+struct commit *commit_inbox_take(struct commit_inbox *inbox) {
+	uint64_t count;
+	if (read(inbox->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		log_error("Reading the commit eventfd failed: %m");
+	}
+	struct commit *done = atomic_exchange_explicit(&inbox->done, NULL, memory_order_acquire);
+	// Newest first as pushed; turn it around
+	struct commit *ordered = NULL;
+	while (done != NULL) {
+		struct commit *next = done->next;
+		done->next = ordered;
+		ordered = done;
+		done = next;
+	}
+	return ordered;
+}
+
+void commit_free(struct commit *commit) {
+	free(commit);
+}
+
+// --- Commit thread ---
+
+// commit->result while a renamed file waits for its directory's fsync
+#define COMMIT_RENAMED 1
+
+// The directory a name is in, relative to the served one ("." at the top)
+static void parent_name(const char *name, char *out, size_t out_size) {
+	const char *slash = strrchr(name, '/');
+	if (slash == NULL) {
+		snprintf(out, out_size, ".");
+		return;
+	}
+	snprintf(out, out_size, "%.*s", (int)(slash - name), name);
+}
+
+static int sync_directory(const char *dir) {
+	int fd = open_beneath(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		log_error("Failed to open directory %s to sync it: %m", dir);
+		return -1;
+	}
+	int result = fsync(fd);
+	if (result != 0) {
+		log_error("fsync failed for directory %s: %m", dir);
+	}
+	close(fd);
+	return result;
+}
+
+// Sync a group of complete uploads and move them into place
+static void commit_group(struct commit *group) {
+	int dir_fd = open_files_dir_fd();
+	size_t count = 0;
+	// Start writeback of every file before waiting on any of them, so the
+	// device sees the whole group's data at once
+	for (struct commit *commit = group; commit != NULL; commit = commit->next) {
+		sync_file_range(commit->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		count++;
+	}
+	for (struct commit *commit = group; commit != NULL; commit = commit->next) {
+		if (fdatasync(commit->fd) != 0) {
+			log_error("fdatasync failed for upload %s: %m", commit->name);
+			commit->result = -1;
+		}
+		if (close(commit->fd) != 0) {
+			log_error("Failed to close upload file: %m");
+			commit->result = -1;
+		}
+		commit->fd = -1;
+		if (commit->result == 0 && renameat(dir_fd, commit->temp_name, dir_fd, commit->name) == 0) {
+			commit->result = COMMIT_RENAMED;
+		} else {
+			if (commit->result == 0) {
+				log_error("Failed to move upload into place: %m");
+			}
+			commit->result = -1;
+			unlinkat(dir_fd, commit->temp_name, 0);
+		}
+	}
+	// A rename is durable once its directory is: one fsync per directory
+	// covers every upload that went into it
+	char dir[1024];
+	char other_dir[1024];
+	for (struct commit *commit = group; commit != NULL; commit = commit->next) {
+		if (commit->result != COMMIT_RENAMED) {
+			continue;
+		}
+		parent_name(commit->name, dir, sizeof(dir));
+		int result = sync_directory(dir);
+		for (struct commit *other = commit; other != NULL; other = other->next) {
+			if (other->result != COMMIT_RENAMED) {
+				continue;
+			}
+			parent_name(other->name, other_dir, sizeof(other_dir));
+			if (strcmp(dir, other_dir) == 0) {
+				other->result = result;
+			}
+		}
+	}
+	metrics_durable_group(count);
+}
+
+// Hand each commit back to the worker that submitted it
+static void commit_deliver(struct commit *group) {
+	while (group != NULL) {
+		struct commit *commit = group;
+		group = group->next;
+		struct commit_inbox *inbox = commit->inbox;
+		struct commit *head = atomic_load_explicit(&inbox->done, memory_order_relaxed);
+		do {
+			commit->next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&inbox->done, &head, commit, memory_order_release,
+														memory_order_relaxed));
+		// Once per inbox per group would do; a spare wakeup finds nothing
+		uint64_t one = 1;
+		if (write(inbox->event_fd, &one, sizeof(one)) < 0) {
+			log_error("Writing the commit eventfd failed: %m");
+		}
+	}
+}
+
+static void *commit_main(void *arg) {
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&queue.lock);
+		while (queue.head == NULL) {
+			pthread_cond_wait(&queue.submitted, &queue.lock);
+		}
+		pthread_mutex_unlock(&queue.lock);
+		if (queue.window_ms > 0) {
+			// Let the uploads finishing about now join this group
+			struct timespec window = { queue.window_ms / 1000, (long)(queue.window_ms % 1000) * 1000000L };
+			nanosleep(&window, NULL);
+		}
+		pthread_mutex_lock(&queue.lock);
+		struct commit *group = queue.head;
+		queue.head = NULL;
+		queue.tail = &queue.head;
+		pthread_mutex_unlock(&queue.lock);
+
+		commit_group(group);
+		commit_deliver(group);
+	}
+	return NULL;
+}
+
+int commit_init(unsigned window_ms) {
+	queue.window_ms = window_ms;
+	int result = pthread_create(&queue.thread, NULL, commit_main, NULL);
+	if (result != 0) {
+		errno = result;
+		log_error("pthread_create failed for the commit thread: %m");
+		return -1;
+	}
+	return 0;
+}
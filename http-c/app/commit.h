@@ -0,0 +1,53 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+// Durable uploads (--durable-uploads). A finished upload is not answered
+// until its data and its new name are on disk. Syncing costs a disk flush
+// whatever the amount of data, so rather than each upload paying for its own,
+// a single commit thread gathers the uploads finished within --commit-window
+// of each other and syncs them as a group: it starts writeback on every file
+// at once, waits for each with fdatasync(), renames them into place and
+// fsyncs each directory they went into once. The whole group is then handed
+// back to the workers that submitted it, which answer the uploads.
+
+struct connection;
+struct commit_inbox;
+
+// An upload waiting to be made durable, or done and on its way back
+struct commit {
+	struct commit *next;
+	struct commit_inbox *inbox; // of the worker that submitted it
+	struct connection *conn;    // waiting for the answer; NULL once it is gone
+	int fd;                     // the temporary file, closed by the commit thread
+	int result;                 // 0 once durable, -1 if anything failed
+	const char *name;           // relative to the served directory, like temp_name
+	const char *temp_name;
+	char names[];
+};
+
+// Start the commit thread. After the first upload of a group arrives it waits
+// `window_ms` for more to join (0: the group is whatever arrived while the
+// previous one was syncing). Returns 0 on success, -1 on error.
+int commit_init(unsigned window_ms);
+
+// A worker's inbox for finished commits, with an eventfd (commit_inbox_fd())
+// that becomes readable when some arrive. NULL on error.
+struct commit_inbox *commit_inbox_new(void);
+int commit_inbox_fd(const struct commit_inbox *inbox);
+
+// Make `inbox` the calling worker thread's: commits it submits come back there
+void commit_inbox_attach(struct commit_inbox *inbox);
+
+// Hand the complete temporary file `fd` at `temp_name` to the commit thread,
+// to be synced and renamed over `name` for `conn`. The fd is taken over.
+// Returns NULL if out of memory, or if the calling thread has no inbox; the
+// caller then still owns the fd.
+struct commit *commit_submit(int fd, const char *temp_name, const char *name, struct connection *conn);
+
+// The commits that came back to `inbox`, in the order they were submitted.
+// Each is given to connection_commit_done(), which frees it.
+struct commit *commit_inbox_take(struct commit_inbox *inbox);
+
+void commit_free(struct commit *commit);
+
+#endif
@@ -0,0 +1,2112 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "connection.h"
+#include "server.h"
+#include "file_cache.h"
+#include "open_files.h"
+#include "gzip.h"
+#include "upload.h"
+#include "commit.h"
+#include "range.h"
+#include "http_date.h"
+#include "validators.h"
+#include "pool.h"
+#include "metrics.h"
+#include "log.h"
+#include "router.h"
+#include "tls.h"
+#include "http2.h"
+#include "restart.h"
+
+// A complete, preformatted status line and its length, so starting a
+// response is a single copy
+struct status_line {
+	const char *text;
+	size_t len;
+};
+#define STATUS_LINE(reason) \
+	((struct status_line){ "HTTP/1.1 " reason "\r\n", sizeof("HTTP/1.1 " reason "\r\n") - 1 })
+
+// Status lines used by the routes
+#define STATUS_200 STATUS_LINE("200 OK")
+#define STATUS_201 STATUS_LINE("201 Created")
+#define STATUS_206 STATUS_LINE("206 Partial Content")
+#define STATUS_304 STATUS_LINE("304 Not Modified")
+#define STATUS_400 STATUS_LINE("400 Bad Request")
+#define STATUS_404 STATUS_LINE("404 Not Found")
+#define STATUS_405 STATUS_LINE("405 Method Not Allowed")
+#define STATUS_413 STATUS_LINE("413 Content Too Large")
+#define STATUS_414 STATUS_LINE("414 URI Too Long")
+#define STATUS_416 STATUS_LINE("416 Range Not Satisfiable")
+#define STATUS_431 STATUS_LINE("431 Request Header Fields Too Large")
+#define STATUS_500 STATUS_LINE("500 Internal Server Error")
+#define STATUS_505 STATUS_LINE("505 HTTP Version Not Supported")
+
+// Connections between connection_new() and connection_free(), across all workers
+static atomic_int open_connections;
+
+// Allocate and initialize a connection for `fd`
+static struct connection *connection_alloc(int fd) {
+	struct connection *conn = pool_acquire(sizeof(*conn));
+	if (conn == NULL) {
+		log_error("Pool allocation failed for connection: %m");
+		return NULL;
+	}
+	conn->io.kind = IO_CONNECTION;
+	conn->io.fd = fd;
+	conn->state = CONN_READING_HEADERS;
+	// A new socket may already have data queued and is writable
+	conn->readable = 1;
+	conn->writable = 1;
+	conn->peer_closed = 0;
+	conn->keep_alive = 0;
+	conn->http10 = 0;
+	conn->tls = NULL;
+	conn->lingered = 0;
+	conn->h2 = NULL;
+	conn->h2_stream = 0;
+	conn->h2_parent = NULL;
+	conn->in_cap = g_parser_limits.max_header_bytes;
+	conn->in = NULL; // Taken from the pool when the first bytes arrive
+	conn->in_start = 0;
+	conn->in_len = 0;
+	http_parser_init(&conn->parser, &conn->request, &g_parser_limits);
+	conn->path = NULL;
+	conn->request_start = 0;
+	conn->route = METRICS_ROUTE_OTHER;
+	conn->status = 0;
+	timer_init(&conn->timer);
+	conn->timeout = CONN_TIMEOUT_NONE;
+	conn->requests = 0;
+	conn->timeout_request = 0;
+	arena_init(&conn->arena);
+	conn->upload = NULL;
+	conn->body_discard = 0;
+	conn->commit = NULL;
+	conn->commit_result = 0;
+	conn->out = NULL;
+	conn->out_len = conn->out_cap = conn->out_sent = 0;
+	conn->body_refs = 1;
+	conn->out_ref = NULL;
+	conn->out_ref_len = conn->out_ref_sent = conn->out_ref_at = 0;
+	conn->cached = NULL;
+	conn->cached_sent = 0;
+	conn->file = NULL;
+	conn->file_fd = -1;
+	conn->file_offset = 0;
+	conn->file_remaining = 0;
+	conn->gzip = NULL;
+	conn->multipart = NULL;
+	conn->ring_slot = -1;
+	conn->ring_inflight = 0;
+	conn->ring_recv_armed = 0;
+	conn->ring_send_armed = 0;
+	conn->ring_closing = 0;
+	return conn;
+}
+
+struct connection *connection_new(int fd) {
+	struct connection *conn = connection_alloc(fd);
+	if (conn == NULL) {
+		return NULL;
+	}
+	atomic_fetch_add_explicit(&open_connections, 1, memory_order_relaxed);
+	metrics_connection_opened();
+	return conn;
+}
+
+struct connection *connection_new_stream(struct connection *parent) {
+	struct connection *conn = connection_alloc(-1);
+	if (conn == NULL) {
+		return NULL;
+	}
+	conn->h2_stream = 1;
+	conn->h2_parent = parent;
+	// The response is read back whenever the stream's turn comes, so echoed
+	// bodies are copied rather than left pointing into `in`
+	conn->body_refs = 0;
+	return conn;
+}
+
+void connection_free(struct connection *conn) {
+	timer_cancel(&conn->timer);
+	if (conn->upload != NULL) {
+		upload_abort(conn->upload);
+	}
+	if (conn->commit != NULL) {
+		// The commit completes all the same, unanswered. Only this worker
+		// reads the field, once the commit is back.
+		conn->commit->conn = NULL;
+	}
+	if (conn->cached != NULL) {
+		file_cache_release(conn->cached);
+	}
+	if (conn->file != NULL) {
+		open_file_release(conn->file);
+	}
+	if (conn->gzip != NULL) {
+		deflateEnd(conn->gzip);
+	}
+	arena_release(&conn->arena);
+	pool_release(conn->out);
+	pool_release(conn->in);
+	if (conn->tls != NULL) {
+		tls_free(conn->tls);
+	}
+	if (conn->h2 != NULL) {
+		http2_free(conn->h2);
+	}
+	if (conn->h2_stream) {
+		pool_release(conn); // No socket, and not counted
+		return;
+	}
+	// Closing the socket also removes it from the epoll interest list.
+	close(conn->io.fd);
+	pool_release(conn);
+	atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+	metrics_connection_closed();
+}
+
+int connection_admit(int fd, int tls) {
+	// Workers check and count separately, so the limit can be overshot by a
+	// connection or two per worker; it only has to hold roughly
+	if (g_max_connections <= 0 ||
+		atomic_load_explicit(&open_connections, memory_order_relaxed) < g_max_connections) {
+		return 1;
+	}
+	if (tls) {
+		// A 503 would take a handshake first, which is the work we are
+		// trying to shed
+		close(fd);
+		metrics_connection_rejected();
+		return 0;
+	}
+	static const char overloaded[] = "HTTP/1.1 503 Service Unavailable\r\n"
+									 "Retry-After: " CONN_RETRY_AFTER "\r\n"
+									 "Connection: close\r\n"
+									 "Content-Length: 0\r\n\r\n";
+	// Closing with unread input makes the kernel reset the connection, which
+	// can destroy the response before the client reads it; take whatever
+	// has arrived already. Best effort, like the send: a socket we refuse
+	// gets no buffers and no further attention.
+	char discard[1024];
+	for (int i = 0; i < 4 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++) {
+	}
+	send(fd, overloaded, sizeof(overloaded) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(fd);
+	metrics_connection_rejected();
+	return 0;
+}
+
+int connection_open_count(void) {
+	return atomic_load_explicit(&open_connections, memory_order_relaxed);
+}
+
+void connection_drain(struct connection *conn) {
+	conn->keep_alive = 0;
+	// Its timer was taken off the wheel; make sure the caller's
+	// connection_update_timeout() arms it again
+	conn->timeout = CONN_TIMEOUT_NONE;
+}
+
+int connection_start_tls(struct connection *conn) {
+	conn->tls = tls_new(conn->io.fd);
+	if (conn->tls == NULL) {
+		return -1;
+	}
+	conn->state = CONN_HANDSHAKE;
+	return 0;
+}
+
+// --- Timeouts ---
+
+static const char *const timeout_names[] = {
+	[CONN_TIMEOUT_NONE] = "no",
+	[CONN_TIMEOUT_HEADER] = "header",
+	[CONN_TIMEOUT_BODY] = "body",
+	[CONN_TIMEOUT_WRITE] = "write",
+	[CONN_TIMEOUT_IDLE] = "idle",
+};
+
+// Which timeout applies to the connection as it is now
+static enum conn_timeout timeout_phase(const struct connection *conn) {
+	if (connection_has_pending_output(conn)) {
+		return CONN_TIMEOUT_WRITE;
+	}
+	switch (conn->state) {
+	case CONN_HANDSHAKE:
+		return CONN_TIMEOUT_HEADER;
+	case CONN_READING_HEADERS:
+		if (conn->h2 != NULL && http2_busy(conn->h2)) {
+			// HTTP/2 streams are waiting on the client, for request body
+			// data or room in a flow-control window
+			return CONN_TIMEOUT_BODY;
+		}
+		// A fresh connection has as long to send its first request as a
+		// started request has to finish its headers
+		return conn->requests == 0 || conn->in_start < conn->in_len ? CONN_TIMEOUT_HEADER : CONN_TIMEOUT_IDLE;
+	case CONN_READING_BODY:
+		return CONN_TIMEOUT_BODY;
+	case CONN_COMMITTING:
+		break; // Up to the disk, not the client
+	case CONN_WRITING:
+		return CONN_TIMEOUT_WRITE;
+	case CONN_LINGERING:
+		return CONN_TIMEOUT_IDLE;
+	case CONN_CLOSED:
+		break;
+	}
+	return CONN_TIMEOUT_NONE;
+}
+
+static unsigned timeout_ms(enum conn_timeout timeout) {
+	switch (timeout) {
+	case CONN_TIMEOUT_HEADER:
+		return g_timeouts.header_ms;
+	case CONN_TIMEOUT_BODY:
+		return g_timeouts.body_ms;
+	case CONN_TIMEOUT_WRITE:
+		return g_timeouts.write_ms;
+	case CONN_TIMEOUT_IDLE:
+		return g_timeouts.idle_ms;
+	case CONN_TIMEOUT_NONE:
+		break;
+	}
+	return 0;
+}
+
+void connection_update_timeout(struct connection *conn, struct timer_wheel *wheel, uint64_t now_ms) {
+	enum conn_timeout timeout = timeout_phase(conn);
+	// Body and write deadlines move with every round of I/O; the others
+	// stand until the phase changes or another request has been answered
+	if (timeout == conn->timeout && conn->requests == conn->timeout_request && timeout != CONN_TIMEOUT_BODY &&
+		timeout != CONN_TIMEOUT_WRITE) {
+		return;
+	}
+	conn->timeout = timeout;
+	conn->timeout_request = conn->requests;
+	unsigned ms = timeout_ms(timeout);
+	if (timeout == CONN_TIMEOUT_IDLE && restart_draining() && (ms == 0 || ms > CONN_DRAIN_IDLE_MS)) {
+		ms = CONN_DRAIN_IDLE_MS;
+	}
+	if (ms == 0) {
+		timer_cancel(&conn->timer);
+	} else {
+		timer_arm(wheel, &conn->timer, now_ms + ms);
+	}
+}
+
+void connection_timed_out(struct connection *conn) {
+	log_info("Closing connection after its %s timeout (FD: %d)", timeout_names[conn->timeout], conn->io.fd);
+	metrics_connection_timeout();
+	conn->state = CONN_CLOSED;
+}
+
+// --- Response buffer helpers ---
+
+// Make room for at least `len` more bytes of pending response, moving to a
+// larger pool buffer (at least twice the size) if needed.
+// Returns 0 on success. On failure the connection is marked for closing,
+// since a half-built response can't be sent, and -1 is returned.
+static int out_reserve(struct connection *conn, size_t len) {
+	if (conn->out_len + len > conn->out_cap) {
+		size_t want = conn->out_len + len;
+		if (want < 2 * conn->out_cap) {
+			want = 2 * conn->out_cap;
+		}
+		size_t new_cap = pool_size(want);
+		char *new_out = pool_acquire(new_cap);
+		if (new_out == NULL) {
+			log_error("Pool allocation failed for response buffer: %m");
+			conn->state = CONN_CLOSED;
+			return -1;
+		}
+		if (conn->out_len > 0) {
+			memcpy(new_out, conn->out, conn->out_len);
+		}
+		pool_release(conn->out);
+		conn->out = new_out;
+		conn->out_cap = new_cap;
+	}
+	return 0;
+}
+
+char *connection_out_reserve(struct connection *conn, size_t len) {
+	if (out_reserve(conn, len) != 0) {
+		return NULL;
+	}
+	return conn->out + conn->out_len;
+}
+
+// Append raw bytes to the pending response, growing the buffer as needed.
+// Returns 0 on success, -1 on failure (see out_reserve()).
+static int out_append(struct connection *conn, const char *data, size_t len) {
+	if (out_reserve(conn, len) != 0) {
+		return -1;
+	}
+	memcpy(conn->out + conn->out_len, data, len);
+	conn->out_len += len;
+	return 0;
+}
+
+// Append a string literal; its length is known at compile time
+#define out_append_literal(conn, literal) out_append(conn, literal, sizeof(literal) - 1)
+
+// "00" "01" ... "99", for converting numbers two digits at a time
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Append `value` in decimal
+static int out_decimal(struct connection *conn, unsigned long long value) {
+	char digits[20];
+	char *start = digits + sizeof(digits);
+	while (value >= 100) {
+		start -= 2;
+		memcpy(start, digit_pairs + (value % 100) * 2, 2);
+		value /= 100;
+	}
+	if (value >= 10) {
+		start -= 2;
+		memcpy(start, digit_pairs + value * 2, 2);
+	} else {
+		*--start = (char)('0' + value);
+	}
+	return out_append(conn, start, (size_t)(digits + sizeof(digits) - start));
+}
+
+// Append the Content-Length header and the blank line that ends the headers
+static int out_content_length(struct connection *conn, unsigned long long length) {
+	if (out_append_literal(conn, "Content-Length: ") != 0 || out_decimal(conn, length) != 0) {
+		return -1;
+	}
+	return out_append_literal(conn, "\r\n\r\n");
+}
+
+// printf-style append for the rare headers not worth building piecewise
+static int out_printf(struct connection *conn, const char *fmt, ...) {
+	char tmp[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int written_len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (written_len < 0 || (size_t)written_len >= sizeof(tmp)) {
+		log_error("snprintf error or truncation for response headers");
+		conn->state = CONN_CLOSED;
+		return -1;
+	}
+	return out_append(conn, tmp, (size_t)written_len);
+}
+
+// Start a response: the status line plus the Connection header telling the
+// client whether we keep the connection open. HTTP/1.1 clients assume
+// keep-alive, HTTP/1.0 clients assume close.
+static int out_head(struct connection *conn, struct status_line status) {
+	// "HTTP/1.1 " is followed by the three digits
+	conn->status = (status.text[9] - '0') * 100 + (status.text[10] - '0') * 10 + (status.text[11] - '0');
+	if (out_append(conn, status.text, status.len) != 0) {
+		return -1;
+	}
+	if (!conn->keep_alive) {
+		return out_append_literal(conn, "Connection: close\r\n");
+	}
+	if (conn->http10) {
+		return out_append_literal(conn, "Connection: keep-alive\r\n");
+	}
+	return 0;
+}
+
+// Queue a response without a body. The explicit zero Content-Length lets a
+// persistent connection's client find where the next response starts.
+static int out_empty_response(struct connection *conn, struct status_line status) {
+	if (out_head(conn, status) != 0) {
+		return -1;
+	}
+	return out_append_literal(conn, "Content-Length: 0\r\n\r\n");
+}
+
+// Copy the unsent part of the body reference into `out` at its place, so
+// `in` can change. Returns 0 on success, -1 on failure (see out_reserve()).
+static int out_copy_ref(struct connection *conn) {
+	if (conn->out_ref == NULL) {
+		return 0;
+	}
+	size_t len = conn->out_ref_len - conn->out_ref_sent;
+	if (out_reserve(conn, len) != 0) {
+		return -1;
+	}
+	char *at = conn->out + conn->out_ref_at;
+	memmove(at + len, at, conn->out_len - conn->out_ref_at);
+	memcpy(at, conn->out_ref + conn->out_ref_sent, len);
+	conn->out_len += len;
+	conn->out_ref = NULL;
+	return 0;
+}
+
+// Queue a response body that lives in `in`: by reference when possible,
+// so it goes out in the same sendmsg() as the headers without being copied
+static int out_body_from_input(struct connection *conn, const char *body, size_t len) {
+	if (!conn->body_refs || conn->out_ref != NULL || len == 0) {
+		return out_append(conn, body, len);
+	}
+	conn->out_ref = body;
+	conn->out_ref_len = len;
+	conn->out_ref_sent = 0;
+	conn->out_ref_at = conn->out_len;
+	return 0;
+}
+
+// Queue a 200 text/plain response whose body is `len` bytes at `body`, a
+// part of the request in `in`. Compressed straight into `out` if the client
+// accepts gzip; otherwise sent from where it is.
+static int out_text_response(struct connection *conn, const char *body, size_t len) {
+	if (out_head(conn, STATUS_200) != 0) {
+		return -1;
+	}
+	size_t bound = conn->request.accept_gzip ? gzip_compress_bound(len) : 0;
+	if (bound > 0) {
+		static const char gzip_headers[] = "Content-Type: text/plain\r\n"
+										   "Content-Encoding: gzip\r\n"
+										   "Vary: Accept-Encoding\r\n"
+										   "Content-Length: ";
+		// Compress into the space after the headers, whose length is only
+		// known afterwards; then slide the body into place. Room for the
+		// longest Content-Length keeps it all in one buffer.
+		size_t headers_at = conn->out_len;
+		size_t headers_max = sizeof(gzip_headers) - 1 + 20 + 4;
+		if (out_reserve(conn, headers_max + bound) != 0) {
+			return -1;
+		}
+		char *body_at = conn->out + headers_at + headers_max;
+		size_t compressed_len = gzip_compress_into(body, len, body_at, bound);
+		if (compressed_len > 0) {
+			if (out_append(conn, gzip_headers, sizeof(gzip_headers) - 1) != 0 ||
+				out_decimal(conn, compressed_len) != 0 || out_append_literal(conn, "\r\n\r\n") != 0) {
+				return -1;
+			}
+			memmove(conn->out + conn->out_len, body_at, compressed_len);
+			conn->out_len += compressed_len;
+			return 0;
+		}
+		// On failure the body simply goes out uncompressed
+	}
+	if (out_append_literal(conn, "Content-Type: text/plain\r\n"
+								 "Vary: Accept-Encoding\r\n") != 0 ||
+		out_content_length(conn, len) != 0) {
+		return -1;
+	}
+	return out_body_from_input(conn, body, len);
+}
+
+// --- Request helpers ---
+
+// Decide whether the connection may be reused after the current request:
+// HTTP/1.1 is persistent unless the client sends "Connection: close",
+// HTTP/1.0 only if it asks for "Connection: keep-alive".
+static int request_keep_alive(const struct http_request *request) {
+	if (request->connection_close) {
+		return 0;
+	}
+	return request->version_minor >= 1 || request->connection_keep_alive;
+}
+
+// Status line for a parser error code
+static struct status_line parse_error_status(int code) {
+	switch (code) {
+	case 413: return STATUS_413;
+	case 414: return STATUS_414;
+	case 431: return STATUS_431;
+	case 505: return STATUS_505;
+	default:  return STATUS_400;
+	}
+}
+
+// --- Routes ---
+
+// Count the request whose response was just queued in the metrics, and log
+// it if the access log is on. `method` and `target` are only for the log.
+static void request_measured(struct connection *conn, const char *method, size_t method_len, const char *target,
+							 size_t target_len) {
+	uint64_t latency = metrics_now() - conn->request_start;
+	metrics_request(conn->route, conn->status, latency);
+	if (g_access_log) {
+		log_access(method, method_len, target, target_len, conn->status, latency);
+	}
+	conn->request_start = 0;
+	conn->requests++;
+}
+
+// request_measured() for a POST /files/ once its body is in; the header
+// block with its target is gone by then
+static void request_measured_upload(struct connection *conn) {
+	char target[sizeof(conn->upload_name) + 8];
+	int len = g_access_log ? snprintf(target, sizeof(target), "/files/%s", conn->upload_name) : 0;
+	request_measured(conn, "POST", 4, target, len > 0 ? (size_t)len : 0);
+}
+
+// Called once the response to the current request is completely queued.
+// Responses that must be flushed before anything else (a file body still to
+// send, or the last one before closing) park the connection in
+// CONN_WRITING; otherwise we go straight on to the next pipelined request.
+static void request_done(struct connection *conn) {
+	if (conn->keep_alive && conn->file_fd < 0 && conn->cached == NULL) {
+		conn->state = CONN_READING_HEADERS;
+	} else {
+		conn->state = CONN_WRITING;
+	}
+}
+
+// Queue a 200 response whose headers and body come from a cache entry.
+// Takes over the caller's reference.
+static void serve_cached(struct connection *conn, struct file_cache_entry *entry) {
+	if (out_head(conn, STATUS_200) != 0) {
+		file_cache_release(entry);
+		return;
+	}
+	conn->cached = entry;
+	conn->cached_sent = 0;
+}
+
+// Only plain names directly inside the served directory are cached: that is
+// the only level the inotify watch covers.
+static int is_cacheable_name(const char *filename) {
+	return file_cache_enabled() && filename[0] != '\0' && strchr(filename, '/') == NULL;
+}
+
+// Append the ETag, Last-Modified and Cache-Control headers of a /files/
+// response. Returns 0 on success, -1 on failure (the connection is closed).
+static int out_validators(struct connection *conn, const char *etag, time_t mtime) {
+	char validators[256];
+	int len = validators_format(validators, sizeof(validators), etag, mtime);
+	if (len < 0) {
+		conn->state = CONN_CLOSED;
+		return -1;
+	}
+	return out_append(conn, validators, (size_t)len);
+}
+
+// Answer 304 Not Modified if the copy the client already has is current:
+// its If-None-Match lists `etag`, or, without If-None-Match, the file hasn't
+// changed since its If-Modified-Since (RFC 9110 13.2.2). Returns 1 if the
+// 304 was queued.
+static int serve_not_modified(struct connection *conn, const char *etag, time_t mtime) {
+	const struct http_request *request = &conn->request;
+	const char *base = conn->in + conn->in_start;
+	if (request->has_if_none_match) {
+		if (!etag_list_matches(base + request->if_none_match.offset, request->if_none_match.len, etag)) {
+			return 0;
+		}
+	} else {
+		time_t since;
+		if (!request->has_if_modified_since ||
+			http_date_parse(base + request->if_modified_since.offset, request->if_modified_since.len, &since) != 0 ||
+			mtime > since) {
+			return 0;
+		}
+	}
+	// A 304 never has a body, so no Content-Length
+	if (out_head(conn, STATUS_304) == 0 && out_validators(conn, etag, mtime) == 0) {
+		out_append_literal(conn, "Vary: Accept-Encoding\r\n\r\n");
+	}
+	return 1;
+}
+
+// Make `file` the body to send, taking over the caller's reference
+static void file_take(struct connection *conn, struct open_file *file) {
+	conn->file = file;
+	conn->file_fd = file->fd;
+}
+
+// Done with the file body: let go of the file
+static void file_done(struct connection *conn) {
+	open_file_release(conn->file);
+	conn->file = NULL;
+	conn->file_fd = -1;
+}
+
+// Queue the headers for a file body and hand the open file to
+// connection_send_file(), which sends it with sendfile() once they are out.
+// `gzipped` marks a precompressed file. Takes over the caller's reference.
+static void serve_file(struct connection *conn, struct open_file *file, const struct stat *file_stat, int gzipped) {
+	char etag[ETAG_MAX];
+	etag_format(etag, file_stat, 0);
+	if (out_head(conn, STATUS_200) != 0 ||
+		out_append_literal(conn, "Content-Type: application/octet-stream\r\n") != 0 ||
+		(gzipped && out_append_literal(conn, "Content-Encoding: gzip\r\n") != 0) ||
+		out_append_literal(conn, "Accept-Ranges: bytes\r\n") != 0 ||
+		out_validators(conn, etag, file_stat->st_mtime) != 0 ||
+		out_append_literal(conn, "Vary: Accept-Encoding\r\n") != 0 ||
+		out_content_length(conn, (unsigned long long)file_stat->st_size) != 0) {
+		open_file_release(file);
+		return;
+	}
+	file_take(conn, file);
+	conn->file_offset = 0;
+	conn->file_remaining = file_stat->st_size;
+}
+
+// zlib's allocator for a connection's deflate stream: everything, the
+// window and hash tables included, comes from the connection's arena and
+// goes back with it
+static voidpf arena_zalloc(voidpf opaque, uInt items, uInt size) {
+	return arena_alloc(opaque, (size_t)items * size);
+}
+
+static void arena_zfree(voidpf opaque, voidpf address) {
+	(void)opaque;
+	(void)address;
+}
+
+// Queue the headers for a file body that is gzip-compressed as it is sent.
+// Its length isn't known up front, so it goes out with chunked transfer
+// coding, which only HTTP/1.1 clients understand. Takes over the caller's
+// reference to `file`.
+static void serve_file_gzip_stream(struct connection *conn, struct open_file *file, const struct stat *file_stat) {
+	z_stream *stream = arena_alloc(&conn->arena, sizeof(*stream));
+	if (stream != NULL) {
+		stream->zalloc = arena_zalloc;
+		stream->zfree = arena_zfree;
+		stream->opaque = &conn->arena;
+	}
+	if (stream == NULL || gzip_stream_init(stream, GZIP_LEVEL_STREAM) != 0) {
+		serve_file(conn, file, file_stat, 0); // Uncompressed is still a valid answer
+		return;
+	}
+	char etag[ETAG_MAX];
+	etag_format(etag, file_stat, 1);
+	if (out_head(conn, STATUS_200) != 0 ||
+		out_append_literal(conn,
+						   "Content-Type: application/octet-stream\r\n"
+						   "Content-Encoding: gzip\r\n") != 0 ||
+		out_validators(conn, etag, file_stat->st_mtime) != 0 ||
+		out_append_literal(conn,
+						   "Vary: Accept-Encoding\r\n"
+						   "Transfer-Encoding: chunked\r\n\r\n") != 0) {
+		deflateEnd(stream);
+		open_file_release(file);
+		return;
+	}
+	conn->gzip = stream;
+	file_take(conn, file);
+	conn->file_offset = 0;
+	conn->file_remaining = file_stat->st_size;
+}
+
+// Whether an If-Range value still describes the file, so the ranges the
+// client asks for fit the copy it already has: the file's (strong) entity
+// tag, or exactly its modification time
+static int if_range_matches(const char *value, size_t len, const char *etag, time_t mtime) {
+	time_t date;
+	if (len > 0 && value[0] == '"') {
+		return len == strlen(etag) && memcmp(value, etag, len) == 0;
+	}
+	return http_date_parse(value, len, &date) == 0 && date == mtime;
+}
+
+// Format the header of multipart part `index` into buf (or just measure it,
+// with cap 0). Returns its length.
+static int multipart_part_header(char *buf, size_t cap, const struct multipart_ranges *multipart, int index) {
+	const struct byte_range *range = &multipart->ranges[index];
+	return snprintf(buf, cap,
+					"\r\n--%s\r\n"
+					"Content-Type: application/octet-stream\r\n"
+					"Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+					multipart->boundary, (long long)range->first, (long long)range->last,
+					(long long)multipart->size);
+}
+
+// Bytes of the delimiter that closes a multipart body
+#define MULTIPART_END_LEN (RANGE_BOUNDARY_LEN + 8)
+
+// Queue the header of the next part of a multipart/byteranges body and point
+// the file body at its bytes, or queue the closing delimiter after the last
+// part. Returns 0 on success, -1 on failure (the connection is closed).
+static int multipart_next_part(struct connection *conn) {
+	struct multipart_ranges *multipart = conn->multipart;
+	if (multipart->next == multipart->count) {
+		if (out_printf(conn, "\r\n--%s--\r\n", multipart->boundary) != 0) {
+			return -1;
+		}
+		conn->multipart = NULL;
+		file_done(conn);
+		return 0;
+	}
+	char part_header[160];
+	int index = multipart->next++;
+	int len = multipart_part_header(part_header, sizeof(part_header), multipart, index);
+	if (out_append(conn, part_header, (size_t)len) != 0) {
+		return -1;
+	}
+	conn->file_offset = multipart->ranges[index].first;
+	conn->file_remaining = multipart->ranges[index].last - multipart->ranges[index].first + 1;
+	return 0;
+}
+
+// Answer a Range request (RFC 9110 14) for `file`, a precompressed file when
+// `gzipped`. The parts are sent with sendfile() from their offsets, like
+// whole files. Returns 1 if a 206 or 416 was queued, taking over the
+// caller's reference; 0 if the whole file should be sent instead: the
+// ranges are unusable, or If-Range says the client's copy is outdated.
+static int serve_file_ranges(struct connection *conn, struct open_file *file, const struct stat *file_stat,
+							 int gzipped) {
+	const struct http_request *request = &conn->request;
+	const char *base = conn->in + conn->in_start;
+	char etag[ETAG_MAX];
+	etag_format(etag, file_stat, 0);
+	size_t if_range_len = 0;
+	const char *if_range = http_request_header(request, base, "if-range", &if_range_len);
+	if (if_range != NULL && !if_range_matches(if_range, if_range_len, etag, file_stat->st_mtime)) {
+		return 0;
+	}
+	struct byte_range ranges[RANGE_MAX];
+	off_t size = file_stat->st_size;
+	int count = range_parse(base + request->range.offset, request->range.len, size, ranges, RANGE_MAX);
+	// Content-Encoding would apply to the multipart body as a whole, not to
+	// the parts, so several ranges of a precompressed file get all of it
+	if (count < 0 || (count > 1 && gzipped)) {
+		return 0;
+	}
+	if (count == 0) {
+		if (out_head(conn, STATUS_416) == 0) {
+			out_printf(conn, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", (long long)size);
+		}
+		open_file_release(file);
+		return 1;
+	}
+
+	if (count == 1) {
+		off_t len = ranges[0].last - ranges[0].first + 1;
+		if (out_head(conn, STATUS_206) != 0 ||
+			out_append_literal(conn, "Content-Type: application/octet-stream\r\n") != 0 ||
+			(gzipped && out_append_literal(conn, "Content-Encoding: gzip\r\n") != 0) ||
+			out_validators(conn, etag, file_stat->st_mtime) != 0 ||
+			out_append_literal(conn, "Vary: Accept-Encoding\r\nContent-Range: bytes ") != 0 ||
+			out_decimal(conn, (unsigned long long)ranges[0].first) != 0 || out_append_literal(conn, "-") != 0 ||
+			out_decimal(conn, (unsigned long long)ranges[0].last) != 0 || out_append_literal(conn, "/") != 0 ||
+			out_decimal(conn, (unsigned long long)size) != 0 || out_append_literal(conn, "\r\n") != 0 ||
+			out_content_length(conn, (unsigned long long)len) != 0) {
+			open_file_release(file);
+			return 1;
+		}
+		file_take(conn, file);
+		conn->file_offset = ranges[0].first;
+		conn->file_remaining = len;
+		return 1;
+	}
+
+	struct multipart_ranges *multipart = arena_alloc(&conn->arena, sizeof(*multipart));
+	if (multipart == NULL) {
+		return 0;
+	}
+	multipart->size = size;
+	multipart->count = count;
+	multipart->next = 0;
+	range_boundary(multipart->boundary);
+	long long content_length = MULTIPART_END_LEN;
+	for (int i = 0; i < count; i++) {
+		multipart->ranges[i] = ranges[i];
+		content_length += multipart_part_header(NULL, 0, multipart, i) + (ranges[i].last - ranges[i].first + 1);
+	}
+	if (out_head(conn, STATUS_206) != 0 ||
+		out_printf(conn, "Content-Type: multipart/byteranges; boundary=%s\r\n", multipart->boundary) != 0 ||
+		out_validators(conn, etag, file_stat->st_mtime) != 0 ||
+		out_append_literal(conn, "Vary: Accept-Encoding\r\n") != 0 ||
+		out_content_length(conn, (unsigned long long)content_length) != 0) {
+		open_file_release(file);
+		return 1;
+	}
+	conn->multipart = multipart;
+	file_take(conn, file);
+	multipart_next_part(conn);
+	return 1;
+}
+
+// Serve foo.gz in place of foo to a client that accepts gzip, unless it is
+// missing or older than foo. Returns 1 if a response was queued, 0 if foo
+// should be served instead.
+static int files_get_precompressed(struct connection *conn, const char *filename, const struct stat *file_stat,
+								   int cacheable, unsigned long cache_generation) {
+	char gz_name[sizeof(conn->upload_name) + 3];
+	struct stat gz_stat;
+	snprintf(gz_name, sizeof(gz_name), "%s.gz", filename);
+	struct open_file *gz_file = open_file_get(gz_name, &gz_stat);
+	if (gz_file == NULL) {
+		return 0;
+	}
+	if (!S_ISREG(gz_stat.st_mode) || gz_stat.st_mtime < file_stat->st_mtime) {
+		open_file_release(gz_file);
+		return 0;
+	}
+	char etag[ETAG_MAX];
+	etag_format(etag, &gz_stat, 0);
+	if (serve_not_modified(conn, etag, gz_stat.st_mtime)) {
+		open_file_release(gz_file);
+		return 1;
+	}
+	if (conn->request.has_range && serve_file_ranges(conn, gz_file, &gz_stat, 1)) {
+		return 1;
+	}
+	if (cacheable && gz_stat.st_size <= FILE_CACHE_MAX_ENTRY) {
+		struct file_cache_entry *entry = file_cache_fill(filename, FILE_CACHE_GZIP, FILE_CACHE_BODY_PRECOMPRESSED,
+														 gz_file->fd, &gz_stat, cache_generation);
+		if (entry != NULL) {
+			open_file_release(gz_file);
+			serve_cached(conn, entry);
+			return 1;
+		}
+	}
+	serve_file(conn, gz_file, &gz_stat, 1);
+	return 1;
+}
+
+// Whether the file goes out gzip-compressed by us: when cached, or else
+// streamed, which HTTP/1.0 can't take
+static int files_compress(const struct connection *conn, const char *filename, const struct stat *file_stat,
+						  int cacheable) {
+	return conn->request.accept_gzip && gzip_compressible_name(filename) &&
+		   (!conn->http10 || (cacheable && file_stat->st_size <= FILE_CACHE_MAX_ENTRY));
+}
+
+// A conditional GET with the open-file cache off: look at the file (and its
+// .gz) with stat() alone, so an unchanged one is answered 304 without being
+// opened. It picks the same variant and ETag files_get() would. Returns 1 if
+// the 304 was queued; anything else is left to files_get().
+static int files_get_not_modified(struct connection *conn, const char *filename, int cacheable) {
+	struct stat file_stat;
+	if (stat_beneath(filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+		return 0;
+	}
+	char etag[ETAG_MAX];
+	if (conn->request.accept_gzip) {
+		char gz_name[sizeof(conn->upload_name) + 3];
+		struct stat gz_stat;
+		snprintf(gz_name, sizeof(gz_name), "%s.gz", filename);
+		if (stat_beneath(gz_name, &gz_stat) == 0 && S_ISREG(gz_stat.st_mode) &&
+			gz_stat.st_mtime >= file_stat.st_mtime) {
+			etag_format(etag, &gz_stat, 0);
+			return serve_not_modified(conn, etag, gz_stat.st_mtime);
+		}
+	}
+	etag_format(etag, &file_stat, files_compress(conn, filename, &file_stat, cacheable));
+	return serve_not_modified(conn, etag, file_stat.st_mtime);
+}
+
+static void files_get(struct connection *conn, const char *filename) {
+	int cacheable = is_cacheable_name(filename);
+	if (!open_files_enabled() && (conn->request.has_if_none_match || conn->request.has_if_modified_since) &&
+		files_get_not_modified(conn, filename, cacheable)) {
+		return;
+	}
+	// Taken before touching the file, so a concurrent change is noticed
+	unsigned long cache_generation = cacheable ? file_cache_generation() : 0;
+	struct stat file_stat;
+	// Resolved beneath the directory, or straight from the open-file cache
+	struct open_file *file = open_file_get(filename, &file_stat);
+	if (file == NULL) {
+		if (errno == EXDEV) {
+			log_info("Access denied: GET '%s' leads outside the directory.", filename);
+		} else if (errno != ENOENT) {
+			log_error("open failed for GET: %m");
+		}
+		out_empty_response(conn, STATUS_404);
+		return;
+	}
+	// Only serve regular files (not directories, devices, ...)
+	if (!S_ISREG(file_stat.st_mode)) {
+		log_info("Access denied: GET '%s' is not a regular file.", filename);
+		open_file_release(file);
+		out_empty_response(conn, STATUS_404);
+		return;
+	}
+
+	int accept_gzip = conn->request.accept_gzip;
+	if (accept_gzip && files_get_precompressed(conn, filename, &file_stat, cacheable, cache_generation)) {
+		open_file_release(file);
+		return;
+	}
+	int compress = files_compress(conn, filename, &file_stat, cacheable);
+	char etag[ETAG_MAX];
+	etag_format(etag, &file_stat, compress);
+	if (serve_not_modified(conn, etag, file_stat.st_mtime)) {
+		open_file_release(file);
+		return;
+	}
+	// Ranges are only served for bodies sent as stored: the bytes of one
+	// compressed on the fly aren't known without compressing it all
+	if (!compress && conn->request.has_range && serve_file_ranges(conn, file, &file_stat, 0)) {
+		return;
+	}
+
+	if (cacheable && file_stat.st_size <= FILE_CACHE_MAX_ENTRY) {
+		// Compressed once here, then served from memory like any other hit.
+		// Clients that take gzip always use the gzip variant, even when it
+		// holds the file as is, so a foo.gz that shows up later is noticed.
+		struct file_cache_entry *entry =
+			file_cache_fill(filename, accept_gzip ? FILE_CACHE_GZIP : FILE_CACHE_PLAIN,
+							compress ? FILE_CACHE_BODY_COMPRESS : FILE_CACHE_BODY_AS_IS, file->fd,
+							&file_stat, cache_generation);
+		if (entry != NULL) {
+			open_file_release(file);
+			serve_cached(conn, entry);
+			return;
+		}
+		// Couldn't read it into memory; fall back to sendfile()
+	}
+	if (compress && !conn->http10) {
+		serve_file_gzip_stream(conn, file, &file_stat);
+		return;
+	}
+	serve_file(conn, file, &file_stat, 0);
+}
+
+// After an upload was moved into place over `name`
+static void upload_invalidate(const char *name) {
+	// The new contents are visible from the rename on; drop any cached copy
+	// of the old ones (also any fill that raced with the rename), and the
+	// old file itself before that, so no fill can start from it again
+	open_files_invalidate(name);
+	file_cache_invalidate(name);
+}
+
+// Answer an upload whose file was moved into place (`result` 0) or not
+static void upload_answer(struct connection *conn, int result) {
+	out_empty_response(conn, result == 0 ? STATUS_201 : STATUS_500);
+	request_measured_upload(conn);
+	if (conn->state != CONN_CLOSED) {
+		request_done(conn);
+	}
+}
+
+// Pass as much of the POST body as is sitting in the read buffer to the
+// upload. Bytes beyond the body (a pipelined request) stay buffered.
+static void consume_body(struct connection *conn) {
+	ssize_t used = upload_feed(conn->upload, conn->in + conn->in_start, conn->in_len - conn->in_start);
+	if (used < 0 && conn->body_discard) {
+		// Answered already; we just can't tell where the next request starts
+		upload_abort(conn->upload);
+		conn->upload = NULL;
+		conn->body_discard = 0;
+		conn->keep_alive = 0;
+		conn->state = CONN_WRITING;
+		return;
+	}
+	if (used < 0) {
+		int status = upload_error_status(conn->upload);
+		log_info("Rejecting malformed chunked body (status %d)", status);
+		upload_abort(conn->upload);
+		conn->upload = NULL;
+		// We can't tell where the next request would start
+		conn->keep_alive = 0;
+		out_empty_response(conn, parse_error_status(status));
+		request_measured_upload(conn);
+		if (conn->state != CONN_CLOSED) {
+			conn->state = CONN_WRITING;
+		}
+		return;
+	}
+	conn->in_start += (size_t)used;
+	if (!upload_complete(conn->upload)) {
+		return;
+	}
+	if (conn->body_discard) {
+		upload_abort(conn->upload);
+		conn->upload = NULL;
+		conn->body_discard = 0;
+		request_done(conn);
+		return;
+	}
+
+	// Body complete: move the file into place and answer
+	if (g_durable_uploads) {
+		// ...once the commit thread has it on disk, in connection_commit_done()
+		conn->commit = upload_commit(conn->upload, conn);
+		conn->upload = NULL;
+		if (conn->commit != NULL) {
+			conn->state = CONN_COMMITTING;
+		} else {
+			upload_answer(conn, -1);
+		}
+		return;
+	}
+	int result = upload_finish(conn->upload);
+	conn->upload = NULL;
+	upload_invalidate(conn->upload_name);
+	upload_answer(conn, result);
+}
+
+struct connection *connection_commit_done(struct commit *commit) {
+	struct connection *conn = commit->conn;
+	// Whether or not anybody is still waiting, the file changed
+	upload_invalidate(commit->name);
+	if (conn != NULL) {
+		conn->commit = NULL;
+		conn->commit_result = commit->result;
+	}
+	commit_free(commit);
+	if (conn == NULL) {
+		return NULL;
+	}
+	if (conn->h2_parent != NULL) {
+		// A stream has no socket, so nothing is being sent from its `out`:
+		// it can answer now, and its parent sends the response on
+		connection_process(conn);
+		return conn->h2_parent;
+	}
+	return conn;
+}
+
+static void files_post(struct connection *conn, const char *filename) {
+	struct http_request *request = &conn->request;
+	if (!request->chunked && request->content_length < 0) { // Absent (the parser rejects invalid values)
+		log_info("Missing Content-Length header for POST /files/");
+		// Without a length we can't tell where the body ends, so the
+		// connection can't be reused either
+		conn->keep_alive = 0;
+		out_empty_response(conn, STATUS_400);
+		return;
+	}
+
+	// The body goes to a temporary file that replaces the target only once
+	// complete, so until then readers (and the cache) keep the old contents
+	snprintf(conn->upload_name, sizeof(conn->upload_name), "%s", filename);
+	conn->upload = upload_begin(&conn->arena, filename, request->content_length, request->chunked, g_parser_limits.max_body);
+	if (conn->upload == NULL) {
+		conn->keep_alive = 0;
+		out_empty_response(conn, STATUS_500);
+		return;
+	}
+	// handle_request() moves past the headers; the body is consumed from there
+	conn->state = CONN_READING_BODY;
+}
+
+// Whether /files/ has a directory to serve; if not, queues a 500
+static int files_configured(struct connection *conn) {
+	// Check if the directory path was provided via command line
+	if (g_directory_path == NULL) {
+		log_warn("Directory path not specified on startup.");
+		// 500 because it's a server configuration issue preventing the request
+		out_empty_response(conn, STATUS_500);
+		return 0;
+	}
+	return 1;
+}
+
+// Whether the name a /files/ request gives fits the buffers it is copied
+// into (as foo.gz too). Returns 1 if so, or 0 after queueing a 500.
+static int files_name_fits(struct connection *conn, const char *filename, size_t filename_len) {
+	if (filename_len >= sizeof(conn->upload_name)) {
+		log_info("File name too long: %.64s...", filename);
+		out_empty_response(conn, STATUS_500);
+		return 0;
+	}
+	return 1;
+}
+
+// GET /files/<filename>
+static void route_files_get(struct connection *conn, const char *filename, size_t filename_len) {
+	if (!files_configured(conn) || !files_name_fits(conn, filename, filename_len)) {
+		return;
+	}
+	// A cache hit needs no filesystem calls at all.
+	// Range requests are served from the file.
+	if (!conn->request.has_range && is_cacheable_name(filename)) {
+		struct file_cache_entry *entry =
+			file_cache_get(filename, conn->request.accept_gzip ? FILE_CACHE_GZIP : FILE_CACHE_PLAIN);
+		if (entry != NULL) {
+			// The entry is current (inotify drops it otherwise), so its
+			// validators answer conditional requests without a stat()
+			if (serve_not_modified(conn, entry->etag, entry->mtime)) {
+				file_cache_release(entry);
+			} else {
+				serve_cached(conn, entry);
+			}
+			return;
+		}
+	}
+	files_get(conn, filename);
+}
+
+// POST /files/<filename>
+static void route_files_post(struct connection *conn, const char *filename, size_t filename_len) {
+	if (files_configured(conn) && files_name_fits(conn, filename, filename_len)) {
+		files_post(conn, filename);
+	}
+}
+
+// GET / (or any method)
+static void route_root(struct connection *conn, const char *rest, size_t rest_len) {
+	(void)rest;
+	(void)rest_len;
+	out_empty_response(conn, STATUS_200);
+}
+
+// /echo/<text>: the text back as the body
+static void route_echo(struct connection *conn, const char *text, size_t text_len) {
+	out_text_response(conn, text, text_len);
+}
+
+// /user-agent: the request's User-Agent value as the body
+static void route_user_agent(struct connection *conn, const char *rest, size_t rest_len) {
+	(void)rest;
+	(void)rest_len;
+	size_t user_agent_len = 0;
+	const char *user_agent =
+		http_request_header(&conn->request, conn->in + conn->in_start, "user-agent", &user_agent_len);
+	if (user_agent == NULL) {
+		user_agent = ""; // Default to empty string
+	}
+	out_text_response(conn, user_agent, user_agent_len);
+}
+
+// GET /metrics: the counters of every worker in the Prometheus text format
+static void route_metrics(struct connection *conn, const char *rest, size_t rest_len) {
+	(void)rest;
+	(void)rest_len;
+	static const char headers[] = "Content-Type: text/plain; version=0.0.4\r\n"
+								  "Content-Length: ";
+	if (out_head(conn, STATUS_200) != 0) {
+		return;
+	}
+	// Render into the space after the headers, whose length is only known
+	// afterwards, as out_text_response() does; retry with the exact size if
+	// the guess was short
+	size_t headers_at = conn->out_len;
+	size_t headers_max = sizeof(headers) - 1 + 20 + 4;
+	size_t room = 16 * 1024;
+	size_t body_len;
+	while (1) {
+		if (out_reserve(conn, headers_max + room) != 0) {
+			return;
+		}
+		body_len = metrics_format(conn->out + headers_at + headers_max, room);
+		if (body_len < room) {
+			break;
+		}
+		room = body_len + 1;
+	}
+	char *body_at = conn->out + headers_at + headers_max;
+	if (out_append(conn, headers, sizeof(headers) - 1) != 0 || out_decimal(conn, body_len) != 0 ||
+		out_append_literal(conn, "\r\n\r\n") != 0) {
+		return;
+	}
+	memmove(conn->out + conn->out_len, body_at, body_len);
+	conn->out_len += body_len;
+}
+
+int connection_routes_init(void) {
+	static const struct {
+		unsigned methods;
+		const char *path;
+		enum route_match match;
+		enum metrics_route metrics;
+		route_handler handler;
+	} routes[] = {
+		{ ROUTE_ANY_METHOD, "/", ROUTE_EXACT, METRICS_ROUTE_ROOT, route_root },
+		{ ROUTE_ANY_METHOD, "/echo/", ROUTE_PREFIX, METRICS_ROUTE_ECHO, route_echo },
+		{ ROUTE_ANY_METHOD, "/user-agent", ROUTE_EXACT, METRICS_ROUTE_USER_AGENT, route_user_agent },
+		{ ROUTE_METHOD(HTTP_GET), "/files/", ROUTE_PREFIX, METRICS_ROUTE_FILES_GET, route_files_get },
+		{ ROUTE_METHOD(HTTP_POST), "/files/", ROUTE_PREFIX, METRICS_ROUTE_FILES_POST, route_files_post },
+		{ ROUTE_METHOD(HTTP_GET), "/metrics", ROUTE_EXACT, METRICS_ROUTE_METRICS, route_metrics },
+	};
+	for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		if (router_add(routes[i].methods, routes[i].path, routes[i].match, routes[i].metrics, routes[i].handler) !=
+			0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Replace the read buffer with one of `cap` bytes, keeping the unconsumed
+// input. Returns 0 on success, -1 on failure (the connection is closed).
+static int in_grow(struct connection *conn, size_t cap) {
+	if (cap <= conn->in_cap) {
+		return 0;
+	}
+	char *in = pool_acquire(cap);
+	if (in == NULL) {
+		log_error("Pool allocation failed for connection buffer: %m");
+		conn->state = CONN_CLOSED;
+		return -1;
+	}
+	// A body still referenced from `out` lives in the old buffer
+	if (out_copy_ref(conn) != 0) {
+		pool_release(in);
+		return -1;
+	}
+	size_t pending = conn->in_len - conn->in_start;
+	if (pending > 0) {
+		memcpy(in, conn->in + conn->in_start, pending);
+	}
+	pool_release(conn->in);
+	conn->in = in;
+	conn->in_cap = cap;
+	conn->in_start = 0;
+	conn->in_len = pending;
+	return 0;
+}
+
+// Switch to HTTP/2 as the request just parsed asks (RFC 7540 3.2). It is
+// answered as stream 1, after the 101 and our SETTINGS.
+static void upgrade_to_http2(struct connection *conn, const char *settings, size_t settings_len) {
+	size_t header_len = conn->request.header_len;
+	if (out_append_literal(conn, "HTTP/1.1 101 Switching Protocols\r\n"
+								 "Connection: Upgrade\r\n"
+								 "Upgrade: h2c\r\n\r\n") != 0) {
+		return;
+	}
+	if (http2_start(conn, settings, settings_len, conn->in + conn->in_start, header_len) != 0) {
+		conn->state = CONN_CLOSED;
+		return;
+	}
+	conn->in_start += header_len;
+	http_parser_reset(&conn->parser);
+	conn->request_start = 0;
+	in_grow(conn, HTTP2_IN_CAP);
+}
+
+// A request body the route didn't consume must still be read past, or its
+// bytes would be taken for the next request. It is discarded on the way;
+// where that can't be done, the connection closes after the response
+// instead (lingering discards what the client still sends).
+static void skip_body(struct connection *conn) {
+	const struct http_request *request = &conn->request;
+	if (conn->keep_alive && conn->file_fd < 0 && conn->cached == NULL) {
+		conn->upload = upload_discard(&conn->arena, request->content_length, request->chunked,
+									  g_parser_limits.max_body);
+		if (conn->upload != NULL) {
+			conn->body_discard = 1;
+			conn->state = CONN_READING_BODY;
+			return;
+		}
+	}
+	// A file response goes out before anything else is read
+	conn->keep_alive = 0;
+}
+
+// Route the request the parser just completed, then move past its header
+// block. Leaves the connection reading the body, waiting for the next
+// request, or with a response that must be flushed.
+static void handle_request(struct connection *conn) {
+	// Whatever the previous request allocated is finished with: the
+	// connection only reads headers again once its response is complete
+	arena_reset(&conn->arena);
+	struct http_request *request = &conn->request;
+	char *base = conn->in + conn->in_start;
+	const char *settings;
+	size_t settings_len;
+	if (conn->tls == NULL && g_http2 && !conn->h2_stream &&
+		http2_upgrade_requested(request, base, &settings, &settings_len)) {
+		upgrade_to_http2(conn, settings, settings_len);
+		return;
+	}
+	// NUL-terminate the target in place: the byte after it is the space
+	// before the version, which nothing needs any more
+	base[request->target.offset + request->target.len] = '\0';
+	const char *path = base + request->target.offset;
+	conn->path = path;
+	conn->http10 = request->version_minor == 0;
+	// While draining for a restart every response is the connection's last
+	conn->keep_alive = request_keep_alive(request) && !restart_draining();
+	conn->route = METRICS_ROUTE_OTHER;
+	conn->status = 0;
+
+	size_t rest_at;
+	int path_known;
+	const struct route *route = router_match(request->method, path, request->target.len, &rest_at, &path_known);
+	if (route != NULL) {
+		conn->route = route->metrics;
+		route->handler(conn, path + rest_at, request->target.len - rest_at);
+	} else if (path_known || request->method != HTTP_GET) {
+		log_info("Method %.*s not allowed for path %s", (int)request->method_text.len,
+				 base + request->method_text.offset, path);
+		out_empty_response(conn, STATUS_405);
+	} else {
+		// Default to 404 for GET requests to unknown paths
+		out_empty_response(conn, STATUS_404);
+	}
+
+	// The header block is no longer needed; any body follows it
+	conn->path = NULL;
+	conn->in_start += request->header_len;
+	if (conn->state != CONN_READING_BODY) {
+		// An upload is counted once its body is in
+		request_measured(conn, base + request->method_text.offset, request->method_text.len, path,
+						 request->target.len);
+	}
+	// A stream's body ends with the stream, so needs no skipping
+	if (conn->state == CONN_READING_HEADERS && !conn->h2_stream &&
+		(request->content_length > 0 || request->has_transfer_encoding)) {
+		skip_body(conn);
+	}
+	http_parser_reset(&conn->parser);
+	if (conn->state == CONN_READING_HEADERS) {
+		request_done(conn);
+	}
+}
+
+// Handle every complete request already sitting in the read buffer, in order,
+// appending their responses to `out` so they can leave in a single send.
+void connection_process(struct connection *conn) {
+	while (1) {
+		if (conn->state == CONN_READING_BODY) {
+			consume_body(conn);
+			if (conn->state == CONN_READING_BODY) {
+				return; // Need more of the body
+			}
+			continue;
+		}
+		if (conn->state == CONN_COMMITTING) {
+			if (conn->commit != NULL) {
+				return; // Not on disk yet
+			}
+			upload_answer(conn, conn->commit_result);
+			continue;
+		}
+		if (conn->state != CONN_READING_HEADERS) {
+			return;
+		}
+		if (conn->h2 != NULL) {
+			http2_process(conn);
+			return;
+		}
+		if (conn->h2_stream && conn->requests > 0) {
+			return; // A stream carries a single request
+		}
+		if (conn->out_len - conn->out_sent >= CONN_OUT_HIGH_WATER) {
+			return; // Let the client catch up before answering more
+		}
+		if (conn->in_start == conn->in_len) {
+			return; // Nothing buffered
+		}
+		if (conn->requests == 0 && conn->in_start == 0 && conn->tls == NULL && !conn->h2_stream && g_http2) {
+			// A client with prior knowledge of HTTP/2 opens with its preface
+			int preface = http2_preface_check(conn->in, conn->in_len);
+			if (preface == 0) {
+				return; // Too little to tell yet
+			}
+			if (preface > 0) {
+				if (http2_start(conn, NULL, 0, NULL, 0) != 0) {
+					conn->state = CONN_CLOSED;
+					return;
+				}
+				in_grow(conn, HTTP2_IN_CAP);
+				continue;
+			}
+		}
+		if (conn->request_start == 0) {
+			conn->request_start = metrics_now();
+		}
+
+		// The parser resumes where it stopped, so each byte is only looked at once
+		enum http_parse_result result = http_parser_execute(&conn->parser, conn->in + conn->in_start,
+															 conn->in_len - conn->in_start);
+		if (result == HTTP_PARSE_INCOMPLETE) {
+			return;
+		}
+		if (result == HTTP_PARSE_ERROR) {
+			int status = conn->parser.error_status;
+			log_info("Rejecting malformed request (status %d)", status);
+			// We can't tell where the next request would start
+			conn->keep_alive = 0;
+			conn->http10 = 0;
+			conn->route = METRICS_ROUTE_OTHER;
+			out_empty_response(conn, parse_error_status(status));
+			request_measured(conn, "-", 1, "-", 1);
+			if (conn->state != CONN_CLOSED) {
+				conn->state = CONN_WRITING;
+			}
+			return;
+		}
+		handle_request(conn);
+	}
+}
+
+// --- Output and input shared by the I/O backends ---
+
+int connection_has_pending_output(const struct connection *conn) {
+	return conn->out_sent < conn->out_len || conn->out_ref != NULL || conn->cached != NULL || conn->file_fd >= 0 ||
+		   (conn->h2 != NULL && http2_has_output(conn->h2));
+}
+
+int connection_wants_input(const struct connection *conn) {
+	if (conn->state != CONN_READING_HEADERS && conn->state != CONN_READING_BODY) {
+		return 0;
+	}
+	if (conn->peer_closed || conn->out_len - conn->out_sent >= CONN_OUT_HIGH_WATER) {
+		return 0;
+	}
+	return conn->in_len - conn->in_start < conn->in_cap;
+}
+
+// Make sure there is a read buffer to receive into.
+// Returns 0 on success, -1 on failure (the connection is closed).
+static int in_acquire(struct connection *conn) {
+	if (conn->in == NULL) {
+		conn->in = pool_acquire(conn->in_cap);
+		if (conn->in == NULL) {
+			log_error("Pool allocation failed for connection buffer: %m");
+			conn->state = CONN_CLOSED;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Slide a partially received request to the front of the read buffer so all
+// free space is at the end. A body still referenced from `out` is copied
+// first, since the move overwrites it.
+static void compact_input(struct connection *conn) {
+	if (conn->in_start > 0) {
+		if (out_copy_ref(conn) != 0) {
+			return;
+		}
+		memmove(conn->in, conn->in + conn->in_start, conn->in_len - conn->in_start);
+		conn->in_len -= conn->in_start;
+		conn->in_start = 0;
+	}
+}
+
+void connection_received(struct connection *conn, const char *data, size_t len) {
+	if (len == 0) {
+		// Requests already buffered are still answered before closing
+		conn->peer_closed = 1;
+		if (conn->state == CONN_LINGERING) {
+			conn->state = CONN_CLOSED;
+		}
+		return;
+	}
+	metrics_bytes_received(len);
+	if (conn->state == CONN_LINGERING) {
+		conn->lingered += len;
+		if (conn->lingered > CONN_LINGER_MAX) {
+			conn->state = CONN_CLOSED;
+		}
+		return;
+	}
+	compact_input(conn);
+	if (conn->state == CONN_CLOSED || in_acquire(conn) != 0) {
+		return;
+	}
+	if (len > conn->in_cap - conn->in_len) {
+		log_error("Received %zu bytes with room for %zu", len, conn->in_cap - conn->in_len);
+		conn->state = CONN_CLOSED;
+		return;
+	}
+	memcpy(conn->in + conn->in_len, data, len);
+	conn->in_len += len;
+}
+
+// Compress the next part of a streamed file body into `out` as one chunk,
+// followed by the last-chunk marker once the file is done.
+// Returns 0 on success, -1 on failure (the connection must be dropped).
+static int gzip_stream_next(struct connection *conn) {
+	z_stream *stream = conn->gzip;
+	char input[GZIP_STREAM_CHUNK];
+	// A stream connection's body is framed by HTTP/2 instead
+	int chunked = !conn->h2_stream;
+	// The chunk size is patched in once known; leading zeros are allowed
+	size_t chunk_start = conn->out_len;
+	if (chunked && out_append(conn, "00000000\r\n", 10) != 0) {
+		return -1;
+	}
+	size_t data_start = conn->out_len;
+	int finished = 0;
+	// deflate() holds input back until it has a block's worth, so keep
+	// feeding it until some output appears
+	while (conn->out_len == data_start && !finished) {
+		size_t want = conn->file_remaining < GZIP_STREAM_CHUNK ? (size_t)conn->file_remaining : GZIP_STREAM_CHUNK;
+		ssize_t bytes_read = 0;
+		if (want > 0) {
+			bytes_read = pread(conn->file_fd, input, want, conn->file_offset);
+			if (bytes_read < 0 && errno == EINTR) {
+				continue;
+			}
+			if (bytes_read <= 0) {
+				// Error, or the file shrank since it was stat()ed
+				log_error("pread failed (GET gzip): %m");
+				return -1;
+			}
+		}
+		conn->file_offset += bytes_read;
+		conn->file_remaining -= bytes_read;
+		int flush = conn->file_remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+		stream->next_in = (Bytef *)input;
+		stream->avail_in = (uInt)bytes_read;
+		do {
+			if (out_reserve(conn, GZIP_STREAM_CHUNK) != 0) {
+				return -1;
+			}
+			stream->next_out = (Bytef *)(conn->out + conn->out_len);
+			stream->avail_out = (uInt)(conn->out_cap - conn->out_len);
+			uInt room = stream->avail_out;
+			int result = deflate(stream, flush);
+			if (result == Z_STREAM_ERROR) {
+				log_error("deflate failed while streaming");
+				return -1;
+			}
+			conn->out_len += room - stream->avail_out;
+			finished = result == Z_STREAM_END;
+		} while (stream->avail_out == 0);
+	}
+
+	if (chunked) {
+		char size_hex[9];
+		snprintf(size_hex, sizeof(size_hex), "%08zx", conn->out_len - data_start);
+		memcpy(conn->out + chunk_start, size_hex, 8);
+		if (out_append(conn, "\r\n", 2) != 0) {
+			return -1;
+		}
+	}
+	if (finished) {
+		if (chunked && out_append(conn, "0\r\n\r\n", 5) != 0) {
+			return -1;
+		}
+		deflateEnd(stream);
+		conn->gzip = NULL;
+		file_done(conn);
+	}
+	return 0;
+}
+
+int connection_output_iov(struct connection *conn, struct iovec iov[CONN_IOV_MAX], int *send_flags) {
+	int drained = conn->out_sent == conn->out_len && conn->out_ref == NULL;
+	// HTTP/2 response frames are produced a round at a time, the streams
+	// taking turns, so each round reflects the flow-control windows and
+	// the streams open when it starts
+	if (drained && conn->h2 != NULL) {
+		conn->out_len = conn->out_sent = 0;
+		http2_produce(conn);
+	}
+	// A body compressed on the fly is produced one chunk at a time, each
+	// time the previous one has left
+	if (drained && conn->cached == NULL && conn->gzip != NULL) {
+		conn->out_len = conn->out_sent = 0;
+		if (gzip_stream_next(conn) != 0) {
+			conn->state = CONN_CLOSED;
+			return 0;
+		}
+	}
+	// Likewise the parts of a multipart/byteranges body, each time the
+	// file bytes of the previous one are out
+	if (drained && conn->multipart != NULL && conn->file_remaining == 0) {
+		conn->out_len = conn->out_sent = 0;
+		if (multipart_next_part(conn) != 0) {
+			conn->state = CONN_CLOSED;
+			return 0;
+		}
+	}
+
+	// Gather the pending head, a referenced body with whatever was queued
+	// after it, and any cached body into one call
+	int iov_count = 0;
+	size_t out_end = conn->out_ref != NULL ? conn->out_ref_at : conn->out_len;
+	if (conn->out_sent < out_end) {
+		iov[iov_count].iov_base = conn->out + conn->out_sent;
+		iov[iov_count].iov_len = out_end - conn->out_sent;
+		iov_count++;
+	}
+	if (conn->out_ref != NULL) {
+		iov[iov_count].iov_base = (char *)conn->out_ref + conn->out_ref_sent;
+		iov[iov_count].iov_len = conn->out_ref_len - conn->out_ref_sent;
+		iov_count++;
+		if (conn->out_ref_at < conn->out_len) {
+			iov[iov_count].iov_base = conn->out + conn->out_ref_at;
+			iov[iov_count].iov_len = conn->out_len - conn->out_ref_at;
+			iov_count++;
+		}
+	}
+	if (conn->cached != NULL) {
+		iov[iov_count].iov_base = conn->cached->blob + conn->cached_sent;
+		iov[iov_count].iov_len = conn->cached->blob_len - conn->cached_sent;
+		iov_count++;
+	}
+	// When a file body follows, MSG_MORE lets the kernel coalesce the
+	// headers with the first part of the file instead of sending a
+	// small segment of its own.
+	*send_flags = MSG_NOSIGNAL | (conn->file_fd >= 0 ? MSG_MORE : 0);
+	return iov_count;
+}
+
+// Advance past `sent` bytes of the iovecs from connection_output_iov()
+static void output_consumed(struct connection *conn, size_t sent) {
+	if (conn->out_ref != NULL) {
+		// `out` up to the reference, the referenced body, then the rest
+		size_t before = conn->out_ref_at - conn->out_sent;
+		if (sent < before) {
+			conn->out_sent += sent;
+			return;
+		}
+		conn->out_sent = conn->out_ref_at;
+		sent -= before;
+		size_t from_ref = conn->out_ref_len - conn->out_ref_sent;
+		if (sent < from_ref) {
+			conn->out_ref_sent += sent;
+			return;
+		}
+		conn->out_ref = NULL;
+		sent -= from_ref;
+	}
+	size_t from_out = conn->out_len - conn->out_sent;
+	if (sent < from_out) {
+		conn->out_sent += sent;
+		return;
+	}
+	// Everything in `out` is gone: reuse the buffer from the start
+	conn->out_len = conn->out_sent = 0;
+	sent -= from_out;
+	if (conn->cached != NULL) {
+		conn->cached_sent += sent;
+		if (conn->cached_sent == conn->cached->blob_len) {
+			file_cache_release(conn->cached);
+			conn->cached = NULL;
+		}
+	}
+}
+
+void connection_output_sent(struct connection *conn, size_t sent) {
+	metrics_bytes_sent(sent);
+	output_consumed(conn, sent);
+}
+
+size_t connection_output_read(struct connection *conn, char *buf, size_t len) {
+	size_t taken = 0;
+	while (taken < len && conn->state != CONN_CLOSED) {
+		struct iovec iov[CONN_IOV_MAX];
+		int send_flags;
+		int iov_count = connection_output_iov(conn, iov, &send_flags);
+		if (iov_count > 0) {
+			size_t copied = 0;
+			for (int i = 0; i < iov_count && taken < len; i++) {
+				size_t part = iov[i].iov_len < len - taken ? iov[i].iov_len : len - taken;
+				memcpy(buf + taken, iov[i].iov_base, part);
+				taken += part;
+				copied += part;
+			}
+			output_consumed(conn, copied);
+			continue;
+		}
+		if (conn->state == CONN_CLOSED || conn->file_fd < 0 || conn->gzip != NULL) {
+			break;
+		}
+		// A file body, read rather than sent with sendfile(). A finished
+		// multipart part was followed by the next part's header above.
+		if (conn->file_remaining == 0) {
+			file_done(conn);
+			continue;
+		}
+		size_t want = (size_t)conn->file_remaining < len - taken ? (size_t)conn->file_remaining : len - taken;
+		ssize_t bytes_read = pread(conn->file_fd, buf + taken, want, conn->file_offset);
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			// Error, or the file shrank since it was stat()ed
+			log_error("pread failed (GET over HTTP/2): %m");
+			conn->state = CONN_CLOSED;
+			break;
+		}
+		conn->file_offset += bytes_read;
+		conn->file_remaining -= bytes_read;
+		taken += (size_t)bytes_read;
+	}
+	return taken;
+}
+
+size_t connection_feed(struct connection *conn, const char *data, size_t len) {
+	size_t fed = 0;
+	while (fed < len && connection_wants_input(conn) && !(conn->h2_stream && conn->requests > 0)) {
+		compact_input(conn);
+		if (conn->state == CONN_CLOSED || in_acquire(conn) != 0) {
+			break;
+		}
+		size_t part = conn->in_cap - conn->in_len < len - fed ? conn->in_cap - conn->in_len : len - fed;
+		memcpy(conn->in + conn->in_len, data + fed, part);
+		conn->in_len += part;
+		fed += part;
+		connection_process(conn);
+	}
+	return fed;
+}
+
+// Without kTLS a file body has to pass through user space to be encrypted:
+// read a record's worth at file_offset and write it with OpenSSL. Returns
+// like sendfile(); after EAGAIN the same bytes are read and offered again.
+static ssize_t tls_send_file(struct connection *conn) {
+	char record[TLS_RECORD_MAX];
+	size_t len = conn->file_remaining < (off_t)sizeof(record) ? (size_t)conn->file_remaining : sizeof(record);
+	ssize_t bytes_read = pread(conn->file_fd, record, len, conn->file_offset);
+	if (bytes_read <= 0) {
+		return bytes_read;
+	}
+	ssize_t bytes_sent = tls_write(conn->tls, record, (size_t)bytes_read);
+	if (bytes_sent > 0) {
+		conn->file_offset += bytes_sent;
+	}
+	return bytes_sent;
+}
+
+int connection_send_file(struct connection *conn) {
+	// sendfile() moves the file's page-cache pages straight to the socket,
+	// with no copy through user space; with kTLS the kernel encrypts them on
+	// the way. On a non-blocking socket it sends as much as fits in the
+	// socket buffer and advances file_offset, so a partial write simply
+	// resumes from there on the next EPOLLOUT.
+	int user_tls = conn->tls != NULL && !tls_kernel_send(conn->tls);
+	while (conn->file_fd >= 0 && conn->gzip == NULL) {
+		if (conn->file_remaining == 0) {
+			if (conn->multipart != NULL) {
+				break; // connection_output_iov() queues the next part
+			}
+			file_done(conn);
+			break;
+		}
+		ssize_t bytes_sent = user_tls ? tls_send_file(conn)
+									  : sendfile(conn->io.fd, conn->file_fd, &conn->file_offset,
+												 (size_t)conn->file_remaining);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn->writable = 0;
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("sendfile failed (GET): %m");
+			conn->state = CONN_CLOSED;
+			return 0;
+		}
+		if (bytes_sent == 0) {
+			// The file shrank under us; the advertised length can no longer
+			// be honoured, so drop the connection.
+			log_warn("File truncated while sending (%lld bytes short)", (long long)conn->file_remaining);
+			conn->state = CONN_CLOSED;
+			return 0;
+		}
+		conn->file_remaining -= bytes_sent;
+		metrics_bytes_sent((size_t)bytes_sent);
+	}
+	return 1;
+}
+
+void connection_response_sent(struct connection *conn) {
+	if (!conn->keep_alive) {
+		connection_linger(conn);
+		return;
+	}
+	conn->state = CONN_READING_HEADERS;
+}
+
+// Finish a connection after its last response. Closing a socket that still
+// has unread input makes the kernel answer with a reset, which can destroy
+// the response before the client reads it (e.g. a 431 sent while the client
+// is still uploading headers). So we half-close our side and read and discard
+// until the client closes too.
+void connection_linger(struct connection *conn) {
+	if (conn->tls != NULL && !conn->peer_closed) {
+		tls_close_notify(conn->tls);
+	}
+	if (conn->peer_closed || shutdown(conn->io.fd, SHUT_WR) != 0) {
+		conn->state = CONN_CLOSED;
+		return;
+	}
+	conn->state = CONN_LINGERING;
+	conn->in_start = conn->in_len = 0;
+}
+
+void connection_release_idle_buffers(struct connection *conn) {
+	// An upload keeps `in`: the body is fed to it from there
+	if (conn->in != NULL && conn->in_start == conn->in_len && conn->out_ref == NULL &&
+		conn->state != CONN_READING_BODY) {
+		pool_release(conn->in);
+		conn->in = NULL;
+		conn->in_start = conn->in_len = 0;
+	}
+	// Streamed gzip and multipart bodies are produced into `out`
+	if (conn->out != NULL && conn->out_sent == conn->out_len && conn->out_ref == NULL && conn->gzip == NULL &&
+		conn->multipart == NULL) {
+		pool_release(conn->out);
+		conn->out = NULL;
+		conn->out_len = conn->out_cap = conn->out_sent = 0;
+	}
+	if (conn->upload == NULL && conn->gzip == NULL && conn->multipart == NULL) {
+		arena_release(&conn->arena);
+	}
+}
+
+// --- Readiness-based (epoll) driver ---
+
+// recv() from the socket, or from OpenSSL on an HTTPS connection
+static ssize_t socket_recv(struct connection *conn, void *buf, size_t len) {
+	if (conn->tls != NULL) {
+		return tls_read(conn->tls, buf, len);
+	}
+	return recv(conn->io.fd, buf, len, 0);
+}
+
+// sendmsg() on the socket, which kTLS encrypts by itself. Without kTLS the
+// iovecs are gathered into at most one record and written with OpenSSL.
+static ssize_t socket_send(struct connection *conn, struct iovec *iov, int iov_count, int send_flags) {
+	if (conn->tls == NULL || tls_kernel_send(conn->tls)) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)iov_count };
+		return sendmsg(conn->io.fd, &msg, send_flags);
+	}
+	if (iov_count == 1) {
+		return tls_write(conn->tls, iov[0].iov_base, iov[0].iov_len);
+	}
+	char record[TLS_RECORD_MAX];
+	size_t len = 0;
+	for (int i = 0; i < iov_count && len < sizeof(record); i++) {
+		size_t chunk = iov[i].iov_len < sizeof(record) - len ? iov[i].iov_len : sizeof(record) - len;
+		memcpy(record + len, iov[i].iov_base, chunk);
+		len += chunk;
+	}
+	return tls_write(conn->tls, record, len);
+}
+
+// Advance the TLS handshake. Returns 1 once it is done and requests can be
+// read, 0 while it waits for the socket (or failed).
+static int connection_handshake(struct connection *conn) {
+	switch (tls_handshake(conn->tls)) {
+	case TLS_DONE:
+		conn->state = CONN_READING_HEADERS;
+		return 1;
+	case TLS_WANT_READ:
+		conn->readable = 0;
+		return 0;
+	case TLS_WANT_WRITE:
+		conn->writable = 0;
+		return 0;
+	case TLS_FAILED:
+		break;
+	}
+	conn->state = CONN_CLOSED;
+	return 0;
+}
+
+// Receive once into the free end of the read buffer.
+// Returns 1 if bytes arrived, 0 if nothing did (would block, EOF or error).
+static int connection_recv(struct connection *conn) {
+	compact_input(conn);
+	if (conn->state == CONN_CLOSED || in_acquire(conn) != 0) {
+		return 0;
+	}
+	while (1) {
+		ssize_t bytes_received = socket_recv(conn, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+		if (bytes_received > 0) {
+			conn->in_len += (size_t)bytes_received;
+			metrics_bytes_received((size_t)bytes_received);
+			return 1;
+		}
+		if (bytes_received == 0) {
+			connection_received(conn, NULL, 0);
+			return 0;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			conn->readable = 0; // Resume on the next EPOLLIN
+		} else {
+			log_error("Receive failed: %m");
+			conn->state = CONN_CLOSED;
+		}
+		return 0;
+	}
+}
+
+int connection_body_spliceable(const struct connection *conn) {
+	// TLS records have to be decrypted first
+	return conn->tls == NULL && conn->state == CONN_READING_BODY && conn->in_start == conn->in_len && connection_wants_input(conn) &&
+		   upload_can_splice(conn->upload);
+}
+
+int connection_splice_body(struct connection *conn) {
+	while (1) {
+		ssize_t moved = upload_splice(conn->upload, conn->io.fd);
+		if (moved > 0) {
+			metrics_bytes_received((size_t)moved);
+			return 1;
+		}
+		if (moved == 0) {
+			connection_received(conn, NULL, 0);
+			return 0;
+		}
+		if (moved == UPLOAD_NO_PIPE) {
+			// The bytes are still on the socket, for the caller to receive
+			return 1;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			conn->readable = 0;
+		} else {
+			log_error("splice from socket failed (POST): %m");
+			conn->state = CONN_CLOSED;
+		}
+		return 0;
+	}
+}
+
+// Send the pending response data, then any file body.
+// Returns 1 once everything is out, 0 if the socket would block or failed.
+static int connection_flush(struct connection *conn) {
+	struct iovec iov[CONN_IOV_MAX];
+	int send_flags;
+	int iov_count;
+	// A multipart body alternates between the two until its last part
+	while (connection_has_pending_output(conn)) {
+		while ((iov_count = connection_output_iov(conn, iov, &send_flags)) > 0) {
+			ssize_t bytes_sent = socket_send(conn, iov, iov_count, send_flags);
+			if (bytes_sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					conn->writable = 0; // Resume on the next EPOLLOUT
+					return 0;
+				}
+				if (errno == EINTR) {
+					continue;
+				}
+				log_error("Send failed: %m");
+				conn->state = CONN_CLOSED;
+				return 0;
+			}
+			connection_output_sent(conn, (size_t)bytes_sent);
+		}
+		if (conn->state == CONN_CLOSED || !connection_send_file(conn)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Discard input while lingering. Gives up after CONN_LINGER_MAX bytes.
+static void connection_discard_input(struct connection *conn) {
+	if (in_acquire(conn) != 0) {
+		return;
+	}
+	// Raw socket bytes even on an HTTPS connection: nothing needs decrypting
+	while (conn->readable) {
+		ssize_t bytes_received = recv(conn->io.fd, conn->in, conn->in_cap, 0);
+		if (bytes_received > 0) {
+			metrics_bytes_received((size_t)bytes_received);
+			conn->lingered += (size_t)bytes_received;
+			if (conn->lingered > CONN_LINGER_MAX) {
+				conn->state = CONN_CLOSED;
+				return;
+			}
+			continue;
+		}
+		if (bytes_received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			conn->readable = 0;
+			return;
+		}
+		conn->state = CONN_CLOSED; // EOF or error
+		return;
+	}
+}
+
+// Make as much progress as the socket's current readiness allows: answer
+// buffered requests, flush responses, and read more, until nothing moves.
+static int connection_drive(struct connection *conn) {
+	int reads = 0;
+	if (conn->state == CONN_HANDSHAKE && !connection_handshake(conn)) {
+		return 0;
+	}
+	while (conn->state != CONN_CLOSED) {
+		if (conn->state == CONN_LINGERING) {
+			connection_discard_input(conn);
+			return 0;
+		}
+		connection_process(conn);
+		if (conn->state == CONN_CLOSED) {
+			return 0;
+		}
+		// Input left unprocessed until the client reads more of our output
+		int held_back = conn->out_len - conn->out_sent >= CONN_OUT_HIGH_WATER && conn->in_start < conn->in_len;
+
+		if (connection_has_pending_output(conn) && conn->writable) {
+			connection_flush(conn);
+			if (conn->state == CONN_CLOSED) {
+				return 0;
+			}
+			if (held_back && conn->out_len - conn->out_sent < CONN_OUT_HIGH_WATER) {
+				continue; // No event will come for what is already buffered
+			}
+		}
+		if (conn->state == CONN_WRITING && !connection_has_pending_output(conn)) {
+			// The response that had to go out first is done
+			connection_response_sent(conn);
+			continue;
+		}
+
+		if (reads == CONN_DRIVE_BUDGET && conn->readable &&
+			(connection_body_spliceable(conn) || connection_wants_input(conn))) {
+			// A client that sends its next request as soon as it has the
+			// answer would otherwise keep us here indefinitely
+			return 1;
+		}
+		if (connection_body_spliceable(conn)) {
+			// Body data goes from the socket to the file without passing
+			// through user space
+			if (conn->readable && connection_splice_body(conn)) {
+				reads++;
+				continue;
+			}
+		} else if (connection_wants_input(conn) && conn->readable && connection_recv(conn)) {
+			reads++;
+			continue;
+		}
+		if (conn->state == CONN_CLOSED) {
+			return 0;
+		}
+
+		// Nothing more to do until the next epoll event. If the client has
+		// gone away and everything it asked for has been answered, finish.
+		if (conn->peer_closed && !connection_has_pending_output(conn) && conn->state != CONN_COMMITTING) {
+			if (conn->state == CONN_READING_BODY) {
+				log_info("Client disconnected before sending the full body");
+			}
+			conn->state = CONN_CLOSED;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+int connection_on_event(struct connection *conn, uint32_t events) {
+	if (events & EPOLLERR) {
+		conn->state = CONN_CLOSED;
+		return 0;
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+		conn->readable = 1;
+	}
+	if (events & EPOLLOUT) {
+		conn->writable = 1;
+	}
+	int yielded = connection_drive(conn);
+	if (conn->state != CONN_CLOSED) {
+		connection_release_idle_buffers(conn);
+	}
+	return yielded;
+}
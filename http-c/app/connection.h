@@ -0,0 +1,288 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+struct file_cache_entry;
+struct z_stream_s;
+struct upload;
+struct commit;
+struct multipart_ranges;
+struct tls;
+struct http2;
+
+// Most unread request bytes discarded after the final response before we
+// give up waiting for the client to close
+#define CONN_LINGER_MAX (256 * 1024)
+// Stop answering pipelined requests while this much response data is still
+// unsent, so a client that never reads can't make us buffer without bound
+#define CONN_OUT_HIGH_WATER (64 * 1024)
+// Reads one connection_on_event() call makes before giving the worker's
+// other connections a turn
+#define CONN_DRIVE_BUDGET 4
+// Seconds a client turned away by --max-connections is asked to wait
+#define CONN_RETRY_AFTER "1"
+// Idle timeout of kept-alive connections while draining for a restart:
+// clients reusing one get its next request answered (and the connection
+// closed), the rest are not waited for
+#define CONN_DRAIN_IDLE_MS 1000
+// Most iovecs connection_output_iov() fills in
+#define CONN_IOV_MAX 4
+
+// Every object registered with epoll starts with this header, so the event
+// loop can tell listeners and client connections apart from epoll_event.data.ptr.
+enum io_kind { IO_LISTENER, IO_TLS_LISTENER, IO_CONNECTION, IO_DRAIN, IO_COMMIT };
+
+struct io_handle {
+	enum io_kind kind;
+	int fd;
+};
+
+// States of the per-connection request state machine. Whenever a socket call
+// returns EAGAIN we simply return to the event loop and resume in the same
+// state on the next event. On a persistent connection the cycle starts over
+// at CONN_READING_HEADERS after each response.
+enum conn_state {
+	CONN_HANDSHAKE,       // HTTPS: the TLS handshake is under way
+	CONN_READING_HEADERS, // waiting for (or parsing) the next request's headers
+	CONN_READING_BODY,    // streaming a POST /files/ body into the target file
+	CONN_COMMITTING,      // the body is in, waiting for the commit thread to make it durable
+	CONN_WRITING,         // a response must be flushed before anything else happens
+	CONN_LINGERING,       // final response sent, discarding input until the client closes
+	CONN_CLOSED,          // done, the event loop frees the connection
+};
+
+// The timeout a connection's timer is armed for, one per phase (see
+// g_timeouts in server.h)
+enum conn_timeout {
+	CONN_TIMEOUT_NONE,
+	CONN_TIMEOUT_HEADER, // a request's header block is incomplete, the first has yet to arrive, or the TLS handshake
+	CONN_TIMEOUT_BODY,   // a request body is being received
+	CONN_TIMEOUT_WRITE,  // response data is waiting to be sent
+	CONN_TIMEOUT_IDLE,   // kept alive between requests, or lingering
+};
+
+struct connection {
+	struct io_handle io; // must stay the first member
+	enum conn_state state;
+
+	// Readiness last reported by edge-triggered epoll; cleared when a call
+	// returns EAGAIN, set again by the next EPOLLIN / EPOLLOUT.
+	int readable;
+	int writable;
+	int peer_closed; // recv() returned 0, no further requests will arrive
+	int keep_alive;  // the current request allows the connection to be reused
+	int http10;      // the current request is HTTP/1.0
+	// HTTPS connection, NULL for plaintext. Reads go through OpenSSL; writes
+	// too unless kTLS took over the sending side.
+	struct tls *tls;
+	size_t lingered; // bytes discarded in CONN_LINGERING
+	// HTTP/2 session (http2.h), NULL while speaking HTTP/1.x. `in` and `out`
+	// then carry frames, and each request runs on a stream connection.
+	struct http2 *h2;
+	// A stream connection: one HTTP/2 request, handed over as HTTP/1.1 text
+	// with connection_feed() and answered through the usual routes. It has
+	// no socket, its response is read back with connection_output_read(),
+	// and its bodies are never chunked, as HTTP/2 frames them itself.
+	int h2_stream;
+	struct connection *h2_parent; // the connection a stream is carried on
+
+	// Raw request bytes; the unconsumed ones are in[in_start, in_len).
+	// Several pipelined requests may be buffered at once. The buffer holds
+	// in_cap bytes, the largest header block we accept. It comes from the
+	// buffer pool when bytes arrive and goes back while nothing is buffered
+	// (NULL then), like `out`.
+	char *in;
+	size_t in_cap;
+	size_t in_start;
+	size_t in_len;
+
+	// Incremental parser state for the request starting at in_start
+	struct http_parser parser;
+	struct http_request request;
+	// NUL-terminated request target, inside `in`; only valid while routing
+	const char *path;
+	// For the metrics: when the current request's first bytes were seen (0
+	// before then), where it was routed and the status it was answered with
+	uint64_t request_start;
+	enum metrics_route route;
+	int status;
+
+	// Closes the connection once it has spent too long in its current phase.
+	// Header and idle deadlines run from the start of the phase (or of the
+	// request), body and write ones from the last activity on the socket.
+	struct timer timer;
+	enum conn_timeout timeout;     // what the timer is armed for
+	unsigned long requests;        // answered so far
+	unsigned long timeout_request; // `requests` when the timer was armed
+
+	// Objects that live for one request: the upload, multipart ranges and
+	// deflate stream below
+	struct arena arena;
+
+	// POST /files/ upload in progress (CONN_READING_BODY)
+	struct upload *upload;
+	// The upload only skips a body no route wanted (upload_discard()); the
+	// response is queued already
+	int body_discard;
+	char upload_name[512]; // filename, for cache invalidation
+	// The finished upload being made durable (CONN_COMMITTING); NULL once
+	// the commit thread is done with it, and commit_result says how it went
+	struct commit *commit;
+	int commit_result;
+
+	// Pending response data; may hold the answers to several pipelined requests
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+	size_t out_sent;
+	// A response body sent straight from `in` (an echoed path or header
+	// value) instead of being copied into `out`. It goes out right after
+	// the first out_ref_at bytes of `out`; at most one is pending at a time.
+	// Only used when body_refs is set: `in` must stay put until the send,
+	// which a backend whose sends complete asynchronously can't promise.
+	int body_refs;
+	const char *out_ref;
+	size_t out_ref_len;
+	size_t out_ref_sent;
+	size_t out_ref_at;
+
+	// GET /files/ body served from the hot-file cache: its pre-rendered
+	// headers and contents go out right after `out`
+	struct file_cache_entry *cached;
+	size_t cached_sent;
+
+	// GET /files/ body, sent with sendfile() once `out` has been flushed.
+	// file_fd is the fd of the referenced `file`, -1 when there is none.
+	struct open_file *file;
+	int file_fd;
+	off_t file_offset;
+	off_t file_remaining;
+	// Set instead when that body is gzip-compressed on the fly: the file is
+	// read through deflate a chunk at a time as `out` drains
+	struct z_stream_s *gzip;
+	// Set for a multipart/byteranges body: file_offset/file_remaining cover
+	// one part at a time, and the next part's header is queued in `out`
+	// when the previous part is done
+	struct multipart_ranges *multipart;
+
+	// io_uring backend bookkeeping (see uring_loop.c), unused with epoll
+	int ring_slot;          // index in the ring's registered file table, or -1
+	int ring_inflight;      // operations submitted and not yet completed
+	int ring_recv_armed;
+	int ring_send_armed;    // a send, or a wait for POLLOUT, is outstanding
+	int ring_closing;       // CONN_CLOSED, waiting for the operations to finish
+	struct iovec ring_iov[CONN_IOV_MAX];
+	struct msghdr ring_msg; // must stay put while the send is in flight
+};
+
+// Register the server's routes with the router (router.h). Called once at
+// startup. Returns 0 on success, -1 on error.
+int connection_routes_init(void);
+// Allocate the state for a freshly accepted, non-blocking client socket
+struct connection *connection_new(int fd);
+// Allocate a stream connection for one HTTP/2 request (see h2_stream)
+// carried on `parent`
+struct connection *connection_new_stream(struct connection *parent);
+// Close the socket and any open files and release the connection
+void connection_free(struct connection *conn);
+// Whether a freshly accepted socket may become a connection. With
+// --max-connections already open it is answered with a 503 (just closed if
+// it came in on the HTTPS listener, `tls`) and 0 is returned.
+int connection_admit(int fd, int tls);
+// Connections open across all workers (HTTP/2 streams not included)
+int connection_open_count(void);
+// Wind the connection down for a restart (restart.h): it closes after the
+// response in progress or the next one, and after CONN_DRAIN_IDLE_MS idle;
+// HTTP/2 connections send GOAWAY on their next drive and close once their
+// open streams are answered. Called with its timer disarmed; the caller
+// drives it or re-arms the timer with connection_update_timeout().
+void connection_drain(struct connection *conn);
+// Make a new connection HTTPS: it starts in CONN_HANDSHAKE. Returns 0 on
+// success, -1 on error.
+int connection_start_tls(struct connection *conn);
+// Arm, move or cancel the connection's timer for the phase it is in now, on
+// its worker's wheel. Called after each round of I/O on the connection.
+void connection_update_timeout(struct connection *conn, struct timer_wheel *wheel, uint64_t now_ms);
+// The connection a timer returned by timer_wheel_expire() belongs to
+static inline struct connection *connection_from_timer(struct timer *timer) {
+	return (struct connection *)((char *)timer - offsetof(struct connection, timer));
+}
+// Note that the connection's timer expired and mark it CONN_CLOSED
+void connection_timed_out(struct connection *conn);
+// The commit thread is done with an upload (commit.h): have its connection
+// answer it on the next drive, and free `commit`. Returns the connection the
+// worker should drive, which for an HTTP/2 stream is the one carrying it, or
+// NULL if the client went away meanwhile.
+struct connection *connection_commit_done(struct commit *commit);
+// Advance the state machine after epoll reported `events` for the socket.
+// Returns 1 if it stopped after CONN_DRIVE_BUDGET reads with more input
+// possibly waiting; edge-triggered epoll won't report that again by itself,
+// so the caller must re-arm the socket.
+int connection_on_event(struct connection *conn, uint32_t events);
+
+// --- Building blocks for completion-based backends (uring_loop.c) ---
+// The epoll driver above is built from the same pieces.
+
+// Answer every complete request buffered in `in`, appending the responses
+// to `out`. Must not run while a send from `out` is in flight.
+void connection_process(struct connection *conn);
+// Append `len` received bytes to `in` (or discard them while lingering);
+// `len` == 0 means the peer closed. `len` must fit in the free space that
+// made connection_wants_input() true.
+void connection_received(struct connection *conn, const char *data, size_t len);
+// Whether response bytes, a cached body or a file body are still to be sent
+int connection_has_pending_output(const struct connection *conn);
+// Whether the connection can take more request bytes right now
+int connection_wants_input(const struct connection *conn);
+// Describe the in-memory response bytes to send next (producing the next
+// chunk of a body compressed on the fly if needed) in up to CONN_IOV_MAX
+// iovecs and the flags to send them with. Returns the iovec count, 0 when
+// only a file body (or nothing) is left.
+int connection_output_iov(struct connection *conn, struct iovec iov[CONN_IOV_MAX], int *send_flags);
+// Account for `sent` bytes of the iovecs from connection_output_iov()
+void connection_output_sent(struct connection *conn, size_t sent);
+// Whether the next bytes on the socket are POST body data that can go
+// straight to the upload file, bypassing `in`
+int connection_body_spliceable(const struct connection *conn);
+// Splice the next run of body data from the socket to the upload file.
+// Returns 1 if bytes moved, or if splicing isn't possible after all and the
+// body must be received into `in` (the body is no longer spliceable);
+// otherwise the socket had nothing (`readable` is cleared), the peer closed,
+// or the connection failed.
+int connection_splice_body(struct connection *conn);
+// Send the file body with sendfile() until done (returns 1) or the socket
+// would block or failed (returns 0)
+int connection_send_file(struct connection *conn);
+// Move on once everything queued in CONN_WRITING is out: wait for the next
+// request, or start closing
+void connection_response_sent(struct connection *conn);
+// Half-close after the final response and discard input until the peer
+// closes (CONN_LINGERING)
+void connection_linger(struct connection *conn);
+// Make room for `len` more bytes at the end of `out` and return where they
+// go; the caller adds what it wrote to out_len. Returns NULL on failure (the
+// connection is closed).
+char *connection_out_reserve(struct connection *conn, size_t len);
+// Take up to `len` bytes of a stream connection's response into `buf`:
+// pending bytes, then any cached or file body. Returns how many were taken;
+// fewer than `len` once the response is exhausted or the connection failed.
+size_t connection_output_read(struct connection *conn, char *buf, size_t len);
+// Hand request bytes to a stream connection and answer what they complete.
+// Returns how many were taken: input stops once its request is answered.
+size_t connection_feed(struct connection *conn, const char *data, size_t len);
+// Give `in`, `out` and the arena back to the pool if they hold nothing the
+// connection still needs; called when it is about to wait for the socket.
+// Must not run while a send from `out` is in flight.
+void connection_release_idle_buffers(struct connection *conn);
+
+#endif
@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "event_loop.h"
+#include "connection.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "log.h"
+#include "restart.h"
+#include "commit.h"
+#include "server.h"
+
+// Maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS 256
+// Most connections accepted per listener event, so a flood of new clients
+// can't starve the open connections; the level-triggered listener reports
+// the rest on the next epoll_wait()
+#define ACCEPT_BATCH 64
+
+// Per-thread state. Each worker owns the connections it accepted, so no
+// connection is ever touched by two threads and no locking is needed.
+struct worker {
+	int id;
+	pthread_t thread;
+	int epoll_fd;
+	struct io_handle listener;
+	struct io_handle tls_listener; // HTTPS; fd -1 when it is off
+	// metrics_now() at which the listeners are re-armed, 0 while accepting
+	uint64_t accept_paused_until;
+	// restart_drain_fd(), readable once the server is draining
+	struct io_handle drain;
+	int drain_requested;
+	// --durable-uploads: where the commit thread returns this worker's
+	// uploads once they are on disk (NULL when off), and its eventfd
+	struct commit_inbox *inbox;
+	struct io_handle commit;
+	int commits_ready;
+	// Header, body, write and idle timeouts of this worker's connections
+	struct timer_wheel timers;
+};
+
+// Milliseconds on the clock the timer wheels run on
+static uint64_t now_ms(void) {
+	return metrics_now() / 1000000u;
+}
+
+// Events every client connection is registered for
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+// Stop or resume watching the listeners, which stay registered either way
+static void listener_watch(struct worker *worker, uint32_t events) {
+	struct io_handle *listeners[] = { &worker->listener, &worker->tls_listener };
+	for (int i = 0; i < 2; i++) {
+		if (listeners[i]->fd < 0) {
+			continue;
+		}
+		struct epoll_event ev = {
+			.events = events,
+			.data.ptr = listeners[i],
+		};
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, listeners[i]->fd, &ev) != 0) {
+			log_error("epoll_ctl MOD listener failed: %m");
+		}
+	}
+}
+
+// Accept up to ACCEPT_BATCH pending connections on `listener` and register
+// them with this worker's epoll instance.
+static void worker_accept(struct worker *worker, struct io_handle *listener, uint64_t now) {
+	int tls = listener->kind == IO_TLS_LISTENER;
+	for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+		int client_fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return; // This worker's accept queue is drained
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			metrics_accept_error();
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// The listener would stay readable and fail again at once;
+				// ignore it until connections have had time to close
+				log_warn("Accept failed, pausing for %dms: %m", ACCEPT_PAUSE_MS);
+				listener_watch(worker, 0);
+				worker->accept_paused_until = metrics_now() + (uint64_t)ACCEPT_PAUSE_MS * 1000000u;
+				return;
+			}
+			log_error("Accept failed: %m");
+			return;
+		}
+
+		// Log client connection
+		log_debug("Client connected (FD: %d)", client_fd);
+
+		if (!connection_admit(client_fd, tls)) {
+			continue;
+		}
+		struct connection *conn = connection_new(client_fd);
+		if (conn == NULL) {
+			close(client_fd);
+			continue;
+		}
+		if (tls && connection_start_tls(conn) != 0) {
+			connection_free(conn);
+			continue;
+		}
+		// Edge-triggered: we are only told about new readiness, so the
+		// connection state machine always drains the socket until EAGAIN.
+		struct epoll_event ev = {
+			.events = CONNECTION_EVENTS,
+			.data.ptr = conn,
+		};
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+			log_error("epoll_ctl ADD client failed: %m");
+			connection_free(conn);
+			continue;
+		}
+		connection_update_timeout(conn, &worker->timers, now);
+	}
+}
+
+// How long epoll_wait() may block: until the next timer is due, or accepting
+// resumes if paused
+static int worker_wait_ms(struct worker *worker) {
+	int wait = timer_wheel_timeout_ms(&worker->timers, now_ms());
+	if (worker->accept_paused_until == 0) {
+		return wait;
+	}
+	uint64_t now = metrics_now();
+	if (now >= worker->accept_paused_until) {
+		worker->accept_paused_until = 0;
+		listener_watch(worker, EPOLLIN);
+		return wait;
+	}
+	// Rounded up, so the wait doesn't end just short of the deadline
+	int pause = (int)((worker->accept_paused_until - now + 999999) / 1000000);
+	return wait < 0 || pause < wait ? pause : wait;
+}
+
+// Close every connection whose timeout has passed, all in one go
+static void worker_expire(struct worker *worker, uint64_t now) {
+	struct timer *expired = timer_wheel_expire(&worker->timers, now);
+	while (expired != NULL) {
+		struct connection *conn = connection_from_timer(expired);
+		expired = expired->next;
+		connection_timed_out(conn);
+		connection_free(conn);
+	}
+}
+
+// Advance a connection after `events` (none when it is driven for another
+// reason), then free it if it closed or re-arm its timer
+static void worker_drive(struct worker *worker, struct connection *conn, uint32_t events, uint64_t now) {
+	if (connection_on_event(conn, events)) {
+		// It yielded with input left. Modifying the registration
+		// makes epoll check readiness again and queue a new event,
+		// behind the connections that are already waiting.
+		struct epoll_event ev = { .events = CONNECTION_EVENTS, .data.ptr = conn };
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->io.fd, &ev) != 0) {
+			log_error("epoll_ctl MOD client failed: %m");
+			conn->state = CONN_CLOSED;
+		}
+	}
+	if (conn->state == CONN_CLOSED) {
+		connection_free(conn);
+	} else {
+		connection_update_timeout(conn, &worker->timers, now);
+	}
+}
+
+// The server is draining: stop accepting (the listeners live on in the new
+// instance, if any) and have every connection close after its current or
+// next response.
+static void worker_drain(struct worker *worker, uint64_t now) {
+	struct io_handle *listeners[] = { &worker->listener, &worker->tls_listener };
+	for (int i = 0; i < 2; i++) {
+		if (listeners[i]->fd < 0) {
+			continue;
+		}
+		// Closing alone wouldn't unregister a socket another process still has open
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, listeners[i]->fd, NULL);
+		close(listeners[i]->fd);
+		listeners[i]->fd = -1;
+	}
+	worker->accept_paused_until = 0;
+
+	// The wheel lists every connection with a timeout running; one whose
+	// timeouts are all off is left to the drain deadline
+	struct timer *timers = timer_wheel_take_all(&worker->timers);
+	while (timers != NULL) {
+		struct connection *conn = connection_from_timer(timers);
+		timers = timers->next;
+		connection_drain(conn);
+		if (conn->h2 != NULL) {
+			worker_drive(worker, conn, 0, now); // To send its GOAWAY
+		} else {
+			connection_update_timeout(conn, &worker->timers, now);
+		}
+	}
+}
+
+// Answer the uploads the commit thread is done with
+static void worker_commits(struct worker *worker, uint64_t now) {
+	struct commit *commit = commit_inbox_take(worker->inbox);
+	while (commit != NULL) {
+		struct commit *next = commit->next;
+		struct connection *conn = connection_commit_done(commit);
+		if (conn != NULL) {
+			worker_drive(worker, conn, 0, now);
+		}
+		commit = next;
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct worker *worker = arg;
+	struct epoll_event events[MAX_EVENTS];
+	commit_inbox_attach(worker->inbox);
+
+	while (1) {
+		int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, worker_wait_ms(worker));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("epoll_wait failed: %m");
+			return NULL;
+		}
+		// One reading of the clock serves the whole batch
+		uint64_t now = now_ms();
+		for (int i = 0; i < n; i++) {
+			struct io_handle *handle = events[i].data.ptr;
+			if (handle->kind == IO_LISTENER || handle->kind == IO_TLS_LISTENER) {
+				worker_accept(worker, handle, now);
+				continue;
+			}
+			if (handle->kind == IO_DRAIN) {
+				worker->drain_requested = 1;
+				continue;
+			}
+			if (handle->kind == IO_COMMIT) {
+				worker->commits_ready = 1;
+				continue;
+			}
+			worker_drive(worker, (struct connection *)handle, events[i].events, now);
+		}
+		// After the batch, so no event left to handle refers to a freed connection
+		if (worker->commits_ready) {
+			worker->commits_ready = 0;
+			worker_commits(worker, now);
+		}
+		if (worker->drain_requested) {
+			worker->drain_requested = 0;
+			worker_drain(worker, now);
+		}
+		worker_expire(worker, now);
+	}
+	return NULL;
+}
+
+int worker_thread_start(pthread_t *thread, int id, void *(*start)(void *), void *arg) {
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count < 1) {
+		cpu_count = 1;
+	}
+	// Pin the worker to one core so its connections, event loop state and
+	// caches stay local. With more workers than cores they wrap around.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(id % cpu_count, &cpus);
+	if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0) {
+		log_warn("Could not pin worker %d to CPU %ld", id, id % cpu_count);
+	}
+	int rc = pthread_create(thread, &attr, start, arg);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		log_error("pthread_create failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+int event_loop_start(const int *listen_fds, const int *tls_listen_fds, int worker_count) {
+	struct worker *workers = calloc((size_t)worker_count, sizeof(*workers));
+	if (workers == NULL) {
+		log_error("Failed to allocate workers: %m");
+		return 1;
+	}
+
+	for (int i = 0; i < worker_count; i++) {
+		struct worker *worker = &workers[i];
+		worker->id = i;
+		worker->listener.kind = IO_LISTENER;
+		worker->listener.fd = listen_fds[i];
+		worker->tls_listener.kind = IO_TLS_LISTENER;
+		worker->tls_listener.fd = tls_listen_fds != NULL ? tls_listen_fds[i] : -1;
+		timer_wheel_init(&worker->timers, now_ms());
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epoll_fd < 0) {
+			log_error("epoll_create1 failed: %m");
+			return 1;
+		}
+		// The listeners are private to this worker, so plain level-triggered
+		// EPOLLIN is enough: nobody else can steal their connections.
+		struct io_handle *listeners[] = { &worker->listener, &worker->tls_listener };
+		for (int j = 0; j < 2; j++) {
+			if (listeners[j]->fd < 0) {
+				continue;
+			}
+			struct epoll_event ev = {
+				.events = EPOLLIN,
+				.data.ptr = listeners[j],
+			};
+			if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, listeners[j]->fd, &ev) != 0) {
+				log_error("epoll_ctl ADD listener failed: %m");
+				return 1;
+			}
+		}
+
+		// Edge-triggered: the eventfd is never read, and each worker only
+		// needs to hear about it once
+		worker->drain.kind = IO_DRAIN;
+		worker->drain.fd = restart_drain_fd();
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLET,
+			.data.ptr = &worker->drain,
+		};
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->drain.fd, &ev) != 0) {
+			log_error("epoll_ctl ADD drain eventfd failed: %m");
+			return 1;
+		}
+
+		if (g_durable_uploads) {
+			worker->inbox = commit_inbox_new();
+			if (worker->inbox == NULL) {
+				return 1;
+			}
+			// Level-triggered; taking the commits reads the eventfd
+			worker->commit.kind = IO_COMMIT;
+			worker->commit.fd = commit_inbox_fd(worker->inbox);
+			struct epoll_event commit_ev = {
+				.events = EPOLLIN,
+				.data.ptr = &worker->commit,
+			};
+			if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->commit.fd, &commit_ev) != 0) {
+				log_error("epoll_ctl ADD commit eventfd failed: %m");
+				return 1;
+			}
+		}
+
+		if (worker_thread_start(&worker->thread, i, worker_main, worker) != 0) {
+			return 1;
+		}
+	}
+	// The workers run until the process exits and own `workers` till then
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+
+// Start `worker_count` threads, each pinned to a CPU and running its own
+// edge-triggered epoll loop. Worker i accepts from the non-blocking
+// listen_fds[i] (one SO_REUSEPORT socket per worker), and HTTPS clients from
+// tls_listen_fds[i] unless that is NULL, and multiplexes every connection it
+// accepted. Once restart_drain_fd() becomes readable the workers close
+// their listeners and wind their connections down. Returns once the workers
+// are running, non-zero if they could not be started.
+int event_loop_start(const int *listen_fds, const int *tls_listen_fds, int worker_count);
+
+// After accept() fails for lack of file descriptors (EMFILE, ENFILE) a
+// worker stops accepting for this long rather than retry in a busy loop;
+// the pending clients stay queued on the listener meanwhile. Shared with
+// the io_uring loop.
+#define ACCEPT_PAUSE_MS 100
+
+// Start a worker thread running start(arg), pinned to CPU `id` (modulo the
+// number of CPUs). Shared with the io_uring loop. Returns 0 on success.
+int worker_thread_start(pthread_t *thread, int id, void *(*start)(void *), void *arg);
+
+#endif
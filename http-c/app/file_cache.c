@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "file_cache.h"
+#include "gzip.h"
+#include "open_files.h"
+#include "log.h"
+
+// Number of hash buckets (power of two)
+#define FILE_CACHE_BUCKETS 1024
+
+// Shared by all workers. Lookups take the lock for reading and only touch the
+// entry's atomic refcount / CLOCK bit, so hits on different workers don't
+// serialize; inserts and invalidations take it for writing.
+static struct {
+	int enabled;
+	size_t capacity;
+	size_t used;
+	pthread_rwlock_t lock;
+	struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+	// CLOCK ring of all entries; the hand points at the next eviction candidate
+	struct file_cache_entry *hand;
+	// Bumped on every invalidation (atomic)
+	unsigned long generation;
+	int inotify_fd;
+	pthread_t inotify_thread;
+} cache;
+
+// FNV-1a hash of a filename
+static size_t hash_name(const char *name) {
+	size_t hash = 14695981039346656037ULL;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash & (FILE_CACHE_BUCKETS - 1);
+}
+
+void file_cache_release(struct file_cache_entry *entry) {
+	if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(entry->blob);
+		free(entry->name);
+		free(entry);
+	}
+}
+
+// Find a variant of `name` in its bucket (both variants hash alike). Caller
+// holds the lock.
+static struct file_cache_entry *lookup_locked(const char *name, enum file_cache_variant variant) {
+	struct file_cache_entry *entry = cache.buckets[hash_name(name)];
+	while (entry != NULL && (entry->variant != variant || strcmp(entry->name, name) != 0)) {
+		entry = entry->hash_next;
+	}
+	return entry;
+}
+
+// Unlink an entry from the hash and the CLOCK ring and drop the cache's
+// reference. Caller holds the write lock.
+static void remove_locked(struct file_cache_entry *entry) {
+	struct file_cache_entry **link = &cache.buckets[hash_name(entry->name)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+
+	if (entry->clock_next == entry) {
+		cache.hand = NULL; // It was the only entry
+	} else {
+		entry->clock_prev->clock_next = entry->clock_next;
+		entry->clock_next->clock_prev = entry->clock_prev;
+		if (cache.hand == entry) {
+			cache.hand = entry->clock_next;
+		}
+	}
+	cache.used -= entry->blob_len;
+	file_cache_release(entry);
+}
+
+// CLOCK eviction: sweep the hand, giving recently used entries a second
+// chance, and evict the first entry that hasn't been used since the last
+// sweep. Caller holds the write lock and guarantees the cache isn't empty.
+static void evict_one_locked(void) {
+	while (1) {
+		struct file_cache_entry *entry = cache.hand;
+		if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+			cache.hand = entry->clock_next;
+			continue;
+		}
+		remove_locked(entry);
+		return;
+	}
+}
+
+static void remove_all_locked(void) {
+	while (cache.hand != NULL) {
+		remove_locked(cache.hand);
+	}
+}
+
+int file_cache_enabled(void) {
+	return cache.enabled;
+}
+
+unsigned long file_cache_generation(void) {
+	return __atomic_load_n(&cache.generation, __ATOMIC_ACQUIRE);
+}
+
+struct file_cache_entry *file_cache_get(const char *name, enum file_cache_variant variant) {
+	pthread_rwlock_rdlock(&cache.lock);
+	struct file_cache_entry *entry = lookup_locked(name, variant);
+	if (entry != NULL) {
+		__atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&cache.lock);
+	return entry;
+}
+
+// Read exactly `size` bytes of the file into `buffer`. Returns 0 on success,
+// -1 on a read error or if the file shrank since it was stat()ed.
+static int read_file(int fd, char *buffer, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t bytes_read = pread(fd, buffer + done, size - done, (off_t)done);
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			return -1;
+		}
+		done += (size_t)bytes_read;
+	}
+	return 0;
+}
+
+struct file_cache_entry *file_cache_fill(const char *name, enum file_cache_variant variant,
+										 enum file_cache_body body, int fd, const struct stat *file_stat,
+										 unsigned long generation) {
+	off_t size = file_stat->st_size;
+	// The file is at most FILE_CACHE_MAX_ENTRY bytes. Compressed bodies are
+	// only known after compressing; other bodies are read straight into the
+	// entry below.
+	char *compressed = NULL;
+	size_t body_len = (size_t)size;
+	if (body == FILE_CACHE_BODY_COMPRESS) {
+		char *contents = malloc(size > 0 ? (size_t)size : 1);
+		if (contents == NULL) {
+			log_error("Malloc failed for file cache entry: %m");
+			return NULL;
+		}
+		if (read_file(fd, contents, (size_t)size) == 0) {
+			compressed = gzip_compress(contents, (size_t)size, GZIP_LEVEL_CACHED, &body_len);
+		}
+		free(contents);
+		if (compressed == NULL) {
+			return NULL;
+		}
+	}
+
+	struct file_cache_entry *entry = calloc(1, sizeof(*entry));
+	if (entry == NULL) {
+		free(compressed);
+		return NULL;
+	}
+	etag_format(entry->etag, file_stat, body == FILE_CACHE_BODY_COMPRESS);
+	entry->mtime = file_stat->st_mtime;
+	char validators[256];
+	char header[512];
+	// Whether a gzip variant exists can change at any time, so every
+	// response says it depends on Accept-Encoding. Range requests are
+	// answered from the file, except for bodies compressed on our side.
+	int header_len = -1;
+	if (validators_format(validators, sizeof(validators), entry->etag, entry->mtime) >= 0) {
+		header_len = snprintf(header, sizeof(header),
+							  "Content-Type: application/octet-stream\r\n"
+							  "%s"
+							  "%s"
+							  "%s"
+							  "Vary: Accept-Encoding\r\n"
+							  "Content-Length: %zu\r\n\r\n",
+							  body == FILE_CACHE_BODY_AS_IS ? "" : "Content-Encoding: gzip\r\n",
+							  body == FILE_CACHE_BODY_COMPRESS ? "" : "Accept-Ranges: bytes\r\n", validators,
+							  body_len);
+	}
+	if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+		log_warn("File cache headers too long for %s", name);
+		free(compressed);
+		free(entry);
+		return NULL;
+	}
+	entry->header_len = (size_t)header_len;
+	entry->blob_len = (size_t)header_len + body_len;
+	entry->blob = malloc(entry->blob_len);
+	entry->name = strdup(name);
+	entry->variant = variant;
+	if (entry->blob == NULL || entry->name == NULL) {
+		log_error("Malloc failed for file cache entry: %m");
+		goto fail;
+	}
+	memcpy(entry->blob, header, (size_t)header_len);
+	if (compressed != NULL) {
+		memcpy(entry->blob + header_len, compressed, body_len);
+		free(compressed);
+		compressed = NULL;
+	} else if (read_file(fd, entry->blob + header_len, body_len) != 0) {
+		goto fail;
+	}
+	entry->refcount = 1; // The caller's reference
+
+	pthread_rwlock_wrlock(&cache.lock);
+	// If the file was invalidated while we read it, what we have may already
+	// be stale: serve it to this one request, but don't cache it.
+	if (generation == file_cache_generation() && entry->blob_len <= cache.capacity) {
+		struct file_cache_entry *old = lookup_locked(name, variant);
+		if (old != NULL) {
+			remove_locked(old);
+		}
+		while (cache.used + entry->blob_len > cache.capacity) {
+			evict_one_locked();
+		}
+
+		size_t bucket = hash_name(name);
+		entry->hash_next = cache.buckets[bucket];
+		cache.buckets[bucket] = entry;
+		// New entries go just behind the hand, the last place it will reach
+		if (cache.hand == NULL) {
+			entry->clock_prev = entry->clock_next = entry;
+			cache.hand = entry;
+		} else {
+			entry->clock_next = cache.hand;
+			entry->clock_prev = cache.hand->clock_prev;
+			cache.hand->clock_prev->clock_next = entry;
+			cache.hand->clock_prev = entry;
+		}
+		cache.used += entry->blob_len;
+		entry->refcount++; // The cache's reference
+	}
+	pthread_rwlock_unlock(&cache.lock);
+	return entry;
+
+fail:
+	free(compressed);
+	free(entry->blob);
+	free(entry->name);
+	free(entry);
+	return NULL;
+}
+
+// Remove `variant` of `name` if it is cached. Caller holds the write lock.
+static void remove_variant_locked(const char *name, enum file_cache_variant variant) {
+	struct file_cache_entry *entry = lookup_locked(name, variant);
+	if (entry != NULL) {
+		remove_locked(entry);
+	}
+}
+
+void file_cache_invalidate(const char *name) {
+	if (!cache.enabled) {
+		return;
+	}
+	__atomic_add_fetch(&cache.generation, 1, __ATOMIC_ACQ_REL);
+	pthread_rwlock_wrlock(&cache.lock);
+	remove_variant_locked(name, FILE_CACHE_PLAIN);
+	remove_variant_locked(name, FILE_CACHE_GZIP);
+	size_t len = strlen(name);
+	if (len > 3 && len <= NAME_MAX && strcmp(name + len - 3, ".gz") == 0) {
+		char stem[NAME_MAX + 1];
+		memcpy(stem, name, len - 3);
+		stem[len - 3] = '\0';
+		remove_variant_locked(stem, FILE_CACHE_GZIP);
+	}
+	pthread_rwlock_unlock(&cache.lock);
+}
+
+static void invalidate_all(void) {
+	open_files_invalidate_all();
+	__atomic_add_fetch(&cache.generation, 1, __ATOMIC_ACQ_REL);
+	pthread_rwlock_wrlock(&cache.lock);
+	remove_all_locked();
+	pthread_rwlock_unlock(&cache.lock);
+}
+
+// Background thread: turn inotify events on the served directory into
+// invalidations, so files changed behind the server's back aren't served
+// stale. The open-file cache (open_files.h) is kept in step on the way.
+static void *inotify_main(void *arg) {
+	(void)arg;
+	// Aligned as the kernel expects for struct inotify_event
+	char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read(cache.inotify_fd, buffer, sizeof(buffer));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("inotify read failed, disabling file cache: %m");
+			cache.enabled = 0;
+			invalidate_all();
+			return NULL;
+		}
+		for (char *p = buffer; p < buffer + len;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+				// Events were lost or the directory itself went away
+				invalidate_all();
+			} else if (event->len > 0) {
+				// The open file first, so a fill after the invalidation
+				// can't start from the old one
+				open_files_invalidate(event->name);
+				file_cache_invalidate(event->name);
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return NULL;
+}
+
+int file_cache_init(size_t capacity, const char *directory) {
+	if (pthread_rwlock_init(&cache.lock, NULL) != 0) {
+		log_error("pthread_rwlock_init failed: %m");
+		return -1;
+	}
+	cache.capacity = capacity;
+
+	cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (cache.inotify_fd < 0) {
+		log_error("inotify_init1 failed: %m");
+		return -1;
+	}
+	uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+					IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+	if (inotify_add_watch(cache.inotify_fd, directory, mask) < 0) {
+		log_error("inotify_add_watch failed: %m");
+		close(cache.inotify_fd);
+		return -1;
+	}
+	cache.enabled = 1;
+	if (pthread_create(&cache.inotify_thread, NULL, inotify_main, NULL) != 0) {
+		log_error("pthread_create failed for inotify thread: %m");
+		cache.enabled = 0;
+		close(cache.inotify_fd);
+		return -1;
+	}
+	pthread_detach(cache.inotify_thread);
+	return 0;
+}
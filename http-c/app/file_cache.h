@@ -0,0 +1,82 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "validators.h"
+
+// Files larger than this are never cached; they are cheap to sendfile()
+// relative to their size, and would crowd out the small hot files.
+#define FILE_CACHE_MAX_ENTRY (256 * 1024)
+
+// Each file can be cached twice: the response for clients that accept gzip
+// and the one for clients that don't
+enum file_cache_variant {
+	FILE_CACHE_PLAIN,
+	FILE_CACHE_GZIP,
+};
+
+// How file_cache_fill() turns the file into the cached body
+enum file_cache_body {
+	FILE_CACHE_BODY_AS_IS,        // the file's bytes, unchanged
+	FILE_CACHE_BODY_COMPRESS,     // the file's bytes, gzip-compressed once at fill time
+	FILE_CACHE_BODY_PRECOMPRESSED // the file is already gzip data (a foo.gz next to foo)
+};
+
+// A cached file: its pre-rendered response headers (everything after the
+// status and Connection lines) immediately followed by the body, so a hit
+// goes out as one contiguous buffer after the status line.
+// Entries are reference counted: a connection that is still sending an
+// entry keeps it alive even after it has been evicted or invalidated.
+struct file_cache_entry {
+	char *blob;         // headers + body
+	size_t header_len;  // bytes of headers at the start of blob
+	size_t blob_len;    // headers + body
+	char *name;         // filename relative to g_directory_path
+	enum file_cache_variant variant; // together with name, the key
+	char etag[ETAG_MAX]; // validators of the body, for conditional requests
+	time_t mtime;
+	int refcount;       // updated atomically
+	int referenced;     // CLOCK "recently used" bit
+	struct file_cache_entry *hash_next;
+	struct file_cache_entry *clock_prev;
+	struct file_cache_entry *clock_next;
+};
+
+// Enable the cache with room for `capacity` bytes of entries and start
+// watching `directory` with inotify so external changes invalidate entries.
+// Returns 0 on success, -1 on error.
+int file_cache_init(size_t capacity, const char *directory);
+
+// Whether file_cache_init() succeeded
+int file_cache_enabled(void);
+
+// Look up `variant` of `name`. Returns a referenced entry (release it with
+// file_cache_release()) or NULL on a miss.
+struct file_cache_entry *file_cache_get(const char *name, enum file_cache_variant variant);
+
+// Read the regular file open as `fd`, whose stat() is `file_stat`, turn it
+// into a body as `body` says and cache the result as `variant` of `name`.
+// `generation` must be the value of file_cache_generation() taken before the
+// file was opened, so contents read across a concurrent invalidation are not
+// cached. Returns
+// a referenced entry holding the response even when it could not be
+// inserted, or NULL if the file could not be read or compressed.
+struct file_cache_entry *file_cache_fill(const char *name, enum file_cache_variant variant,
+										 enum file_cache_body body, int fd, const struct stat *file_stat,
+										 unsigned long generation);
+
+// Current invalidation generation (see file_cache_fill())
+unsigned long file_cache_generation(void);
+
+// Drop every variant of `name` from the cache, e.g. because it is being
+// overwritten. Changing "foo.gz" also drops the gzip variant of "foo", which
+// may have been served from it.
+void file_cache_invalidate(const char *name);
+
+// Release a reference obtained from file_cache_get() / file_cache_fill()
+void file_cache_release(struct file_cache_entry *entry);
+
+#endif
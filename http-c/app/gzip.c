@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "gzip.h"
+#include "log.h"
+
+// windowBits 15 plus 16 asks zlib for a gzip header and trailer
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+
+static const char *const compressible_extensions[] = {
+	"txt", "html", "htm", "css", "js", "mjs", "json", "xml", "svg", "csv", "md", "log", "tsv", "ini", NULL,
+};
+
+int gzip_compressible_name(const char *filename) {
+	const char *dot = strrchr(filename, '.');
+	if (dot == NULL || strchr(dot, '/') != NULL) {
+		return 0;
+	}
+	for (const char *const *ext = compressible_extensions; *ext != NULL; ext++) {
+		if (strcasecmp(dot + 1, *ext) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int gzip_stream_init(z_stream *stream, int level) {
+	alloc_func zalloc = stream->zalloc;
+	free_func zfree = stream->zfree;
+	voidpf opaque = stream->opaque;
+	memset(stream, 0, sizeof(*stream));
+	stream->zalloc = zalloc;
+	stream->zfree = zfree;
+	stream->opaque = opaque;
+	int result = deflateInit2(stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (result != Z_OK) {
+		log_error("deflateInit2 failed (%d)", result);
+		return -1;
+	}
+	return 0;
+}
+
+// The calling thread's stream for gzip_compress_into(), ready for a new
+// member, or NULL if it can't be set up
+static z_stream *thread_stream(void) {
+	static __thread z_stream stream;
+	static __thread int ready;
+	if (!ready) {
+		if (gzip_stream_init(&stream, GZIP_LEVEL_STREAM) != 0) {
+			return NULL;
+		}
+		ready = 1;
+	} else if (deflateReset(&stream) != Z_OK) {
+		return NULL;
+	}
+	return &stream;
+}
+
+size_t gzip_compress_bound(size_t len) {
+	z_stream *stream = thread_stream();
+	return stream != NULL ? deflateBound(stream, (uLong)len) : 0;
+}
+
+size_t gzip_compress_into(const char *data, size_t len, char *dst, size_t cap) {
+	z_stream *stream = thread_stream();
+	if (stream == NULL) {
+		return 0;
+	}
+	stream->next_in = (Bytef *)data;
+	stream->avail_in = (uInt)len;
+	stream->next_out = (Bytef *)dst;
+	stream->avail_out = (uInt)cap;
+	int result = deflate(stream, Z_FINISH);
+	if (result != Z_STREAM_END) {
+		log_error("deflate failed (%d)", result);
+		return 0;
+	}
+	return cap - stream->avail_out;
+}
+
+char *gzip_compress(const char *data, size_t len, int level, size_t *compressed_len) {
+	z_stream stream = { 0 };
+	if (gzip_stream_init(&stream, level) != 0) {
+		return NULL;
+	}
+	// deflateBound() is enough for the whole output, so one Z_FINISH call does it
+	size_t capacity = deflateBound(&stream, (uLong)len);
+	char *compressed = malloc(capacity);
+	if (compressed == NULL) {
+		log_error("Malloc failed for compressed body: %m");
+		deflateEnd(&stream);
+		return NULL;
+	}
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = (uInt)len;
+	stream.next_out = (Bytef *)compressed;
+	stream.avail_out = (uInt)capacity;
+	int result = deflate(&stream, Z_FINISH);
+	deflateEnd(&stream);
+	if (result != Z_STREAM_END) {
+		log_error("deflate failed (%d)", result);
+		free(compressed);
+		return NULL;
+	}
+	*compressed_len = capacity - stream.avail_out;
+	return compressed;
+}
@@ -0,0 +1,39 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+// Compression level for bodies that are compressed once and then cached
+#define GZIP_LEVEL_CACHED 9
+// Compression level for bodies compressed on every request
+#define GZIP_LEVEL_STREAM 6
+
+// Input consumed per step when streaming a file through deflate
+#define GZIP_STREAM_CHUNK (32 * 1024)
+
+// Whether a file is worth compressing, judged by its extension (text formats
+// compress well; images, archives and the like are already compressed)
+int gzip_compressible_name(const char *filename);
+
+// Compress `len` bytes at `data` into a new malloc()ed gzip member and store
+// its size in *compressed_len. Returns NULL on failure.
+char *gzip_compress(const char *data, size_t len, int level, size_t *compressed_len);
+
+// Largest gzip_compress_into() output for `len` bytes of input, or 0 if
+// compression is unavailable
+size_t gzip_compress_bound(size_t len);
+
+// Compress `len` bytes at `data` into `dst`, which has room for
+// gzip_compress_bound(len) bytes, at GZIP_LEVEL_STREAM. Uses a deflate
+// stream kept per thread and reset between calls, so only a thread's first
+// call allocates. Returns the compressed size, or 0 on failure.
+size_t gzip_compress_into(const char *data, size_t len, char *dst, size_t cap);
+
+// Prepare `stream` to produce gzip (rather than raw zlib) output. Its
+// zalloc, zfree and opaque fields pick the allocator zlib uses (Z_NULL for
+// malloc), so they must be set, if only to zero, beforehand.
+// Returns 0 on success, -1 on failure.
+int gzip_stream_init(z_stream *stream, int level);
+
+#endif
@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "header_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// RFC 9110 token characters (same set the parser accepts)
+static const unsigned char token_chars[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+	['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+	['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+// --- Scalar kernels (also used for the tails of the vector ones) ---
+
+static size_t value_scalar(const char *data, size_t i, size_t len) {
+	for (; i < len; i++) {
+		unsigned char c = (unsigned char)data[i];
+		if ((c < ' ' && c != '\t') || c == 0x7f) {
+			break;
+		}
+	}
+	return i;
+}
+
+static size_t target_scalar(const char *data, size_t i, size_t len) {
+	for (; i < len; i++) {
+		unsigned char c = (unsigned char)data[i];
+		if (c <= ' ' || c == 0x7f) {
+			break;
+		}
+	}
+	return i;
+}
+
+static size_t token_scalar(const char *data, size_t i, size_t len) {
+	while (i < len && token_chars[(unsigned char)data[i]]) {
+		i++;
+	}
+	return i;
+}
+
+static size_t scan_value_scalar(const char *data, size_t len) {
+	return value_scalar(data, 0, len);
+}
+
+static size_t scan_target_scalar(const char *data, size_t len) {
+	return target_scalar(data, 0, len);
+}
+
+static size_t scan_token_scalar(const char *data, size_t len) {
+	return token_scalar(data, 0, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// --- SSE4.2: PCMPESTRI with byte ranges, 16 bytes per step ---
+
+// Byte ranges (inclusive pairs) that end a field value: 0x00-0x08, 0x0a-0x1f, DEL
+static const char value_stop_ranges[16] __attribute__((aligned(16))) = "\x00\x08\x0a\x1f\x7f\x7f";
+// SP and below, DEL
+static const char target_stop_ranges[16] __attribute__((aligned(16))) = "\x00\x20\x7f\x7f";
+// Everything that isn't a token character, except that '{' to 0xff is one
+// range: '|' and '~' are rare in names and get sorted out by the scalar check.
+static const char token_stop_ranges[16] __attribute__((aligned(16))) =
+	"\x00\x20" "\"\"" "()" ",," "//" ":@" "[]" "{\xff";
+
+#define RANGES_MODE (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT)
+
+__attribute__((target("sse4.2")))
+static size_t scan_value_sse42(const char *data, size_t len) {
+	__m128i ranges = _mm_load_si128((const __m128i *)value_stop_ranges);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		int index = _mm_cmpestri(ranges, 6, chunk, 16, RANGES_MODE);
+		if (index != 16) {
+			return i + (size_t)index;
+		}
+	}
+	return value_scalar(data, i, len);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_target_sse42(const char *data, size_t len) {
+	__m128i ranges = _mm_load_si128((const __m128i *)target_stop_ranges);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		int index = _mm_cmpestri(ranges, 4, chunk, 16, RANGES_MODE);
+		if (index != 16) {
+			return i + (size_t)index;
+		}
+	}
+	return target_scalar(data, i, len);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_token_sse42(const char *data, size_t len) {
+	__m128i ranges = _mm_load_si128((const __m128i *)token_stop_ranges);
+	size_t i = 0;
+	while (i + 16 <= len) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		int index = _mm_cmpestri(ranges, 16, chunk, 16, RANGES_MODE);
+		if (index == 16) {
+			i += 16;
+			continue;
+		}
+		i += (size_t)index;
+		if (!token_chars[(unsigned char)data[i]]) {
+			return i;
+		}
+		i++; // A '|' or '~'
+	}
+	return token_scalar(data, i, len);
+}
+
+// --- AVX2: 32 bytes per step with compare masks ---
+
+// Mask of bytes that are unsigned-less-than `bound`
+__attribute__((target("avx2")))
+static inline __m256i below(__m256i v, unsigned char bound) {
+	// v < bound  <=>  max(v, bound) != v
+	__m256i b = _mm256_set1_epi8((char)bound);
+	return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, b), v), _mm256_set1_epi8(-1));
+}
+
+// Mask of bytes in [lo, hi]
+__attribute__((target("avx2")))
+static inline __m256i in_range(__m256i v, unsigned char lo, unsigned char hi) {
+	__m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8((char)lo));
+	__m256i span = _mm256_set1_epi8((char)(hi - lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, span), shifted);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_value_avx2(const char *data, size_t len) {
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), below(v, ' '));
+		__m256i stop = _mm256_or_si256(control, _mm256_cmpeq_epi8(v, del));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);
+		if (mask != 0) {
+			return i + (size_t)__builtin_ctz(mask);
+		}
+	}
+	return value_scalar(data, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_target_avx2(const char *data, size_t len) {
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i stop = _mm256_or_si256(below(v, ' ' + 1), _mm256_cmpeq_epi8(v, del));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);
+		if (mask != 0) {
+			return i + (size_t)__builtin_ctz(mask);
+		}
+	}
+	return target_scalar(data, i, len);
+}
+
+// Header names are almost always letters, digits and '-'. Skip runs of those
+// 32 at a time and let the exact table decide at anything else.
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *data, size_t len) {
+	const __m256i lower_bit = _mm256_set1_epi8(0x20);
+	const __m256i dash = _mm256_set1_epi8('-');
+	size_t i = 0;
+	while (i + 32 <= len) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i letter = in_range(_mm256_or_si256(v, lower_bit), 'a', 'z');
+		__m256i common = _mm256_or_si256(_mm256_or_si256(letter, in_range(v, '0', '9')),
+										 _mm256_cmpeq_epi8(v, dash));
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(common);
+		if (mask == 0) {
+			i += 32;
+			continue;
+		}
+		i += (size_t)__builtin_ctz(mask);
+		if (!token_chars[(unsigned char)data[i]]) {
+			return i;
+		}
+		i++; // A rarer token character such as '_' or '.'
+	}
+	return token_scalar(data, i, len);
+}
+
+#endif // HAVE_X86_KERNELS
+
+// Selected kernels; scalar until header_scan_init() runs
+static size_t (*value_kernel)(const char *, size_t) = scan_value_scalar;
+static size_t (*target_kernel)(const char *, size_t) = scan_target_scalar;
+static size_t (*token_kernel)(const char *, size_t) = scan_token_scalar;
+
+size_t scan_field_value(const char *data, size_t len) {
+	return value_kernel(data, len);
+}
+
+size_t scan_request_target(const char *data, size_t len) {
+	return target_kernel(data, len);
+}
+
+size_t scan_token(const char *data, size_t len) {
+	return token_kernel(data, len);
+}
+
+// Fold ASCII letters to lowercase by setting bit 0x20, several bytes at a
+// time. Exact as long as the lowercase name only has letters, digits and '-':
+// the only other bytes that fold onto those are control characters, which a
+// token never contains.
+#define FOLD64 0x2020202020202020ULL
+#define FOLD32 0x20202020U
+
+int header_name_equals(const char *name, size_t len, const char *lowercase, size_t lowercase_len) {
+	if (len != lowercase_len) {
+		return 0;
+	}
+	// Compare in the widest units that fit, overlapping the last unit with
+	// the previous one instead of looping over a byte tail
+	if (len >= 16) {
+#ifdef HAVE_X86_KERNELS
+		const __m128i fold = _mm_set1_epi8(0x20);
+		size_t i = 0;
+		for (; i + 16 < len; i += 16) {
+			__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(name + i)), fold);
+			__m128i b = _mm_loadu_si128((const __m128i *)(lowercase + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+				return 0;
+			}
+		}
+		__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(name + len - 16)), fold);
+		__m128i b = _mm_loadu_si128((const __m128i *)(lowercase + len - 16));
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+#endif
+	}
+	if (len >= 8) {
+		size_t i = 0;
+		uint64_t a, b;
+		for (; i + 8 < len; i += 8) {
+			memcpy(&a, name + i, 8);
+			memcpy(&b, lowercase + i, 8);
+			if ((a | FOLD64) != b) {
+				return 0;
+			}
+		}
+		memcpy(&a, name + len - 8, 8);
+		memcpy(&b, lowercase + len - 8, 8);
+		return (a | FOLD64) == b;
+	}
+	if (len >= 4) {
+		uint32_t a1, b1, a2, b2;
+		memcpy(&a1, name, 4);
+		memcpy(&b1, lowercase, 4);
+		memcpy(&a2, name + len - 4, 4);
+		memcpy(&b2, lowercase + len - 4, 4);
+		return (a1 | FOLD32) == b1 && (a2 | FOLD32) == b2;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (((unsigned char)name[i] | 0x20) != (unsigned char)lowercase[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+const char *header_scan_init(void) {
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		value_kernel = scan_value_avx2;
+		target_kernel = scan_target_avx2;
+		token_kernel = scan_token_avx2;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		value_kernel = scan_value_sse42;
+		target_kernel = scan_target_sse42;
+		token_kernel = scan_token_sse42;
+		return "sse4.2";
+	}
+#endif
+	return "scalar";
+}
@@ -0,0 +1,32 @@
+#ifndef HEADER_SCAN_H
+#define HEADER_SCAN_H
+
+#include <stddef.h>
+
+// Vectorized scanning kernels for the request parser. Each scan returns the
+// index of the first byte in data[0, len) that ends the current token, or
+// len if there is none. An AVX2 or SSE4.2 version is picked at startup by
+// header_scan_init(); a scalar version is used on other CPUs.
+
+// Header field values: stops at CR, LF, other control characters and DEL
+// (HTAB and bytes >= 0x80 are part of the value)
+size_t scan_field_value(const char *data, size_t len);
+
+// Request target: stops at SP, any control character and DEL
+size_t scan_request_target(const char *data, size_t len);
+
+// Methods and header names: stops at the first non-token character (':' or
+// SP on well-formed input)
+size_t scan_token(const char *data, size_t len);
+
+// Case-insensitive comparison of a header name that the parser has already
+// validated as a token against a name such as "content-length", which must be
+// written in lowercase letters, digits and '-'.
+int header_name_equals(const char *name, size_t len, const char *lowercase, size_t lowercase_len);
+
+// Choose the best kernels for this CPU. Returns the name of the choice
+// ("avx2", "sse4.2" or "scalar") for logging. Safe to skip: the scalar
+// kernels are used until it is called.
+const char *header_scan_init(void);
+
+#endif
@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "hpack.h"
+
+// --- Static table (RFC 7541 Appendix A) ---
+
+struct static_field {
+	const char *name;
+	const char *value;
+	uint8_t name_len;
+	uint8_t value_len;
+};
+
+#define FIELD(name, value) { name, value, sizeof(name) - 1, sizeof(value) - 1 }
+
+// Index 1 is the first entry
+static const struct static_field static_table[] = {
+	FIELD(":authority", ""),
+	FIELD(":method", "GET"),
+	FIELD(":method", "POST"),
+	FIELD(":path", "/"),
+	FIELD(":path", "/index.html"),
+	FIELD(":scheme", "http"),
+	FIELD(":scheme", "https"),
+	FIELD(":status", "200"),
+	FIELD(":status", "204"),
+	FIELD(":status", "206"),
+	FIELD(":status", "304"),
+	FIELD(":status", "400"),
+	FIELD(":status", "404"),
+	FIELD(":status", "500"),
+	FIELD("accept-charset", ""),
+	FIELD("accept-encoding", "gzip, deflate"),
+	FIELD("accept-language", ""),
+	FIELD("accept-ranges", ""),
+	FIELD("accept", ""),
+	FIELD("access-control-allow-origin", ""),
+	FIELD("age", ""),
+	FIELD("allow", ""),
+	FIELD("authorization", ""),
+	FIELD("cache-control", ""),
+	FIELD("content-disposition", ""),
+	FIELD("content-encoding", ""),
+	FIELD("content-language", ""),
+	FIELD("content-length", ""),
+	FIELD("content-location", ""),
+	FIELD("content-range", ""),
+	FIELD("content-type", ""),
+	FIELD("cookie", ""),
+	FIELD("date", ""),
+	FIELD("etag", ""),
+	FIELD("expect", ""),
+	FIELD("expires", ""),
+	FIELD("from", ""),
+	FIELD("host", ""),
+	FIELD("if-match", ""),
+	FIELD("if-modified-since", ""),
+	FIELD("if-none-match", ""),
+	FIELD("if-range", ""),
+	FIELD("if-unmodified-since", ""),
+	FIELD("last-modified", ""),
+	FIELD("link", ""),
+	FIELD("location", ""),
+	FIELD("max-forwards", ""),
+	FIELD("proxy-authenticate", ""),
+	FIELD("proxy-authorization", ""),
+	FIELD("range", ""),
+	FIELD("referer", ""),
+	FIELD("refresh", ""),
+	FIELD("retry-after", ""),
+	FIELD("server", ""),
+	FIELD("set-cookie", ""),
+	FIELD("strict-transport-security", ""),
+	FIELD("transfer-encoding", ""),
+	FIELD("user-agent", ""),
+	FIELD("vary", ""),
+	FIELD("via", ""),
+	FIELD("www-authenticate", ""),
+};
+
+#define STATIC_COUNT (sizeof(static_table) / sizeof(static_table[0]))
+
+// --- Huffman code (RFC 7541 Appendix B) ---
+// The code is canonical: codes of one length are consecutive numbers, in
+// symbol order, and shorter codes come first. Decoding only needs the first
+// code of each length.
+
+// Code of each symbol (the 256 octets, then EOS), right-aligned
+static const uint32_t huffman_codes[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff,
+};
+
+// Length of each symbol's code in bits
+static const uint8_t huffman_lengths[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+// Decoding: the symbols ordered by code, and for each code length the
+// first code of that length, how many there are and where they start in
+// huffman_symbols
+static const uint16_t huffman_symbols[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256,
+};
+static const uint32_t huffman_first[31] = {
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c,
+	0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+	0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+	0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc,
+};
+static const uint16_t huffman_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+static const uint16_t huffman_index[31] = {
+	0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+#define HUFFMAN_EOS 256
+
+// Decode `len` Huffman-coded bytes into `out`. Returns the decoded length,
+// or -1 if the string is malformed.
+static long huffman_decode(const uint8_t *in, size_t len, char *out) {
+	char *start = out;
+	uint32_t code = 0;
+	unsigned bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			code = code << 1 | ((in[i] >> bit) & 1);
+			bits++;
+			// Unsigned: a code below the first of its length wraps around
+			uint32_t offset = code - huffman_first[bits];
+			if (offset < huffman_count[bits]) {
+				uint16_t symbol = huffman_symbols[huffman_index[bits] + offset];
+				if (symbol == HUFFMAN_EOS) {
+					return -1;
+				}
+				*out++ = (char)symbol;
+				code = 0;
+				bits = 0;
+			} else if (bits == 30) {
+				return -1;
+			}
+		}
+	}
+	// What is left must be padding: fewer than 8 bits, all ones (a prefix of EOS)
+	if (bits > 7 || code != (1u << bits) - 1) {
+		return -1;
+	}
+	return out - start;
+}
+
+// Encoded length of a string in bytes
+static size_t huffman_length(const char *in, size_t len) {
+	size_t bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		bits += huffman_lengths[(uint8_t)in[i]];
+	}
+	return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char *in, size_t len, uint8_t *out) {
+	uint64_t pending = 0;
+	unsigned bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		uint8_t symbol = (uint8_t)in[i];
+		pending = pending << huffman_lengths[symbol] | huffman_codes[symbol];
+		bits += huffman_lengths[symbol];
+		while (bits >= 8) {
+			bits -= 8;
+			*out++ = (uint8_t)(pending >> bits);
+		}
+	}
+	if (bits > 0) {
+		// Padded with the most significant bits of EOS, which are all ones
+		*out = (uint8_t)(pending << (8 - bits) | (0xffu >> bits));
+	}
+}
+
+// --- Dynamic table ---
+
+static void table_init(struct hpack_table *table) {
+	table->count = 0;
+	table->used = 0;
+	table->size = 0;
+	table->max_size = HPACK_TABLE_SIZE;
+}
+
+static void table_evict_oldest(struct hpack_table *table) {
+	const struct hpack_entry *oldest = &table->entries[0];
+	size_t bytes = (size_t)oldest->name_len + oldest->value_len;
+	memmove(table->data, table->data + bytes, table->used - bytes);
+	table->used -= bytes;
+	table->size -= bytes + HPACK_ENTRY_OVERHEAD;
+	table->count--;
+	for (size_t i = 0; i < table->count; i++) {
+		table->entries[i] = table->entries[i + 1];
+		table->entries[i].offset = (uint16_t)(table->entries[i].offset - bytes);
+	}
+}
+
+// Evict until `room` more can be added within the limit
+static void table_make_room(struct hpack_table *table, size_t room) {
+	while (table->count > 0 && table->size + room > table->max_size) {
+		table_evict_oldest(table);
+	}
+}
+
+static void table_set_limit(struct hpack_table *table, size_t max_size) {
+	table->max_size = max_size;
+	table_make_room(table, 0);
+}
+
+// Add a field as the newest entry. One larger than the whole table just
+// empties it (RFC 7541 4.4).
+static void table_add(struct hpack_table *table, const char *name, size_t name_len, const char *value,
+					  size_t value_len) {
+	size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	if (entry_size > table->max_size) {
+		table_make_room(table, HPACK_TABLE_SIZE + 1);
+		return;
+	}
+	// The name may be an existing entry's, which eviction can overwrite
+	char name_copy[HPACK_TABLE_SIZE];
+	if (name >= table->data && name < table->data + sizeof(table->data)) {
+		memcpy(name_copy, name, name_len);
+		name = name_copy;
+	}
+	table_make_room(table, entry_size);
+	struct hpack_entry *entry = &table->entries[table->count++];
+	entry->offset = (uint16_t)table->used;
+	entry->name_len = (uint16_t)name_len;
+	entry->value_len = (uint16_t)value_len;
+	memcpy(table->data + table->used, name, name_len);
+	memcpy(table->data + table->used + name_len, value, value_len);
+	table->used += name_len + value_len;
+	table->size += entry_size;
+}
+
+// The field at `index` of the combined index space: the static table from
+// 1, then the dynamic table, newest first. Returns 0, or -1 if there is none.
+static int table_lookup(const struct hpack_table *table, uint32_t index, const char **name, size_t *name_len,
+						const char **value, size_t *value_len) {
+	if (index == 0) {
+		return -1;
+	}
+	if (index <= STATIC_COUNT) {
+		const struct static_field *field = &static_table[index - 1];
+		*name = field->name;
+		*name_len = field->name_len;
+		*value = field->value;
+		*value_len = field->value_len;
+		return 0;
+	}
+	index -= STATIC_COUNT;
+	if (index > table->count) {
+		return -1;
+	}
+	const struct hpack_entry *entry = &table->entries[table->count - index];
+	*name = table->data + entry->offset;
+	*name_len = entry->name_len;
+	*value = *name + entry->name_len;
+	*value_len = entry->value_len;
+	return 0;
+}
+
+// --- Decoding ---
+
+void hpack_decoder_init(struct hpack_decoder *decoder) {
+	table_init(&decoder->table);
+}
+
+// Integers larger than this are rejected; nothing we accept comes close
+#define INTEGER_MAX (1u << 30)
+
+// Decode an integer with an N-bit prefix (RFC 7541 5.1) starting at *at,
+// which is moved past it. Returns 0, or -1 if it is truncated or too large.
+static int decode_integer(const uint8_t **at, const uint8_t *end, int prefix_bits, uint32_t *out) {
+	uint32_t prefix_max = (1u << prefix_bits) - 1;
+	uint32_t value = *(*at)++ & prefix_max;
+	if (value < prefix_max) {
+		*out = value;
+		return 0;
+	}
+	for (int shift = 0; *at < end; shift += 7) {
+		uint8_t byte = *(*at)++;
+		value += (uint32_t)(byte & 0x7f) << shift;
+		if (value > INTEGER_MAX || shift > 21) {
+			return -1;
+		}
+		if (!(byte & 0x80)) {
+			*out = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Decode a string literal (RFC 7541 5.2), Huffman-coded ones into *scratch,
+// which is moved past it
+static int decode_string(const uint8_t **at, const uint8_t *end, char **scratch, const char **out,
+						 size_t *out_len) {
+	if (*at == end) {
+		return -1;
+	}
+	int huffman = **at & 0x80;
+	uint32_t len;
+	if (decode_integer(at, end, 7, &len) != 0 || len > (size_t)(end - *at)) {
+		return -1;
+	}
+	if (huffman) {
+		long decoded = huffman_decode(*at, len, *scratch);
+		if (decoded < 0) {
+			return -1;
+		}
+		*out = *scratch;
+		*out_len = (size_t)decoded;
+		*scratch += decoded;
+	} else {
+		*out = (const char *)*at;
+		*out_len = len;
+	}
+	*at += len;
+	return 0;
+}
+
+enum hpack_result hpack_decode(struct hpack_decoder *decoder, const uint8_t *block, size_t len, char *scratch,
+							   hpack_field_fn on_field, void *arg) {
+	const uint8_t *at = block;
+	const uint8_t *end = block + len;
+	int fields = 0;
+	while (at < end) {
+		uint8_t first = *at;
+		const char *name;
+		const char *value;
+		size_t name_len;
+		size_t value_len;
+		uint32_t index;
+		char *field_scratch = scratch;
+		if (first & 0x80) {
+			// Indexed field
+			if (decode_integer(&at, end, 7, &index) != 0 ||
+				table_lookup(&decoder->table, index, &name, &name_len, &value, &value_len) != 0) {
+				return HPACK_ERROR;
+			}
+			on_field(arg, name, name_len, value, value_len);
+			fields++;
+			continue;
+		}
+		if ((first & 0xe0) == 0x20) {
+			// Dynamic table size update: only ahead of the fields, and
+			// within the size we allow
+			if (fields > 0 || decode_integer(&at, end, 5, &index) != 0 || index > HPACK_TABLE_SIZE) {
+				return HPACK_ERROR;
+			}
+			table_set_limit(&decoder->table, index);
+			continue;
+		}
+		// A literal, with incremental indexing (01), without (0000) or
+		// never indexed (0001); the name is indexed unless the index is 0
+		int incremental = (first & 0xc0) == 0x40;
+		if (decode_integer(&at, end, incremental ? 6 : 4, &index) != 0) {
+			return HPACK_ERROR;
+		}
+		if (index > 0) {
+			const char *unused;
+			size_t unused_len;
+			if (table_lookup(&decoder->table, index, &name, &name_len, &unused, &unused_len) != 0) {
+				return HPACK_ERROR;
+			}
+		} else if (decode_string(&at, end, &field_scratch, &name, &name_len) != 0) {
+			return HPACK_ERROR;
+		}
+		if (decode_string(&at, end, &field_scratch, &value, &value_len) != 0) {
+			return HPACK_ERROR;
+		}
+		on_field(arg, name, name_len, value, value_len);
+		fields++;
+		if (incremental) {
+			table_add(&decoder->table, name, name_len, value, value_len);
+		}
+	}
+	return HPACK_OK;
+}
+
+// --- Encoding ---
+
+void hpack_encoder_init(struct hpack_encoder *encoder) {
+	table_init(&encoder->table);
+	encoder->size_update = 0;
+}
+
+void hpack_encoder_set_limit(struct hpack_encoder *encoder, size_t size) {
+	if (size > HPACK_TABLE_SIZE) {
+		size = HPACK_TABLE_SIZE;
+	}
+	if (size != encoder->table.max_size) {
+		table_set_limit(&encoder->table, size);
+		encoder->size_update = 1;
+	}
+}
+
+// Append an integer with an N-bit prefix, the prefix's other bits set to `flags`
+static enum hpack_result encode_integer(struct hpack_buffer *out, uint8_t flags, int prefix_bits, size_t value) {
+	size_t prefix_max = ((size_t)1 << prefix_bits) - 1;
+	// The prefix, then 7 bits per byte: 6 bytes cover anything we send
+	if (out->cap - out->len < 6) {
+		return HPACK_TOO_LARGE;
+	}
+	if (value < prefix_max) {
+		out->data[out->len++] = (uint8_t)(flags | value);
+		return HPACK_OK;
+	}
+	out->data[out->len++] = (uint8_t)(flags | prefix_max);
+	value -= prefix_max;
+	while (value >= 0x80) {
+		out->data[out->len++] = (uint8_t)(0x80 | (value & 0x7f));
+		value >>= 7;
+	}
+	out->data[out->len++] = (uint8_t)value;
+	return HPACK_OK;
+}
+
+// Append a string literal, Huffman-coded when that is shorter
+static enum hpack_result encode_string(struct hpack_buffer *out, const char *text, size_t len) {
+	size_t coded_len = huffman_length(text, len);
+	int huffman = coded_len < len;
+	size_t body_len = huffman ? coded_len : len;
+	if (encode_integer(out, huffman ? 0x80 : 0, 7, body_len) != HPACK_OK || out->cap - out->len < body_len) {
+		return HPACK_TOO_LARGE;
+	}
+	if (huffman) {
+		huffman_encode(text, len, out->data + out->len);
+	} else {
+		memcpy(out->data + out->len, text, len);
+	}
+	out->len += body_len;
+	return HPACK_OK;
+}
+
+enum hpack_result hpack_encode_begin(struct hpack_encoder *encoder, struct hpack_buffer *out) {
+	if (!encoder->size_update) {
+		return HPACK_OK;
+	}
+	encoder->size_update = 0;
+	return encode_integer(out, 0x20, 5, encoder->table.max_size);
+}
+
+static int same(const char *a, size_t a_len, const char *b, size_t b_len) {
+	return a_len == b_len && memcmp(a, b, a_len) == 0;
+}
+
+enum hpack_result hpack_encode_field(struct hpack_encoder *encoder, struct hpack_buffer *out, const char *name,
+									 size_t name_len, const char *value, size_t value_len,
+									 enum hpack_indexing indexing) {
+	// The whole field from either table, or else the index of its name
+	size_t name_index = 0;
+	for (size_t i = 0; i < STATIC_COUNT; i++) {
+		const struct static_field *field = &static_table[i];
+		if (same(field->name, field->name_len, name, name_len)) {
+			if (same(field->value, field->value_len, value, value_len)) {
+				return encode_integer(out, 0x80, 7, i + 1);
+			}
+			if (name_index == 0) {
+				name_index = i + 1;
+			}
+		}
+	}
+	const struct hpack_table *table = &encoder->table;
+	for (size_t i = 1; i <= table->count; i++) {
+		const struct hpack_entry *entry = &table->entries[table->count - i];
+		const char *entry_name = table->data + entry->offset;
+		if (same(entry_name, entry->name_len, name, name_len)) {
+			if (same(entry_name + entry->name_len, entry->value_len, value, value_len)) {
+				return encode_integer(out, 0x80, 7, STATIC_COUNT + i);
+			}
+			if (name_index == 0) {
+				name_index = STATIC_COUNT + i;
+			}
+		}
+	}
+
+	int incremental = indexing == HPACK_INDEX && name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size;
+	enum hpack_result result = incremental ? encode_integer(out, 0x40, 6, name_index)
+										   : encode_integer(out, 0x00, 4, name_index);
+	if (result == HPACK_OK && name_index == 0) {
+		result = encode_string(out, name, name_len);
+	}
+	if (result == HPACK_OK) {
+		result = encode_string(out, value, value_len);
+	}
+	if (result == HPACK_OK && incremental) {
+		table_add(&encoder->table, name, name_len, value, value_len);
+	}
+	return result;
+}
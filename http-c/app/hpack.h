@@ -0,0 +1,89 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HPACK (RFC 7541), the header compression of HTTP/2. Each direction of a
+// connection has its own dynamic table of recently sent fields, which the
+// encoder and decoder on either side keep in step.
+
+// Dynamic table size we decode with (the SETTINGS_HEADER_TABLE_SIZE default,
+// so it never has to be announced) and the most we encode with
+#define HPACK_TABLE_SIZE 4096
+// Every table entry counts its name and value plus this much
+#define HPACK_ENTRY_OVERHEAD 32
+
+struct hpack_entry {
+	uint16_t offset; // of the name in `data`; the value follows it
+	uint16_t name_len;
+	uint16_t value_len;
+};
+
+// A dynamic table. Entries are kept oldest first, their names and values
+// packed in `data`; evicting the oldest slides the rest down, which is cheap
+// at this size.
+struct hpack_table {
+	char data[HPACK_TABLE_SIZE];
+	struct hpack_entry entries[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+	size_t count;
+	size_t used;     // bytes of `data` in use
+	size_t size;     // the table's size as RFC 7541 counts it
+	size_t max_size; // current limit
+};
+
+enum hpack_result {
+	HPACK_OK,
+	HPACK_ERROR,     // malformed block: a connection error (COMPRESSION_ERROR)
+	HPACK_TOO_LARGE, // the output buffer is full
+};
+
+struct hpack_decoder {
+	struct hpack_table table;
+};
+
+// Called for each decoded field, in order. Pseudo-header names start with
+// ':'. The strings are only valid during the call.
+typedef void (*hpack_field_fn)(void *arg, const char *name, size_t name_len, const char *value, size_t value_len);
+
+void hpack_decoder_init(struct hpack_decoder *decoder);
+
+// Decode a complete header block, calling `on_field` for each field.
+// Huffman-coded strings are decoded into `scratch`, which must hold
+// `len` * 8 / 5 + 1 bytes to fit any string in the block.
+enum hpack_result hpack_decode(struct hpack_decoder *decoder, const uint8_t *block, size_t len, char *scratch,
+							   hpack_field_fn on_field, void *arg);
+
+struct hpack_encoder {
+	struct hpack_table table;
+	int size_update; // the limit changed; announce it at the start of the next block
+};
+
+// Whether a field is worth a dynamic table entry: values that repeat from
+// response to response are, per-response ones (lengths, dates, tags) aren't
+enum hpack_indexing {
+	HPACK_INDEX,
+	HPACK_NO_INDEX,
+};
+
+// Where an encoded block is built
+struct hpack_buffer {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+void hpack_encoder_init(struct hpack_encoder *encoder);
+
+// The peer's SETTINGS_HEADER_TABLE_SIZE changed to `size`
+void hpack_encoder_set_limit(struct hpack_encoder *encoder, size_t size);
+
+// Start a header block in `out`
+enum hpack_result hpack_encode_begin(struct hpack_encoder *encoder, struct hpack_buffer *out);
+
+// Append one field to the block. `name` must be lowercase.
+enum hpack_result hpack_encode_field(struct hpack_encoder *encoder, struct hpack_buffer *out, const char *name,
+									 size_t name_len, const char *value, size_t value_len,
+									 enum hpack_indexing indexing);
+
+#endif
@@ -0,0 +1,1310 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "http2.h"
+#include "hpack.h"
+#include "connection.h"
+#include "server.h"
+#include "pool.h"
+#include "metrics.h"
+#include "log.h"
+#include "restart.h"
+
+// Frame types (RFC 9113 6)
+enum frame_type {
+	FRAME_DATA = 0x0,
+	FRAME_HEADERS = 0x1,
+	FRAME_PRIORITY = 0x2,
+	FRAME_RST_STREAM = 0x3,
+	FRAME_SETTINGS = 0x4,
+	FRAME_PUSH_PROMISE = 0x5,
+	FRAME_PING = 0x6,
+	FRAME_GOAWAY = 0x7,
+	FRAME_WINDOW_UPDATE = 0x8,
+	FRAME_CONTINUATION = 0x9,
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// Error codes (RFC 9113 7)
+enum h2_error {
+	H2_NO_ERROR = 0x0,
+	H2_PROTOCOL_ERROR = 0x1,
+	H2_INTERNAL_ERROR = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED = 0x5,
+	H2_FRAME_SIZE_ERROR = 0x6,
+	H2_REFUSED_STREAM = 0x7,
+	H2_COMPRESSION_ERROR = 0x9,
+	H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum setting {
+	SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	SETTINGS_ENABLE_PUSH = 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	SETTINGS_MAX_FRAME_SIZE = 0x5,
+	SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+#define FRAME_HEADER_LEN 9
+// Flow-control windows start at this and may not exceed WINDOW_MAX
+#define WINDOW_DEFAULT 65535
+#define WINDOW_MAX 0x7fffffff
+// Streams a client may have open at once (SETTINGS_MAX_CONCURRENT_STREAMS)
+#define HTTP2_MAX_STREAMS 100
+// Receive window we grant the connection and each stream. Upload data is
+// written out as soon as it arrives, so it can be generous; it is topped up
+// once half of it is used.
+#define RECEIVE_WINDOW (1024 * 1024)
+// Longest response head (status line and headers) a route produces
+#define RESPONSE_HEAD_MAX 2048
+// Frames queued per call to http2_produce()
+#define OUTPUT_ROUND CONN_OUT_HIGH_WATER
+// Largest DATA frame we send, however large a frame the peer accepts. A
+// stream's turn is one frame, so this bounds how long the streams behind a
+// large body wait, and how far a frame grows `out`.
+#define DATA_FRAME_MAX HTTP2_FRAME_MAX
+
+struct stream {
+	uint32_t id;
+	struct stream *next; // streams are listed by id
+	// Runs the request, handed over as HTTP/1.1 text, like a client
+	// connection without a socket
+	struct connection *conn;
+	int64_t send_window;      // may go negative when the client shrinks windows
+	uint32_t receive_unacked; // DATA bytes taken since the last WINDOW_UPDATE
+	int remote_closed;        // END_STREAM received
+	int chunked;              // the body is handed over with chunked framing (no content-length)
+	int head_request;         // HEAD: no DATA follows the headers
+	int headers_sent;
+	// The response head, read from conn's output until the blank line ending
+	// it. Body bytes read along with it are head[head_at, head_len), sent
+	// before the rest.
+	char head[RESPONSE_HEAD_MAX];
+	size_t head_len;
+	size_t head_at;
+};
+
+struct http2 {
+	int preface_received;
+	int failed;              // GOAWAY sent for an error; nothing else is done
+	int goaway;              // no new streams; close once the last one is done
+	uint32_t last_stream_id; // highest stream the client has opened
+	struct stream *streams;
+	int stream_count;
+	uint32_t turn;           // id of the stream whose turn it is to produce a frame
+	int64_t send_window;
+	uint32_t receive_unacked;
+	uint32_t peer_initial_window;
+	uint32_t peer_max_frame;
+	// A header block being continued in CONTINUATION frames
+	uint32_t block_stream; // 0 when none
+	int block_opens;
+	int block_end_stream;
+	char *block;
+	size_t block_len;
+	size_t block_cap;
+	struct hpack_decoder decoder;
+	struct hpack_encoder encoder;
+};
+
+static uint32_t read_u32(const uint8_t *at) {
+	return (uint32_t)at[0] << 24 | (uint32_t)at[1] << 16 | (uint32_t)at[2] << 8 | at[3];
+}
+
+static void write_u32(uint8_t *at, uint32_t value) {
+	at[0] = (uint8_t)(value >> 24);
+	at[1] = (uint8_t)(value >> 16);
+	at[2] = (uint8_t)(value >> 8);
+	at[3] = (uint8_t)value;
+}
+
+static void write_frame_header(uint8_t *at, size_t len, enum frame_type type, uint8_t flags, uint32_t stream_id) {
+	at[0] = (uint8_t)(len >> 16);
+	at[1] = (uint8_t)(len >> 8);
+	at[2] = (uint8_t)len;
+	at[3] = (uint8_t)type;
+	at[4] = flags;
+	write_u32(at + 5, stream_id);
+}
+
+// Queue a frame with a `len`-byte payload. Returns where the payload goes,
+// or NULL on failure (the connection is closed).
+static uint8_t *frame_begin(struct connection *conn, size_t len, enum frame_type type, uint8_t flags,
+							uint32_t stream_id) {
+	uint8_t *at = (uint8_t *)connection_out_reserve(conn, FRAME_HEADER_LEN + len);
+	if (at == NULL) {
+		return NULL;
+	}
+	write_frame_header(at, len, type, flags, stream_id);
+	conn->out_len += FRAME_HEADER_LEN + len;
+	return at + FRAME_HEADER_LEN;
+}
+
+static void send_rst_stream(struct connection *conn, uint32_t stream_id, enum h2_error error) {
+	uint8_t *payload = frame_begin(conn, 4, FRAME_RST_STREAM, 0, stream_id);
+	if (payload != NULL) {
+		write_u32(payload, error);
+	}
+}
+
+static void send_window_update(struct connection *conn, uint32_t stream_id, uint32_t increment) {
+	uint8_t *payload = frame_begin(conn, 4, FRAME_WINDOW_UPDATE, 0, stream_id);
+	if (payload != NULL) {
+		write_u32(payload, increment);
+	}
+}
+
+// --- Streams ---
+
+static struct stream *stream_find(const struct http2 *h2, uint32_t id) {
+	for (struct stream *stream = h2->streams; stream != NULL; stream = stream->next) {
+		if (stream->id == id) {
+			return stream;
+		}
+	}
+	return NULL;
+}
+
+static void stream_free(struct http2 *h2, struct stream *stream) {
+	struct stream **link = &h2->streams;
+	while (*link != stream) {
+		link = &(*link)->next;
+	}
+	*link = stream->next;
+	h2->stream_count--;
+	connection_free(stream->conn);
+	pool_release(stream);
+}
+
+// Start closing the connection once what is queued has been sent
+static void close_after_output(struct connection *conn) {
+	conn->keep_alive = 0;
+	conn->state = CONN_WRITING;
+}
+
+// Forget the stream, after the client stopped it or on a stream error
+static void stream_reset(struct connection *conn, struct http2 *h2, struct stream *stream, enum h2_error error) {
+	if (error != H2_NO_ERROR || !stream->remote_closed) {
+		send_rst_stream(conn, stream->id, error);
+	}
+	stream_free(h2, stream);
+	if (h2->goaway && h2->stream_count == 0) {
+		close_after_output(conn);
+	}
+}
+
+// A connection error: tell the client why and close
+static void session_fail(struct connection *conn, struct http2 *h2, enum h2_error error, const char *why) {
+	log_info("HTTP/2 connection error (%s), closing (FD: %d)", why, conn->io.fd);
+	while (h2->streams != NULL) {
+		stream_free(h2, h2->streams);
+	}
+	uint8_t *payload = frame_begin(conn, 8, FRAME_GOAWAY, 0, 0);
+	if (payload != NULL) {
+		write_u32(payload, h2->last_stream_id);
+		write_u32(payload + 4, error);
+	}
+	h2->failed = 1;
+	h2->goaway = 1;
+	if (conn->state != CONN_CLOSED) {
+		close_after_output(conn);
+	}
+}
+
+static struct stream *stream_open(struct connection *conn, struct http2 *h2, uint32_t id) {
+	struct stream *stream = pool_acquire(sizeof(*stream));
+	if (stream == NULL) {
+		log_error("Pool allocation failed for HTTP/2 stream: %m");
+		return NULL;
+	}
+	stream->conn = connection_new_stream(conn);
+	if (stream->conn == NULL) {
+		pool_release(stream);
+		return NULL;
+	}
+	stream->id = id;
+	stream->send_window = h2->peer_initial_window;
+	stream->receive_unacked = 0;
+	stream->remote_closed = 0;
+	stream->chunked = 0;
+	stream->head_request = 0;
+	stream->headers_sent = 0;
+	stream->head_len = 0;
+	stream->head_at = 0;
+	// Client streams only come in increasing order, so appending keeps the
+	// list sorted
+	stream->next = NULL;
+	struct stream **link = &h2->streams;
+	while (*link != NULL) {
+		link = &(*link)->next;
+	}
+	*link = stream;
+	h2->stream_count++;
+	metrics_http2_stream();
+	return stream;
+}
+
+// Hand request bytes to the stream's connection. Returns 0, or -1 if the
+// connection failed.
+static int stream_feed(struct stream *stream, const char *data, size_t len) {
+	connection_feed(stream->conn, data, len);
+	return stream->conn->state == CONN_CLOSED ? -1 : 0;
+}
+
+// The client sent END_STREAM: the request body, if any, is complete
+static void stream_remote_end(struct connection *conn, struct http2 *h2, struct stream *stream) {
+	stream->remote_closed = 1;
+	if (stream->chunked && stream->conn->state == CONN_READING_BODY &&
+		stream_feed(stream, "0\r\n\r\n", 5) != 0) {
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+		return;
+	}
+	if (stream->conn->state == CONN_READING_BODY) {
+		// Shorter than its content-length
+		stream_reset(conn, h2, stream, H2_PROTOCOL_ERROR);
+	}
+}
+
+// --- Requests: header blocks turned into HTTP/1.1 ---
+
+// What a pseudo-header said, copied to the end of the request buffer until
+// the request line is written
+struct pseudo_value {
+	size_t at;
+	size_t len;
+	int seen;
+};
+
+struct request_builder {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t pseudo_at; // pseudo-header values occupy buf[pseudo_at, cap)
+	struct pseudo_value method;
+	struct pseudo_value path;
+	struct pseudo_value scheme;
+	struct pseudo_value authority;
+	int line_written;
+	int has_content_length;
+	int malformed;
+	int too_large;
+};
+
+static void builder_append(struct request_builder *builder, const char *data, size_t len) {
+	if (builder->too_large || len > builder->pseudo_at - builder->len) {
+		builder->too_large = 1;
+		return;
+	}
+	memcpy(builder->buf + builder->len, data, len);
+	builder->len += len;
+}
+
+#define builder_append_literal(builder, literal) builder_append(builder, literal, sizeof(literal) - 1)
+
+static void builder_pseudo(struct request_builder *builder, struct pseudo_value *pseudo, const char *value,
+						   size_t len) {
+	if (pseudo->seen || builder->line_written) {
+		builder->malformed = 1; // Repeated, or after a regular field
+		return;
+	}
+	pseudo->seen = 1;
+	if (len > builder->pseudo_at - builder->len) {
+		builder->too_large = 1;
+		return;
+	}
+	builder->pseudo_at -= len;
+	memcpy(builder->buf + builder->pseudo_at, value, len);
+	pseudo->at = builder->pseudo_at;
+	pseudo->len = len;
+}
+
+// Characters allowed in a method and a request target: visible ASCII
+static int visible(const char *text, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if ((unsigned char)text[i] <= 0x20 || (unsigned char)text[i] >= 0x7f) {
+			return 0;
+		}
+	}
+	return len > 0;
+}
+
+// Write the request line (and Host) once the pseudo-headers are all in
+static void builder_request_line(struct request_builder *builder) {
+	if (builder->line_written) {
+		return;
+	}
+	builder->line_written = 1;
+	const struct pseudo_value *method = &builder->method;
+	const struct pseudo_value *path = &builder->path;
+	const struct pseudo_value *authority = &builder->authority;
+	if (!method->seen || !path->seen || !builder->scheme.seen) {
+		builder->malformed = 1;
+		return;
+	}
+	if (builder->too_large) {
+		return;
+	}
+	if (!visible(builder->buf + method->at, method->len) || !visible(builder->buf + path->at, path->len)) {
+		builder->malformed = 1;
+		return;
+	}
+	// Nothing has been written yet, and the values sit at the end of the
+	// buffer: if the lines fit in front of them, they can't overlap
+	size_t line_len = method->len + 1 + path->len + sizeof(" HTTP/1.1\r\n") - 1;
+	if (authority->seen) {
+		line_len += sizeof("Host: \r\n") - 1 + authority->len;
+	}
+	if (line_len > builder->pseudo_at) {
+		builder->too_large = 1;
+		return;
+	}
+	// Regular fields may use the space the values took once this is done
+	builder->pseudo_at = builder->cap;
+	builder_append(builder, builder->buf + method->at, method->len);
+	builder_append_literal(builder, " ");
+	builder_append(builder, builder->buf + path->at, path->len);
+	builder_append_literal(builder, " HTTP/1.1\r\n");
+	if (authority->seen) {
+		builder_append_literal(builder, "Host: ");
+		builder_append(builder, builder->buf + authority->at, authority->len);
+		builder_append_literal(builder, "\r\n");
+	}
+}
+
+static int name_is(const char *name, size_t name_len, const char *literal) {
+	return name_len == strlen(literal) && memcmp(name, literal, name_len) == 0;
+}
+
+// hpack_field_fn: add one field of a request's header block
+static void request_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+	struct request_builder *builder = arg;
+	if (name_len > 0 && name[0] == ':') {
+		if (name_is(name, name_len, ":method")) {
+			builder_pseudo(builder, &builder->method, value, value_len);
+		} else if (name_is(name, name_len, ":path")) {
+			builder_pseudo(builder, &builder->path, value, value_len);
+		} else if (name_is(name, name_len, ":scheme")) {
+			builder_pseudo(builder, &builder->scheme, value, value_len);
+		} else if (name_is(name, name_len, ":authority")) {
+			builder_pseudo(builder, &builder->authority, value, value_len);
+		} else {
+			builder->malformed = 1;
+		}
+		return;
+	}
+	builder_request_line(builder);
+	// Lowercase token characters only in names, and nothing in values
+	// that would end the line early
+	for (size_t i = 0; i < name_len; i++) {
+		unsigned char c = (unsigned char)name[i];
+		if (c <= 0x20 || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z')) {
+			builder->malformed = 1;
+			return;
+		}
+	}
+	if (name_len == 0 || memchr(value, '\r', value_len) != NULL || memchr(value, '\n', value_len) != NULL ||
+		memchr(value, '\0', value_len) != NULL) {
+		builder->malformed = 1;
+		return;
+	}
+	// HTTP/2 has no connection-specific fields (RFC 9113 8.2.2)
+	if (name_is(name, name_len, "connection") || name_is(name, name_len, "keep-alive") ||
+		name_is(name, name_len, "proxy-connection") || name_is(name, name_len, "transfer-encoding") ||
+		name_is(name, name_len, "upgrade")) {
+		builder->malformed = 1;
+		return;
+	}
+	if (name_is(name, name_len, "te")) {
+		if (value_len != 8 || memcmp(value, "trailers", 8) != 0) {
+			builder->malformed = 1;
+		}
+		return;
+	}
+	if (name_is(name, name_len, "host") && builder->authority.seen) {
+		return; // :authority already gave it
+	}
+	if (name_is(name, name_len, "content-length")) {
+		builder->has_content_length = 1;
+	}
+	builder_append(builder, name, name_len);
+	builder_append_literal(builder, ": ");
+	builder_append(builder, value, value_len);
+	builder_append_literal(builder, "\r\n");
+}
+
+// Answer a stream with just a status, for requests that never got a
+// connection of their own
+static void send_status_only(struct connection *conn, struct http2 *h2, uint32_t stream_id, const char *status) {
+	uint8_t block[32];
+	struct hpack_buffer out = { block, 0, sizeof(block) };
+	if (hpack_encode_begin(&h2->encoder, &out) != HPACK_OK ||
+		hpack_encode_field(&h2->encoder, &out, ":status", 7, status, strlen(status), HPACK_INDEX) != HPACK_OK) {
+		session_fail(conn, h2, H2_INTERNAL_ERROR, "response header block too large");
+		return;
+	}
+	uint8_t *payload = frame_begin(conn, out.len, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, stream_id);
+	if (payload != NULL) {
+		memcpy(payload, block, out.len);
+	}
+}
+
+// A complete header block for `stream_id`: if it `opens` the stream, hand
+// its request over; otherwise these are trailers, which end the body
+static void header_block(struct connection *conn, struct http2 *h2, uint32_t stream_id, int opens, int end_stream,
+						 const uint8_t *block, size_t len) {
+	struct request_builder builder;
+	memset(&builder, 0, sizeof(builder));
+	// Room for the largest request the parser takes, and the framing
+	// header we may add
+	builder.cap = g_parser_limits.max_header_bytes + 64;
+	builder.buf = pool_acquire(builder.cap);
+	char *scratch = pool_acquire(len * 8 / 5 + 1);
+	if (builder.buf == NULL || scratch == NULL) {
+		pool_release(builder.buf);
+		pool_release(scratch);
+		session_fail(conn, h2, H2_INTERNAL_ERROR, "out of memory");
+		return;
+	}
+	builder.pseudo_at = builder.cap;
+	enum hpack_result result = hpack_decode(&h2->decoder, block, len, scratch, request_field, &builder);
+	pool_release(scratch);
+	if (result != HPACK_OK) {
+		pool_release(builder.buf);
+		session_fail(conn, h2, H2_COMPRESSION_ERROR, "undecodable header block");
+		return;
+	}
+
+	if (!opens) {
+		// We have no use for the trailer fields themselves. A stream that
+		// is gone already was reset or answered; the client may not know.
+		pool_release(builder.buf);
+		struct stream *stream = stream_find(h2, stream_id);
+		if (stream != NULL && (!end_stream || stream->remote_closed)) {
+			stream_reset(conn, h2, stream, H2_PROTOCOL_ERROR);
+		} else if (stream != NULL) {
+			stream_remote_end(conn, h2, stream);
+		}
+		return;
+	}
+	if (h2->goaway) {
+		pool_release(builder.buf); // Ignored after GOAWAY
+		return;
+	}
+	if (h2->stream_count >= HTTP2_MAX_STREAMS) {
+		pool_release(builder.buf);
+		send_rst_stream(conn, stream_id, H2_REFUSED_STREAM);
+		return;
+	}
+	builder_request_line(&builder);
+	if (builder.malformed) {
+		pool_release(builder.buf);
+		log_info("Rejecting malformed HTTP/2 request (stream %u)", stream_id);
+		send_rst_stream(conn, stream_id, H2_PROTOCOL_ERROR);
+		return;
+	}
+	// A body without a length is handed over chunked; none at all is an
+	// explicit zero, so a POST gets the same answer as over HTTP/1.1
+	int chunked = 0;
+	if (!builder.has_content_length) {
+		if (end_stream) {
+			builder_append_literal(&builder, "Content-Length: 0\r\n");
+		} else {
+			builder_append_literal(&builder, "Transfer-Encoding: chunked\r\n");
+			chunked = 1;
+		}
+	}
+	builder_append_literal(&builder, "\r\n");
+	if (builder.too_large || builder.len > g_parser_limits.max_header_bytes) {
+		pool_release(builder.buf);
+		send_status_only(conn, h2, stream_id, "431");
+		return;
+	}
+
+	struct stream *stream = stream_open(conn, h2, stream_id);
+	if (stream == NULL) {
+		pool_release(builder.buf);
+		send_rst_stream(conn, stream_id, H2_REFUSED_STREAM);
+		return;
+	}
+	stream->chunked = chunked;
+	stream->head_request = builder.method.len == 4 && memcmp(builder.buf, "HEAD", 4) == 0;
+	int fed = stream_feed(stream, builder.buf, builder.len);
+	pool_release(builder.buf);
+	if (fed != 0) {
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+	} else if (end_stream) {
+		stream_remote_end(conn, h2, stream);
+	}
+}
+
+// --- Frames from the client ---
+
+// Strip the padding of a PADDED frame. Returns 0, or -1 if it is malformed.
+static int strip_padding(uint8_t flags, const uint8_t **payload, size_t *len) {
+	if (!(flags & FLAG_PADDED)) {
+		return 0;
+	}
+	if (*len == 0 || (*payload)[0] >= *len) {
+		return -1;
+	}
+	*len -= 1 + (*payload)[0];
+	(*payload)++;
+	return 0;
+}
+
+static void on_data(struct connection *conn, struct http2 *h2, uint8_t flags, uint32_t stream_id,
+					const uint8_t *payload, size_t len) {
+	if (stream_id == 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "DATA on stream 0");
+		return;
+	}
+	// The whole frame counts against the windows, padding included. The
+	// data is consumed right away, so the window is given back as it goes.
+	size_t flow_len = len;
+	h2->receive_unacked += (uint32_t)flow_len;
+	if (h2->receive_unacked >= RECEIVE_WINDOW / 2) {
+		send_window_update(conn, 0, h2->receive_unacked);
+		h2->receive_unacked = 0;
+	}
+	if (strip_padding(flags, &payload, &len) != 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad padding");
+		return;
+	}
+	struct stream *stream = stream_find(h2, stream_id);
+	if (stream == NULL) {
+		if (stream_id > h2->last_stream_id) {
+			session_fail(conn, h2, H2_PROTOCOL_ERROR, "DATA on an idle stream");
+		}
+		return; // Reset or done already; the client may not know yet
+	}
+	if (stream->remote_closed) {
+		stream_reset(conn, h2, stream, H2_STREAM_CLOSED);
+		return;
+	}
+	// Only an upload takes a body; any other is dropped
+	if (len > 0 && stream->conn->state == CONN_READING_BODY) {
+		int fed = 0;
+		if (stream->chunked) {
+			char size_line[20];
+			int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+			fed = stream_feed(stream, size_line, (size_t)size_len) | stream_feed(stream, (const char *)payload, len) |
+				  stream_feed(stream, "\r\n", 2);
+		} else {
+			fed = stream_feed(stream, (const char *)payload, len);
+		}
+		if (fed != 0) {
+			stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+			return;
+		}
+	}
+	if (flags & FLAG_END_STREAM) {
+		stream_remote_end(conn, h2, stream);
+		return;
+	}
+	stream->receive_unacked += (uint32_t)flow_len;
+	if (stream->receive_unacked >= RECEIVE_WINDOW / 2) {
+		send_window_update(conn, stream_id, stream->receive_unacked);
+		stream->receive_unacked = 0;
+	}
+}
+
+static void on_headers(struct connection *conn, struct http2 *h2, uint8_t flags, uint32_t stream_id,
+					   const uint8_t *payload, size_t len) {
+	if (stream_id == 0 || (stream_id & 1) == 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "HEADERS on a server stream");
+		return;
+	}
+	if (strip_padding(flags, &payload, &len) != 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad padding");
+		return;
+	}
+	if (flags & FLAG_PRIORITY) {
+		// Stream dependency and weight, which we don't act on
+		if (len < 5) {
+			session_fail(conn, h2, H2_FRAME_SIZE_ERROR, "short HEADERS");
+			return;
+		}
+		payload += 5;
+		len -= 5;
+	}
+	// A new stream takes its id even if it is refused
+	int opens = stream_id > h2->last_stream_id;
+	if (opens) {
+		h2->last_stream_id = stream_id;
+	}
+	if (flags & FLAG_END_HEADERS) {
+		header_block(conn, h2, stream_id, opens, flags & FLAG_END_STREAM, payload, len);
+		return;
+	}
+	// The block goes on in CONTINUATION frames
+	if (h2->block == NULL) {
+		h2->block_cap = g_parser_limits.max_header_bytes + HTTP2_FRAME_MAX;
+		h2->block = pool_acquire(h2->block_cap);
+		if (h2->block == NULL) {
+			session_fail(conn, h2, H2_INTERNAL_ERROR, "out of memory");
+			return;
+		}
+	}
+	memcpy(h2->block, payload, len);
+	h2->block_len = len;
+	h2->block_stream = stream_id;
+	h2->block_opens = opens;
+	h2->block_end_stream = flags & FLAG_END_STREAM;
+}
+
+static void on_continuation(struct connection *conn, struct http2 *h2, uint8_t flags, uint32_t stream_id,
+							const uint8_t *payload, size_t len) {
+	if (h2->block_stream == 0 || stream_id != h2->block_stream) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+		return;
+	}
+	if (len > h2->block_cap - h2->block_len) {
+		session_fail(conn, h2, H2_ENHANCE_YOUR_CALM, "header block too large");
+		return;
+	}
+	memcpy(h2->block + h2->block_len, payload, len);
+	h2->block_len += len;
+	if (flags & FLAG_END_HEADERS) {
+		h2->block_stream = 0;
+		header_block(conn, h2, stream_id, h2->block_opens, h2->block_end_stream, (const uint8_t *)h2->block,
+					 h2->block_len);
+		pool_release(h2->block);
+		h2->block = NULL;
+	}
+}
+
+// Apply a SETTINGS payload (also what HTTP2-Settings carries). Returns 0, or
+// -1 after failing the connection.
+static int apply_settings(struct connection *conn, struct http2 *h2, const uint8_t *payload, size_t len) {
+	for (size_t at = 0; at + 6 <= len; at += 6) {
+		uint16_t id = (uint16_t)(payload[at] << 8 | payload[at + 1]);
+		uint32_t value = read_u32(payload + at + 2);
+		switch (id) {
+		case SETTINGS_HEADER_TABLE_SIZE:
+			hpack_encoder_set_limit(&h2->encoder, value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if (value > 1) {
+				session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad SETTINGS_ENABLE_PUSH");
+				return -1;
+			}
+			break; // We never push
+		case SETTINGS_INITIAL_WINDOW_SIZE: {
+			if (value > WINDOW_MAX) {
+				session_fail(conn, h2, H2_FLOW_CONTROL_ERROR, "bad SETTINGS_INITIAL_WINDOW_SIZE");
+				return -1;
+			}
+			// Applies to open streams too, by the difference
+			int64_t delta = (int64_t)value - h2->peer_initial_window;
+			for (struct stream *stream = h2->streams; stream != NULL; stream = stream->next) {
+				stream->send_window += delta;
+				if (stream->send_window > WINDOW_MAX) {
+					session_fail(conn, h2, H2_FLOW_CONTROL_ERROR, "stream window overflow");
+					return -1;
+				}
+			}
+			h2->peer_initial_window = value;
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < HTTP2_FRAME_MAX || value > 0xffffff) {
+				session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad SETTINGS_MAX_FRAME_SIZE");
+				return -1;
+			}
+			h2->peer_max_frame = value;
+			break;
+		default:
+			break; // SETTINGS_MAX_CONCURRENT_STREAMS and SETTINGS_MAX_HEADER_LIST_SIZE limit pushes and requests, which we don't make; unknown ones are ignored
+		}
+	}
+	return 0;
+}
+
+static void on_settings(struct connection *conn, struct http2 *h2, uint8_t flags, uint32_t stream_id,
+						const uint8_t *payload, size_t len) {
+	if (stream_id != 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+		return;
+	}
+	if (flags & FLAG_ACK) {
+		if (len != 0) {
+			session_fail(conn, h2, H2_FRAME_SIZE_ERROR, "SETTINGS ack with a payload");
+		}
+		return;
+	}
+	if (len % 6 != 0) {
+		session_fail(conn, h2, H2_FRAME_SIZE_ERROR, "SETTINGS length");
+		return;
+	}
+	if (apply_settings(conn, h2, payload, len) == 0) {
+		frame_begin(conn, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+	}
+}
+
+static void on_window_update(struct connection *conn, struct http2 *h2, uint32_t stream_id, const uint8_t *payload,
+							 size_t len) {
+	if (len != 4) {
+		session_fail(conn, h2, H2_FRAME_SIZE_ERROR, "WINDOW_UPDATE length");
+		return;
+	}
+	uint32_t increment = read_u32(payload) & WINDOW_MAX;
+	if (stream_id == 0) {
+		h2->send_window += increment;
+		if (increment == 0 || h2->send_window > WINDOW_MAX) {
+			session_fail(conn, h2, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR,
+						 "bad connection WINDOW_UPDATE");
+		}
+		return;
+	}
+	struct stream *stream = stream_find(h2, stream_id);
+	if (stream == NULL) {
+		if (stream_id > h2->last_stream_id) {
+			session_fail(conn, h2, H2_PROTOCOL_ERROR, "WINDOW_UPDATE on an idle stream");
+		}
+		return;
+	}
+	stream->send_window += increment;
+	if (increment == 0 || stream->send_window > WINDOW_MAX) {
+		stream_reset(conn, h2, stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+	}
+}
+
+static void on_frame(struct connection *conn, struct http2 *h2, enum frame_type type, uint8_t flags,
+					 uint32_t stream_id, const uint8_t *payload, size_t len) {
+	if (h2->block_stream != 0 && type != FRAME_CONTINUATION) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "header block interrupted");
+		return;
+	}
+	switch (type) {
+	case FRAME_DATA:
+		on_data(conn, h2, flags, stream_id, payload, len);
+		break;
+	case FRAME_HEADERS:
+		on_headers(conn, h2, flags, stream_id, payload, len);
+		break;
+	case FRAME_PRIORITY:
+		// Advisory; we schedule streams round-robin
+		if (stream_id == 0 || len != 5) {
+			session_fail(conn, h2, stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR, "bad PRIORITY");
+		}
+		break;
+	case FRAME_RST_STREAM: {
+		if (stream_id == 0 || stream_id > h2->last_stream_id || len != 4) {
+			session_fail(conn, h2, len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR, "bad RST_STREAM");
+			break;
+		}
+		struct stream *stream = stream_find(h2, stream_id);
+		if (stream != NULL) {
+			stream->remote_closed = 1; // No RST_STREAM back
+			stream_reset(conn, h2, stream, H2_NO_ERROR);
+		}
+		break;
+	}
+	case FRAME_SETTINGS:
+		on_settings(conn, h2, flags, stream_id, payload, len);
+		break;
+	case FRAME_PUSH_PROMISE:
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "PUSH_PROMISE from a client");
+		break;
+	case FRAME_PING:
+		if (stream_id != 0 || len != 8) {
+			session_fail(conn, h2, stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR, "bad PING");
+		} else if (!(flags & FLAG_ACK)) {
+			uint8_t *reply = frame_begin(conn, 8, FRAME_PING, FLAG_ACK, 0);
+			if (reply != NULL) {
+				memcpy(reply, payload, 8);
+			}
+		}
+		break;
+	case FRAME_GOAWAY:
+		if (stream_id != 0 || len < 8) {
+			session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad GOAWAY");
+			break;
+		}
+		// Streams in progress are still answered
+		h2->goaway = 1;
+		if (h2->stream_count == 0) {
+			close_after_output(conn);
+		}
+		break;
+	case FRAME_WINDOW_UPDATE:
+		on_window_update(conn, h2, stream_id, payload, len);
+		break;
+	case FRAME_CONTINUATION:
+		on_continuation(conn, h2, flags, stream_id, payload, len);
+		break;
+	default:
+		break; // Unknown frame types are ignored
+	}
+}
+
+// Stop taking new streams because the server is draining for a restart:
+// answer the ones already open, then close
+static void shutdown_gracefully(struct connection *conn, struct http2 *h2) {
+	// Streams above last_stream_id were not seen, so the client can safely
+	// retry them on a new connection
+	uint8_t *payload = frame_begin(conn, 8, FRAME_GOAWAY, 0, 0);
+	if (payload == NULL) {
+		return;
+	}
+	write_u32(payload, h2->last_stream_id);
+	write_u32(payload + 4, H2_NO_ERROR);
+	h2->goaway = 1;
+	if (h2->stream_count == 0) {
+		close_after_output(conn);
+	}
+}
+
+void http2_process(struct connection *conn) {
+	struct http2 *h2 = conn->h2;
+	if (!h2->goaway && restart_draining()) {
+		shutdown_gracefully(conn, h2);
+	}
+	while (conn->state == CONN_READING_HEADERS && !h2->failed) {
+		if (conn->in_start == conn->in_len) {
+			return; // Nothing buffered (`in` may have gone back to the pool)
+		}
+		const uint8_t *data = (const uint8_t *)conn->in + conn->in_start;
+		size_t available = conn->in_len - conn->in_start;
+		if (!h2->preface_received) {
+			int preface = http2_preface_check((const char *)data, available);
+			if (preface < 0) {
+				session_fail(conn, h2, H2_PROTOCOL_ERROR, "no connection preface");
+				return;
+			}
+			if (preface == 0) {
+				return;
+			}
+			conn->in_start += HTTP2_PREFACE_LEN;
+			h2->preface_received = 1;
+			continue;
+		}
+		if (conn->out_len - conn->out_sent >= CONN_OUT_HIGH_WATER) {
+			return; // Let the client catch up first
+		}
+		if (available < FRAME_HEADER_LEN) {
+			return;
+		}
+		size_t len = (size_t)data[0] << 16 | (size_t)data[1] << 8 | data[2];
+		if (len > HTTP2_FRAME_MAX) {
+			session_fail(conn, h2, H2_FRAME_SIZE_ERROR, "frame too large");
+			return;
+		}
+		if (available < FRAME_HEADER_LEN + len) {
+			return;
+		}
+		on_frame(conn, h2, (enum frame_type)data[3], data[4], read_u32(data + 5) & WINDOW_MAX,
+				 data + FRAME_HEADER_LEN, len);
+		conn->in_start += FRAME_HEADER_LEN + len;
+	}
+}
+
+// --- Responses: HTTP/1.1 output turned into frames ---
+
+// Whether the stream's connection has queued its whole response
+static int stream_answered(const struct stream *stream) {
+	return stream->conn->requests > 0;
+}
+
+static int stream_body_pending(const struct stream *stream) {
+	return stream->head_at < stream->head_len || connection_has_pending_output(stream->conn);
+}
+
+// Whether the stream has a frame to send that flow control allows
+static int stream_ready(const struct http2 *h2, const struct stream *stream) {
+	if (stream->conn->state == CONN_CLOSED) {
+		return 1; // To be reset
+	}
+	if (!stream->headers_sent) {
+		return stream_answered(stream);
+	}
+	if (!stream_body_pending(stream)) {
+		return 1; // END_STREAM is due
+	}
+	return stream->send_window > 0 && h2->send_window > 0;
+}
+
+int http2_has_output(const struct http2 *h2) {
+	if (h2->failed) {
+		return 0;
+	}
+	for (const struct stream *stream = h2->streams; stream != NULL; stream = stream->next) {
+		if (stream_ready(h2, stream)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int http2_busy(const struct http2 *h2) {
+	return h2->stream_count > 0;
+}
+
+// The response has been sent in full
+static void stream_done(struct connection *conn, struct http2 *h2, struct stream *stream) {
+	conn->requests++;
+	// A client still sending the body is told to stop (RFC 9113 8.1)
+	stream_reset(conn, h2, stream, H2_NO_ERROR);
+}
+
+// Response headers that only make sense on an HTTP/1.1 connection
+static int connection_specific(const char *name, size_t len) {
+	return name_is(name, len, "connection") || name_is(name, len, "keep-alive") ||
+		   name_is(name, len, "transfer-encoding") || name_is(name, len, "upgrade");
+}
+
+// Values that change from response to response aren't worth a table entry
+static enum hpack_indexing field_indexing(const char *name, size_t len) {
+	if (name_is(name, len, "content-length") || name_is(name, len, "etag") || name_is(name, len, "last-modified") ||
+		name_is(name, len, "content-range") || name_is(name, len, "date")) {
+		return HPACK_NO_INDEX;
+	}
+	return HPACK_INDEX;
+}
+
+// Encode the response head in stream->head[0, head_len) ("HTTP/1.1 200
+// OK\r\n" and header lines) into `out`
+static enum hpack_result encode_head(struct http2 *h2, const char *head, size_t head_len, struct hpack_buffer *out) {
+	enum hpack_result result = hpack_encode_begin(&h2->encoder, out);
+	if (result == HPACK_OK) {
+		result = hpack_encode_field(&h2->encoder, out, ":status", 7, head + 9, 3, HPACK_INDEX);
+	}
+	const char *line = memchr(head, '\n', head_len);
+	const char *end = head + head_len;
+	while (result == HPACK_OK && line != NULL && line + 1 < end) {
+		line++;
+		const char *line_end = memchr(line, '\r', (size_t)(end - line));
+		const char *colon = memchr(line, ':', (size_t)(end - line));
+		if (line_end == NULL || colon == NULL || colon > line_end) {
+			break;
+		}
+		char name[64];
+		size_t name_len = (size_t)(colon - line);
+		if (name_len > sizeof(name)) {
+			name_len = sizeof(name); // Not from any of our routes
+		}
+		for (size_t i = 0; i < name_len; i++) {
+			name[i] = (char)(line[i] >= 'A' && line[i] <= 'Z' ? line[i] + ('a' - 'A') : line[i]);
+		}
+		const char *value = colon + 1;
+		while (value < line_end && *value == ' ') {
+			value++;
+		}
+		if (!connection_specific(name, name_len)) {
+			result = hpack_encode_field(&h2->encoder, out, name, name_len, value, (size_t)(line_end - value),
+										field_indexing(name, name_len));
+		}
+		line = memchr(line_end, '\n', (size_t)(end - line_end));
+	}
+	return result;
+}
+
+// Gather the response head from the stream's connection and send it as
+// HEADERS. Returns 1 if anything was queued.
+static int stream_send_headers(struct connection *conn, struct http2 *h2, struct stream *stream) {
+	const char *blank_line;
+	while ((blank_line = memmem(stream->head, stream->head_len, "\r\n\r\n", 4)) == NULL) {
+		size_t got = connection_output_read(stream->conn, stream->head + stream->head_len,
+											sizeof(stream->head) - stream->head_len);
+		if (got == 0) {
+			if (stream->conn->state != CONN_CLOSED) {
+				log_error("HTTP/2 response head incomplete or over %d bytes", RESPONSE_HEAD_MAX);
+			}
+			stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+			return 1;
+		}
+		stream->head_len += got;
+	}
+	size_t head_len = (size_t)(blank_line - stream->head) + 2;
+	stream->head_at = head_len + 2;
+
+	// Our heads fit one frame with room to spare: HPACK output is about as
+	// long as its input, and RESPONSE_HEAD_MAX is far below the smallest
+	// frame size limit
+	uint8_t block[2 * RESPONSE_HEAD_MAX + 64];
+	struct hpack_buffer out = { block, 0, sizeof(block) };
+	if (head_len < 12 || memcmp(stream->head, "HTTP/1.1 ", 9) != 0 ||
+		encode_head(h2, stream->head, head_len, &out) != HPACK_OK) {
+		// The encoder's table may be ahead of the client's now
+		session_fail(conn, h2, H2_INTERNAL_ERROR, "unencodable response head");
+		return 1;
+	}
+	int end_stream = stream->head_request || !stream_body_pending(stream);
+	uint8_t *payload = frame_begin(conn, out.len, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0),
+								   stream->id);
+	if (payload == NULL) {
+		return 1;
+	}
+	memcpy(payload, block, out.len);
+	stream->headers_sent = 1;
+	if (end_stream) {
+		stream_done(conn, h2, stream);
+	}
+	return 1;
+}
+
+// Send the next DATA frame of the stream's body, as much as the windows
+// allow. Returns 1 if anything was queued.
+static int stream_send_data(struct connection *conn, struct http2 *h2, struct stream *stream) {
+	int64_t window = stream->send_window < h2->send_window ? stream->send_window : h2->send_window;
+	uint32_t max_frame = h2->peer_max_frame < DATA_FRAME_MAX ? h2->peer_max_frame : DATA_FRAME_MAX;
+	if (window > max_frame) {
+		window = max_frame;
+	}
+	int body_pending = stream_body_pending(stream);
+	if (body_pending && window <= 0) {
+		return 0;
+	}
+	size_t room = body_pending ? (size_t)window : 0;
+	char *frame = connection_out_reserve(conn, FRAME_HEADER_LEN + room);
+	if (frame == NULL) {
+		return 1;
+	}
+	// Body bytes read along with the head go first, then the rest of the
+	// connection's output, file bodies included
+	char *payload = frame + FRAME_HEADER_LEN;
+	size_t len = stream->head_len - stream->head_at;
+	if (len > room) {
+		len = room;
+	}
+	memcpy(payload, stream->head + stream->head_at, len);
+	stream->head_at += len;
+	if (len < room) {
+		len += connection_output_read(stream->conn, payload + len, room - len);
+	}
+	if (stream->conn->state == CONN_CLOSED) {
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+		return 1;
+	}
+	int end_stream = !stream_body_pending(stream);
+	if (len == 0 && !end_stream) {
+		log_error("HTTP/2 stream %u has a body but produced none", stream->id);
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+		return 1;
+	}
+	write_frame_header((uint8_t *)frame, len, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id);
+	conn->out_len += FRAME_HEADER_LEN + len;
+	stream->send_window -= (int64_t)len;
+	h2->send_window -= (int64_t)len;
+	if (end_stream) {
+		stream_done(conn, h2, stream);
+	}
+	return 1;
+}
+
+// Queue the stream's next frame, if it has one it may send
+static int stream_produce(struct connection *conn, struct http2 *h2, struct stream *stream) {
+	if (!stream_ready(h2, stream)) {
+		return 0;
+	}
+	if (stream->conn->state == CONN_CLOSED) {
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+		return 1;
+	}
+	if (!stream->headers_sent) {
+		return stream_send_headers(conn, h2, stream);
+	}
+	return stream_send_data(conn, h2, stream);
+}
+
+// One frame from every stream that has one, starting with the stream whose
+// turn it is. Returns whether anything was queued.
+static int produce_round(struct connection *conn, struct http2 *h2) {
+	int progress = 0;
+	// Streams from h2->turn on, then those before it
+	for (int wrapped = 0; wrapped < 2; wrapped++) {
+		struct stream *stream = h2->streams;
+		while (stream != NULL) {
+			struct stream *next = stream->next;
+			if ((stream->id >= h2->turn) != wrapped) {
+				if (conn->out_len - conn->out_sent >= OUTPUT_ROUND) {
+					h2->turn = stream->id; // Goes first next time
+					return progress;
+				}
+				progress |= stream_produce(conn, h2, stream);
+				if (h2->failed || conn->state == CONN_CLOSED) {
+					return progress;
+				}
+			}
+			stream = next;
+		}
+	}
+	h2->turn = 0;
+	return progress;
+}
+
+void http2_produce(struct connection *conn) {
+	struct http2 *h2 = conn->h2;
+	while (!h2->failed && conn->state != CONN_CLOSED && conn->out_len - conn->out_sent < OUTPUT_ROUND &&
+		   produce_round(conn, h2)) {
+	}
+}
+
+// --- Starting and ending ---
+
+int http2_preface_check(const char *data, size_t len) {
+	size_t compared = len < HTTP2_PREFACE_LEN ? len : HTTP2_PREFACE_LEN;
+	if (memcmp(data, HTTP2_PREFACE, compared) != 0) {
+		return -1;
+	}
+	return len >= HTTP2_PREFACE_LEN ? 1 : 0;
+}
+
+// Whether a comma-separated header value lists `token` (case-insensitive)
+static int lists_token(const char *value, size_t len, const char *token) {
+	size_t token_len = strlen(token);
+	size_t at = 0;
+	while (at < len) {
+		while (at < len && (value[at] == ' ' || value[at] == '\t' || value[at] == ',')) {
+			at++;
+		}
+		size_t start = at;
+		while (at < len && value[at] != ',' && value[at] != ' ' && value[at] != '\t') {
+			at++;
+		}
+		if (at - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int http2_upgrade_requested(const struct http_request *request, const char *data, const char **settings,
+							size_t *settings_len) {
+	if (request->version_minor < 1 || request->content_length > 0 || request->has_transfer_encoding) {
+		return 0;
+	}
+	size_t upgrade_len;
+	const char *upgrade = http_request_header(request, data, "upgrade", &upgrade_len);
+	if (upgrade == NULL || !lists_token(upgrade, upgrade_len, "h2c")) {
+		return 0;
+	}
+	*settings = http_request_header(request, data, "http2-settings", settings_len);
+	return *settings != NULL;
+}
+
+// Decode base64url (RFC 4648 5, unpadded as HTTP2-Settings is) into `out`.
+// Returns the decoded length, or -1 if malformed or too long.
+static long base64url_decode(const char *in, size_t len, uint8_t *out, size_t cap) {
+	uint32_t bits = 0;
+	int bit_count = 0;
+	size_t out_len = 0;
+	for (size_t i = 0; i < len && in[i] != '='; i++) {
+		char c = in[i];
+		int value;
+		if (c >= 'A' && c <= 'Z') {
+			value = c - 'A';
+		} else if (c >= 'a' && c <= 'z') {
+			value = c - 'a' + 26;
+		} else if (c >= '0' && c <= '9') {
+			value = c - '0' + 52;
+		} else if (c == '-') {
+			value = 62;
+		} else if (c == '_') {
+			value = 63;
+		} else {
+			return -1;
+		}
+		bits = bits << 6 | (uint32_t)value;
+		bit_count += 6;
+		if (bit_count >= 8) {
+			bit_count -= 8;
+			if (out_len == cap) {
+				return -1;
+			}
+			out[out_len++] = (uint8_t)(bits >> bit_count);
+		}
+	}
+	return (long)out_len;
+}
+
+int http2_start(struct connection *conn, const char *settings, size_t settings_len, const char *request,
+				size_t request_len) {
+	struct http2 *h2 = pool_acquire(sizeof(*h2));
+	if (h2 == NULL) {
+		log_error("Pool allocation failed for HTTP/2 state: %m");
+		return -1;
+	}
+	h2->preface_received = 0;
+	h2->failed = 0;
+	h2->goaway = 0;
+	h2->last_stream_id = 0;
+	h2->streams = NULL;
+	h2->stream_count = 0;
+	h2->turn = 0;
+	h2->send_window = WINDOW_DEFAULT;
+	h2->receive_unacked = 0;
+	h2->peer_initial_window = WINDOW_DEFAULT;
+	h2->peer_max_frame = HTTP2_FRAME_MAX;
+	h2->block_stream = 0;
+	h2->block_opens = 0;
+	h2->block_end_stream = 0;
+	h2->block = NULL;
+	h2->block_len = h2->block_cap = 0;
+	hpack_decoder_init(&h2->decoder);
+	hpack_encoder_init(&h2->encoder);
+	conn->h2 = h2;
+	metrics_http2_connection();
+	log_debug("Switching to HTTP/2 (%s, FD: %d)", request != NULL ? "upgrade" : "prior knowledge", conn->io.fd);
+
+	// Our SETTINGS open the connection, then the larger connection window
+	static const uint8_t our_settings[] = {
+		0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, HTTP2_MAX_STREAMS,
+		0, SETTINGS_INITIAL_WINDOW_SIZE, (uint8_t)(RECEIVE_WINDOW >> 24), (uint8_t)(RECEIVE_WINDOW >> 16),
+		(uint8_t)(RECEIVE_WINDOW >> 8), (uint8_t)RECEIVE_WINDOW,
+	};
+	uint8_t *payload = frame_begin(conn, sizeof(our_settings) + 6, FRAME_SETTINGS, 0, 0);
+	if (payload == NULL) {
+		return -1;
+	}
+	memcpy(payload, our_settings, sizeof(our_settings));
+	payload[sizeof(our_settings)] = 0;
+	payload[sizeof(our_settings) + 1] = SETTINGS_MAX_HEADER_LIST_SIZE;
+	write_u32(payload + sizeof(our_settings) + 2, (uint32_t)g_parser_limits.max_header_bytes);
+	send_window_update(conn, 0, RECEIVE_WINDOW - WINDOW_DEFAULT);
+	if (request == NULL) {
+		return conn->state == CONN_CLOSED ? -1 : 0;
+	}
+
+	// The upgraded request is stream 1, whose request is complete already
+	uint8_t decoded[256];
+	long decoded_len = base64url_decode(settings, settings_len, decoded, sizeof(decoded));
+	if (decoded_len < 0 || decoded_len % 6 != 0) {
+		session_fail(conn, h2, H2_PROTOCOL_ERROR, "bad HTTP2-Settings");
+		return 0;
+	}
+	if (apply_settings(conn, h2, decoded, (size_t)decoded_len) != 0) {
+		return 0;
+	}
+	h2->last_stream_id = 1;
+	struct stream *stream = stream_open(conn, h2, 1);
+	if (stream == NULL) {
+		return -1;
+	}
+	stream->head_request = request_len >= 5 && memcmp(request, "HEAD ", 5) == 0;
+	if (stream_feed(stream, request, request_len) != 0) {
+		stream_reset(conn, h2, stream, H2_INTERNAL_ERROR);
+		return 0;
+	}
+	stream_remote_end(conn, h2, stream);
+	return conn->state == CONN_CLOSED ? -1 : 0;
+}
+
+void http2_free(struct http2 *h2) {
+	while (h2->streams != NULL) {
+		stream_free(h2, h2->streams);
+	}
+	pool_release(h2->block);
+	pool_release(h2);
+}
@@ -0,0 +1,66 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+// Cleartext HTTP/2 (h2c, RFC 9113), entered with prior knowledge (the
+// client opens with the connection preface) or from HTTP/1.1 with
+// "Upgrade: h2c". The connection then carries frames in `in` and `out`, and
+// each stream's request runs on a connection of its own, made with
+// connection_new_stream(): it is handed the request as HTTP/1.1 text and
+// answers it through the same routes, and its response is turned into
+// HEADERS and DATA frames. Streams that have output take turns, a frame
+// each, so a large file can't hold up the small responses next to it.
+
+struct connection;
+// One connection's HTTP/2 state
+struct http2;
+
+// The client connection preface, the first bytes of every HTTP/2 connection
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN (sizeof(HTTP2_PREFACE) - 1)
+// Largest frame payload we accept (the SETTINGS_MAX_FRAME_SIZE default)
+#define HTTP2_FRAME_MAX 16384
+// Read buffer an HTTP/2 connection needs to hold any frame whole
+#define HTTP2_IN_CAP (9 + HTTP2_FRAME_MAX)
+
+// Whether the `len` bytes a connection starts with are the preface: 1 if
+// so, 0 if they are too few to tell yet, -1 if not
+int http2_preface_check(const char *data, size_t len);
+
+// Whether an HTTP/1.1 request asks to upgrade to h2c (and has no body, which
+// would have to arrive before the switch). If so, points `settings` at its
+// HTTP2-Settings value. `data` is the start of the request.
+int http2_upgrade_requested(const struct http_request *request, const char *data, const char **settings,
+							size_t *settings_len);
+
+// Switch `conn` to HTTP/2 and queue our SETTINGS. After an upgrade,
+// `settings` is the HTTP2-Settings value and `request` the header block of
+// the request that asked, which becomes stream 1; both are NULL with prior
+// knowledge. Either way the client's preface is still to come in `in`,
+// whose capacity the caller raises to HTTP2_IN_CAP. Returns 0 on success,
+// -1 on error.
+int http2_start(struct connection *conn, const char *settings, size_t settings_len, const char *request,
+				size_t request_len);
+
+// Free the state and every stream still open
+void http2_free(struct http2 *h2);
+
+// Handle the frames buffered in conn->in, leaving a partial one there. Once
+// the server is draining for a restart, the first call sends GOAWAY.
+void http2_process(struct connection *conn);
+
+// Whether a stream has a frame it may send now (flow control permitting)
+int http2_has_output(const struct http2 *h2);
+
+// Whether streams are open: requests still arriving, or responses waiting
+// for room in the client's flow-control windows
+int http2_busy(const struct http2 *h2);
+
+// Append the next round of response frames to conn->out, taking turns
+// among the streams. Called when `out` has drained.
+void http2_produce(struct connection *conn);
+
+#endif
@@ -0,0 +1,39 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+
+#include "http_date.h"
+
+// strptime() formats for the HTTP-date variants, preferred one first. The
+// server never calls setlocale(), so day and month names are English.
+static const char *const date_formats[] = {
+	"%a, %d %b %Y %H:%M:%S GMT",
+	"%A, %d-%b-%y %H:%M:%S GMT",
+	"%a %b %e %H:%M:%S %Y",
+	NULL,
+};
+
+void http_date_format(time_t t, char date[HTTP_DATE_LEN + 1]) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(date, HTTP_DATE_LEN + 1, date_formats[0], &tm);
+}
+
+int http_date_parse(const char *value, size_t len, time_t *t) {
+	char text[64];
+	if (len >= sizeof(text)) {
+		return -1;
+	}
+	memcpy(text, value, len);
+	text[len] = '\0';
+	for (const char *const *format = date_formats; *format != NULL; format++) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		const char *end = strptime(text, *format, &tm);
+		if (end != NULL && *end == '\0') {
+			*t = timegm(&tm);
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,19 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LEN 29
+
+// Format `t` as an IMF-fixdate, the form HTTP-dates are sent in
+void http_date_format(time_t t, char date[HTTP_DATE_LEN + 1]);
+
+// Parse an HTTP-date in any of the three formats recipients must accept
+// (RFC 9110 5.6.7): IMF-fixdate "Sun, 06 Nov 1994 08:49:37 GMT", the
+// obsolete RFC 850 "Sunday, 06-Nov-94 08:49:37 GMT" and asctime()'s
+// "Sun Nov  6 08:49:37 1994". Returns 0 and stores the time in *t, or -1.
+int http_date_parse(const char *value, size_t len, time_t *t);
+
+#endif
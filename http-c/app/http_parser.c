@@ -0,0 +1,470 @@
+#include <string.h>
+#include <strings.h>
+
+#include "header_scan.h"
+#include "http_parser.h"
+
+enum parser_state {
+	S_START,          // skipping blank lines before the request line
+	S_METHOD,
+	S_TARGET,
+	S_VERSION,
+	S_REQUEST_LINE_LF,
+	S_HEADER_START,   // start of a header line, or the blank line ending the block
+	S_HEADER_NAME,
+	S_VALUE_START,    // skipping whitespace after the colon
+	S_VALUE,
+	S_HEADER_LF,
+	S_END_LF,
+	S_DONE,
+	S_ERROR,
+};
+
+// RFC 9110 token characters, used for methods and header names
+static const unsigned char token_chars[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+	['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+	['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+void http_parser_init(struct http_parser *parser, struct http_request *request,
+					  const struct http_parser_limits *limits) {
+	parser->limits = limits;
+	parser->request = request;
+	http_parser_reset(parser);
+}
+
+void http_parser_reset(struct http_parser *parser) {
+	struct http_request *request = parser->request;
+	parser->state = S_START;
+	parser->pos = 0;
+	parser->mark = 0;
+	parser->error_status = 0;
+	request->method = HTTP_METHOD_UNKNOWN;
+	request->header_len = 0;
+	request->header_count = 0;
+	request->version_minor = 1;
+	request->content_length = -1;
+	request->has_transfer_encoding = 0;
+	request->chunked = 0;
+	request->connection_close = 0;
+	request->connection_keep_alive = 0;
+	request->accept_gzip = 0;
+	request->has_range = 0;
+	request->has_if_none_match = 0;
+	request->has_if_modified_since = 0;
+}
+
+static enum http_parse_result fail(struct http_parser *parser, int status) {
+	parser->state = S_ERROR;
+	parser->error_status = status;
+	return HTTP_PARSE_ERROR;
+}
+
+static struct http_slice make_slice(size_t from, size_t to) {
+	struct http_slice slice = { (uint32_t)from, (uint32_t)(to - from) };
+	return slice;
+}
+
+static enum http_method lookup_method(const char *name, size_t len) {
+	switch (len) {
+	case 3:
+		if (memcmp(name, "GET", 3) == 0) return HTTP_GET;
+		if (memcmp(name, "PUT", 3) == 0) return HTTP_PUT;
+		break;
+	case 4:
+		if (memcmp(name, "POST", 4) == 0) return HTTP_POST;
+		if (memcmp(name, "HEAD", 4) == 0) return HTTP_HEAD;
+		break;
+	case 5:
+		if (memcmp(name, "PATCH", 5) == 0) return HTTP_PATCH;
+		if (memcmp(name, "TRACE", 5) == 0) return HTTP_TRACE;
+		break;
+	case 6:
+		if (memcmp(name, "DELETE", 6) == 0) return HTTP_DELETE;
+		break;
+	case 7:
+		if (memcmp(name, "OPTIONS", 7) == 0) return HTTP_OPTIONS;
+		if (memcmp(name, "CONNECT", 7) == 0) return HTTP_CONNECT;
+		break;
+	}
+	return HTTP_METHOD_UNKNOWN;
+}
+
+// Visit each item of a comma-separated header value and report whether
+// `token` is among them (case-insensitive); if `last_only`, only the final
+// item counts (as for Transfer-Encoding, where "chunked" must come last).
+static int value_has_token(const char *value, size_t value_len, const char *token, int last_only) {
+	size_t token_len = strlen(token);
+	const char *end = value + value_len;
+	int found = 0;
+	while (value < end) {
+		while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+			value++;
+		}
+		if (value == end) {
+			break;
+		}
+		const char *item = value;
+		while (value < end && *value != ',') {
+			value++;
+		}
+		const char *item_end = value;
+		while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+			item_end--;
+		}
+		int match = (size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0;
+		if (match && !last_only) {
+			return 1;
+		}
+		found = match;
+	}
+	return found;
+}
+
+// Find `coding` in an Accept-Encoding value such as "gzip;q=0.8, br" and
+// return its weight in thousandths (1000 when no q is given), or -1 if the
+// value doesn't list it.
+static int coding_quality(const char *value, size_t value_len, const char *coding) {
+	size_t coding_len = strlen(coding);
+	const char *end = value + value_len;
+	while (value < end) {
+		while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+			value++;
+		}
+		const char *item = value;
+		while (value < end && *value != ',' && *value != ';' && *value != ' ' && *value != '\t') {
+			value++;
+		}
+		int match = (size_t)(value - item) == coding_len && strncasecmp(item, coding, coding_len) == 0;
+		int quality = 1000;
+		// Parameters up to the next item; only q matters
+		while (value < end && *value != ',') {
+			if ((*value == 'q' || *value == 'Q') && value + 1 < end && value[1] == '=' &&
+				(value[-1] == ';' || value[-1] == ' ' || value[-1] == '\t')) {
+				value += 2;
+				quality = 0;
+				if (value < end && *value == '1') {
+					quality = 1000;
+				} else if (value + 1 < end && value[0] == '0' && value[1] == '.') {
+					// Up to three decimals: "0.5" is 500
+					int scale = 100;
+					for (value += 2; value < end && *value >= '0' && *value <= '9' && scale > 0; value++, scale /= 10) {
+						quality += (*value - '0') * scale;
+					}
+				}
+				continue;
+			}
+			value++;
+		}
+		if (match) {
+			return quality;
+		}
+	}
+	return -1;
+}
+
+// Parse a Content-Length value. Returns -1 if it isn't a plain decimal number.
+static long long parse_length(const char *value, size_t len) {
+	if (len == 0 || len > 18) {
+		return -1; // Empty, or too large to be meaningful
+	}
+	long long result = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9') {
+			return -1;
+		}
+		result = result * 10 + (value[i] - '0');
+	}
+	return result;
+}
+
+// Record a complete header line and interpret the ones the server cares about
+static enum http_parse_result add_header(struct http_parser *parser, const char *data,
+										 struct http_slice name, struct http_slice value) {
+	struct http_request *request = parser->request;
+	if (request->header_count >= parser->limits->max_headers ||
+		request->header_count >= HTTP_MAX_HEADERS_CAP) {
+		return fail(parser, 431);
+	}
+	request->headers[request->header_count].name = name;
+	request->headers[request->header_count].value = value;
+	request->header_count++;
+
+	const char *name_ptr = data + name.offset;
+	const char *value_ptr = data + value.offset;
+	switch (name.len) {
+	case 5:
+		if (header_name_equals(name_ptr, 5, "range", 5)) {
+			request->has_range = 1;
+			request->range = value;
+		}
+		break;
+	case 10:
+		if (header_name_equals(name_ptr, 10, "connection", 10)) {
+			if (value_has_token(value_ptr, value.len, "close", 0)) {
+				request->connection_close = 1;
+			}
+			if (value_has_token(value_ptr, value.len, "keep-alive", 0)) {
+				request->connection_keep_alive = 1;
+			}
+		}
+		break;
+	case 13:
+		if (header_name_equals(name_ptr, 13, "if-none-match", 13)) {
+			request->has_if_none_match = 1;
+			request->if_none_match = value;
+		}
+		break;
+	case 14:
+		if (header_name_equals(name_ptr, 14, "content-length", 14)) {
+			long long length = parse_length(value_ptr, value.len);
+			// Conflicting duplicates make the body boundary ambiguous
+			if (length < 0 || (request->content_length >= 0 && request->content_length != length)) {
+				return fail(parser, 400);
+			}
+			if (parser->limits->max_body != 0 && (unsigned long long)length > parser->limits->max_body) {
+				return fail(parser, 413);
+			}
+			request->content_length = length;
+		}
+		break;
+	case 15:
+		if (header_name_equals(name_ptr, 15, "accept-encoding", 15)) {
+			// An explicit weight for gzip wins over the "*" wildcard
+			int quality = coding_quality(value_ptr, value.len, "gzip");
+			if (quality < 0) {
+				quality = coding_quality(value_ptr, value.len, "*");
+			}
+			if (quality > 0) {
+				request->accept_gzip = 1;
+			}
+		}
+		break;
+	case 17:
+		if (header_name_equals(name_ptr, 17, "transfer-encoding", 17)) {
+			// The lines form one list, in which chunked may only come last
+			// and only once: nothing may follow a line that ended in it
+			if (request->chunked) {
+				return fail(parser, 400);
+			}
+			request->has_transfer_encoding = 1;
+			request->chunked = value_has_token(value_ptr, value.len, "chunked", 1);
+		} else if (header_name_equals(name_ptr, 17, "if-modified-since", 17)) {
+			request->has_if_modified_since = 1;
+			request->if_modified_since = value;
+		}
+		break;
+	}
+	return HTTP_PARSE_INCOMPLETE;
+}
+
+enum http_parse_result http_parser_execute(struct http_parser *parser, const char *data, size_t len) {
+	struct http_request *request = parser->request;
+	const struct http_parser_limits *limits = parser->limits;
+	size_t limit = len < limits->max_header_bytes ? len : limits->max_header_bytes;
+	size_t i = parser->pos;
+	unsigned char c;
+
+	if (parser->state == S_DONE) {
+		return HTTP_PARSE_DONE;
+	}
+	if (parser->state == S_ERROR) {
+		return HTTP_PARSE_ERROR;
+	}
+
+	while (i < limit) {
+		switch (parser->state) {
+		case S_START:
+			// Tolerate stray CRLFs between pipelined requests (RFC 9112 2.2)
+			c = (unsigned char)data[i];
+			if (c == '\r' || c == '\n') {
+				i++;
+				break;
+			}
+			if (!token_chars[c]) {
+				return fail(parser, 400);
+			}
+			parser->mark = i;
+			parser->state = S_METHOD;
+			break;
+
+		case S_METHOD:
+			i += scan_token(data + i, limit - i);
+			if (i == limit) {
+				break;
+			}
+			if (data[i] != ' ') {
+				return fail(parser, 400);
+			}
+			request->method_text = make_slice(parser->mark, i);
+			request->method = lookup_method(data + parser->mark, i - parser->mark);
+			parser->mark = ++i;
+			parser->state = S_TARGET;
+			break;
+
+		case S_TARGET:
+			// Any visible character; whitespace or a control ends the target
+			i += scan_request_target(data + i, limit - i);
+			if (i - parser->mark > limits->max_uri) {
+				return fail(parser, 414);
+			}
+			if (i == limit) {
+				break;
+			}
+			if (data[i] != ' ' || i == parser->mark) {
+				return fail(parser, 400);
+			}
+			request->target = make_slice(parser->mark, i);
+			parser->mark = ++i;
+			parser->state = S_VERSION;
+			break;
+
+		case S_VERSION:
+			while (i < limit && data[i] != '\r' && data[i] != '\n') {
+				if (i - parser->mark >= 8) {
+					return fail(parser, 400); // Longer than "HTTP/1.1"
+				}
+				i++;
+			}
+			if (i == limit) {
+				break;
+			}
+			{
+				const char *version = data + parser->mark;
+				if (i - parser->mark != 8 || memcmp(version, "HTTP/", 5) != 0 || version[6] != '.' ||
+					version[5] < '0' || version[5] > '9' || version[7] < '0' || version[7] > '9') {
+					return fail(parser, 400);
+				}
+				if (version[5] != '1') {
+					return fail(parser, 505);
+				}
+				request->version_minor = version[7] - '0';
+			}
+			parser->state = data[i] == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+			i++;
+			break;
+
+		case S_REQUEST_LINE_LF:
+		case S_HEADER_LF:
+			if (data[i] != '\n') {
+				return fail(parser, 400);
+			}
+			i++;
+			parser->state = S_HEADER_START;
+			break;
+
+		case S_HEADER_START:
+			c = (unsigned char)data[i];
+			if (c == '\r') {
+				i++;
+				parser->state = S_END_LF;
+				break;
+			}
+			if (c == '\n') {
+				i++;
+				goto done;
+			}
+			// Anything else must start a field name; leading whitespace
+			// would be an obsolete line folding, which we reject
+			if (!token_chars[c]) {
+				return fail(parser, 400);
+			}
+			parser->mark = i;
+			parser->state = S_HEADER_NAME;
+			break;
+
+		case S_HEADER_NAME:
+			i += scan_token(data + i, limit - i);
+			if (i == limit) {
+				break;
+			}
+			if (data[i] != ':') {
+				return fail(parser, 400); // Includes whitespace before the colon
+			}
+			parser->current_name = make_slice(parser->mark, i);
+			i++;
+			parser->state = S_VALUE_START;
+			break;
+
+		case S_VALUE_START:
+			while (i < limit && (data[i] == ' ' || data[i] == '\t')) {
+				i++;
+			}
+			if (i == limit) {
+				break;
+			}
+			parser->mark = i;
+			parser->state = S_VALUE;
+			break;
+
+		case S_VALUE:
+			// Field content is visible characters, obs-text, SP and HTAB
+			i += scan_field_value(data + i, limit - i);
+			if (i == limit) {
+				break;
+			}
+			if (data[i] != '\r' && data[i] != '\n') {
+				return fail(parser, 400);
+			}
+			{
+				size_t value_end = i;
+				while (value_end > parser->mark && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t')) {
+					value_end--;
+				}
+				if (add_header(parser, data, parser->current_name, make_slice(parser->mark, value_end)) ==
+					HTTP_PARSE_ERROR) {
+					return HTTP_PARSE_ERROR;
+				}
+			}
+			parser->state = data[i] == '\r' ? S_HEADER_LF : S_HEADER_START;
+			i++;
+			break;
+
+		case S_END_LF:
+			if (data[i] != '\n') {
+				return fail(parser, 400);
+			}
+			i++;
+			goto done;
+		}
+	}
+
+	parser->pos = i;
+	if (i >= limits->max_header_bytes) {
+		// Out of room before the header block ended. Only a target can
+		// reasonably be that long; no method is.
+		if (parser->state == S_TARGET) {
+			return fail(parser, 414);
+		}
+		return fail(parser, parser->state < S_TARGET ? 400 : 431);
+	}
+	return HTTP_PARSE_INCOMPLETE;
+
+done:
+	// Both framings at once is a classic request smuggling vector
+	if (request->has_transfer_encoding && request->content_length >= 0) {
+		return fail(parser, 400);
+	}
+	// Without chunked last nothing says where the body ends (RFC 9112 6.3)
+	if (request->has_transfer_encoding && !request->chunked) {
+		return fail(parser, 400);
+	}
+	parser->pos = i;
+	parser->state = S_DONE;
+	request->header_len = i;
+	return HTTP_PARSE_DONE;
+}
+
+const char *http_request_header(const struct http_request *request, const char *data,
+								const char *name, size_t *value_len) {
+	size_t name_len = strlen(name);
+	for (size_t i = 0; i < request->header_count; i++) {
+		const struct http_header *header = &request->headers[i];
+		if (header_name_equals(data + header->name.offset, header->name.len, name, name_len)) {
+			*value_len = header->value.len;
+			return data + header->value.offset;
+		}
+	}
+	return NULL;
+}
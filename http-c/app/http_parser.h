@@ -0,0 +1,112 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Default limits, used unless overridden on the command line
+#define HTTP_DEFAULT_MAX_HEADER_BYTES 8192
+#define HTTP_DEFAULT_MAX_HEADERS 64
+#define HTTP_DEFAULT_MAX_URI 2048
+// Hard cap on the number of header slots kept per request
+#define HTTP_MAX_HEADERS_CAP 256
+
+enum http_method {
+	HTTP_METHOD_UNKNOWN = 0,
+	HTTP_GET,
+	HTTP_HEAD,
+	HTTP_POST,
+	HTTP_PUT,
+	HTTP_DELETE,
+	HTTP_OPTIONS,
+	HTTP_PATCH,
+	HTTP_CONNECT,
+	HTTP_TRACE,
+};
+
+// A run of bytes inside the request, as an offset from the first byte of the
+// request. Offsets (rather than pointers) stay valid when the connection
+// slides a partially received request to the front of its buffer.
+struct http_slice {
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value; // leading and trailing whitespace trimmed
+};
+
+// Everything the parser extracted from a request's header block
+struct http_request {
+	enum http_method method;
+	struct http_slice method_text;
+	struct http_slice target; // request target, e.g. "/files/foo"
+	int version_minor;        // HTTP/1.<version_minor>
+	size_t header_len;        // request line + headers + final blank line
+
+	struct http_header headers[HTTP_MAX_HEADERS_CAP];
+	size_t header_count;
+
+	// Well-known headers, interpreted as they are parsed so routes don't
+	// have to search for them
+	long long content_length;  // -1 when absent
+	int has_transfer_encoding;
+	int chunked;               // Transfer-Encoding ends in "chunked"
+	int connection_close;      // "Connection: close"
+	int connection_keep_alive; // "Connection: keep-alive"
+	int accept_gzip;           // Accept-Encoding allows gzip
+	int has_range;             // a Range header was sent...
+	struct http_slice range;   // ...with this value
+	int has_if_none_match;
+	struct http_slice if_none_match;
+	int has_if_modified_since;
+	struct http_slice if_modified_since;
+};
+
+struct http_parser_limits {
+	size_t max_header_bytes;   // request line + all headers (431 beyond)
+	size_t max_headers;        // number of header fields (431 beyond)
+	size_t max_uri;            // request target length (414 beyond)
+	unsigned long long max_body; // Content-Length limit (413 beyond), 0 = unlimited
+};
+
+enum http_parse_result {
+	HTTP_PARSE_INCOMPLETE, // need more bytes
+	HTTP_PARSE_DONE,       // header block complete, request filled in
+	HTTP_PARSE_ERROR,      // malformed or over a limit, see error_status
+};
+
+// Resumable parser for one request at a time. Each byte is examined once:
+// a call picks up where the previous one stopped, so feeding a request one
+// TCP segment at a time costs the same as feeding it whole.
+struct http_parser {
+	const struct http_parser_limits *limits;
+	struct http_request *request;
+	int state;
+	size_t pos;        // bytes of the request consumed so far
+	size_t mark;       // start of the token being parsed
+	size_t value_end;  // end of the header value, excluding trailing whitespace
+	struct http_slice current_name;
+	int error_status;  // HTTP status to answer with after HTTP_PARSE_ERROR
+};
+
+// Prepare `parser` to fill `request`. `limits` must outlive the parser.
+void http_parser_init(struct http_parser *parser, struct http_request *request,
+					  const struct http_parser_limits *limits);
+
+// Forget the current request and start on the next one
+void http_parser_reset(struct http_parser *parser);
+
+// Parse the request whose first byte is data[0]; `len` bytes are available.
+// The same request start must be passed on every call (the data may have
+// moved, but not changed), with `len` growing as more bytes arrive.
+enum http_parse_result http_parser_execute(struct http_parser *parser, const char *data, size_t len);
+
+// Find a header by name (case-insensitive; `name` is given in lowercase, e.g.
+// "user-agent") among the parsed headers. `data` is the start of the request. Returns a pointer to the value and stores its
+// length in *value_len, or returns NULL if the header is absent.
+const char *http_request_header(const struct http_request *request, const char *data,
+								const char *name, size_t *value_len);
+
+#endif
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Queued lines are tagged with their level, or as access-log lines
+#define LOG_ACCESS (LOG_ERROR + 1)
+
+// The writer naps when it finds every ring empty: briefly at first, doubling
+// while nothing arrives, so a busy server is drained often and an idle one
+// is barely woken
+#define LOG_SLEEP_MIN_NS (100 * 1000)
+#define LOG_SLEEP_MAX_NS (10 * 1000 * 1000)
+// Dropped lines are reported at most this often
+#define LOG_DROP_REPORT_NS (1000 * 1000 * 1000)
+// Bytes the writer gathers before each write()
+#define LOG_BATCH_SIZE (64 * 1024)
+// Room for the time and level in front of a line
+#define LOG_PREFIX_MAX 48
+
+struct log_record {
+	uint64_t time_ns; // CLOCK_REALTIME
+	uint8_t kind;     // enum log_level or LOG_ACCESS
+	uint8_t len;
+	char text[LOG_LINE_MAX];
+};
+
+// A single-producer, single-consumer ring: its thread fills records at
+// `head`, the writer empties them at `tail`. Both only ever grow (wrapping
+// around), so head - tail is the number of lines waiting. They sit on
+// separate cache lines so the two sides don't bounce one between them.
+struct log_ring {
+	_Alignas(64) _Atomic uint32_t head;
+	_Atomic uint64_t dropped; // written by the owning thread only
+	_Alignas(64) _Atomic uint32_t tail;
+	struct log_ring *next;
+	struct log_record records[LOG_RING_SLOTS];
+};
+
+// Every thread's ring, newest first. Rings live as long as the process.
+static _Atomic(struct log_ring *) rings;
+static _Thread_local struct log_ring *thread_ring;
+
+static enum log_level min_level = LOG_INFO;
+static atomic_int writer_running;
+static atomic_int writer_stop;
+static pthread_t writer_thread;
+
+static const char *const kind_names[] = {
+	[LOG_DEBUG] = "DEBUG ",
+	[LOG_INFO] = "INFO ",
+	[LOG_WARN] = "WARN ",
+	[LOG_ERROR] = "ERROR ",
+	[LOG_ACCESS] = "",
+};
+
+static int kind_fd(int kind) {
+	return kind == LOG_WARN || kind == LOG_ERROR ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+// "2025-01-31T12:34:56.789Z LEVEL " in front of each line
+static size_t format_prefix(char *out, uint64_t time_ns, int kind) {
+	time_t seconds = (time_t)(time_ns / 1000000000u);
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	size_t len = strftime(out, LOG_PREFIX_MAX, "%Y-%m-%dT%H:%M:%S", &tm);
+	int rest = snprintf(out + len, LOG_PREFIX_MAX - len, ".%03uZ %s",
+						(unsigned)(time_ns / 1000000u % 1000u), kind_names[kind]);
+	return rest > 0 ? len + (size_t)rest : len;
+}
+
+// write() all of `len` bytes, giving up on errors other than EINTR
+static void write_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += written;
+		len -= (size_t)written;
+	}
+}
+
+static uint64_t realtime_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Fill in a record; `saved_errno` is what "%m" describes
+static void record_format(struct log_record *record, int kind, int saved_errno, const char *fmt, va_list ap) {
+	record->time_ns = realtime_ns();
+	record->kind = (uint8_t)kind;
+	errno = saved_errno;
+	int len = vsnprintf(record->text, sizeof(record->text), fmt, ap);
+	if (len < 0) {
+		len = 0;
+	} else if (len >= (int)sizeof(record->text)) {
+		len = sizeof(record->text) - 1;
+	}
+	if (len > 0 && record->text[len - 1] == '\n') {
+		len--;
+	}
+	record->len = (uint8_t)len;
+}
+
+// Write one record straight away, for when there is no writer thread
+static void record_write_direct(const struct log_record *record) {
+	char line[LOG_PREFIX_MAX + LOG_LINE_MAX + 1];
+	size_t len = format_prefix(line, record->time_ns, record->kind);
+	memcpy(line + len, record->text, record->len);
+	len += record->len;
+	line[len++] = '\n';
+	write_all(kind_fd(record->kind), line, len);
+}
+
+// This thread's ring, set up on its first line. NULL if it can't be allocated.
+static struct log_ring *ring_get(void) {
+	struct log_ring *ring = thread_ring;
+	if (__builtin_expect(ring != NULL, 1)) {
+		return ring;
+	}
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	struct log_ring *head = atomic_load_explicit(&rings, memory_order_relaxed);
+	do {
+		ring->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&rings, &head, ring, memory_order_release,
+													memory_order_relaxed));
+	thread_ring = ring;
+	return ring;
+}
+
+static void queue_line(int kind, const char *fmt, va_list ap) {
+	int saved_errno = errno;
+	struct log_ring *ring = atomic_load_explicit(&writer_running, memory_order_acquire) ? ring_get() : NULL;
+	if (ring == NULL) {
+		struct log_record record;
+		record_format(&record, kind, saved_errno, fmt, ap);
+		record_write_direct(&record);
+		errno = saved_errno;
+		return;
+	}
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+		atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+							  memory_order_relaxed);
+		return;
+	}
+	record_format(&ring->records[head % LOG_RING_SLOTS], kind, saved_errno, fmt, ap);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	errno = saved_errno;
+}
+
+void log_write(enum log_level level, const char *fmt, ...) {
+	if (level < min_level) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	queue_line((int)level, fmt, ap);
+	va_end(ap);
+}
+
+// Goes through queue_line() like any other line
+static void access_line(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void access_line(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	queue_line(LOG_ACCESS, fmt, ap);
+	va_end(ap);
+}
+
+void log_access(const char *method, size_t method_len, const char *target, size_t target_len, int status,
+				uint64_t latency_ns) {
+	access_line("%.*s %.*s %d %lluus", (int)method_len, method, (int)target_len, target, status,
+				(unsigned long long)((latency_ns + 500) / 1000));
+}
+
+unsigned long long log_dropped(void) {
+	unsigned long long dropped = 0;
+	for (struct log_ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL;
+		 ring = ring->next) {
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	}
+	return dropped;
+}
+
+// --- Writer thread ---
+
+// Lines gathered for one file descriptor
+struct batch {
+	int fd;
+	size_t len;
+	char data[LOG_BATCH_SIZE];
+};
+
+static void batch_flush(struct batch *batch) {
+	write_all(batch->fd, batch->data, batch->len);
+	batch->len = 0;
+}
+
+static void batch_append(struct batch *batch, const struct log_record *record) {
+	if (batch->len + LOG_PREFIX_MAX + record->len + 1 > sizeof(batch->data)) {
+		batch_flush(batch);
+	}
+	batch->len += format_prefix(batch->data + batch->len, record->time_ns, record->kind);
+	memcpy(batch->data + batch->len, record->text, record->len);
+	batch->len += record->len;
+	batch->data[batch->len++] = '\n';
+}
+
+// Move every waiting line into the batches. Returns how many there were.
+static size_t drain(struct batch *out, struct batch *err) {
+	size_t drained = 0;
+	for (struct log_ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL;
+		 ring = ring->next) {
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		for (; tail != head; tail++) {
+			const struct log_record *record = &ring->records[tail % LOG_RING_SLOTS];
+			batch_append(kind_fd(record->kind) == STDERR_FILENO ? err : out, record);
+			drained++;
+		}
+		// The records are copied out, so their slots can be reused
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	return drained;
+}
+
+static void *writer_main(void *arg) {
+	(void)arg;
+	static struct batch out = { .fd = STDOUT_FILENO };
+	static struct batch err = { .fd = STDERR_FILENO };
+	unsigned long long dropped_reported = 0;
+	uint64_t reported_at = 0;
+	long sleep_ns = LOG_SLEEP_MIN_NS;
+	while (1) {
+		int stopping = atomic_load_explicit(&writer_stop, memory_order_acquire);
+		size_t drained = drain(&out, &err);
+		unsigned long long dropped = log_dropped();
+		uint64_t now = realtime_ns();
+		if (dropped != dropped_reported && (now - reported_at >= LOG_DROP_REPORT_NS || stopping)) {
+			struct log_record record = { .time_ns = now, .kind = LOG_WARN };
+			int len = snprintf(record.text, sizeof(record.text), "%llu log lines dropped, the writer fell behind",
+							   dropped - dropped_reported);
+			record.len = (uint8_t)(len > 0 && len < (int)sizeof(record.text) ? len : 0);
+			batch_append(&err, &record);
+			dropped_reported = dropped;
+			reported_at = now;
+		}
+		batch_flush(&out);
+		batch_flush(&err);
+		if (drained > 0) {
+			sleep_ns = LOG_SLEEP_MIN_NS;
+			continue;
+		}
+		if (stopping) {
+			return NULL;
+		}
+		struct timespec idle = { 0, sleep_ns };
+		nanosleep(&idle, NULL);
+		if (sleep_ns < LOG_SLEEP_MAX_NS) {
+			sleep_ns *= 2;
+		}
+	}
+}
+
+// Registered with atexit(): write out what is still queued
+static void log_shutdown(void) {
+	if (!atomic_load_explicit(&writer_running, memory_order_acquire)) {
+		return;
+	}
+	atomic_store_explicit(&writer_stop, 1, memory_order_release);
+	pthread_join(writer_thread, NULL);
+	// Anything logged from here on is written directly
+	atomic_store_explicit(&writer_running, 0, memory_order_release);
+}
+
+int log_init(enum log_level level) {
+	min_level = level;
+	int result = pthread_create(&writer_thread, NULL, writer_main, NULL);
+	if (result != 0) {
+		errno = result;
+		log_error("pthread_create failed for the log writer: %m");
+		return -1;
+	}
+	atomic_store_explicit(&writer_running, 1, memory_order_release);
+	atexit(log_shutdown);
+	return 0;
+}
+
+int log_parse_level(const char *name, enum log_level *level) {
+	static const char *const names[] = { [LOG_DEBUG] = "debug", [LOG_INFO] = "info", [LOG_WARN] = "warn",
+										 [LOG_ERROR] = "error" };
+	for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*level = (enum log_level)i;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,48 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Logging that never blocks the thread calling it. Each thread formats its
+// lines into a ring of its own, which a background thread drains in batches
+// with one write() per batch: debug, info and access lines to stdout,
+// warnings and errors to stderr, each prefixed with the time it was logged.
+// A thread whose ring is full drops the line and counts it rather than wait.
+
+enum log_level {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR,
+};
+
+// Lines each thread can have waiting for the writer
+#define LOG_RING_SLOTS 2048
+// Longest line kept; longer ones are cut short
+#define LOG_LINE_MAX 240
+
+// Start the writer thread and drop lines below `level` from now on. Until
+// then (and after exit() has flushed what was queued) lines are written
+// directly. Returns 0 on success, -1 on error.
+int log_init(enum log_level level);
+
+// Parse "debug", "info", "warn" or "error". Returns 0 on success.
+int log_parse_level(const char *name, enum log_level *level);
+
+// printf-style; "%m" is the message for the current errno, as with perror()
+void log_write(enum log_level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+// One access-log line for a request answered with `status` after `latency_ns`
+void log_access(const char *method, size_t method_len, const char *target, size_t target_len, int status,
+				uint64_t latency_ns);
+
+// Lines dropped so far because a ring was full
+unsigned long long log_dropped(void);
+
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "log.h"
+
+// Status codes the server sends; anything else is counted under the last slot
+static const int known_statuses[] = { 200, 201, 206, 304, 400, 404, 405, 413, 414, 416, 431, 500, 503, 505 };
+#define METRICS_STATUSES (sizeof(known_statuses) / sizeof(known_statuses[0]) + 1)
+
+// Latency buckets are log-linear in microseconds: two per power of two, with
+// upper bounds 1, 2, 3, 4, 6, 8, 12, 16, ... up to 2^24us (about 17s), then
+// one for everything slower
+#define METRICS_BUCKETS 49
+
+static const char *const route_names[METRICS_ROUTES] = {
+	[METRICS_ROUTE_ROOT] = "root",
+	[METRICS_ROUTE_ECHO] = "echo",
+	[METRICS_ROUTE_USER_AGENT] = "user_agent",
+	[METRICS_ROUTE_FILES_GET] = "files_get",
+	[METRICS_ROUTE_FILES_POST] = "files_post",
+	[METRICS_ROUTE_METRICS] = "metrics",
+	[METRICS_ROUTE_OTHER] = "other",
+};
+
+// One thread's counters. Shards are never freed; the aligned size keeps two
+// threads' counters off the same cache line.
+struct metrics_shard {
+	_Alignas(64) _Atomic uint64_t requests[METRICS_ROUTES][METRICS_STATUSES];
+	_Atomic uint64_t latency[METRICS_ROUTES][METRICS_BUCKETS];
+	_Atomic uint64_t latency_sum_ns[METRICS_ROUTES];
+	_Atomic uint64_t bytes_received;
+	_Atomic uint64_t bytes_sent;
+	_Atomic uint64_t connections_opened;
+	_Atomic uint64_t connections_closed;
+	_Atomic uint64_t accept_errors;
+	_Atomic uint64_t connections_rejected;
+	_Atomic uint64_t connection_timeouts;
+	_Atomic uint64_t tls_handshakes;
+	_Atomic uint64_t tls_resumed;
+	_Atomic uint64_t tls_kernel;
+	_Atomic uint64_t tls_handshake_failures;
+	_Atomic uint64_t http2_connections;
+	_Atomic uint64_t http2_streams;
+	_Atomic uint64_t durable_groups;
+	_Atomic uint64_t durable_uploads;
+	struct metrics_shard *next;
+};
+
+// Every shard, newest first
+static _Atomic(struct metrics_shard *) shards;
+static _Thread_local struct metrics_shard *thread_shard;
+
+// A fallback for a thread whose shard couldn't be allocated. Threads sharing
+// it may lose the odd update to a race, nothing worse.
+static struct metrics_shard shared_shard;
+static atomic_flag shared_shard_listed = ATOMIC_FLAG_INIT;
+
+static void shard_publish(struct metrics_shard *shard) {
+	struct metrics_shard *head = atomic_load_explicit(&shards, memory_order_relaxed);
+	do {
+		shard->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&shards, &head, shard, memory_order_release,
+													memory_order_relaxed));
+}
+
+// This thread's shard, set up on its first use
+static struct metrics_shard *shard_get(void) {
+	struct metrics_shard *shard = thread_shard;
+	if (__builtin_expect(shard != NULL, 1)) {
+		return shard;
+	}
+	shard = aligned_alloc(_Alignof(struct metrics_shard), sizeof(*shard));
+	if (shard != NULL) {
+		memset(shard, 0, sizeof(*shard));
+		shard_publish(shard);
+	} else {
+		log_error("Allocation failed for metrics, sharing counters: %m");
+		shard = &shared_shard;
+		if (!atomic_flag_test_and_set(&shared_shard_listed)) {
+			shard_publish(shard);
+		}
+	}
+	thread_shard = shard;
+	return shard;
+}
+
+// Only the owning thread writes a counter, so a relaxed load and store
+// suffice; they compile to plain moves but keep concurrent reads defined
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+						  memory_order_relaxed);
+}
+
+static size_t status_slot(int status) {
+	for (size_t i = 0; i < METRICS_STATUSES - 1; i++) {
+		if (known_statuses[i] == status) {
+			return i;
+		}
+	}
+	return METRICS_STATUSES - 1;
+}
+
+// Bucket whose upper bound is the first at or above `us`
+static int latency_bucket(uint64_t us) {
+	if (us <= 2) {
+		return us == 0 ? 0 : (int)us - 1;
+	}
+	// Bucket 2k covers (2^k, 3 * 2^(k-1)], bucket 2k + 1 up to 2^(k+1)
+	uint64_t below = us - 1;
+	int k = 63 - __builtin_clzll(below);
+	int bucket = 2 * k + (int)((below >> (k - 1)) & 1);
+	return bucket < METRICS_BUCKETS - 1 ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Upper bound of a latency bucket in microseconds (not for the last one)
+static uint64_t bucket_bound(int bucket) {
+	if (bucket < 2) {
+		return (uint64_t)bucket + 1;
+	}
+	int k = bucket / 2;
+	return bucket % 2 == 0 ? (uint64_t)3 << (k - 1) : (uint64_t)1 << (k + 1);
+}
+
+uint64_t metrics_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_request(enum metrics_route route, int status, uint64_t latency_ns) {
+	struct metrics_shard *shard = shard_get();
+	counter_add(&shard->requests[route][status_slot(status)], 1);
+	counter_add(&shard->latency[route][latency_bucket((latency_ns + 999) / 1000)], 1);
+	counter_add(&shard->latency_sum_ns[route], latency_ns);
+}
+
+void metrics_bytes_received(size_t len) {
+	counter_add(&shard_get()->bytes_received, len);
+}
+
+void metrics_bytes_sent(size_t len) {
+	counter_add(&shard_get()->bytes_sent, len);
+}
+
+void metrics_connection_opened(void) {
+	counter_add(&shard_get()->connections_opened, 1);
+}
+
+void metrics_connection_closed(void) {
+	counter_add(&shard_get()->connections_closed, 1);
+}
+
+void metrics_accept_error(void) {
+	counter_add(&shard_get()->accept_errors, 1);
+}
+
+void metrics_connection_rejected(void) {
+	counter_add(&shard_get()->connections_rejected, 1);
+}
+
+void metrics_connection_timeout(void) {
+	counter_add(&shard_get()->connection_timeouts, 1);
+}
+
+void metrics_tls_handshake(int resumed, int kernel) {
+	struct metrics_shard *shard = shard_get();
+	counter_add(&shard->tls_handshakes, 1);
+	if (resumed) {
+		counter_add(&shard->tls_resumed, 1);
+	}
+	if (kernel) {
+		counter_add(&shard->tls_kernel, 1);
+	}
+}
+
+void metrics_tls_handshake_failed(void) {
+	counter_add(&shard_get()->tls_handshake_failures, 1);
+}
+
+void metrics_http2_connection(void) {
+	counter_add(&shard_get()->http2_connections, 1);
+}
+
+void metrics_http2_stream(void) {
+	counter_add(&shard_get()->http2_streams, 1);
+}
+
+void metrics_durable_group(size_t uploads) {
+	struct metrics_shard *shard = shard_get();
+	counter_add(&shard->durable_groups, 1);
+	counter_add(&shard->durable_uploads, uploads);
+}
+
+// --- Exposition ---
+
+// The shards summed up
+struct metrics_totals {
+	uint64_t requests[METRICS_ROUTES][METRICS_STATUSES];
+	uint64_t latency[METRICS_ROUTES][METRICS_BUCKETS];
+	uint64_t latency_sum_ns[METRICS_ROUTES];
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
+	uint64_t connections_opened;
+	uint64_t connections_closed;
+	uint64_t accept_errors;
+	uint64_t connections_rejected;
+	uint64_t connection_timeouts;
+	uint64_t tls_handshakes;
+	uint64_t tls_resumed;
+	uint64_t tls_kernel;
+	uint64_t tls_handshake_failures;
+	uint64_t http2_connections;
+	uint64_t http2_streams;
+	uint64_t durable_groups;
+	uint64_t durable_uploads;
+};
+
+static uint64_t load(_Atomic uint64_t *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void totals_collect(struct metrics_totals *totals) {
+	memset(totals, 0, sizeof(*totals));
+	for (struct metrics_shard *shard = atomic_load_explicit(&shards, memory_order_acquire); shard != NULL;
+		 shard = shard->next) {
+		for (int route = 0; route < METRICS_ROUTES; route++) {
+			for (size_t i = 0; i < METRICS_STATUSES; i++) {
+				totals->requests[route][i] += load(&shard->requests[route][i]);
+			}
+			for (int i = 0; i < METRICS_BUCKETS; i++) {
+				totals->latency[route][i] += load(&shard->latency[route][i]);
+			}
+			totals->latency_sum_ns[route] += load(&shard->latency_sum_ns[route]);
+		}
+		totals->bytes_received += load(&shard->bytes_received);
+		totals->bytes_sent += load(&shard->bytes_sent);
+		totals->connections_opened += load(&shard->connections_opened);
+		totals->connections_closed += load(&shard->connections_closed);
+		totals->accept_errors += load(&shard->accept_errors);
+		totals->connections_rejected += load(&shard->connections_rejected);
+		totals->connection_timeouts += load(&shard->connection_timeouts);
+		totals->tls_handshakes += load(&shard->tls_handshakes);
+		totals->tls_resumed += load(&shard->tls_resumed);
+		totals->tls_kernel += load(&shard->tls_kernel);
+		totals->tls_handshake_failures += load(&shard->tls_handshake_failures);
+		totals->http2_connections += load(&shard->http2_connections);
+		totals->http2_streams += load(&shard->http2_streams);
+		totals->durable_groups += load(&shard->durable_groups);
+		totals->durable_uploads += load(&shard->durable_uploads);
+	}
+}
+
+// Output position for metrics_format(), counting past the end of the buffer
+struct text {
+	char *buf;
+	size_t cap;
+	size_t len;
+};
+
+static void text_printf(struct text *text, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t room = text->len < text->cap ? text->cap - text->len : 0;
+	int written = vsnprintf(room > 0 ? text->buf + text->len : NULL, room, fmt, ap);
+	va_end(ap);
+	if (written > 0) {
+		text->len += (size_t)written;
+	}
+}
+
+static void text_counter(struct text *text, const char *name, const char *help, uint64_t value) {
+	text_printf(text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+				(unsigned long long)value);
+}
+
+size_t metrics_format(char *buf, size_t cap) {
+	struct metrics_totals totals;
+	totals_collect(&totals);
+	struct text text = { buf, cap, 0 };
+	if (cap > 0) {
+		buf[0] = '\0';
+	}
+
+	text_printf(&text, "# HELP http_requests_total Requests answered, by route and status code.\n"
+					   "# TYPE http_requests_total counter\n");
+	for (int route = 0; route < METRICS_ROUTES; route++) {
+		for (size_t i = 0; i < METRICS_STATUSES; i++) {
+			if (totals.requests[route][i] == 0) {
+				continue;
+			}
+			char code[8];
+			if (i < METRICS_STATUSES - 1) {
+				snprintf(code, sizeof(code), "%d", known_statuses[i]);
+			} else {
+				snprintf(code, sizeof(code), "other");
+			}
+			text_printf(&text, "http_requests_total{route=\"%s\",code=\"%s\"} %llu\n", route_names[route], code,
+						(unsigned long long)totals.requests[route][i]);
+		}
+	}
+
+	text_printf(&text, "# HELP http_request_duration_seconds Time from a request's first byte arriving to its "
+					   "response being queued.\n"
+					   "# TYPE http_request_duration_seconds histogram\n");
+	for (int route = 0; route < METRICS_ROUTES; route++) {
+		uint64_t count = 0;
+		for (int i = 0; i < METRICS_BUCKETS; i++) {
+			count += totals.latency[route][i];
+		}
+		if (count == 0) {
+			continue; // Routes appear once they have been used
+		}
+		uint64_t cumulative = 0;
+		for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+			cumulative += totals.latency[route][i];
+			text_printf(&text, "http_request_duration_seconds_bucket{route=\"%s\",le=\"%.9g\"} %llu\n",
+						route_names[route], (double)bucket_bound(i) / 1e6, (unsigned long long)cumulative);
+		}
+		text_printf(&text,
+					"http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n"
+					"http_request_duration_seconds_sum{route=\"%s\"} %.9f\n"
+					"http_request_duration_seconds_count{route=\"%s\"} %llu\n",
+					route_names[route], (unsigned long long)count, route_names[route],
+					(double)totals.latency_sum_ns[route] / 1e9, route_names[route], (unsigned long long)count);
+	}
+
+	text_counter(&text, "http_received_bytes_total", "Bytes received from clients.", totals.bytes_received);
+	text_counter(&text, "http_sent_bytes_total", "Bytes sent to clients.", totals.bytes_sent);
+	text_counter(&text, "http_connections_total", "Connections accepted.", totals.connections_opened);
+	// Shards are read one after the other, so a connection opened and
+	// closed meanwhile may only have its close counted
+	uint64_t active = totals.connections_opened > totals.connections_closed
+						  ? totals.connections_opened - totals.connections_closed
+						  : 0;
+	text_printf(&text, "# HELP http_connections_active Connections currently open.\n"
+					   "# TYPE http_connections_active gauge\n"
+					   "http_connections_active %llu\n",
+				(unsigned long long)active);
+	text_counter(&text, "http_accept_errors_total", "Failed accept() calls.", totals.accept_errors);
+	text_counter(&text, "http_connections_rejected_total", "Connections turned away with 503 at --max-connections.",
+				 totals.connections_rejected);
+	text_counter(&text, "http_connection_timeouts_total",
+				 "Connections closed for exceeding a header, body, write or idle timeout.",
+				 totals.connection_timeouts);
+	text_counter(&text, "http_tls_handshakes_total", "Completed TLS handshakes.", totals.tls_handshakes);
+	text_counter(&text, "http_tls_resumed_total", "TLS handshakes that resumed an earlier session.",
+				 totals.tls_resumed);
+	text_counter(&text, "http_tls_ktls_total", "TLS connections whose sends were handed to kernel TLS.",
+				 totals.tls_kernel);
+	text_counter(&text, "http_tls_handshake_failures_total", "TLS handshakes that failed or were abandoned.",
+				 totals.tls_handshake_failures);
+	text_counter(&text, "http_http2_connections_total", "Connections switched to HTTP/2.",
+				 totals.http2_connections);
+	text_counter(&text, "http_http2_streams_total", "HTTP/2 streams opened for requests.", totals.http2_streams);
+	text_counter(&text, "http_durable_commits_total", "Groups of uploads synced to disk together.",
+				 totals.durable_groups);
+	text_counter(&text, "http_durable_uploads_total", "Uploads synced to disk before being answered.",
+				 totals.durable_uploads);
+	text_counter(&text, "http_log_dropped_total", "Log lines dropped because the writer fell behind.",
+				 log_dropped());
+	return text.len;
+}
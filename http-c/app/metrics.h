@@ -0,0 +1,53 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Server counters and request latency histograms. Every thread that records
+// gets its own cache-line-aligned shard, which only it writes (a plain load
+// and store, no read-modify-write), so recording never contends with other
+// workers. metrics_format() sums the shards when someone asks.
+
+// What a request was routed to, for breaking the counters down
+enum metrics_route {
+	METRICS_ROUTE_ROOT,       // GET /
+	METRICS_ROUTE_ECHO,       // /echo/
+	METRICS_ROUTE_USER_AGENT, // /user-agent
+	METRICS_ROUTE_FILES_GET,  // GET /files/
+	METRICS_ROUTE_FILES_POST, // POST /files/
+	METRICS_ROUTE_METRICS,    // GET /metrics
+	METRICS_ROUTE_OTHER,      // unknown paths and requests rejected by the parser
+	METRICS_ROUTES,
+};
+
+// Monotonic clock in nanoseconds, for request latencies
+uint64_t metrics_now(void);
+
+// A request answered with `status`, `latency_ns` after its first byte was seen
+void metrics_request(enum metrics_route route, int status, uint64_t latency_ns);
+
+void metrics_bytes_received(size_t len);
+void metrics_bytes_sent(size_t len);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_accept_error(void);
+void metrics_connection_rejected(void);
+void metrics_connection_timeout(void);
+// A TLS handshake completed; `resumed` if it resumed a session, `kernel` if
+// kTLS took over the sending side
+void metrics_tls_handshake(int resumed, int kernel);
+void metrics_tls_handshake_failed(void);
+// A connection switched to HTTP/2, and a stream it opened for a request
+void metrics_http2_connection(void);
+void metrics_http2_stream(void);
+// The commit thread synced a group of `uploads` uploads (--durable-uploads)
+void metrics_durable_group(size_t uploads);
+
+// Write everything recorded so far in the Prometheus text exposition format.
+// Like snprintf(): writes at most `cap` bytes including a terminating NUL
+// and returns the length of the whole text, so a result >= `cap` means it
+// was cut short.
+size_t metrics_format(char *buf, size_t cap);
+
+#endif
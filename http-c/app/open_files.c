@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "open_files.h"
+#include "log.h"
+
+// Independent locks, so workers opening different files rarely meet
+#define OPEN_FILES_SHARDS 16
+// Hash buckets per shard (power of two)
+#define OPEN_FILES_BUCKETS 256
+// How long a cached file is trusted to be what its name refers to before
+// the name is resolved again. Uploads and the file cache's inotify watch drop
+// entries right away, and a deleted or replaced file is noticed on the next
+// hit; this bounds how long a file created, or renamed away, behind the
+// server's back can go unseen.
+#define OPEN_FILE_VALID_MS 1000
+
+struct open_files_shard {
+	pthread_mutex_t lock;
+	size_t count;
+	// Bumped on every invalidation, so a file opened before one isn't cached
+	unsigned long generation;
+	struct open_file *buckets[OPEN_FILES_BUCKETS];
+	struct open_file *lru_head; // most recently used
+	struct open_file *lru_tail;
+} __attribute__((aligned(64)));
+
+static struct {
+	int dir_fd;
+	int have_openat2; // else names are checked for ".." before openat()
+	size_t shard_capacity; // 0 = nothing is cached
+	struct open_files_shard shards[OPEN_FILES_SHARDS];
+} files = { .dir_fd = -1 };
+
+// FNV-1a hash of a name; the low bits pick the shard, the next the bucket
+static uint64_t hash_name(const char *name) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static struct open_files_shard *shard_of(uint64_t hash) {
+	return &files.shards[hash & (OPEN_FILES_SHARDS - 1)];
+}
+
+static struct open_file **bucket_of(struct open_files_shard *shard, uint64_t hash) {
+	return &shard->buckets[(hash >> 4) & (OPEN_FILES_BUCKETS - 1)];
+}
+
+static uint64_t now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+int open_files_dir_fd(void) {
+	return files.dir_fd;
+}
+
+// Whether `name` is absolute or has a ".." component
+static int name_escapes(const char *name) {
+	if (name[0] == '/') {
+		return 1;
+	}
+	for (const char *p = name; *p;) {
+		const char *end = strchrnul(p, '/');
+		if (end - p == 2 && p[0] == '.' && p[1] == '.') {
+			return 1;
+		}
+		p = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+int open_beneath(const char *name, int flags, mode_t mode) {
+	if (!files.have_openat2) {
+		// Symlinks are still followed wherever they lead
+		if (name_escapes(name)) {
+			errno = EXDEV;
+			return -1;
+		}
+		return openat(files.dir_fd, name, flags, mode);
+	}
+	struct open_how how = {
+		.flags = (uint64_t)flags,
+		.mode = (flags & O_CREAT) ? mode : 0,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+	};
+	while (1) {
+		int fd = (int)syscall(SYS_openat2, files.dir_fd, name, &how, sizeof(how));
+		// EAGAIN: a concurrent rename made the kernel give up on checking
+		// the walk stayed beneath the directory
+		if (fd >= 0 || (errno != EINTR && errno != EAGAIN)) {
+			return fd;
+		}
+	}
+}
+
+int stat_beneath(const char *name, struct stat *file_stat) {
+	int fd = open_beneath(name, O_PATH | O_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	int result = fstat(fd, file_stat);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return result;
+}
+
+int open_files_enabled(void) {
+	return files.shard_capacity > 0;
+}
+
+void open_file_release(struct open_file *file) {
+	if (__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (file->fd >= 0) {
+			close(file->fd);
+		}
+		free(file->name);
+		free(file);
+	}
+}
+
+static struct open_file *lookup_locked(struct open_files_shard *shard, uint64_t hash, const char *name) {
+	struct open_file *file = *bucket_of(shard, hash);
+	while (file != NULL && strcmp(file->name, name) != 0) {
+		file = file->hash_next;
+	}
+	return file;
+}
+
+static void lru_unlink_locked(struct open_files_shard *shard, struct open_file *file) {
+	if (file->lru_prev != NULL) {
+		file->lru_prev->lru_next = file->lru_next;
+	} else {
+		shard->lru_head = file->lru_next;
+	}
+	if (file->lru_next != NULL) {
+		file->lru_next->lru_prev = file->lru_prev;
+	} else {
+		shard->lru_tail = file->lru_prev;
+	}
+}
+
+static void lru_push_locked(struct open_files_shard *shard, struct open_file *file) {
+	file->lru_prev = NULL;
+	file->lru_next = shard->lru_head;
+	if (shard->lru_head != NULL) {
+		shard->lru_head->lru_prev = file;
+	} else {
+		shard->lru_tail = file;
+	}
+	shard->lru_head = file;
+}
+
+// Unlink a file from its shard and drop the cache's reference. Caller holds
+// the shard lock.
+static void remove_locked(struct open_files_shard *shard, struct open_file *file) {
+	struct open_file **link = bucket_of(shard, hash_name(file->name));
+	while (*link != file) {
+		link = &(*link)->hash_next;
+	}
+	*link = file->hash_next;
+	lru_unlink_locked(shard, file);
+	shard->count--;
+	open_file_release(file);
+}
+
+// Cache a freshly opened file unless `name` was invalidated since
+// `generation` was read. Takes a reference of its own.
+static void insert(struct open_file *file, uint64_t hash, unsigned long generation) {
+	struct open_files_shard *shard = shard_of(hash);
+	pthread_mutex_lock(&shard->lock);
+	if (shard->generation == generation) {
+		struct open_file *old = lookup_locked(shard, hash, file->name);
+		if (old != NULL) {
+			remove_locked(shard, old); // Someone opened it at the same time
+		}
+		struct open_file **bucket = bucket_of(shard, hash);
+		file->hash_next = *bucket;
+		*bucket = file;
+		lru_push_locked(shard, file);
+		__atomic_add_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL);
+		if (++shard->count > files.shard_capacity) {
+			remove_locked(shard, shard->lru_tail);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+// Remember that `name` doesn't exist, so asking again (say for a foo.gz
+// that was never there) doesn't cost a path walk either
+static void cache_missing(const char *name, uint64_t hash, uint64_t now, unsigned long generation) {
+	struct open_file *file = calloc(1, sizeof(*file));
+	if (file == NULL || (file->name = strdup(name)) == NULL) {
+		free(file);
+		return;
+	}
+	file->fd = -1;
+	file->resolved_ms = now;
+	file->refcount = 1;
+	insert(file, hash, generation);
+	open_file_release(file);
+}
+
+// Whether a cached file still is what its name refers to, as far as an
+// fstat() can tell without a path walk: it hasn't been deleted, or replaced
+// by a rename, since it was opened. Fills `file_stat`, so a file written in
+// place is served with its new size and mtime.
+static int still_current(const struct open_file *file, struct stat *file_stat) {
+	return fstat(file->fd, file_stat) == 0 && file_stat->st_nlink > 0;
+}
+
+struct open_file *open_file_get(const char *name, struct stat *file_stat) {
+	uint64_t hash = hash_name(name);
+	struct open_files_shard *shard = shard_of(hash);
+	uint64_t now = now_ms();
+	unsigned long generation = 0;
+	if (files.shard_capacity > 0) {
+		pthread_mutex_lock(&shard->lock);
+		struct open_file *file = lookup_locked(shard, hash, name);
+		if (file != NULL && now - file->resolved_ms < OPEN_FILE_VALID_MS) {
+			if (file->fd < 0) {
+				pthread_mutex_unlock(&shard->lock);
+				errno = ENOENT;
+				return NULL;
+			}
+			__atomic_add_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL);
+			if (shard->lru_head != file) {
+				lru_unlink_locked(shard, file);
+				lru_push_locked(shard, file);
+			}
+			pthread_mutex_unlock(&shard->lock);
+			if (still_current(file, file_stat)) {
+				return file;
+			}
+			pthread_mutex_lock(&shard->lock);
+			if (lookup_locked(shard, hash, name) == file) {
+				remove_locked(shard, file);
+			}
+			open_file_release(file);
+		} else if (file != NULL) {
+			// Due for a check: resolve the name again and cache what it is now
+			remove_locked(shard, file);
+		}
+		generation = shard->generation;
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	// O_NONBLOCK: opening a FIFO must not wait for a writer
+	int fd = open_beneath(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY, 0);
+	if (fd < 0) {
+		if (errno == ENOENT && files.shard_capacity > 0) {
+			cache_missing(name, hash, now, generation);
+			errno = ENOENT;
+		}
+		return NULL;
+	}
+	struct open_file *file = calloc(1, sizeof(*file));
+	if (file == NULL || (file->name = strdup(name)) == NULL || fstat(fd, file_stat) != 0) {
+		int saved_errno = file == NULL || file->name == NULL ? ENOMEM : errno;
+		if (file != NULL) {
+			free(file->name);
+			free(file);
+		}
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	file->fd = fd;
+	file->resolved_ms = now;
+	file->refcount = 1;
+	if (files.shard_capacity > 0 && S_ISREG(file_stat->st_mode)) {
+		insert(file, hash, generation);
+	}
+	return file;
+}
+
+void open_files_invalidate(const char *name) {
+	if (files.shard_capacity == 0) {
+		return;
+	}
+	uint64_t hash = hash_name(name);
+	struct open_files_shard *shard = shard_of(hash);
+	pthread_mutex_lock(&shard->lock);
+	shard->generation++;
+	struct open_file *file = lookup_locked(shard, hash, name);
+	if (file != NULL) {
+		remove_locked(shard, file);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void open_files_invalidate_all(void) {
+	if (files.shard_capacity == 0) {
+		return;
+	}
+	for (int i = 0; i < OPEN_FILES_SHARDS; i++) {
+		struct open_files_shard *shard = &files.shards[i];
+		pthread_mutex_lock(&shard->lock);
+		shard->generation++;
+		while (shard->lru_head != NULL) {
+			remove_locked(shard, shard->lru_head);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+int open_files_init(const char *directory, size_t capacity) {
+	files.dir_fd = open(directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (files.dir_fd < 0) {
+		log_error("Cannot open directory %s: %m", directory);
+		return -1;
+	}
+	struct open_how how = { .flags = O_PATH | O_CLOEXEC, .resolve = RESOLVE_BENEATH };
+	int probe = (int)syscall(SYS_openat2, files.dir_fd, ".", &how, sizeof(how));
+	if (probe >= 0) {
+		close(probe);
+		files.have_openat2 = 1;
+	} else {
+		log_warn("openat2() unavailable (%m); refusing names with \"..\" instead, symlinks are followed");
+	}
+	for (int i = 0; i < OPEN_FILES_SHARDS; i++) {
+		pthread_mutex_init(&files.shards[i].lock, NULL);
+	}
+	files.shard_capacity = (capacity + OPEN_FILES_SHARDS - 1) / OPEN_FILES_SHARDS;
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef OPEN_FILES_H
+#define OPEN_FILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Files under the served directory. The directory is opened once at startup
+// and every name is resolved relative to it with openat2(RESOLVE_BENEATH),
+// so the kernel walks only the name itself, and a name that would lead out
+// of the directory (through "..", an absolute symlink, ...) fails with EXDEV.
+//
+// Regular files that were opened are kept open in a cache shared by all
+// workers, so a repeated request costs a hash lookup and an fstat() instead
+// of a path walk, an open() and a stat(); names found missing are remembered
+// too. The fstat() keeps the size and mtime current for a file written in
+// place and tells when it was deleted or renamed over. Every fd is only read with pread() or sendfile() from an
+// explicit offset, so any number of connections can send from it at once.
+
+// A cached open file. Reference counted like file_cache entries: a
+// connection still sending from it keeps the fd open after it has been
+// dropped from the cache.
+struct open_file {
+	int fd;               // -1 for a name remembered as missing
+	char *name;           // relative to the served directory
+	uint64_t resolved_ms; // when `name` was last resolved to this file
+	int refcount;         // updated atomically
+	struct open_file *hash_next;
+	struct open_file *lru_prev;
+	struct open_file *lru_next;
+};
+
+// Open `directory` and keep up to `capacity` open files cached (0 disables
+// the cache; names are still resolved beneath the directory). Returns 0 on
+// success, -1 on error.
+int open_files_init(const char *directory, size_t capacity);
+
+// The served directory, opened with O_PATH
+int open_files_dir_fd(void);
+
+// openat() `name` relative to the served directory, refusing to leave it.
+// Returns the fd, or -1 with errno set (EXDEV for a name leading outside).
+int open_beneath(const char *name, int flags, mode_t mode);
+
+// stat() `name` beneath the served directory without opening it for reading
+// (it is resolved with O_PATH). Returns 0, or -1 with errno set as for
+// open_beneath().
+int stat_beneath(const char *name, struct stat *file_stat);
+
+// Whether open files are cached (a capacity above 0 was given)
+int open_files_enabled(void);
+
+// Open `name` for reading, from the cache if possible, and store its current
+// stat() in `file_stat`. Returns a referenced file (release it with
+// open_file_release()) or NULL with errno set. Files other than regular
+// ones are returned as well, but never cached.
+struct open_file *open_file_get(const char *name, struct stat *file_stat);
+
+// Release a reference obtained from open_file_get()
+void open_file_release(struct open_file *file);
+
+// Forget the open file for `name`, e.g. because it was replaced; the next
+// open_file_get() resolves the name again
+void open_files_invalidate(const char *name);
+
+// Forget every open file
+void open_files_invalidate_all(void);
+
+#endif
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "log.h"
+
+// Address space reserved for each class; only what is used becomes resident
+#define POOL_CLASS_BYTES ((size_t)64 * 1024 * 1024)
+
+// Each class is a lock-free stack of free buffer indices. The head packs a
+// generation count above the top index (plus one; 0 means empty), so a pop
+// that raced with another thread popping and pushing back the same buffer
+// fails its compare-and-swap instead of installing a stale link. The links
+// live outside the buffers and the reservation is never unmapped, so nothing
+// a racing pop reads can go away under it.
+struct pool_class {
+	_Alignas(64) _Atomic uint64_t head;
+	atomic_uint carved;     // buffers handed out from the reservation so far
+	unsigned capacity;      // buffers that fit in the reservation
+	size_t size;
+	char *base;
+	_Atomic uint32_t *next; // free list links by index, plus one
+	atomic_ullong reused;
+	atomic_ullong fallback;
+};
+
+static struct pool_class classes[POOL_CLASSES];
+// All the reservations, back to back
+static char *region;
+static atomic_ullong oversized;
+
+static int class_index(size_t size) {
+	if (size <= POOL_MIN_SIZE) {
+		return 0;
+	}
+	return 64 - __builtin_clzll((unsigned long long)size - 1) - 10;
+}
+
+int pool_init(void) {
+	if (region != NULL) {
+		return 0;
+	}
+	void *reserved = mmap(NULL, POOL_CLASSES * POOL_CLASS_BYTES, PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserved == MAP_FAILED) {
+		log_error("mmap failed for buffer pool: %m");
+		return -1;
+	}
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		struct pool_class *class = &classes[i];
+		class->size = (size_t)POOL_MIN_SIZE << i;
+		class->capacity = (unsigned)(POOL_CLASS_BYTES / class->size);
+		class->base = (char *)reserved + (size_t)i * POOL_CLASS_BYTES;
+		class->next = calloc(class->capacity, sizeof(*class->next));
+		if (class->next == NULL) {
+			log_error("Calloc failed for buffer pool: %m");
+			for (int j = 0; j < i; j++) {
+				free(classes[j].next);
+			}
+			munmap(reserved, POOL_CLASSES * POOL_CLASS_BYTES);
+			return -1;
+		}
+	}
+	region = reserved;
+	return 0;
+}
+
+size_t pool_size(size_t size) {
+	return size > POOL_MAX_SIZE ? size : (size_t)POOL_MIN_SIZE << class_index(size);
+}
+
+void *pool_acquire(size_t size) {
+	if (size > POOL_MAX_SIZE || region == NULL) {
+		atomic_fetch_add_explicit(&oversized, 1, memory_order_relaxed);
+		return malloc(pool_size(size));
+	}
+	struct pool_class *class = &classes[class_index(size)];
+	uint64_t head = atomic_load_explicit(&class->head, memory_order_acquire);
+	while ((uint32_t)head != 0) {
+		uint32_t index = (uint32_t)head - 1;
+		uint64_t next = (((head >> 32) + 1) << 32) | atomic_load_explicit(&class->next[index], memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&class->head, &head, next, memory_order_acquire,
+												  memory_order_acquire)) {
+			atomic_fetch_add_explicit(&class->reused, 1, memory_order_relaxed);
+			return class->base + (size_t)index * class->size;
+		}
+	}
+	// Nothing free: take a buffer that has never been used. The check first
+	// keeps a full class from counting ever upwards.
+	if (atomic_load_explicit(&class->carved, memory_order_relaxed) < class->capacity) {
+		unsigned index = atomic_fetch_add_explicit(&class->carved, 1, memory_order_relaxed);
+		if (index < class->capacity) {
+			return class->base + (size_t)index * class->size;
+		}
+	}
+	atomic_fetch_add_explicit(&class->fallback, 1, memory_order_relaxed);
+	return malloc(class->size);
+}
+
+void pool_release(void *buffer) {
+	char *at = buffer;
+	if (region == NULL || at < region || at >= region + POOL_CLASSES * POOL_CLASS_BYTES) {
+		free(buffer); // From malloc(), or NULL
+		return;
+	}
+	struct pool_class *class = &classes[(size_t)(at - region) / POOL_CLASS_BYTES];
+	uint32_t index = (uint32_t)((size_t)(at - class->base) / class->size);
+	uint64_t head = atomic_load_explicit(&class->head, memory_order_relaxed);
+	uint64_t new_head;
+	do {
+		atomic_store_explicit(&class->next[index], (uint32_t)head, memory_order_relaxed);
+		new_head = (((head >> 32) + 1) << 32) | (index + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&class->head, &head, new_head, memory_order_release,
+													memory_order_relaxed));
+}
+
+void pool_get_stats(struct pool_stats *stats) {
+	stats->reused = 0;
+	stats->carved = 0;
+	stats->fallback = atomic_load_explicit(&oversized, memory_order_relaxed);
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		unsigned carved = atomic_load_explicit(&classes[i].carved, memory_order_relaxed);
+		stats->reused += atomic_load_explicit(&classes[i].reused, memory_order_relaxed);
+		stats->carved += carved < classes[i].capacity ? carved : classes[i].capacity;
+		stats->fallback += atomic_load_explicit(&classes[i].fallback, memory_order_relaxed);
+	}
+}
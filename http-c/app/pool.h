@@ -0,0 +1,40 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Recycled buffers shared by all workers, in power-of-two size classes from
+// POOL_MIN_SIZE to POOL_MAX_SIZE. Connections take their I/O buffers (and
+// themselves) from here and give them back as soon as they go idle, so an
+// idle keep-alive connection holds no buffer memory and resident memory
+// follows the number of busy connections rather than open ones.
+#define POOL_MIN_SIZE 1024
+#define POOL_MAX_SIZE (256 * 1024)
+#define POOL_CLASSES 9
+
+// Reserve the address space the classes carve their buffers from. Pages only
+// become resident once a buffer is first used. Call before the workers
+// start; without it every request falls through to malloc(). Returns 0 on
+// success, -1 on error.
+int pool_init(void);
+
+// A buffer of at least `size` bytes (exactly pool_size(size)), or NULL if
+// memory is exhausted. Sizes above POOL_MAX_SIZE, or a class that has used up
+// its reservation, fall back to malloc().
+void *pool_acquire(size_t size);
+
+// Give back a buffer from pool_acquire(). NULL is ignored.
+void pool_release(void *buffer);
+
+// Usable size of a buffer acquired for `size` bytes
+size_t pool_size(size_t size);
+
+// Cumulative counts, summed over the classes
+struct pool_stats {
+	unsigned long long reused;   // acquisitions served from the free lists
+	unsigned long long carved;   // fresh buffers taken from the reservation
+	unsigned long long fallback; // acquisitions that went to malloc()
+};
+void pool_get_stats(struct pool_stats *stats);
+
+#endif
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+#include "range.h"
+
+static int is_ows(char c) {
+	return c == ' ' || c == '\t';
+}
+
+// Parse the decimal number at value[*pos], advancing *pos past it.
+// Returns -1 if there are no digits or the number doesn't fit in off_t.
+static long long parse_number(const char *value, size_t len, size_t *pos) {
+	size_t i = *pos;
+	long long number = 0;
+	while (i < len && value[i] >= '0' && value[i] <= '9') {
+		if (number > (0x7fffffffffffffffLL - 9) / 10) {
+			return -1;
+		}
+		number = number * 10 + (value[i] - '0');
+		i++;
+	}
+	if (i == *pos) {
+		return -1;
+	}
+	*pos = i;
+	return number;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+	off_t first_a = ((const struct byte_range *)a)->first;
+	off_t first_b = ((const struct byte_range *)b)->first;
+	return first_a < first_b ? -1 : first_a > first_b;
+}
+
+int range_parse(const char *value, size_t len, off_t size, struct byte_range *ranges, int max) {
+	// "bytes" OWS "=" OWS range-set; the unit is case-insensitive
+	if (len < 6 || strncasecmp(value, "bytes", 5) != 0) {
+		return -1;
+	}
+	size_t pos = 5;
+	while (pos < len && is_ows(value[pos])) {
+		pos++;
+	}
+	if (pos == len || value[pos] != '=') {
+		return -1;
+	}
+	pos++;
+
+	int specs = 0;
+	int count = 0;
+	while (pos < len) {
+		// Empty list elements (", ,") are allowed
+		if (is_ows(value[pos]) || value[pos] == ',') {
+			pos++;
+			continue;
+		}
+		if (++specs > max) {
+			return -1;
+		}
+		long long first;
+		long long last;
+		if (value[pos] == '-') {
+			// "-N": the last N bytes
+			pos++;
+			long long suffix = parse_number(value, len, &pos);
+			if (suffix < 0) {
+				return -1;
+			}
+			if (suffix == 0 || size == 0) {
+				first = -1; // Unsatisfiable, but the header may still be valid
+				last = -1;
+			} else {
+				first = suffix >= size ? 0 : size - suffix;
+				last = size - 1;
+			}
+		} else {
+			// "N-" or "N-M"
+			first = parse_number(value, len, &pos);
+			if (first < 0 || pos == len || value[pos] != '-') {
+				return -1;
+			}
+			pos++;
+			last = size - 1;
+			if (pos < len && value[pos] >= '0' && value[pos] <= '9') {
+				last = parse_number(value, len, &pos);
+				if (last < 0 || last < first) {
+					return -1;
+				}
+				if (last >= size) {
+					last = size - 1;
+				}
+			}
+			if (first >= size) {
+				first = -1;
+			}
+		}
+		// Each spec ends at a comma or the end of the value
+		while (pos < len && is_ows(value[pos])) {
+			pos++;
+		}
+		if (pos < len && value[pos] != ',') {
+			return -1;
+		}
+		if (first >= 0) {
+			ranges[count].first = (off_t)first;
+			ranges[count].last = (off_t)last;
+			count++;
+		}
+	}
+	if (specs == 0) {
+		return -1;
+	}
+
+	// Overlapping or adjacent ranges are sent once, as one part
+	qsort(ranges, (size_t)count, sizeof(*ranges), compare_ranges);
+	int merged = 0;
+	for (int i = 0; i < count; i++) {
+		if (merged > 0 && ranges[i].first <= ranges[merged - 1].last + 1) {
+			if (ranges[i].last > ranges[merged - 1].last) {
+				ranges[merged - 1].last = ranges[i].last;
+			}
+		} else {
+			ranges[merged++] = ranges[i];
+		}
+	}
+	return merged;
+}
+
+// Boundaries only have to be unlikely to appear in the parts; a counter
+// started from the clock gives each response its own
+static atomic_ullong boundary_counter;
+
+void range_boundary(char boundary[RANGE_BOUNDARY_LEN + 1]) {
+	unsigned long long expected = 0;
+	atomic_compare_exchange_strong(&boundary_counter, &expected, (unsigned long long)time(NULL) * 1000003ULL);
+	unsigned long long n = atomic_fetch_add(&boundary_counter, 1);
+	snprintf(boundary, RANGE_BOUNDARY_LEN + 1, "%020llu", n);
+}
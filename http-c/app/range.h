@@ -0,0 +1,39 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Most ranges we accept in one Range header; a request asking for more is
+// answered with the whole file
+#define RANGE_MAX 16
+// Length of a multipart/byteranges boundary
+#define RANGE_BOUNDARY_LEN 20
+
+// Bytes first..last (inclusive) of a file
+struct byte_range {
+	off_t first;
+	off_t last;
+};
+
+// Interpret a Range header value (RFC 9110 14.2) for a file of `size`
+// bytes. Stores the satisfiable ranges in `ranges`, sorted, with overlapping
+// and adjacent ones merged, and returns how many there are. Returns 0 if
+// none is satisfiable (answer 416), or -1 if the header is to be ignored
+// (not a byte range, malformed, or more than `max` ranges).
+int range_parse(const char *value, size_t len, off_t size, struct byte_range *ranges, int max);
+
+// A multipart/byteranges body on its way out: each part is a small header
+// followed by a run of the file
+struct multipart_ranges {
+	off_t size; // the whole file's length, for Content-Range
+	int count;
+	int next;   // index of the next part to start; count once all started
+	char boundary[RANGE_BOUNDARY_LEN + 1];
+	struct byte_range ranges[RANGE_MAX];
+};
+
+// Fill in a fresh boundary string for a multipart body
+void range_boundary(char boundary[RANGE_BOUNDARY_LEN + 1]);
+
+#endif
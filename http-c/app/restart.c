@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "restart.h"
+#include "server.h"
+#include "connection.h"
+#include "metrics.h"
+#include "log.h"
+
+// Byte the new instance sends once it is accepting
+#define READY_BYTE 'R'
+
+// What to run for a new instance, read at startup: after a deploy replaced
+// the executable, /proc/self/exe names the old one as deleted
+static char exe_path[PATH_MAX];
+static char **saved_argv;
+static int drain_fd = -1;
+static atomic_int draining;
+
+// Listening sockets inherited from the previous instance, and their ports
+static int *inherited_fds;
+static int *inherited_ports;
+static int inherited_count;
+// Where to report readiness to the previous instance; -1 if there is none
+static int handoff_fd = -1;
+// Our end of the connection to the spawner
+static int spawner_fd = -1;
+
+static int socket_port(int fd) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET) {
+		return -1;
+	}
+	return ntohs(addr.sin_port);
+}
+
+// Send a message of one byte, `flag`, passing `count` descriptors (at most
+// RESTART_FDS_PER_MESSAGE). Returns 0 on success.
+static int send_fds(int sock, const int *fds, int count, char flag) {
+	struct iovec iov = { .iov_base = &flag, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MESSAGE)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+	while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Receive a message sent with send_fds(): its descriptors (close-on-exec)
+// into `fds` and its byte into `flag`. Returns how many descriptors came, or
+// -1 on error or end of file.
+static int receive_fds(int sock, int *fds, char *flag) {
+	struct iovec iov = { .iov_base = flag, .iov_len = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MESSAGE)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+	}
+	if (n <= 0) {
+		return -1;
+	}
+	int count = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (size_t)count);
+		}
+	}
+	if (msg.msg_flags & MSG_CTRUNC) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return count;
+}
+
+// Receive the listening sockets the previous instance sends on `sock`:
+// batches of descriptors, each with a byte saying whether more follow
+static int receive_listeners(int sock) {
+	// The sender may have died; don't wait for it forever
+	struct timeval timeout = { .tv_sec = RESTART_READY_TIMEOUT_MS / 1000 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char more = 1;
+	while (more) {
+		int batch[RESTART_FDS_PER_MESSAGE];
+		int count = receive_fds(sock, batch, &more);
+		if (count < 0) {
+			log_error("Receiving the listening sockets failed: %m");
+			return -1;
+		}
+		int *fds = realloc(inherited_fds, sizeof(int) * (size_t)(inherited_count + count));
+		if (fds != NULL) {
+			inherited_fds = fds;
+		}
+		int *ports = realloc(inherited_ports, sizeof(int) * (size_t)(inherited_count + count));
+		if (ports != NULL) {
+			inherited_ports = ports;
+		}
+		if (fds == NULL || ports == NULL) {
+			log_error("Failed to allocate inherited listeners: %m");
+			return -1;
+		}
+		for (int i = 0; i < count; i++) {
+			inherited_fds[inherited_count] = batch[i];
+			inherited_ports[inherited_count] = socket_port(batch[i]);
+			inherited_count++;
+		}
+	}
+	return 0;
+}
+
+// The spawner: for each handoff socket the server sends on `sock`, start a
+// new instance with it and reply with the new PID (-1 if fork() failed).
+// Exits when the server does.
+static void spawner_main(int sock) {
+	prctl(PR_SET_NAME, "restart-spawner");
+	// Children that fail to start are reaped by the kernel
+	signal(SIGCHLD, SIG_IGN);
+	while (1) {
+		int fd;
+		char flag;
+		if (receive_fds(sock, &fd, &flag) != 1) {
+			_exit(0);
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			signal(SIGCHLD, SIG_DFL);
+			char value[16];
+			snprintf(value, sizeof(value), "%d", fd);
+			setenv(RESTART_HANDOFF_ENV, value, 1);
+			// The restart signals stay blocked until the new instance waits for them
+			if (fcntl(fd, F_SETFD, 0) == 0) {
+				execv(exe_path, saved_argv);
+			}
+			_exit(127);
+		}
+		close(fd);
+		send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+	}
+}
+
+int restart_init(char *argv[]) {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	saved_argv = argv;
+	ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if (len < 0) {
+		log_warn("Can't tell the executable's path, restarts are off: %m");
+		exe_path[0] = '\0';
+	} else {
+		exe_path[len] = '\0';
+	}
+	const char *handoff = getenv(RESTART_HANDOFF_ENV);
+	if (handoff != NULL) {
+		handoff_fd = atoi(handoff);
+		unsetenv(RESTART_HANDOFF_ENV);
+		// Not to be passed on to whatever this instance starts
+		fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	// New instances are started by a process forked now, while this one is
+	// small and single-threaded. Forking the running server would copy its
+	// page tables, stalling the workers, and leave the child holding every
+	// client socket until it execs, so closing one would no longer take it
+	// out of epoll.
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		log_error("socketpair failed: %m");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_error("fork failed: %m");
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		if (handoff_fd >= 0) {
+			close(handoff_fd); // So the previous instance sees us exit
+		}
+		spawner_main(sv[1]);
+	}
+	close(sv[1]);
+	spawner_fd = sv[0];
+
+	drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (drain_fd < 0) {
+		log_error("eventfd failed: %m");
+		return -1;
+	}
+	if (handoff_fd >= 0) {
+		if (receive_listeners(handoff_fd) != 0) {
+			return -1;
+		}
+		log_info("Took over %d listening sockets", inherited_count);
+	}
+	return 0;
+}
+
+int restart_take_listener(int port) {
+	for (int i = 0; i < inherited_count; i++) {
+		if (inherited_fds[i] >= 0 && inherited_ports[i] == port) {
+			int fd = inherited_fds[i];
+			inherited_fds[i] = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+int restart_drain_fd(void) {
+	return drain_fd;
+}
+
+int restart_draining(void) {
+	return atomic_load_explicit(&draining, memory_order_relaxed);
+}
+
+// Tell the previous instance we are accepting, so it can start draining
+static void report_ready(void) {
+	int unused = 0;
+	for (int i = 0; i < inherited_count; i++) {
+		if (inherited_fds[i] >= 0) {
+			close(inherited_fds[i]);
+			unused++;
+		}
+	}
+	if (unused > 0) {
+		// Clients queued on them are reset once the old instance lets go
+		log_warn("Closed %d inherited listening sockets this instance has no worker for", unused);
+	}
+	free(inherited_fds);
+	free(inherited_ports);
+	inherited_fds = inherited_ports = NULL;
+	inherited_count = 0;
+	if (handoff_fd < 0) {
+		return;
+	}
+	char ready = READY_BYTE;
+	if (send(handoff_fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+		log_warn("Could not report readiness to the previous instance: %m");
+	}
+	close(handoff_fd);
+	handoff_fd = -1;
+}
+
+// Wait for the new instance to report it is accepting. Returns 0 once it
+// has, -1 if it exited or took too long.
+static int wait_ready(int fd) {
+	uint64_t deadline = metrics_now() + (uint64_t)RESTART_READY_TIMEOUT_MS * 1000000u;
+	while (1) {
+		uint64_t now = metrics_now();
+		if (now >= deadline) {
+			log_error("The new instance did not start accepting within %dms", RESTART_READY_TIMEOUT_MS);
+			return -1;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int n = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+		if (n < 0 && errno != EINTR) {
+			log_error("poll failed: %m");
+			return -1;
+		}
+		if (n <= 0) {
+			continue;
+		}
+		char ready;
+		if (recv(fd, &ready, 1, 0) == 1 && ready == READY_BYTE) {
+			return 0;
+		}
+		log_error("The new instance exited before accepting");
+		return -1;
+	}
+}
+
+// Start a new instance and pass it the listening sockets. Returns 0 once it
+// is accepting; on failure it is killed and -1 is returned.
+static int hand_off(const int *listen_fds, const int *tls_listen_fds, int count) {
+	if (exe_path[0] == '\0') {
+		log_error("Restart requested, but the executable's path is unknown");
+		return -1;
+	}
+	int *fds = malloc(sizeof(int) * (size_t)count * 2);
+	if (fds == NULL) {
+		log_error("Failed to allocate listener array: %m");
+		return -1;
+	}
+	int fd_count = 0;
+	for (int i = 0; i < count; i++) {
+		fds[fd_count++] = listen_fds[i];
+		if (tls_listen_fds != NULL) {
+			fds[fd_count++] = tls_listen_fds[i];
+		}
+	}
+	// Datagram-like, so each batch of descriptors arrives as its own message
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		log_error("socketpair failed: %m");
+		free(fds);
+		return -1;
+	}
+	pid_t pid = -1;
+	if (send_fds(spawner_fd, &sv[1], 1, 0) != 0 || recv(spawner_fd, &pid, sizeof(pid), 0) != sizeof(pid)) {
+		log_error("The restart spawner is gone: %m");
+		pid = -1;
+	} else if (pid < 0) {
+		log_error("The restart spawner could not fork");
+	}
+	close(sv[1]);
+	int result = -1;
+	if (pid > 0) {
+		log_info("Started new instance (PID %d) of %s, handing over %d listening sockets", (int)pid, exe_path,
+				 fd_count);
+		result = 0;
+		for (int at = 0; at < fd_count && result == 0; at += RESTART_FDS_PER_MESSAGE) {
+			int batch = fd_count - at < RESTART_FDS_PER_MESSAGE ? fd_count - at : RESTART_FDS_PER_MESSAGE;
+			if (send_fds(sv[0], &fds[at], batch, at + batch < fd_count) != 0) {
+				log_error("Sending the listening sockets failed: %m");
+				result = -1;
+			}
+		}
+		if (result == 0) {
+			result = wait_ready(sv[0]);
+		}
+		if (result != 0) {
+			kill(pid, SIGKILL);
+		}
+	}
+	close(sv[0]);
+	free(fds);
+	if (result != 0) {
+		log_warn("Restart failed, carrying on");
+	}
+	return result;
+}
+
+// Stop accepting and wait for the open connections to finish
+static void drain(void) {
+	atomic_store_explicit(&draining, 1, memory_order_relaxed);
+	uint64_t one = 1;
+	if (write(drain_fd, &one, sizeof(one)) != sizeof(one)) {
+		log_error("Could not signal the workers to drain: %m");
+	}
+	uint64_t deadline = metrics_now() + (uint64_t)g_drain_timeout_ms * 1000000u;
+	int open;
+	while ((open = connection_open_count()) > 0) {
+		if (g_drain_timeout_ms > 0 && metrics_now() >= deadline) {
+			log_warn("Drain timeout passed with %d connections still open", open);
+			return;
+		}
+		poll(NULL, 0, RESTART_DRAIN_POLL_MS);
+	}
+	log_info("All connections finished");
+}
+
+int restart_serve(const int *listen_fds, const int *tls_listen_fds, int count) {
+	report_ready();
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGQUIT);
+	while (1) {
+		int sig = sigwaitinfo(&signals, NULL);
+		if (sig == SIGUSR2) {
+			log_info("Restart requested");
+			if (hand_off(listen_fds, tls_listen_fds, count) == 0) {
+				log_info("New instance is accepting, draining (PID %d)", (int)getpid());
+				break;
+			}
+		} else if (sig == SIGQUIT) {
+			log_info("Shutdown requested, draining");
+			break;
+		} else if (errno != EINTR) {
+			log_error("sigwaitinfo failed: %m");
+			return 1;
+		}
+	}
+	drain();
+	return 0;
+}
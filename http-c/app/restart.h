@@ -0,0 +1,49 @@
+#ifndef RESTART_H
+#define RESTART_H
+
+// Restarts without dropping a connection. On SIGUSR2 the server starts a
+// fresh copy of its executable with the same arguments and passes it every
+// listening socket over a Unix socket (SCM_RIGHTS). The sockets, and the
+// clients queued on them, carry on in the new process: nothing is ever
+// unbound, so no client is refused. Once the new instance reports it is
+// accepting, this one stops accepting, lets the requests in progress finish
+// (up to --drain-timeout) and exits. SIGQUIT drains and exits the same way
+// without starting a successor. If the new instance fails to come up, the
+// old one logs why and carries on serving.
+
+// Environment variable telling a new instance which inherited descriptor
+// the listening sockets arrive on
+#define RESTART_HANDOFF_ENV "HTTP_C_HANDOFF_FD"
+// How long the old instance waits for the new one to be accepting
+#define RESTART_READY_TIMEOUT_MS 10000
+// Most descriptors passed per message; the kernel caps one message at 253
+#define RESTART_FDS_PER_MESSAGE 64
+// How often the draining instance checks whether its connections are gone
+#define RESTART_DRAIN_POLL_MS 50
+
+// Block the restart signals (before any thread starts, so they all inherit
+// the mask and only restart_serve() sees them) and fork the spawner, a small
+// process ("restart-spawner") that starts new instances when asked. In an
+// instance started by a restart, also receive the inherited listening
+// sockets. Returns 0 on success, -1 on error.
+int restart_init(char *argv[]);
+
+// An inherited listening socket bound to `port`, or -1 if none is left; the
+// caller then creates one
+int restart_take_listener(int port);
+
+// An eventfd that becomes readable once draining starts; the workers stop
+// accepting and wind their connections down when it does
+int restart_drain_fd(void);
+
+// Whether draining has started: responses are then the last on their
+// connection
+int restart_draining(void);
+
+// Report the new instance ready to whoever started it, then wait for the
+// restart signals, handing `listen_fds` and `tls_listen_fds` (NULL if HTTPS
+// is off), `count` of each, to a successor on SIGUSR2. Returns once the
+// connections have drained, or the drain timeout passed; main() then exits.
+int restart_serve(const int *listen_fds, const int *tls_listen_fds, int count);
+
+#endif
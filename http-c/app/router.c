@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+#include "log.h"
+
+// A node stands for the path spelled by the labels from the root down to
+// it. Children are found by the first byte of their label, which differs
+// between siblings.
+struct router_node {
+	char *label; // bytes on the edge from the parent
+	size_t label_len;
+	unsigned short child_at[256]; // 1 + index in `children` by first label byte, 0 for none
+	struct router_node **children;
+	size_t child_count;
+	unsigned exact_methods; // methods with a route in `exact`
+	unsigned prefix_methods;
+	struct route exact[HTTP_METHOD_COUNT];
+	struct route prefix[HTTP_METHOD_COUNT];
+};
+
+static struct router_node *root;
+
+static struct router_node *node_new(const char *label, size_t len) {
+	struct router_node *node = calloc(1, sizeof(*node));
+	if (node == NULL) {
+		return NULL;
+	}
+	node->label = malloc(len + 1);
+	if (node->label == NULL) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->label, label, len);
+	node->label[len] = '\0';
+	node->label_len = len;
+	return node;
+}
+
+static int node_add_child(struct router_node *parent, struct router_node *child) {
+	struct router_node **children = realloc(parent->children, (parent->child_count + 1) * sizeof(*children));
+	if (children == NULL) {
+		return -1;
+	}
+	parent->children = children;
+	children[parent->child_count++] = child;
+	parent->child_at[(unsigned char)child->label[0]] = (unsigned short)parent->child_count;
+	return 0;
+}
+
+// Cut `child`'s label after `len` bytes, putting a new node for the first
+// part between it and `parent`. Returns the new node, or NULL.
+static struct router_node *node_split(struct router_node *parent, struct router_node *child, size_t len) {
+	struct router_node *middle = node_new(child->label, len);
+	if (middle == NULL) {
+		return NULL;
+	}
+	struct router_node *rest = node_new(child->label + len, child->label_len - len);
+	if (rest == NULL) {
+		free(middle->label);
+		free(middle);
+		return NULL;
+	}
+	// `child` keeps its identity and routes, only with the shorter label
+	free(child->label);
+	child->label = rest->label;
+	child->label_len = rest->label_len;
+	free(rest);
+	if (node_add_child(middle, child) != 0) {
+		return NULL;
+	}
+	parent->children[parent->child_at[(unsigned char)middle->label[0]] - 1] = middle;
+	return middle;
+}
+
+// The node for `path`, created along with any missing ones
+static struct router_node *node_find_or_add(const char *path) {
+	if (root == NULL && (root = node_new("", 0)) == NULL) {
+		return NULL;
+	}
+	struct router_node *node = root;
+	size_t len = strlen(path);
+	size_t at = 0;
+	while (at < len) {
+		unsigned index = node->child_at[(unsigned char)path[at]];
+		if (index == 0) {
+			struct router_node *child = node_new(path + at, len - at);
+			if (child == NULL || node_add_child(node, child) != 0) {
+				return NULL;
+			}
+			return child;
+		}
+		struct router_node *child = node->children[index - 1];
+		size_t common = 0;
+		while (common < child->label_len && at + common < len && child->label[common] == path[at + common]) {
+			common++;
+		}
+		if (common < child->label_len && (child = node_split(node, child, common)) == NULL) {
+			return NULL;
+		}
+		node = child;
+		at += common;
+	}
+	return node;
+}
+
+int router_add(unsigned methods, const char *path, enum route_match match, enum metrics_route metrics,
+			   route_handler handler) {
+	struct router_node *node = node_find_or_add(path);
+	if (node == NULL) {
+		log_error("Out of memory adding route %s", path);
+		return -1;
+	}
+	unsigned *routed = match == ROUTE_EXACT ? &node->exact_methods : &node->prefix_methods;
+	struct route *routes = match == ROUTE_EXACT ? node->exact : node->prefix;
+	if (*routed & methods) {
+		log_error("Route %s registered twice for the same method", path);
+		return -1;
+	}
+	*routed |= methods;
+	for (int method = 0; method < HTTP_METHOD_COUNT; method++) {
+		if (methods & ROUTE_METHOD(method)) {
+			routes[method] = (struct route){ handler, metrics };
+		}
+	}
+	return 0;
+}
+
+const struct route *router_match(enum http_method method, const char *path, size_t len, size_t *rest_at,
+								 int *path_known) {
+	const struct route *best = NULL;
+	size_t best_at = 0;
+	int known = 0;
+	unsigned bit = ROUTE_METHOD(method);
+	const struct router_node *node = root;
+	size_t at = 0;
+	while (node != NULL) {
+		// Prefix routes on the way down are candidates; deeper ones win
+		if (node->prefix_methods != 0) {
+			known = 1;
+			if (node->prefix_methods & bit) {
+				best = &node->prefix[method];
+				best_at = at;
+			}
+		}
+		if (at == len) {
+			if (node->exact_methods != 0) {
+				known = 1;
+				if (node->exact_methods & bit) {
+					best = &node->exact[method];
+					best_at = at;
+				}
+			}
+			break;
+		}
+		unsigned index = node->child_at[(unsigned char)path[at]];
+		if (index == 0) {
+			break;
+		}
+		const struct router_node *child = node->children[index - 1];
+		if (child->label_len > len - at || memcmp(child->label, path + at, child->label_len) != 0) {
+			break;
+		}
+		at += child->label_len;
+		node = child;
+	}
+	*rest_at = best_at;
+	*path_known = known;
+	return best;
+}
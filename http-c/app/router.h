@@ -0,0 +1,49 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+#include "metrics.h"
+
+// Request routing. Routes are registered once at startup and compiled into a
+// radix trie keyed on the path, each node holding a handler per method, so a
+// lookup is one walk down the request target and costs the same however
+// many routes there are. The trie is read-only once the workers run.
+
+struct connection;
+
+// Handles a matched request by queueing its response on `conn` (see
+// connection.c). `rest` is what follows the route's path in the request
+// target: the remainder for a prefix route, "" for an exact one.
+typedef void (*route_handler)(struct connection *conn, const char *rest, size_t rest_len);
+
+#define HTTP_METHOD_COUNT (HTTP_TRACE + 1)
+// Sets of methods a route answers, as a bit per enum http_method
+#define ROUTE_METHOD(method) (1u << (method))
+#define ROUTE_ANY_METHOD ((1u << HTTP_METHOD_COUNT) - 1)
+
+enum route_match {
+	ROUTE_EXACT,  // the target equals the path
+	ROUTE_PREFIX, // the target starts with the path
+};
+
+struct route {
+	route_handler handler;
+	enum metrics_route metrics; // what its requests are counted under
+};
+
+// Route requests whose method is in `methods` and whose target matches
+// `path`. Only before the workers start. Returns 0 on success, -1 if a
+// method is already routed for that path or memory runs out.
+int router_add(unsigned methods, const char *path, enum route_match match, enum metrics_route metrics,
+			   route_handler handler);
+
+// The route for `method` and the target path[0, len): an exact route, or
+// else the longest prefix route that takes the method. Sets *rest_at to
+// where the remainder starts. Returns NULL if there is none; *path_known
+// then tells whether some route matched the path but not the method.
+const struct route *router_match(enum http_method method, const char *path, size_t len, size_t *rest_at,
+								 int *path_known);
+
+#endif
@@ -12,506 +12,114 @@
 #include <string.h>
 /* Include error number definitions and the errno variable */
 #include <errno.h>
-/* Include POSIX operating system API functions like close, setbuf */
+/* Include POSIX operating system API functions like close */
 #include <unistd.h>
-#include <ctype.h>
-// for concurrent connections, using threads
-#include <pthread.h>
-// For stat() to get file information
-#include <sys/stat.h>
-// For off_t type used in file size
-#include <sys/types.h>
-// For PATH_MAX (optional, could use a fixed buffer size)
-// #include <limits.h> 
+/* Include INT_MAX for validating numeric flags */
+#include <limits.h>
+/* Include SIZE_MAX */
+#include <stdint.h>
+/* Include signal() for ignoring SIGPIPE */
+#include <signal.h>
+/* Include getrlimit() and setrlimit() for the open file limit */
+#include <sys/resource.h>
+
+#include "server.h"
+// Worker threads multiplexing client connections with epoll
+#include "event_loop.h"
+// In-memory cache of small, frequently requested files
+#include "file_cache.h"
+// The served directory and the files kept open in it
+#include "open_files.h"
+// Vectorized request scanning, dispatched on the CPU's features
+#include "header_scan.h"
+// Recycled connection and I/O buffers
+#include "pool.h"
+// Asynchronous logging through per-thread rings
+#include "log.h"
+// Alternative worker loop built on io_uring
+#include "uring_loop.h"
+// The routes, registered with the request router
+#include "connection.h"
+// HTTPS through OpenSSL, with kernel TLS offload
+#include "tls.h"
+// Listening sockets handed from one instance to the next on restart
+#include "restart.h"
+// Group-commit thread for --durable-uploads
+#include "commit.h"
 
 // Global variable to store the directory path provided via command line argument
 char *g_directory_path = NULL;
-
-// Function to handle individual client connections in separate threads
-void *handle_client(void *client_fd_ptr) {
-	// The argument is a pointer to the client file descriptor allocated in main.
-	// We dereference it to get the actual file descriptor.
-	int client_fd = *(int *)client_fd_ptr;
-	// We must free the memory allocated in main for this argument.
-	free(client_fd_ptr);
-
-	// Buffer to store incoming request data
-	char buffer[1024];
-	// Receive data from the client
-	ssize_t bytes_received = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-	
-	// Error handling for recv
-	if (bytes_received < 0) {
-		perror("Receive failed"); // Use perror for system call errors
-		close(client_fd);
-		return NULL; // Exit thread
-	}
-	// Null-terminate the received data to treat it as a string
-	buffer[bytes_received] = '\0';
-
-	// Debug: Print received request
-	// printf("Received Request:\n%s\n", buffer); 
-
-	// Variables for parsing the HTTP request line
-	char method[16];
-	char path[512]; 
-	char version[16];
-	// Parse the first line (request line)
-	int parsed_items = sscanf(buffer, "%15s %511s %15s", method, path, version);
-
-	char *response = NULL;
-	size_t response_len = 0;
-	// Flag to track if 'response' was dynamically allocated (needs free)
-	int use_dynamic_response = 0; 
-	// Flag to track if the response was fully sent within a specific route handler
-	int response_sent = 0; 
-
-	// --- Start of Request Routing ---
-	// Handle root path "/"
-	if (parsed_items == 3 && strcmp(path, "/") == 0) {
-		response = "HTTP/1.1 200 OK\r\n\r\n";
-		response_len = strlen(response);
-	} 
-	// Handle "/echo/..." paths
-	else if (parsed_items == 3 && strncmp(path, "/echo/", 6) == 0) {
-		char *echo_str = path + 6; // Point to the string after "/echo/"
-		size_t echo_len = strlen(echo_str);
-
-		// Estimate size needed for the response string
-		size_t required_size = 100 + echo_len; 
-		response = malloc(required_size);
-		// Error handling for malloc
-		if (response == NULL) {
-			perror("Malloc failed for echo response");
-			close(client_fd);
-			return NULL; // Exit thread
-		}
-		use_dynamic_response = 1; // Mark response for freeing later
-		
-		// Safely format the HTTP response string
-		int written_len = snprintf(response, required_size,
-									"HTTP/1.1 200 OK\r\n"
-									"Content-Type: text/plain\r\n"
-									"Content-Length: %zu\r\n\r\n"
-									"%s",
-									echo_len, echo_str);
-		// Error handling for snprintf
-		if (written_len < 0 || (size_t)written_len >= required_size) {
-			fprintf(stderr, "snprintf error or truncation for echo response\n");
-			free(response);
-			close(client_fd);
-			return NULL; // Exit thread
-		}
-		response_len = (size_t)written_len;
-	} 
-	// Handle "/user-agent" path
-	else if (parsed_items == 3 && strcmp(path, "/user-agent") == 0) {
-		char *user_agent = ""; // Default to empty string
-		size_t user_agent_len = 0;
-
-		// Find the start of headers (after the first \r\n)
-		char *header_start = strstr(buffer, "\r\n");
-		if (header_start) {
-			header_start += 2; // Move past the first \r\n
-			char *current_line = header_start;
-			char *buffer_end = buffer + bytes_received; // End of received data
-
-			// Iterate through header lines
-			while (current_line < buffer_end && strncmp(current_line, "\r\n", 2) != 0) {
-				// Find the end of the current header line
-				char *next_line_end = strstr(current_line, "\r\n");
-				if (!next_line_end) {
-					// Malformed header section
-					break; 
-				}
-
-				// Check if the line starts with "User-Agent: " (case-insensitive)
-				const char *ua_prefix = "User-Agent: ";
-				size_t ua_prefix_len = strlen(ua_prefix);
-				if (strncasecmp(current_line, ua_prefix, ua_prefix_len) == 0) {
-					// Found the User-Agent header
-					user_agent = current_line + ua_prefix_len; // Point to the value
-					// Calculate the length of the value (up to the \r\n)
-					user_agent_len = next_line_end - user_agent; 
-					break; // Stop searching once found
-				}
-				// Move to the start of the next header line
-				current_line = next_line_end + 2; 
-			}
-		}
-
-		// Construct the response
-		size_t required_size = 100 + user_agent_len; // Estimate size
-		response = malloc(required_size);
-		// Error handling for malloc
-		if (response == NULL) {
-			perror("Malloc failed for user-agent response");
-			close(client_fd);
-			return NULL; // Exit thread
-		}
-		use_dynamic_response = 1; // Mark response for freeing
-
-		// Safely format the response string including the User-Agent value
-		int written_len = snprintf(response, required_size,
-								   "HTTP/1.1 200 OK\r\n"
-								   "Content-Type: text/plain\r\n"
-								   "Content-Length: %zu\r\n"
-								   "\r\n"
-								   "%.*s", // Use %.*s to print exactly user_agent_len bytes
-								   user_agent_len,      // Value for Content-Length
-								   (int)user_agent_len, // Length specifier for %.*s
-								   user_agent);         // The User-Agent string itself
-
-		// Error handling for snprintf
-		if (written_len < 0 || (size_t)written_len >= required_size) {
-			fprintf(stderr, "snprintf error or truncation for user-agent response\n");
-			free(response);
-			close(client_fd);
-			return NULL; // Exit thread
-		}
-		response_len = (size_t)written_len;
-	} 
-	// Handle "/files/<filename>" paths
-	else if (parsed_items == 3 && strncmp(path, "/files/", 7) == 0) {
-		// Check if the directory path was provided via command line
-		if (g_directory_path == NULL) {
-			fprintf(stderr, "Error: Directory path not specified on startup.\n");
-			// 500 because it's a server configuration issue preventing the request
-			response = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-			response_len = strlen(response);
-			use_dynamic_response = 0;
-		} else {
-			// Extract the filename from the path (skip "/files/")
-			const char *filename = path + 7;
-			// Buffer to hold the full path to the requested file
-			char full_path[1024]; 
-			
-			// Construct the full path safely
-			int path_len = snprintf(full_path, sizeof(full_path), "%s/%s", g_directory_path, filename);
-			
-			// Check for path construction errors (e.g., truncation)
-			if (path_len < 0 || (size_t)path_len >= sizeof(full_path)) {
-				fprintf(stderr, "Error constructing file path (too long?): %s\n", filename);
-				// 500 for server-side path issue
-				response = "HTTP/1.1 500 Internal Server Error\r\n\r\n"; 
-				response_len = strlen(response);
-				use_dynamic_response = 0;
-			} else {
-
-				// --- Handle GET requests --- 
-				if (strcmp(method, "GET") == 0) {
-					struct stat file_stat;
-					// Use stat() to check if the file exists and get its properties
-					if (stat(full_path, &file_stat) == 0) {
-						// Check if it's a regular file (not a directory, etc.)
-						if (S_ISREG(file_stat.st_mode)) {
-							// Get the file size
-							off_t file_size = file_stat.st_size;
-							// Open the file in binary read mode ("rb")
-							FILE *file = fopen(full_path, "rb");
-							
-							if (file == NULL) {
-								// Error opening file (e.g., permissions) - treat as Not Found
-								perror("fopen failed for GET");
-								response = "HTTP/1.1 404 Not Found\r\n\r\n";
-								response_len = strlen(response);
-								use_dynamic_response = 0;
-							} else {
-								// File opened successfully, prepare 200 OK response with file content
-								char header_buffer[256]; 
-								int header_len = snprintf(header_buffer, sizeof(header_buffer),
-														  "HTTP/1.1 200 OK\r\n"
-														  "Content-Type: application/octet-stream\r\n"
-														  "Content-Length: %lld\r\n\r\n", // %lld for off_t
-														  file_size);
-
-								if (header_len < 0 || (size_t)header_len >= sizeof(header_buffer)) {
-									fprintf(stderr, "snprintf error or truncation for GET file headers\n");
-									fclose(file);
-									close(client_fd); 
-									return NULL; 
-								}
-
-								// Send the headers first
-								if (send(client_fd, header_buffer, header_len, 0) != header_len) {
-									perror("Failed to send GET file headers completely");
-									fclose(file);
-									close(client_fd);
-									return NULL; 
-								}
-
-								// Read file and send content in chunks
-								char file_buffer[4096]; 
-								size_t bytes_read;
-								while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0) {
-									if (send(client_fd, file_buffer, bytes_read, 0) != (ssize_t)bytes_read) {
-										perror("Failed to send file chunk completely (GET)");
-										break; // Error or client disconnected
-									}
-								}
-
-								// Check for file read errors
-								if (ferror(file)) {
-									perror("fread failed (GET)");
-								}
-
-								fclose(file);
-								response_sent = 1; // Mark response handled
-							}
-						} else {
-							// Path exists but is not a regular file
-							fprintf(stderr, "Access denied: GET '%s' is not a regular file.\n", full_path);
-							response = "HTTP/1.1 404 Not Found\r\n\r\n";
-							response_len = strlen(response);
-							use_dynamic_response = 0;
-						}
-					} else {
-						// stat failed - File likely doesn't exist (errno == ENOENT)
-						if (errno != ENOENT) {
-							 perror("stat failed for GET file"); 
-						}
-						response = "HTTP/1.1 404 Not Found\r\n\r\n";
-						response_len = strlen(response);
-						use_dynamic_response = 0;
-					}
-				} 
-				// --- Handle POST requests --- 
-				else if (strcmp(method, "POST") == 0) {
-					// --- Find Content-Length Header --- 
-					long content_length_val = -1; // Use long for strtol, init to invalid
-					char *header_iter = strstr(buffer, "\r\n"); // Find end of request line
-					if (header_iter) {
-						header_iter += 2; // Point to start of first header
-						char *buffer_end = buffer + bytes_received;
-
-						while (header_iter < buffer_end && strncmp(header_iter, "\r\n", 2) != 0) {
-							char *next_line_end = strstr(header_iter, "\r\n");
-							if (!next_line_end) break; // Malformed headers
-
-							const char *cl_prefix = "Content-Length: ";
-							size_t cl_prefix_len = strlen(cl_prefix);
-							if (strncasecmp(header_iter, cl_prefix, cl_prefix_len) == 0) {
-								char *value_start = header_iter + cl_prefix_len;
-								char *endptr;
-								errno = 0; // Reset errno before strtol
-								content_length_val = strtol(value_start, &endptr, 10);
-
-								// Check strtol errors: range error, no digits, extra chars, negative
-								if (errno != 0 || endptr == value_start || (*endptr != '\r' && *endptr != ' ') || content_length_val < 0) {
-									fprintf(stderr, "Invalid Content-Length value: %.*s\n", (int)(next_line_end - value_start), value_start);
-									content_length_val = -2; // Mark as invalid parse
-								}
-								break; // Found header (valid or invalid), stop searching
-							}
-							header_iter = next_line_end + 2;
-						}
-					}
-
-					if (content_length_val < 0) { // Check if not found (-1) or invalid parse (-2)
-						fprintf(stderr, "Missing or invalid Content-Length header for POST /files/\n");
-						response = "HTTP/1.1 400 Bad Request\r\n\r\n";
-						response_len = strlen(response);
-						use_dynamic_response = 0;
-					} else {
-						size_t content_length = (size_t)content_length_val;
-						// --- Locate Body Start --- 
-						char *body_start_ptr = strstr(buffer, "\r\n\r\n");
-						if (body_start_ptr == NULL) {
-							fprintf(stderr, "Malformed request: Cannot find body separator \r\n\r\n\n");
-							response = "HTTP/1.1 400 Bad Request\r\n\r\n";
-							response_len = strlen(response);
-							use_dynamic_response = 0;
-						} else {
-							char *body_in_buffer_start = body_start_ptr + 4;
-							ssize_t initial_body_bytes_signed = bytes_received - (body_in_buffer_start - buffer);
-							size_t initial_body_bytes = (initial_body_bytes_signed < 0) ? 0 : (size_t)initial_body_bytes_signed;
-
-							// Check/handle if initial recv got more data than content-length specifies
-							if (initial_body_bytes > content_length) {
-								fprintf(stderr, "Warning: Received more initial data (%zu) than Content-Length (%zu), truncating file write.\n", initial_body_bytes, content_length);
-								initial_body_bytes = content_length; // Only use up to content_length
-							}
-
-							// --- Write to File --- 
-							FILE *file = fopen(full_path, "wb"); // Open for binary write
-							if (file == NULL) {
-								perror("fopen failed for writing (POST)");
-								response = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-								response_len = strlen(response);
-								use_dynamic_response = 0;
-							} else {
-								size_t total_bytes_written = 0;
-								int write_error = 0;
-
-								// Write the part of the body already in the buffer
-								if (initial_body_bytes > 0) {
-									if (fwrite(body_in_buffer_start, 1, initial_body_bytes, file) != initial_body_bytes) {
-										perror("fwrite failed for initial chunk (POST)");
-										write_error = 1;
-									} else {
-										total_bytes_written += initial_body_bytes;
-									}
-								}
-
-								// Read remaining bytes from socket and write to file
-								size_t bytes_remaining = content_length - total_bytes_written;
-								char chunk_buffer[4096];
-								while (!write_error && bytes_remaining > 0) {
-									// Determine max bytes to read in this recv call
-									size_t bytes_to_read_now = (bytes_remaining < sizeof(chunk_buffer)) ? bytes_remaining : sizeof(chunk_buffer);
-									ssize_t chunk_read = recv(client_fd, chunk_buffer, bytes_to_read_now, 0);
-
-									if (chunk_read < 0) { // recv error
-										perror("recv failed while reading body (POST)");
-										write_error = 1; break;
-									} else if (chunk_read == 0) { // Client closed connection
-										fprintf(stderr, "Client disconnected before sending full body (expected %zu more bytes)\n", bytes_remaining);
-										// File will be potentially partial, which is acceptable per spec.
-										break; 
-									}
-									
-									// Write the received chunk
-									if (fwrite(chunk_buffer, 1, chunk_read, file) != (size_t)chunk_read) {
-										perror("fwrite failed for subsequent chunk (POST)");
-										write_error = 1; break;
-									}
-									total_bytes_written += chunk_read;
-									bytes_remaining -= chunk_read; // Decrement remaining count
-								}
-
-								// Close the file regardless of write success/failure
-								if (fclose(file) != 0) {
-									perror("fclose failed");
-									// Mark as error even if writes seemed ok, as close failed
-									write_error = 1;
-								}
-
-								if (write_error) {
-									// Set 500 response if not already set (e.g., by fclose)
-									response = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
-									response_len = strlen(response);
-									use_dynamic_response = 0;
-								} else {
-									// Success! Send 201 Created
-									const char *created_response = "HTTP/1.1 201 Created\r\n\r\n";
-									if (send(client_fd, created_response, strlen(created_response), 0) == -1) {
-										perror("Send failed for 201 response");
-										// Can't send response, but file likely created. Error is logged.
-									}
-									response_sent = 1; // Mark response as handled
-								}
-							}
-						}
-					}
-				} 
-				// --- Handle other methods for /files/ --- 
-				else {
-					 fprintf(stderr, "Method %s not allowed for /files/\n", method);
-					 response = "HTTP/1.1 405 Method Not Allowed\r\n\r\n";
-					 response_len = strlen(response);
-					 use_dynamic_response = 0;
-				}
-			} // End path construction check
-		} // End g_directory_path check
-	} // End /files/ route block
-	// Handle any other paths (Not Found) - This is the fallback
-	else {
-		// Added method check to ensure only GET gives 404 for unknown paths
-		if (parsed_items == 3 && strcmp(method, "GET") != 0) {
-			fprintf(stderr, "Method %s not supported for path %s\n", method, path);
-			response = "HTTP/1.1 405 Method Not Allowed\r\n\r\n";
-			response_len = strlen(response);
-		} else {
-			// Default to 404 for GET requests to unknown paths or parse errors
-			response = "HTTP/1.1 404 Not Found\r\n\r\n";
-			response_len = strlen(response);
-		}
-		use_dynamic_response = 0;
-	}
-	// --- End of Request Routing ---
-
-	// Send the prepared response back to the client, but only if it wasn't handled internally
-	// by a specific route (like the file serving route).
-	if (!response_sent && response != NULL) {
-		// Use send() to transmit data
-		ssize_t bytes_sent = send(client_fd, response, response_len, 0);
-		// Error handling for send
-		if (bytes_sent == -1) {
-			perror("Send failed");
-			// Fall through to free response if needed and close socket
-		} else if ((size_t)bytes_sent < response_len) {
-			// Handle cases where not all data was sent (less likely for small responses)
-			fprintf(stderr, "Warning: Partial send (%zd / %zu bytes)\n", bytes_sent, response_len);
-		}
-		
-		// If the response string was dynamically allocated, free it now.
-		if (use_dynamic_response) {
-			free(response);
-		}
-	} else if (!response_sent && response == NULL) {
-		// This case indicates a logic error - a route didn't prepare a response
-		// nor did it send one itself.
-		fprintf(stderr, "Error: Response is NULL and wasn't sent internally. Closing connection.\n");
-	} else if (response_sent) {
-		// Response was already sent by the handler (e.g., file transfer). No further action needed here.
-		// printf("Debug: Response already sent by handler for FD %d\n", client_fd);
-	}
-
-	// Close the connection with this specific client.
-	close(client_fd);
-	// Thread finishes its work.
-	return NULL;
-}
-
-
-/* Main function - entry point of the program */
-int main(int argc, char *argv[]) {
-	/* 
-	 * Disable output buffering for stdout and stderr.
-	 * This ensures that any output (like printf statements) is immediately visible, 
-	 * which is helpful for debugging, especially when the program might crash or exit unexpectedly.
-	 * By default, C might buffer output, meaning it waits until a certain amount of data is ready 
-	 * or a newline is encountered before actually writing it out.
-	 */
-	setbuf(stdout, NULL);
- 	setbuf(stderr, NULL);
-
-	printf("Logs from your program will appear here!\n");
-
-	/* 
-	 * Variable declarations for socket programming:
-	 * server_fd: Integer to hold the file descriptor for the server socket. 
-	 *            File descriptors are small non-negative integers that the kernel uses 
-	 *            to identify open files, sockets, pipes, etc.
-	 * client_addr_len: Integer to store the size of the client address structure. 
-	 *                  This is needed by the accept() function. 
-	 *                  Note: The correct type for this is socklen_t, using int might cause warnings
-	 *                  as seen in your build output (`-Wpointer-sign` warning).
-	 * client_addr: A structure of type sockaddr_in to hold the address information 
-	 *              (IP address, port number) of the connecting client.
-	 */
-	int server_fd;
-	/* Note: The correct type is socklen_t, using int might cause warnings. */
-	/* socklen_t client_addr_len; */
-	socklen_t client_addr_len; 
-	struct sockaddr_in client_addr;
-	
+// Number of worker threads (--workers); 0 means one per online CPU
+int g_worker_count = 0;
+// Listen queue length for each worker's socket (--backlog)
+int g_listen_backlog = SOMAXCONN;
+// Open connections beyond which new ones get a 503 (--max-connections); 0 until derived from the file limit
+int g_max_connections = 0;
+// Memory budget of the /files/ hot-file cache in bytes (--cache-size); 0 disables it
+size_t g_cache_size = 0;
+// Files under the served directory kept open (--open-files); 0 opens them for every request
+size_t g_open_files = 1024;
+// Cache-Control sent with /files/ responses (--cache-control); none by default
+const char *g_cache_control = NULL;
+
+// epoll unless --io-backend io_uring is given
+enum io_backend g_io_backend = IO_BACKEND_EPOLL;
+// HTTPS listener certificate and key (--tls-cert, --tls-key); HTTPS is off without both
+const char *g_tls_cert = NULL;
+const char *g_tls_key = NULL;
+// Port of the HTTPS listener (--tls-port)
+int g_tls_port = TLS_DEFAULT_PORT;
+// Lines below this level are dropped (--log-level)
+enum log_level g_log_level = LOG_INFO;
+// Whether each request gets an access-log line (--access-log)
+int g_access_log = 0;
+// Whether plaintext connections may switch to HTTP/2 (--http2)
+int g_http2 = 1;
+// Per-phase connection timeouts (--header-timeout, --body-timeout, --write-timeout, --idle-timeout)
+struct connection_timeouts g_timeouts = {
+	.header_ms = 10 * 1000,
+	.body_ms = 30 * 1000,
+	.write_ms = 30 * 1000,
+	.idle_ms = 60 * 1000,
+};
+// Time allowed for connections to finish when restarting or stopping (--drain-timeout)
+unsigned g_drain_timeout_ms = 30 * 1000;
+// Uploads synced before they are answered (--durable-uploads), in groups
+// gathered over --commit-window
+int g_durable_uploads = 0;
+unsigned g_commit_window_ms = 0;
+// Limits enforced while parsing requests
+struct http_parser_limits g_parser_limits = {
+	.max_header_bytes = HTTP_DEFAULT_MAX_HEADER_BYTES,
+	.max_headers = HTTP_DEFAULT_MAX_HEADERS,
+	.max_uri = HTTP_DEFAULT_MAX_URI,
+	.max_body = 0,
+};
+
+/*
+ * Create one listening socket on `port`. Each worker gets its own, so this is
+ * called once per worker and port; returns the socket's file descriptor, or -1 on error.
+ */
+static int create_listen_socket(int port, int backlog) {
 	/*
 	 * Create a new socket:
 	 * AF_INET: Specifies the address family (IPv4 internet protocols).
 	 * SOCK_STREAM: Specifies the socket type (TCP - sequenced, reliable, two-way, connection-based byte streams).
+	 * SOCK_NONBLOCK: accept() returns EAGAIN instead of blocking once no connections are pending,
+	 *                which the epoll workers rely on to drain the listener without stalling.
+	 * SOCK_CLOEXEC: Don't leak the listening socket into child processes.
 	 * 0: Specifies the protocol (IPPROTO_TCP for SOCK_STREAM, usually 0 allows the system to choose the correct protocol).
 	 * Returns a file descriptor for the new socket, or -1 on error.
 	 */
-	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_fd == -1) {
 		/* 
 		 * Error handling: If socket() returns -1, an error occurred.
 		 * strerror(errno): Returns a string describing the error code stored in the global variable `errno`.
 		 * Print an error message and exit the program with a non-zero status code indicating failure.
 		 */
-		perror("Socket creation failed"); // Use perror for better error messages
-		return 1; /* Exit with error code 1 */
+		log_error("Socket creation failed: %m");
+		return -1;
 	}
 	
 	/*
@@ -527,16 +135,28 @@ int main(int argc, char *argv[]) {
 	int reuse = 1;
 	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
 		/* Error handling for setsockopt */
-		perror("SO_REUSEADDR failed");
+		log_error("SO_REUSEADDR failed: %m");
 		close(server_fd); // Close socket before exiting
-		return 1; /* Exit with error code 1 */
+		return -1;
+	}
+
+	/*
+	 * Let every worker bind its own socket to the same port. With SO_REUSEPORT the kernel
+	 * keeps one accept queue per socket and spreads incoming connections across them by
+	 * hashing the connection's address tuple, so the workers never contend on a shared
+	 * listener or accept lock.
+	 */
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		log_error("SO_REUSEPORT failed: %m");
+		close(server_fd);
+		return -1;
 	}
 	
 	/*
 	 * Define the server address structure (sockaddr_in):
 	 * .sin_family: Address family, must match the socket's family (AF_INET for IPv4).
 	 * .sin_port: Port number in network byte order. htons() (Host TO Network Short) converts 
-	 *            the port number (4221) from host byte order to network byte order, which is 
+	 *            the port number (4221, or the HTTPS port) from host byte order to network byte order, which is 
 	 *            required for network protocols. Different systems might store multi-byte numbers 
 	 *            differently (little-endian vs. big-endian), network byte order (big-endian) ensures consistency.
 	 * .sin_addr: IP address. 
@@ -546,7 +166,7 @@ int main(int argc, char *argv[]) {
 	 *                             available network interface on the machine (e.g., localhost, Ethernet, Wi-Fi).
 	 */
 	struct sockaddr_in serv_addr = { .sin_family = AF_INET ,
-									 .sin_port = htons(4221),
+									 .sin_port = htons((uint16_t)port),
 									 .sin_addr = { htonl(INADDR_ANY) },
 									};
 	
@@ -563,126 +183,430 @@ int main(int argc, char *argv[]) {
 	 */
 	if (bind(server_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) != 0) {
 		/* Error handling for bind */
-		perror("Bind failed");
+		log_error("Bind failed: %m");
 		close(server_fd);
-		return 1; /* Exit with error code 1 */
+		return -1;
 	}
 	
-	/*
-	 * Set the maximum number of pending connections that can be queued for the socket.
-	 * If multiple clients try to connect while the server is busy handling another connection, 
-	 * the OS will queue up to `connection_backlog` connections. Further connection attempts might be rejected.
-	 */
-	int connection_backlog = 5;
 	/*
 	 * Mark the socket as a passive socket, i.e., one that will be used to accept incoming connection requests.
 	 * server_fd: The socket file descriptor to listen on.
-	 * connection_backlog: The maximum length of the queue for pending connections.
+	 * backlog: The maximum number of pending connections the OS queues for this socket (set with
+	 *          --backlog). Further connection attempts might be rejected. The kernel silently
+	 *          caps it at net.core.somaxconn.
 	 * Returns 0 on success, -1 on error.
 	 */
-	if (listen(server_fd, connection_backlog) != 0) {
+	if (listen(server_fd, backlog) != 0) {
 		/* Error handling for listen */
-		perror("Listen failed");
+		log_error("Listen failed: %m");
 		close(server_fd);
-		return 1; /* Exit with error code 1 */
+		return -1;
 	}
-	
-	// --- Argument Parsing ---
-	// Look for the --directory argument
+	return server_fd;
+
+}
+
+// Parse a strictly positive integer flag value. Returns 0 on success.
+static int parse_positive_int(const char *flag, const char *value, int *out) {
+	char *endptr;
+	errno = 0;
+	long parsed = strtol(value, &endptr, 10);
+	if (errno != 0 || endptr == value || *endptr != '\0' || parsed <= 0 || parsed > INT_MAX) {
+		fprintf(stderr, "Error: %s expects a positive integer, got '%s'.\n", flag, value);
+		return -1;
+	}
+	*out = (int)parsed;
+	return 0;
+}
+
+// Parse a byte count with an optional K, M or G suffix (e.g. "64M"). Returns 0 on success.
+static int parse_size(const char *flag, const char *value, size_t *out) {
+	char *endptr;
+	errno = 0;
+	unsigned long long parsed = strtoull(value, &endptr, 10);
+	int shift = 0;
+	switch (*endptr) {
+	case 'K': case 'k': shift = 10; endptr++; break;
+	case 'M': case 'm': shift = 20; endptr++; break;
+	case 'G': case 'g': shift = 30; endptr++; break;
+	}
+	if (errno != 0 || endptr == value || *endptr != '\0' || value[0] == '-' ||
+		parsed > (SIZE_MAX >> shift)) {
+		fprintf(stderr, "Error: %s expects a size like 1048576, 512K or 64M, got '%s'.\n", flag, value);
+		return -1;
+	}
+	*out = (size_t)parsed << shift;
+	return 0;
+}
+
+// Parse a duration in seconds, fractions allowed (e.g. "2.5"), into milliseconds;
+// 0 turns the timeout off. Returns 0 on success.
+static int parse_timeout(const char *flag, const char *value, unsigned *out_ms) {
+	char *endptr;
+	errno = 0;
+	double seconds = strtod(value, &endptr);
+	if (errno != 0 || endptr == value || *endptr != '\0' || !(seconds >= 0) || seconds > UINT_MAX / 1000) {
+		fprintf(stderr, "Error: %s expects a number of seconds like 30 or 0.5 (0 for none), got '%s'.\n", flag,
+				value);
+		return -1;
+	}
+	*out_ms = (unsigned)(seconds * 1000 + 0.5);
+	if (*out_ms == 0 && seconds > 0) {
+		*out_ms = 1;
+	}
+	return 0;
+}
+
+/*
+ * Parse the command line:
+ *   --directory <path>  directory served by /files/
+ *   --workers <n>       number of worker threads, each with its own listener (default: one per CPU)
+ *   --backlog <n>       listen queue length per worker socket (default: SOMAXCONN)
+ *   --max-connections <n>     open connections before new ones are answered 503 (default: half the file limit)
+ *   --cache-size <size> memory for caching small /files/ responses, e.g. 64M (default: off)
+ *   --open-files <n>    /files/ kept open along with their stat() (default: 1024; 0 for none)
+ *   --cache-control <value>   Cache-Control header for /files/ responses, e.g. "max-age=60" (default: none)
+ *   --max-header-size <size>  largest request line + header block, answered with 431 beyond (default: 8K)
+ *   --max-headers <n>         most header fields per request, 431 beyond (default: 64)
+ *   --max-body-size <size>    largest accepted Content-Length, 413 beyond (default: unlimited)
+ *   --io-backend <name>       epoll or io_uring (default: epoll; io_uring falls back to epoll if unavailable)
+ *   --tls-cert <file>         PEM certificate chain for HTTPS; with --tls-key opens the HTTPS listener
+ *   --tls-key <file>          PEM private key for the certificate
+ *   --tls-port <port>         port of the HTTPS listener (default: 4443)
+ *   --log-level <level>       debug, info, warn or error (default: info)
+ *   --access-log <on|off>     log a line per request with its status and latency (default: off)
+ *   --http2 <on|off>          accept cleartext HTTP/2, by prior knowledge or Upgrade: h2c (default: on)
+ *   --header-timeout <s>      seconds to receive a request's header block (default: 10; 0 for none)
+ *   --body-timeout <s>        seconds a request body may stall (default: 30)
+ *   --write-timeout <s>       seconds a response may stall because the client isn't reading (default: 30)
+ *   --idle-timeout <s>        seconds a kept-alive connection may wait for its next request (default: 60)
+ *   --drain-timeout <s>       seconds open connections get to finish on restart or SIGQUIT (default: 30)
+ *   --durable-uploads <on|off>  answer POST /files/ only once the file is synced to disk (default: off)
+ *   --commit-window <s>       seconds a durable upload waits for others to share its sync (default: 0)
+ * Returns 0 on success, -1 if an argument is malformed.
+ */
+static int parse_args(int argc, char *argv[]) {
 	for (int i = 1; i < argc; ++i) {
-		if (strcmp(argv[i], "--directory") == 0) {
-			if (i + 1 < argc) { // Make sure there is a value after the flag
-				g_directory_path = argv[i + 1];
-				printf("Serving files from directory: %s\n", g_directory_path);
-				break; // Stop parsing once directory is found
+		// Every flag takes a value, so make sure there is one after it
+		if (i + 1 >= argc) {
+			fprintf(stderr, "Error: %s flag requires an argument.\n", argv[i]);
+			return -1;
+		}
+		const char *flag = argv[i];
+		char *value = argv[++i];
+		if (strcmp(flag, "--directory") == 0) {
+			g_directory_path = value;
+		} else if (strcmp(flag, "--workers") == 0) {
+			if (parse_positive_int("--workers", value, &g_worker_count) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--backlog") == 0) {
+			if (parse_positive_int("--backlog", value, &g_listen_backlog) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--max-connections") == 0) {
+			if (parse_positive_int("--max-connections", value, &g_max_connections) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--header-timeout") == 0) {
+			if (parse_timeout(flag, value, &g_timeouts.header_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--body-timeout") == 0) {
+			if (parse_timeout(flag, value, &g_timeouts.body_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--write-timeout") == 0) {
+			if (parse_timeout(flag, value, &g_timeouts.write_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--idle-timeout") == 0) {
+			if (parse_timeout(flag, value, &g_timeouts.idle_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--drain-timeout") == 0) {
+			if (parse_timeout(flag, value, &g_drain_timeout_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--commit-window") == 0) {
+			if (parse_timeout(flag, value, &g_commit_window_ms) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--cache-size") == 0) {
+			if (parse_size("--cache-size", value, &g_cache_size) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--open-files") == 0) {
+			if (parse_size(flag, value, &g_open_files) != 0) {
+				return -1;
+			}
+		} else if (strcmp(flag, "--cache-control") == 0) {
+			// Sent verbatim as a header line, so it must be one short line
+			if (strlen(value) > CACHE_CONTROL_MAX || strpbrk(value, "\r\n") != NULL) {
+				fprintf(stderr, "Error: --cache-control must be a single line of at most %d bytes.\n",
+						CACHE_CONTROL_MAX);
+				return -1;
+			}
+			g_cache_control = value;
+		} else if (strcmp(flag, "--io-backend") == 0) {
+			if (strcmp(value, "epoll") == 0) {
+				g_io_backend = IO_BACKEND_EPOLL;
+			} else if (strcmp(value, "io_uring") == 0) {
+				g_io_backend = IO_BACKEND_IO_URING;
 			} else {
-				fprintf(stderr, "Error: --directory flag requires an argument.\n");
-				close(server_fd);
-				return 1; // Exit if argument is malformed
+				fprintf(stderr, "Error: --io-backend expects epoll or io_uring, got '%s'.\n", value);
+				return -1;
+			}
+		} else if (strcmp(flag, "--tls-cert") == 0) {
+			g_tls_cert = value;
+		} else if (strcmp(flag, "--tls-key") == 0) {
+			g_tls_key = value;
+		} else if (strcmp(flag, "--tls-port") == 0) {
+			if (parse_positive_int(flag, value, &g_tls_port) != 0) {
+				return -1;
+			}
+			if (g_tls_port > 65535 || g_tls_port == SERVER_PORT) {
+				fprintf(stderr, "Error: --tls-port must be a port other than %d, got '%s'.\n", SERVER_PORT, value);
+				return -1;
 			}
+		} else if (strcmp(flag, "--log-level") == 0) {
+			if (log_parse_level(value, &g_log_level) != 0) {
+				fprintf(stderr, "Error: --log-level expects debug, info, warn or error, got '%s'.\n", value);
+				return -1;
+			}
+		} else if (strcmp(flag, "--access-log") == 0) {
+			if (strcmp(value, "on") == 0) {
+				g_access_log = 1;
+			} else if (strcmp(value, "off") == 0) {
+				g_access_log = 0;
+			} else {
+				fprintf(stderr, "Error: --access-log expects on or off, got '%s'.\n", value);
+				return -1;
+			}
+		} else if (strcmp(flag, "--http2") == 0) {
+			if (strcmp(value, "on") == 0) {
+				g_http2 = 1;
+			} else if (strcmp(value, "off") == 0) {
+				g_http2 = 0;
+			} else {
+				fprintf(stderr, "Error: --http2 expects on or off, got '%s'.\n", value);
+				return -1;
+			}
+		} else if (strcmp(flag, "--durable-uploads") == 0) {
+			if (strcmp(value, "on") == 0) {
+				g_durable_uploads = 1;
+			} else if (strcmp(value, "off") == 0) {
+				g_durable_uploads = 0;
+			} else {
+				fprintf(stderr, "Error: --durable-uploads expects on or off, got '%s'.\n", value);
+				return -1;
+			}
+		} else if (strcmp(flag, "--max-header-size") == 0) {
+			if (parse_size(flag, value, &g_parser_limits.max_header_bytes) != 0) {
+				return -1;
+			}
+			// Must at least fit a minimal request line
+			if (g_parser_limits.max_header_bytes < 64 || g_parser_limits.max_header_bytes > UINT32_MAX) {
+				fprintf(stderr, "Error: --max-header-size must be between 64 bytes and 4G.\n");
+				return -1;
+			}
+			if (g_parser_limits.max_uri > g_parser_limits.max_header_bytes) {
+				g_parser_limits.max_uri = g_parser_limits.max_header_bytes;
+			}
+		} else if (strcmp(flag, "--max-headers") == 0) {
+			int max_headers;
+			if (parse_positive_int(flag, value, &max_headers) != 0) {
+				return -1;
+			}
+			if (max_headers > HTTP_MAX_HEADERS_CAP) {
+				fprintf(stderr, "Error: --max-headers can be at most %d.\n", HTTP_MAX_HEADERS_CAP);
+				return -1;
+			}
+			g_parser_limits.max_headers = (size_t)max_headers;
+		} else if (strcmp(flag, "--max-body-size") == 0) {
+			size_t max_body;
+			if (parse_size(flag, value, &max_body) != 0) {
+				return -1;
+			}
+			g_parser_limits.max_body = max_body;
+		} else {
+			fprintf(stderr, "Error: unknown flag %s.\n", flag);
+			return -1;
 		}
 	}
-	// Optional: Could add a check here to ensure g_directory_path is set if required
-	// if (g_directory_path == NULL) { ... error ... }
+	if ((g_tls_cert == NULL) != (g_tls_key == NULL)) {
+		fprintf(stderr, "Error: --tls-cert and --tls-key must be given together.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Main function - entry point of the program */
+int main(int argc, char *argv[]) {
+	// Sends use MSG_NOSIGNAL, but sendfile() and splice() have no such flag:
+	// writing to a socket the client has reset would kill the whole server
+	// instead of failing with EPIPE
+	signal(SIGPIPE, SIG_IGN);
+	// Before any thread exists, so they all leave the restart signals to main()
+	if (restart_init(argv) != 0) {
+		return 1;
+	}
+
+	// --- Argument Parsing ---
+	// Errors in the arguments go straight to stderr: the logger isn't running yet
+	if (parse_args(argc, argv) != 0) {
+		return 1; // Exit if an argument is malformed
+	}
 
-	printf("Waiting for clients to connect...\n");
-	
-	/* 
-	 * Set the size of the client address structure. This is required by accept().
-	 * It's an "value-result" argument for accept: 
-	 * Before the call, it holds the size of the buffer pointed to by client_addr.
-	 * After the call, it holds the actual size of the client address returned.
-	 */
-	client_addr_len = sizeof(client_addr);
-	
 	/*
-	 * Accept an incoming connection on the listening socket:
-	 * This function blocks (waits) until a client attempts to connect to the server.
-	 * When a connection arrives, it creates a *new* socket for communication with that specific client
-	 * and fills in the client_addr structure with the client's address details.
-	 * server_fd: The listening socket descriptor.
-	 * (struct sockaddr *) &client_addr: Pointer to a sockaddr structure (or sockaddr_in) where the 
-	 *                                  connecting client's address information will be stored.
-	 * &client_addr_len: Pointer to the variable holding the size of the client_addr structure. 
-	 *                   On return, it will contain the actual size of the client address.
-	 *                   Note: This should technically be a pointer to socklen_t.
-	 * Returns a new socket file descriptor for the accepted connection, or -1 on error.
-	 * The original server_fd remains listening for more connections. 
-	 * (Although in this simple example, we only accept one connection).
-	 * --- This simple version does not store or use the returned client socket descriptor. ---
+	 * From here on everything is logged through log.h: each thread queues its lines in a ring
+	 * of its own and a background thread writes them out in batches, so a worker never waits
+	 * on a write() or on other threads to log. What is still queued is written out at exit.
 	 */
-	// --- Main Server Loop ---
-	// Continuously accept incoming connections
-	while(1) {
-		client_addr_len = sizeof(client_addr); // Reset size for each accept call
-		// Accept a new connection. This blocks until a client connects.
-		int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-		if (client_fd < 0) {
-			perror("Accept failed");
-			// Don't exit the server on accept failure, just log and continue.
-			continue; 
+	if (log_init(g_log_level) != 0) {
+		return 1;
+	}
+	log_info("Logs from your program will appear here!");
+	// Opened once: requests name files relative to it and can't get out of it
+	if (g_directory_path != NULL) {
+		if (open_files_init(g_directory_path, g_open_files) != 0) {
+			return 1;
+		}
+		log_info("Serving files from directory: %s", g_directory_path);
+	}
+	// Durable uploads are synced by a thread of their own, in groups
+	if (g_durable_uploads) {
+		if (commit_init(g_commit_window_ms) != 0) {
+			return 1;
 		}
-		
-		// Log client connection
-		printf("Client connected (FD: %d)\n", client_fd);
+		log_info("Durable uploads on, commit window %ums", g_commit_window_ms);
+	}
+
+	log_info("Header scanning: %s", header_scan_init());
 
-		// --- Thread Creation ---
-		// We need to pass the client_fd to the new thread. 
-		// Since client_fd is on the stack of this loop and the loop continues,
-		// we must allocate memory on the heap to safely pass the FD value.
-		int *client_fd_arg = malloc(sizeof(int));
-		if (client_fd_arg == NULL) {
-			perror("Failed to allocate memory for thread argument");
-			close(client_fd); // Close the accepted socket as we can't handle it
-			continue; // Continue to the next loop iteration
+	// The certificate and key are loaded once, into the context every worker's connections share
+	if (g_tls_cert != NULL) {
+		if (tls_init(g_tls_cert, g_tls_key) != 0) {
+			return 1;
 		}
-		*client_fd_arg = client_fd; // Store the accepted file descriptor
+		log_info("HTTPS enabled on port %d", g_tls_port);
+	}
+
+	// Connections and their buffers come from the pool; if the address space
+	// can't be reserved they fall back to malloc(), which still works
+	pool_init();
 
-		// Create a new thread to handle the client connection.
-		pthread_t thread_id;
-		if (pthread_create(&thread_id, NULL, handle_client, client_fd_arg) != 0) {
-			perror("pthread_create failed");
-			free(client_fd_arg); // Free allocated memory as thread creation failed
-			close(client_fd);    // Close the client socket
-			continue; // Continue to the next loop iteration
+	// The routes are compiled into the router's trie once, before any worker reads it
+	if (connection_routes_init() != 0) {
+		return 1;
+	}
+
+	// The cache watches the served directory for changes, so it needs one
+	if (g_cache_size > 0 && g_directory_path != NULL) {
+		if (file_cache_init(g_cache_size, g_directory_path) != 0) {
+			return 1;
 		}
+		log_info("File cache enabled (%zu bytes)", g_cache_size);
+	}
 
-		// Detach the thread. This tells the system that we don't intend to 
-		// join this thread later. Resources associated with the thread will be 
-		// automatically released when the thread terminates. This simplifies cleanup.
-		pthread_detach(thread_id);
+	/*
+	 * Every connection costs at least one file descriptor, so take all the hard limit allows. Past
+	 * --max-connections new clients are answered with a quick 503 instead of being served; by
+	 * default the cap is half the limit, leaving room for the files, upload pipes and cache
+	 * watches that connections open on top of their sockets. Should descriptors run out anyway,
+	 * the workers pause accepting for a moment instead of spinning on EMFILE.
+	 */
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+		nofile.rlim_cur = nofile.rlim_max;
+		// Fails for a hard limit above what the kernel allows (RLIM_INFINITY);
+		// the soft limit then stays as it was
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+	if (g_max_connections == 0) {
+		rlim_t half = getrlimit(RLIMIT_NOFILE, &nofile) == 0 ? nofile.rlim_cur / 2 : 512;
+		g_max_connections = half > INT_MAX ? INT_MAX : half > 0 ? (int)half : 1;
+	}
+	log_info("Accepting up to %d connections", g_max_connections);
 
-		// The main loop immediately continues to accept the next connection, 
-		// while the newly created thread handles the previous client concurrently.
-	} // --- End of Main Server Loop ---
+	if (g_worker_count == 0) {
+		long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+		g_worker_count = cpu_count > 0 ? (int)cpu_count : 1;
+	}
+
+	/*
+	 * Pre-create one listening socket per worker. 
+	 * listen_fds: File descriptors of the sockets, all bound to the same port through SO_REUSEPORT.
+	 *             File descriptors are small non-negative integers that the kernel uses 
+	 *             to identify open files, sockets, pipes, etc.
+	 *             Accepting clients (and their addresses) is left to the event loop workers.
+	 */
+	int *listen_fds = calloc((size_t)g_worker_count, sizeof(*listen_fds));
+	if (listen_fds == NULL) {
+		log_error("Failed to allocate listener array: %m");
+		return 1;
+	}
+	for (int i = 0; i < g_worker_count; i++) {
+		// After a restart, the sockets the previous instance listened on
+		listen_fds[i] = restart_take_listener(SERVER_PORT);
+		if (listen_fds[i] < 0) {
+			listen_fds[i] = create_listen_socket(SERVER_PORT, g_listen_backlog);
+		}
+		if (listen_fds[i] < 0) {
+			return 1; /* Exit with error code 1 */
+		}
+	}
+	// Likewise for HTTPS: each worker also accepts TLS clients on a listener of its own
+	int *tls_listen_fds = NULL;
+	if (g_tls_cert != NULL) {
+		tls_listen_fds = calloc((size_t)g_worker_count, sizeof(*tls_listen_fds));
+		if (tls_listen_fds == NULL) {
+			log_error("Failed to allocate listener array: %m");
+			return 1;
+		}
+		for (int i = 0; i < g_worker_count; i++) {
+			tls_listen_fds[i] = restart_take_listener(g_tls_port);
+			if (tls_listen_fds[i] < 0) {
+				tls_listen_fds[i] = create_listen_socket(g_tls_port, g_listen_backlog);
+			}
+			if (tls_listen_fds[i] < 0) {
+				return 1;
+			}
+		}
+	}
+
+	log_info("Waiting for clients to connect...");
 	
-	/* 
-	 * The code below is now unreachable because of the infinite `while(1)` loop. 
-	 * In a production server, you'd typically have signal handling (e.g., for Ctrl+C) 
-	 * to gracefully break the loop and close the main server socket.
-	 * For this exercise, leaving the loop infinite is acceptable.
+	/*
+	 * Hand the listening sockets to the event loop. Instead of one blocking thread per
+	 * client, a fixed pool of worker threads, each pinned to a core, runs an edge-triggered
+	 * epoll loop over its own listener. A worker accepts the connections the kernel queued on
+	 * its socket and multiplexes them together with all its other clients, resuming each
+	 * connection's request state machine whenever its socket becomes ready again.
+	 * With --io-backend io_uring the workers instead queue accepts, receives and sends on
+	 * a per-worker io_uring and react to their completions, entering the kernel once per
+	 * batch rather than once per operation.
 	 */
-	// close(server_fd);
+	if (g_io_backend == IO_BACKEND_IO_URING && !uring_loop_supported()) {
+		log_warn("io_uring is not available on this system, falling back to epoll");
+		g_io_backend = IO_BACKEND_EPOLL;
+	}
+	log_info("Starting %d worker threads (listen backlog %d, %s)", g_worker_count, g_listen_backlog,
+		   g_io_backend == IO_BACKEND_IO_URING ? "io_uring" : "epoll");
+	int loop_result = g_io_backend == IO_BACKEND_IO_URING
+						  ? uring_loop_start(listen_fds, tls_listen_fds, g_worker_count)
+						  : event_loop_start(listen_fds, tls_listen_fds, g_worker_count);
+	if (loop_result != 0) {
+		return 1;
+	}
 
-	return 0; // Technically unreachable, but good practice.
-}
\ No newline at end of file
+	/*
+	 * The workers run on their own from here. The main thread waits for SIGUSR2, on which it
+	 * starts a new instance and hands it the listening sockets, or SIGQUIT; either way the
+	 * workers then stop accepting and main() returns once their connections have finished.
+	 * SIGTERM and SIGINT still end the process at once.
+	 */
+	int result = restart_serve(listen_fds, tls_listen_fds, g_worker_count);
+	log_info("Exiting");
+	return result;
+}
@@ -0,0 +1,74 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+#include "log.h"
+
+// Port the server listens on
+#define SERVER_PORT 4221
+// Port of the HTTPS listener, unless set with --tls-port
+#define TLS_DEFAULT_PORT 4443
+
+// Directory that /files/ requests are served from (set with --directory).
+// NULL when the flag was not given.
+extern char *g_directory_path;
+// Number of worker threads / listening sockets (set with --workers)
+extern int g_worker_count;
+// Listen queue length of each worker's socket (set with --backlog)
+extern int g_listen_backlog;
+// Open connections beyond which new clients are answered with 503 (set with --max-connections)
+extern int g_max_connections;
+// Byte budget of the /files/ hot-file cache, 0 when disabled (set with --cache-size)
+extern size_t g_cache_size;
+// Files kept open with their stat() for /files/, 0 to open every time (set with --open-files)
+extern size_t g_open_files;
+// Cache-Control value for /files/ responses, NULL to send none (set with --cache-control)
+#define CACHE_CONTROL_MAX 128
+extern const char *g_cache_control;
+// Lines below this level are not logged (set with --log-level)
+extern enum log_level g_log_level;
+// Log a line for every request answered (set with --access-log)
+extern int g_access_log;
+// Whether cleartext HTTP/2 is accepted, by prior knowledge or Upgrade: h2c
+// (set with --http2)
+extern int g_http2;
+// How long a connection may stay in each phase before it is closed, in
+// milliseconds, 0 for no limit (set with --header-timeout, --body-timeout,
+// --write-timeout, --idle-timeout)
+struct connection_timeouts {
+	unsigned header_ms; // waiting for a request's header block to complete
+	unsigned body_ms;   // without any of a request body arriving
+	unsigned write_ms;  // with a response pending and nothing sent
+	unsigned idle_ms;   // between requests on a kept-alive connection
+};
+extern struct connection_timeouts g_timeouts;
+// How long a restart or SIGQUIT waits for open connections to finish before
+// exiting, in milliseconds, 0 for no limit (set with --drain-timeout)
+extern unsigned g_drain_timeout_ms;
+// Whether POST /files/ is answered only once the upload is synced to disk
+// (set with --durable-uploads)
+extern int g_durable_uploads;
+// How long the commit thread lets more uploads join a group before syncing
+// it, in milliseconds, 0 to sync at once (set with --commit-window)
+extern unsigned g_commit_window_ms;
+// Request parser limits (set with --max-header-size, --max-headers, --max-body-size)
+extern struct http_parser_limits g_parser_limits;
+
+// How the workers wait for and perform socket I/O
+enum io_backend {
+	IO_BACKEND_EPOLL,    // readiness with epoll, then plain system calls
+	IO_BACKEND_IO_URING, // batched submissions and completions through io_uring
+};
+// Selected I/O backend (set with --io-backend)
+extern enum io_backend g_io_backend;
+
+// Certificate chain and private key (PEM files) of the HTTPS listener, which
+// is only opened when both are given (set with --tls-cert, --tls-key)
+extern const char *g_tls_cert;
+extern const char *g_tls_key;
+// Port of the HTTPS listener (set with --tls-port)
+extern int g_tls_port;
+
+#endif
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <limits.h>
+
+#include "timer_wheel.h"
+
+// Ticks spanned by one slot of `level`, minus one
+static uint64_t span_mask(int level) {
+	return (1ULL << (TIMER_SLOT_BITS * level)) - 1;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+	wheel->tick = 0;
+	wheel->base_ms = now_ms;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		wheel->occupied[level] = 0;
+		for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+			struct timer *head = &wheel->slots[level][slot];
+			head->next = head->prev = head;
+		}
+	}
+}
+
+// Put an armed timer into the slot its deadline falls in, relative to the
+// current tick. Also used to move timers down when their slot comes up, in
+// which case the deadline may be the current tick itself.
+static void place(struct timer_wheel *wheel, struct timer *timer) {
+	uint64_t expires = timer->expires;
+	uint64_t delta = expires - wheel->tick;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta > span_mask(level + 1)) {
+		level++;
+	}
+	if (delta > span_mask(TIMER_LEVELS)) {
+		expires = wheel->tick + span_mask(TIMER_LEVELS); // Placed again when the top level turns over
+	}
+	int slot = (int)((expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+	struct timer *head = &wheel->slots[level][slot];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_ms) {
+	timer_cancel(timer);
+	uint64_t expires = 0;
+	if (deadline_ms > wheel->base_ms) {
+		expires = (deadline_ms - wheel->base_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	}
+	// The current tick has already been expired
+	timer->expires = expires > wheel->tick ? expires : wheel->tick + 1;
+	place(wheel, timer);
+}
+
+void timer_cancel(struct timer *timer) {
+	if (timer->prev == NULL) {
+		return;
+	}
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+// Whether a slot's list is empty; clears its occupied bit if so
+static int slot_empty(struct timer_wheel *wheel, int level, int slot) {
+	struct timer *head = &wheel->slots[level][slot];
+	if (head->next != head) {
+		return 0;
+	}
+	wheel->occupied[level] &= ~(1ULL << slot);
+	return 1;
+}
+
+// Empty a slot of `level`, whose span starts at the current tick, into the
+// levels below
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+	struct timer *head = &wheel->slots[level][slot];
+	struct timer *timer = head->next;
+	head->next = head->prev = head;
+	wheel->occupied[level] &= ~(1ULL << slot);
+	while (timer != head) {
+		struct timer *next = timer->next;
+		place(wheel, timer);
+		timer = next;
+	}
+}
+
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms) {
+	uint64_t target = now_ms > wheel->base_ms ? (now_ms - wheel->base_ms) / TIMER_TICK_MS : 0;
+	struct timer *expired = NULL;
+	while (wheel->tick < target) {
+		// With the lowest levels empty, nothing happens before the span of
+		// the first occupied one ends: skip there
+		int level = 0;
+		while (level < TIMER_LEVELS && wheel->occupied[level] == 0) {
+			level++;
+		}
+		if (level == TIMER_LEVELS) {
+			wheel->tick = target;
+			break;
+		}
+		if (level > 0) {
+			uint64_t next = (wheel->tick | span_mask(level)) + 1;
+			if (next > target) {
+				wheel->tick = target;
+				break;
+			}
+			wheel->tick = next - 1;
+		}
+
+		uint64_t tick = ++wheel->tick;
+		// Where a span starts, bring its timers down, coarsest level first
+		int top = 0;
+		while (top < TIMER_LEVELS - 1 && (tick & span_mask(top + 1)) == 0) {
+			top++;
+		}
+		for (level = top; level > 0; level--) {
+			cascade(wheel, level, (int)((tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)));
+		}
+		// Everything left in this tick's level 0 slot is due
+		int slot = (int)(tick & (TIMER_SLOTS - 1));
+		struct timer *head = &wheel->slots[0][slot];
+		while (head->next != head) {
+			struct timer *timer = head->next;
+			timer_cancel(timer);
+			timer->next = expired;
+			expired = timer;
+		}
+		wheel->occupied[0] &= ~(1ULL << slot);
+	}
+	return expired;
+}
+
+struct timer *timer_wheel_take_all(struct timer_wheel *wheel) {
+	struct timer *taken = NULL;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+			struct timer *head = &wheel->slots[level][slot];
+			while (head->next != head) {
+				struct timer *timer = head->next;
+				timer_cancel(timer);
+				timer->next = taken;
+				taken = timer;
+			}
+		}
+		wheel->occupied[level] = 0;
+	}
+	return taken;
+}
+
+// Distance from slot `from` to the first occupied slot of `level` at or
+// after it, going round once. The level must have an occupied slot.
+static uint64_t slots_ahead(const struct timer_wheel *wheel, int level, uint64_t from) {
+	unsigned shift = (unsigned)(from & (TIMER_SLOTS - 1));
+	uint64_t bits = wheel->occupied[level];
+	uint64_t rotated = shift == 0 ? bits : (bits >> shift) | (bits << (TIMER_SLOTS - shift));
+	return (uint64_t)__builtin_ctzll(rotated);
+}
+
+int timer_wheel_timeout_ms(struct timer_wheel *wheel, uint64_t now_ms) {
+	uint64_t next = UINT64_MAX;
+	while (wheel->occupied[0] != 0) {
+		uint64_t tick = wheel->tick + 1 + slots_ahead(wheel, 0, wheel->tick + 1);
+		if (!slot_empty(wheel, 0, (int)(tick & (TIMER_SLOTS - 1)))) {
+			next = tick;
+			break;
+		}
+	}
+	// Timers further out first have to be moved down, at the start of their
+	// slot's span
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		if (wheel->occupied[level] == 0) {
+			continue;
+		}
+		uint64_t span = (wheel->tick >> (TIMER_SLOT_BITS * level)) + 1;
+		span += slots_ahead(wheel, level, span);
+		uint64_t start = span << (TIMER_SLOT_BITS * level);
+		if (start < next) {
+			next = start;
+		}
+	}
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+	uint64_t due_ms = wheel->base_ms + next * TIMER_TICK_MS;
+	if (due_ms <= now_ms) {
+		return 0;
+	}
+	return due_ms - now_ms > INT_MAX ? INT_MAX : (int)(due_ms - now_ms);
+}
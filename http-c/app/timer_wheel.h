@@ -0,0 +1,68 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel, one per worker and only touched by its thread.
+// Time is counted in ticks of TIMER_TICK_MS. Level 0 has a slot per tick for
+// the next TIMER_SLOTS ticks; each level above covers TIMER_SLOTS times the
+// span of the one below, one slot per span of the level below. A timer sits
+// in the slot of the coarsest level its deadline falls in and is moved down
+// a level each time the wheel reaches the start of that slot's span, so
+// arming and cancelling are O(1) and expiring costs O(1) per timer and level.
+
+// Deadlines are rounded up to whole ticks
+#define TIMER_TICK_MS 10
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+// Four levels reach 64^4 ticks, about 46 hours; later deadlines wait in the
+// top level and are placed again each time it turns over
+#define TIMER_LEVELS 4
+
+// Embedded in whatever it times. Armed timers are kept in a circular list
+// per slot, which is what makes cancelling O(1).
+struct timer {
+	struct timer *next;
+	struct timer *prev; // NULL while not armed
+	uint64_t expires;   // tick
+};
+
+struct timer_wheel {
+	uint64_t tick;    // last tick expired
+	uint64_t base_ms; // time at tick 0
+	// A bit per slot that may hold timers. Cancelling doesn't clear it; the
+	// wheel does when it finds the slot empty.
+	uint64_t occupied[TIMER_LEVELS];
+	struct timer slots[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+};
+
+// `now_ms` is on whatever clock the caller keeps passing in
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+
+static inline void timer_init(struct timer *timer) {
+	timer->next = timer->prev = NULL;
+}
+
+static inline int timer_armed(const struct timer *timer) {
+	return timer->prev != NULL;
+}
+
+// (Re)arm `timer` to expire at `deadline_ms`, at least one tick from now
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline_ms);
+// Disarm `timer` if armed
+void timer_cancel(struct timer *timer);
+
+// Advance the wheel to `now_ms` and return the timers that expired on the
+// way, disarmed and chained through `next`, or NULL
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms);
+
+// Disarm every timer and return them chained through `next`, or NULL, for
+// when all that is timed has to be visited at once
+struct timer *timer_wheel_take_all(struct timer_wheel *wheel);
+
+// Milliseconds until timer_wheel_expire() may have something to do, for a
+// poll timeout: 0 if it's due, -1 if no timer is armed
+int timer_wheel_timeout_ms(struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "tls.h"
+#include "metrics.h"
+#include "log.h"
+
+// Sessions remembered in the shared cache, for clients that resume by
+// session ID rather than with a ticket
+#define TLS_SESSION_CACHE_SIZE 20000
+// How long a session (or ticket) may be resumed, in seconds
+#define TLS_SESSION_LIFETIME (2 * 60 * 60)
+
+struct tls {
+	SSL *ssl;
+	int handshake_done;
+	int kernel_send; // kTLS took over the sending side
+};
+
+static SSL_CTX *context;
+
+// Log the reasons OpenSSL queued for the last failure, and clear them
+static void log_openssl_errors(enum log_level level, const char *what) {
+	unsigned long code;
+	while ((code = ERR_get_error()) != 0) {
+		char reason[256];
+		ERR_error_string_n(code, reason, sizeof(reason));
+		log_write(level, "%s: %s", what, reason);
+	}
+}
+
+// ALPN: we only speak HTTP/1.1. A client that offers no protocol we know
+// gets no ALPN answer and may go on with HTTP/1.1 anyway.
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in,
+						   unsigned in_len, void *arg) {
+	(void)ssl;
+	(void)arg;
+	static const unsigned char supported[] = "\x08http/1.1";
+	unsigned char *selected;
+	if (SSL_select_next_proto(&selected, out_len, supported, sizeof(supported) - 1, in, in_len) !=
+		OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const char *cert_file, const char *key_file) {
+	context = SSL_CTX_new(TLS_server_method());
+	if (context == NULL) {
+		log_openssl_errors(LOG_ERROR, "SSL_CTX_new failed");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	// ENABLE_KTLS: offload the record layer once the keys are known.
+	// IGNORE_UNEXPECTED_EOF: a client that just closes the connection is
+	// treated like one that sent close_notify first, as plaintext HTTP does.
+	SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF |
+									 SSL_OP_CIPHER_SERVER_PREFERENCE);
+	// Writes may complete partially and be retried from a buffer that has
+	// moved, like send(); idle connections give their record buffers back
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+								  SSL_MODE_RELEASE_BUFFERS);
+	if (SSL_CTX_use_certificate_chain_file(context, cert_file) != 1) {
+		log_openssl_errors(LOG_ERROR, "Cannot load TLS certificate");
+		return -1;
+	}
+	if (SSL_CTX_use_PrivateKey_file(context, key_file, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(context) != 1) {
+		log_openssl_errors(LOG_ERROR, "Cannot load TLS private key");
+		return -1;
+	}
+	// Resumption: tickets are sealed with keys OpenSSL generated for this
+	// context, and session IDs are looked up in its internal cache, which
+	// is locked, so both work across workers
+	static const unsigned char session_context[] = "http-c";
+	SSL_CTX_set_session_id_context(context, session_context, sizeof(session_context) - 1);
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(context, TLS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(context, TLS_SESSION_LIFETIME);
+	SSL_CTX_set_alpn_select_cb(context, select_protocol, NULL);
+	return 0;
+}
+
+struct tls *tls_new(int fd) {
+	struct tls *tls = calloc(1, sizeof(*tls));
+	if (tls == NULL) {
+		log_error("Out of memory for TLS state");
+		return NULL;
+	}
+	tls->ssl = SSL_new(context);
+	// A socket BIO, which is what kTLS can be enabled on
+	if (tls->ssl == NULL || SSL_set_fd(tls->ssl, fd) != 1) {
+		log_openssl_errors(LOG_ERROR, "Cannot set up TLS connection");
+		SSL_free(tls->ssl);
+		free(tls);
+		return NULL;
+	}
+	SSL_set_accept_state(tls->ssl);
+	return tls;
+}
+
+void tls_free(struct tls *tls) {
+	// OpenSSL drops the session from the cache when a connection is freed
+	// without having sent close_notify, as most are (the client closes first,
+	// or times out while idle). Mark it shut down so the session stays
+	// resumable; fatal errors have made it unresumable already.
+	if (tls->handshake_done) {
+		SSL_set_shutdown(tls->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	}
+	SSL_free(tls->ssl);
+	free(tls);
+}
+
+enum tls_result tls_handshake(struct tls *tls) {
+	ERR_clear_error();
+	int result = SSL_do_handshake(tls->ssl);
+	if (result == 1) {
+		tls->handshake_done = 1;
+		tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+		int resumed = SSL_session_reused(tls->ssl);
+		log_debug("TLS handshake done: %s, %s, %s, kTLS send %s, receive %s", SSL_get_version(tls->ssl),
+				  SSL_get_cipher_name(tls->ssl), resumed ? "resumed" : "full",
+				  tls->kernel_send ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? "on" : "off");
+		metrics_tls_handshake(resumed, tls->kernel_send);
+		return TLS_DONE;
+	}
+	switch (SSL_get_error(tls->ssl, result)) {
+	case SSL_ERROR_WANT_READ:
+		return TLS_WANT_READ;
+	case SSL_ERROR_WANT_WRITE:
+		return TLS_WANT_WRITE;
+	case SSL_ERROR_SYSCALL:
+		// The client went away (errno is 0 at a plain EOF)
+		ERR_clear_error();
+		break;
+	default:
+		log_openssl_errors(LOG_INFO, "TLS handshake failed");
+		break;
+	}
+	metrics_tls_handshake_failed();
+	return TLS_FAILED;
+}
+
+int tls_kernel_send(const struct tls *tls) {
+	return tls->kernel_send;
+}
+
+// errno for a failed SSL_read() or SSL_write() that returned `result`
+static void set_errno(struct tls *tls, int result, const char *what) {
+	switch (SSL_get_error(tls->ssl, result)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		break;
+	case SSL_ERROR_SYSCALL:
+		// errno comes from the socket call
+		if (errno == 0) {
+			errno = ECONNRESET;
+		}
+		ERR_clear_error();
+		break;
+	default:
+		log_openssl_errors(LOG_INFO, what);
+		errno = EPROTO;
+		break;
+	}
+}
+
+ssize_t tls_read(struct tls *tls, void *buf, size_t len) {
+	ERR_clear_error();
+	size_t done;
+	int result = SSL_read_ex(tls->ssl, buf, len, &done);
+	if (result == 1) {
+		return (ssize_t)done;
+	}
+	if (SSL_get_error(tls->ssl, result) == SSL_ERROR_ZERO_RETURN) {
+		return 0;
+	}
+	set_errno(tls, result, "TLS read failed");
+	return -1;
+}
+
+ssize_t tls_write(struct tls *tls, const void *buf, size_t len) {
+	ERR_clear_error();
+	size_t done;
+	int result = SSL_write_ex(tls->ssl, buf, len, &done);
+	if (result == 1) {
+		return (ssize_t)done;
+	}
+	set_errno(tls, result, "TLS write failed");
+	return -1;
+}
+
+void tls_close_notify(struct tls *tls) {
+	if (tls->handshake_done) {
+		ERR_clear_error();
+		SSL_shutdown(tls->ssl);
+		ERR_clear_error();
+	}
+}
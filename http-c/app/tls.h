@@ -0,0 +1,64 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// HTTPS through OpenSSL. Connections accepted on the TLS listener run the
+// handshake in user space; once it is done OpenSSL hands the record layer to
+// the kernel (kTLS) where the kernel has the "tls" module and the cipher is
+// one it knows. The socket is then written like a plaintext one: sendmsg()
+// and sendfile() are encrypted by the kernel, so file bodies stay zero-copy.
+// Without kTLS, records are encrypted in user space with SSL_write().
+//
+// One context is shared by every worker, and with it the session cache and
+// the ticket keys, so a client can resume its session on any worker: with a
+// ticket (TLS 1.3, and 1.2 clients that support them) or by session ID.
+
+// Largest TLS record payload; user-space writes are gathered up to this
+#define TLS_RECORD_MAX (16 * 1024)
+
+// One connection's TLS state
+struct tls;
+
+enum tls_result {
+	TLS_DONE,
+	TLS_WANT_READ,  // retry once the socket is readable
+	TLS_WANT_WRITE, // retry once the socket is writable
+	TLS_FAILED,
+};
+
+// Load the certificate chain and private key (PEM files) and set up the
+// shared context. Only before the workers start. Returns 0 on success, -1
+// on error.
+int tls_init(const char *cert_file, const char *key_file);
+
+// TLS state for the accepted socket `fd`, in the server role. Returns NULL
+// on failure.
+struct tls *tls_new(int fd);
+
+// Free the state; the caller closes the socket
+void tls_free(struct tls *tls);
+
+// Advance the handshake as far as the socket allows. Counts it in the
+// metrics when it completes or fails.
+enum tls_result tls_handshake(struct tls *tls);
+
+// Whether, after the handshake, the kernel encrypts what is written to the
+// socket, so it can be written directly (including with sendfile())
+int tls_kernel_send(const struct tls *tls);
+
+// Like recv(): returns the bytes decrypted into `buf`, 0 once the peer has
+// closed, or -1 with errno set (EAGAIN when more must arrive first)
+ssize_t tls_read(struct tls *tls, void *buf, size_t len);
+
+// Like send() for user-space TLS: returns the bytes taken, or -1 with errno
+// set (EAGAIN when the socket is full). After EAGAIN the same bytes must be
+// offered again, possibly followed by more and from another address.
+ssize_t tls_write(struct tls *tls, const void *buf, size_t len);
+
+// Tell the peer we are done writing (close_notify), if the socket has room.
+// Best effort, before half-closing the socket.
+void tls_close_notify(struct tls *tls);
+
+#endif
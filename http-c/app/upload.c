@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "upload.h"
+#include "commit.h"
+#include "open_files.h"
+#include "log.h"
+
+// Requested pipe capacity for splicing. 1MB is the default
+// /proc/sys/fs/pipe-max-size, so unprivileged processes can get it; if
+// not, the pipe keeps whatever size the kernel gave it.
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+// Hex digits allowed in a chunk size (keeps the size below 2^60)
+#define CHUNK_SIZE_MAX_DIGITS 15
+// Bytes of chunk extensions and trailers we skip before giving up
+#define CHUNK_SKIP_MAX 8192
+
+// Where we are in the body. A Content-Length body is one BODY_DATA run.
+enum body_state {
+	BODY_DATA,
+	BODY_CHUNK_SIZE,
+	BODY_CHUNK_EXT,
+	BODY_CHUNK_SIZE_LF,
+	BODY_CHUNK_DATA_CR,
+	BODY_CHUNK_DATA_LF,
+	BODY_TRAILER,
+	BODY_TRAILER_LINE,
+	BODY_TRAILER_LF,
+	BODY_DONE,
+};
+
+struct upload {
+	int fd;                       // temporary file, -1 if it couldn't be created
+	int failed;                   // a write failed; keep consuming the body, then answer 500
+	off_t offset;                 // next write position in the file
+	int pipe_fds[2];              // splice pipe, created on first use (-1 until then)
+	size_t pipe_size;
+	int no_pipe;                  // pipe2() failed: the body goes through memory
+	int chunked;
+	enum body_state state;
+	unsigned long long remaining; // data bytes left in the body or current chunk
+	unsigned long long received;  // chunked data bytes so far, for max_body
+	unsigned long long max_body;
+	int size_digits;              // hex digits seen in the current chunk size
+	size_t skipped;               // extension/trailer bytes skipped
+	int error_status;
+	char name[1024];      // relative to the served directory, like temp_name
+	char temp_name[1100];
+};
+
+// Suffix counter for temporary names; O_EXCL catches any collision with a
+// leftover from an earlier run, and we simply try the next number.
+static atomic_ulong temp_counter;
+
+static int open_temp(struct upload *upload) {
+	for (int attempt = 0; attempt < 16; attempt++) {
+		unsigned long n = atomic_fetch_add(&temp_counter, 1);
+		snprintf(upload->temp_name, sizeof(upload->temp_name), "%s.upload-%ld-%lu", upload->name, (long)getpid(), n);
+		// Mode 0666 filtered by the umask, like the fopen() we replaced
+		int fd = open_beneath(upload->temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd >= 0 || errno != EEXIST) {
+			return fd;
+		}
+	}
+	errno = EEXIST;
+	return -1;
+}
+
+// An upload with no file yet, at the start of its body
+static struct upload *upload_new(struct arena *arena, long long content_length, int chunked,
+								 unsigned long long max_body) {
+	struct upload *upload = arena_alloc(arena, sizeof(*upload));
+	if (upload == NULL) {
+		return NULL;
+	}
+	memset(upload, 0, sizeof(*upload));
+	upload->fd = -1;
+	upload->pipe_fds[0] = upload->pipe_fds[1] = -1;
+	upload->chunked = chunked;
+	upload->max_body = max_body;
+	if (chunked) {
+		upload->state = BODY_CHUNK_SIZE;
+	} else {
+		upload->remaining = content_length > 0 ? (unsigned long long)content_length : 0;
+		upload->state = upload->remaining > 0 ? BODY_DATA : BODY_DONE;
+	}
+	return upload;
+}
+
+struct upload *upload_discard(struct arena *arena, long long content_length, int chunked,
+							  unsigned long long max_body) {
+	// Without a file, write_data() only counts the bytes
+	return upload_new(arena, content_length, chunked, max_body);
+}
+
+struct upload *upload_begin(struct arena *arena, const char *name, long long content_length, int chunked,
+							unsigned long long max_body) {
+	struct upload *upload = upload_new(arena, content_length, chunked, max_body);
+	if (upload == NULL) {
+		return NULL;
+	}
+	snprintf(upload->name, sizeof(upload->name), "%s", name);
+
+	upload->fd = open_temp(upload);
+	if (upload->fd < 0) {
+		if (errno == EXDEV) {
+			log_info("Refusing upload to '%s': outside the directory", upload->name);
+		} else {
+			log_error("Failed to create upload file: %m");
+		}
+		return upload;
+	}
+	// Reserve the blocks up front: the file is laid out contiguously instead
+	// of growing a piece at a time, and a full disk is reported now rather
+	// than halfway through the body. Filesystems without fallocate() just
+	// allocate as we write.
+	if (!chunked && content_length > 0 && fallocate(upload->fd, 0, 0, (off_t)content_length) != 0 &&
+		errno != EOPNOTSUPP && errno != ENOSYS) {
+		log_error("fallocate failed for upload: %m");
+		upload->failed = 1;
+	}
+	return upload;
+}
+
+// Write body data to the file at the current offset. After a failure the data
+// is only counted, so the rest of the body is still consumed.
+static void write_data(struct upload *upload, const char *data, size_t len) {
+	if (upload->fd < 0 || upload->failed) {
+		return;
+	}
+	while (len > 0) {
+		ssize_t written = pwrite(upload->fd, data, len, upload->offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("Failed to write upload: %m");
+			upload->failed = 1;
+			return;
+		}
+		upload->offset += written;
+		data += written;
+		len -= (size_t)written;
+	}
+}
+
+static ssize_t body_error(struct upload *upload, int status) {
+	upload->error_status = status;
+	return -1;
+}
+
+// The chunk size line is complete: start the chunk's data or the trailer
+static ssize_t end_chunk_size(struct upload *upload) {
+	if (upload->size_digits == 0) {
+		return body_error(upload, 400);
+	}
+	if (upload->remaining == 0) {
+		upload->state = BODY_TRAILER;
+		upload->skipped = 0;
+		return 0;
+	}
+	upload->received += upload->remaining;
+	if (upload->max_body > 0 && upload->received > upload->max_body) {
+		return body_error(upload, 413);
+	}
+	upload->state = BODY_DATA;
+	return 0;
+}
+
+// The current run of data bytes ended
+static void end_data(struct upload *upload) {
+	upload->state = upload->chunked ? BODY_CHUNK_DATA_CR : BODY_DONE;
+}
+
+ssize_t upload_feed(struct upload *upload, const char *data, size_t len) {
+	size_t pos = 0;
+	while (pos < len && upload->state != BODY_DONE) {
+		if (upload->state == BODY_DATA) {
+			size_t take = len - pos;
+			if (take > upload->remaining) {
+				take = (size_t)upload->remaining;
+			}
+			write_data(upload, data + pos, take);
+			pos += take;
+			upload->remaining -= take;
+			if (upload->remaining == 0) {
+				end_data(upload);
+			}
+			continue;
+		}
+
+		// Chunk framing, one byte at a time; it's a few bytes per chunk
+		char c = data[pos++];
+		switch (upload->state) {
+		case BODY_CHUNK_SIZE: {
+			int digit = -1;
+			if (c >= '0' && c <= '9') {
+				digit = c - '0';
+			} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+				digit = (c | 0x20) - 'a' + 10;
+			}
+			if (digit >= 0) {
+				if (++upload->size_digits > CHUNK_SIZE_MAX_DIGITS) {
+					return body_error(upload, 413);
+				}
+				upload->remaining = upload->remaining * 16 + (unsigned long long)digit;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				upload->state = BODY_CHUNK_EXT;
+				upload->skipped = 0;
+			} else if (c == '\r') {
+				upload->state = BODY_CHUNK_SIZE_LF;
+			} else if (c == '\n') {
+				if (end_chunk_size(upload) < 0) {
+					return -1;
+				}
+			} else {
+				return body_error(upload, 400);
+			}
+			break;
+		}
+		case BODY_CHUNK_EXT:
+			// Extensions carry nothing we use
+			if (c == '\n') {
+				if (end_chunk_size(upload) < 0) {
+					return -1;
+				}
+			} else if (++upload->skipped > CHUNK_SKIP_MAX) {
+				return body_error(upload, 400);
+			}
+			break;
+		case BODY_CHUNK_SIZE_LF:
+			if (c != '\n') {
+				return body_error(upload, 400);
+			}
+			if (end_chunk_size(upload) < 0) {
+				return -1;
+			}
+			break;
+		case BODY_CHUNK_DATA_CR:
+			if (c == '\r') {
+				upload->state = BODY_CHUNK_DATA_LF;
+				break;
+			}
+			// A bare LF after the data is tolerated
+			// fall through
+		case BODY_CHUNK_DATA_LF:
+			if (c != '\n') {
+				return body_error(upload, 400);
+			}
+			upload->state = BODY_CHUNK_SIZE;
+			upload->size_digits = 0;
+			upload->remaining = 0;
+			break;
+		case BODY_TRAILER:
+			// At the start of a trailer line; an empty line ends the body
+			if (c == '\r') {
+				upload->state = BODY_TRAILER_LF;
+			} else if (c == '\n') {
+				upload->state = BODY_DONE;
+			} else {
+				upload->state = BODY_TRAILER_LINE;
+			}
+			break;
+		case BODY_TRAILER_LINE:
+			if (++upload->skipped > CHUNK_SKIP_MAX) {
+				return body_error(upload, 400);
+			}
+			if (c == '\n') {
+				upload->state = BODY_TRAILER;
+			}
+			break;
+		case BODY_TRAILER_LF:
+			if (c != '\n') {
+				return body_error(upload, 400);
+			}
+			upload->state = BODY_DONE;
+			break;
+		case BODY_DATA:
+		case BODY_DONE:
+			break;
+		}
+	}
+	return (ssize_t)pos;
+}
+
+int upload_can_splice(const struct upload *upload) {
+	return upload->state == BODY_DATA && upload->fd >= 0 && !upload->failed && !upload->no_pipe;
+}
+
+static int open_pipe(struct upload *upload) {
+	if (pipe2(upload->pipe_fds, O_CLOEXEC) != 0) {
+		log_error("pipe2 failed for upload: %m");
+		upload->pipe_fds[0] = upload->pipe_fds[1] = -1;
+		return -1;
+	}
+	fcntl(upload->pipe_fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+	int size = fcntl(upload->pipe_fds[1], F_GETPIPE_SZ);
+	upload->pipe_size = size > 0 ? (size_t)size : 65536;
+	return 0;
+}
+
+static void close_pipe(struct upload *upload) {
+	if (upload->pipe_fds[0] >= 0) {
+		close(upload->pipe_fds[0]);
+		close(upload->pipe_fds[1]);
+		upload->pipe_fds[0] = upload->pipe_fds[1] = -1;
+	}
+}
+
+ssize_t upload_splice(struct upload *upload, int socket_fd) {
+	if (upload->pipe_fds[0] < 0 && open_pipe(upload) != 0) {
+		// No pipe: the caller falls back to reading into memory, and the
+		// upload itself is fine
+		upload->no_pipe = 1;
+		return UPLOAD_NO_PIPE;
+	}
+	size_t want = upload->pipe_size;
+	if (want > upload->remaining) {
+		want = (size_t)upload->remaining;
+	}
+	ssize_t moved = splice(socket_fd, NULL, upload->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (moved <= 0) {
+		return moved;
+	}
+	upload->remaining -= (unsigned long long)moved;
+	if (upload->remaining == 0) {
+		end_data(upload);
+	}
+
+	// The pipe was empty before, so it now holds exactly `moved` bytes; push
+	// them all to the file before returning so the pipe is empty again.
+	size_t left = (size_t)moved;
+	while (left > 0) {
+		ssize_t written = splice(upload->pipe_fds[0], NULL, upload->fd, &upload->offset, left, SPLICE_F_MOVE);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			log_error("splice to upload file failed: %m");
+			// The bytes left in the pipe are lost with it; the body is still
+			// consumed (through memory from now on) and the upload fails.
+			upload->failed = 1;
+			close_pipe(upload);
+			break;
+		}
+		left -= (size_t)written;
+	}
+	return moved;
+}
+
+int upload_complete(const struct upload *upload) {
+	return upload->state == BODY_DONE;
+}
+
+int upload_error_status(const struct upload *upload) {
+	return upload->error_status;
+}
+
+// The memory itself goes back with the arena
+static void upload_free(struct upload *upload) {
+	close_pipe(upload);
+}
+
+int upload_finish(struct upload *upload) {
+	int result = -1;
+	if (upload->fd >= 0) {
+		if (close(upload->fd) != 0) {
+			log_error("Failed to close upload file: %m");
+			upload->failed = 1;
+		}
+		int dir_fd = open_files_dir_fd();
+		// The temporary file was created beneath the directory, so the
+		// name's own directory is inside it
+		if (!upload->failed && renameat(dir_fd, upload->temp_name, dir_fd, upload->name) == 0) {
+			result = 0;
+		} else {
+			if (!upload->failed) {
+				log_error("Failed to move upload into place: %m");
+			}
+			unlinkat(dir_fd, upload->temp_name, 0);
+		}
+	}
+	upload_free(upload);
+	return result;
+}
+
+struct commit *upload_commit(struct upload *upload, struct connection *conn) {
+	struct commit *commit = NULL;
+	if (upload->fd >= 0) {
+		if (!upload->failed) {
+			commit = commit_submit(upload->fd, upload->temp_name, upload->name, conn);
+		}
+		if (commit == NULL) {
+			close(upload->fd);
+			unlinkat(open_files_dir_fd(), upload->temp_name, 0);
+		}
+	}
+	upload_free(upload);
+	return commit;
+}
+
+void upload_abort(struct upload *upload) {
+	if (upload->fd >= 0) {
+		close(upload->fd);
+		unlinkat(open_files_dir_fd(), upload->temp_name, 0);
+	}
+	upload_free(upload);
+}
@@ -0,0 +1,71 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+struct commit;
+struct connection;
+
+// A POST /files/ body on its way to disk. It is written to a temporary file
+// next to the target and renamed over it once complete, so readers see
+// either the old file or the whole new one, never a partial upload.
+struct upload;
+
+// Start receiving a body for `name`, relative to the served directory (see
+// open_files.h) and confined to it: `content_length` bytes, or a chunked
+// body when `chunked` is set (content_length is then ignored). `max_body`
+// caps a chunked body's size (0 = unlimited). The upload's state is
+// allocated from `arena`, which must outlive it. Returns NULL only when out
+// of memory; if the temporary file can't be created the upload still
+// consumes the body and then fails, so the connection stays in sync.
+struct upload *upload_begin(struct arena *arena, const char *name, long long content_length, int chunked,
+							unsigned long long max_body);
+
+// Read past a body nobody wants, framed like upload_begin()'s but written
+// nowhere, so whatever follows it is found. Complete it with upload_abort().
+// Returns NULL only when out of memory.
+struct upload *upload_discard(struct arena *arena, long long content_length, int chunked,
+							  unsigned long long max_body);
+
+// Consume body bytes that were already received into memory. Returns how
+// many of `len` bytes belong to the body (the rest is the next request), or
+// -1 if a chunked body is malformed or over the limit (see
+// upload_error_status()).
+ssize_t upload_feed(struct upload *upload, const char *data, size_t len);
+
+// Whether the next body bytes may be moved straight from the socket to the
+// file with upload_splice(): the file is healthy and the next bytes are
+// known to be plain data, not chunk framing.
+int upload_can_splice(const struct upload *upload);
+
+// Move the next body bytes from `socket_fd` to the file through a pipe
+// without copying them into user space. Returns the byte count, 0 at EOF,
+// -1 with errno set (EAGAIN when the socket has nothing to read), or
+// UPLOAD_NO_PIPE if no pipe could be made; upload_can_splice() is then false
+// and the rest of the body has to be read into memory.
+#define UPLOAD_NO_PIPE (-2)
+ssize_t upload_splice(struct upload *upload, int socket_fd);
+
+// Whether the whole body has been consumed
+int upload_complete(const struct upload *upload);
+
+// HTTP status for a malformed body after upload_feed() returned -1
+int upload_error_status(const struct upload *upload);
+
+// After upload_complete(): move the file into place and release the upload.
+// Returns 0 on success, -1 if anything failed (the target is then untouched).
+int upload_finish(struct upload *upload);
+
+// upload_finish() for --durable-uploads: hand the file to the commit thread
+// (see commit.h), which syncs it before moving it into place, and release
+// the upload. Returns the commit to wait for, or NULL if the upload failed
+// (the target is then untouched).
+struct commit *upload_commit(struct upload *upload, struct connection *conn);
+
+// Discard an unfinished upload and its temporary file
+void upload_abort(struct upload *upload);
+
+#endif
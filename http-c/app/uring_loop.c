@@ -0,0 +1,910 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring_loop.h"
+#include "event_loop.h"
+#include "connection.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "log.h"
+#include "restart.h"
+#include "commit.h"
+#include "server.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef HAVE_IO_URING
+
+// Submission queue size per worker (the completion queue is twice as large)
+#define RING_ENTRIES 1024
+// Receive buffers handed to the kernel per worker (power of two)
+#define RECV_BUFFERS 256
+#define RECV_BUFFER_SIZE (16 * 1024)
+#define RECV_BUFFER_GROUP 0
+// Upper bound on the registered file table (also capped by RLIMIT_NOFILE)
+#define MAX_FIXED_FILES 65536
+
+// What a completion is for, stored in the low OP_BITS of its user_data next
+// to the connection pointer (connections come from the buffer pool, or
+// malloc() as a fallback, so are aligned to at least 16 bytes)
+enum ring_op {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SEND,
+	OP_POLL_OUT, // waiting for room to continue a sendfile(), or an HTTPS connection to become writable
+	OP_POLL_IN,  // waiting for upload data to splice(), or an HTTPS connection to become readable
+	OP_ACCEPT_PAUSE, // accepting resumes when this timeout expires
+	OP_ACCEPT_TLS,   // OP_ACCEPT for the HTTPS listener
+	OP_DRAIN,        // restart_drain_fd() became readable, or cancelling the accepts after it did
+	OP_COMMIT,       // the commit thread returned uploads to this worker's inbox
+};
+#define OP_BITS 4
+#define OP_MASK ((1ULL << OP_BITS) - 1)
+
+// The shared-memory queues of one io_uring instance
+struct ring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned sqe_tail; // our tail, published to *sq_tail when submitting
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	size_t sqes_len;
+};
+
+struct uring_worker {
+	int id;
+	pthread_t thread;
+	int listen_fd;
+	int tls_listen_fd; // -1 when HTTPS is off
+	struct ring ring;
+	struct io_uring_buf_ring *buf_ring;
+	char *buffers;
+	unsigned short buf_tail;
+	int fixed_files;      // size of the registered file table, 0 if none
+	int multishot_accept; // cleared if the kernel doesn't support it
+	int draining;         // the listeners are closed
+	// --durable-uploads: where the commit thread returns this worker's
+	// uploads once they are on disk, NULL when off
+	struct commit_inbox *inbox;
+	struct __kernel_timespec accept_pause; // read by the kernel while the pause is queued
+	// Header, body, write and idle timeouts of this worker's connections,
+	// and the time the current batch of completions is handled at
+	struct timer_wheel timers;
+	uint64_t now_ms;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+							  size_t arg_size) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// --- Ring setup and submission ---
+
+static void ring_free(struct ring *ring) {
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_map_len);
+	}
+	if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_map_len);
+	}
+	close(ring->fd);
+}
+
+static int ring_init(struct ring *ring, unsigned entries) {
+	memset(ring, 0, sizeof(*ring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	// Only this worker's thread submits, and completions are only needed
+	// when it asks for them; both let the kernel skip work (Linux 6.1)
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring->fd = sys_io_uring_setup(entries, &params);
+	if (ring->fd < 0 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params)); // An older kernel
+		ring->fd = sys_io_uring_setup(entries, &params);
+	}
+	if (ring->fd < 0) {
+		return -1;
+	}
+
+	ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_len > ring->sq_map_len) {
+			ring->sq_map_len = ring->cq_map_len;
+		}
+		ring->cq_map_len = ring->sq_map_len;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+						IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring_free(ring);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+							IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring_free(ring);
+			return -1;
+		}
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+					  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring_free(ring);
+		return -1;
+	}
+
+	char *sq = ring->sq_map;
+	char *cq = ring->cq_map;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+// Hand every queued submission to the kernel and, if `wait`, sleep until at
+// least one completion is available or `timeout_ms` has passed (-1 for no
+// limit). Returns 0, or -1 with errno set (ETIME if the time ran out).
+static int ring_submit(struct ring *ring, int wait, int timeout_ms) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && !wait) {
+		return 0;
+	}
+	if (!wait || timeout_ms < 0) {
+		return sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0
+				   ? -1
+				   : 0;
+	}
+	// The timeout rides along with the wait itself (Linux 5.11), instead of
+	// as a submission of its own
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+	};
+	struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+	return sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+							  sizeof(arg)) < 0
+			   ? -1
+			   : 0;
+}
+
+// Next free submission entry, zeroed. Returns NULL if the queue is full even
+// after submitting what it holds.
+static struct io_uring_sqe *ring_get_sqe(struct ring *ring) {
+	if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+		ring_submit(ring, 0, -1);
+		if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+			return NULL;
+		}
+	}
+	unsigned index = ring->sqe_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+// --- Provided receive buffers and fixed files ---
+
+// Give buffer `bid` back to the kernel for future receives
+static void recycle_buffer(struct uring_worker *worker, unsigned short bid) {
+	struct io_uring_buf *buf = &worker->buf_ring->bufs[worker->buf_tail & (RECV_BUFFERS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(worker->buffers + (size_t)bid * RECV_BUFFER_SIZE);
+	buf->len = RECV_BUFFER_SIZE;
+	buf->bid = bid;
+	worker->buf_tail++;
+	__atomic_store_n(&worker->buf_ring->tail, worker->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Register a ring of RECV_BUFFERS receive buffers. The kernel picks one when
+// data actually arrives, so idle connections don't pin any buffer memory.
+static int setup_buffers(struct uring_worker *worker) {
+	size_t ring_len = RECV_BUFFERS * sizeof(struct io_uring_buf);
+	worker->buf_ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (worker->buf_ring == MAP_FAILED) {
+		return -1;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)worker->buf_ring,
+		.ring_entries = RECV_BUFFERS,
+		.bgid = RECV_BUFFER_GROUP,
+	};
+	if (sys_io_uring_register(worker->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		munmap(worker->buf_ring, ring_len);
+		return -1;
+	}
+	worker->buffers = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+	if (worker->buffers == NULL) {
+		return -1;
+	}
+	for (unsigned short bid = 0; bid < RECV_BUFFERS; bid++) {
+		recycle_buffer(worker, bid);
+	}
+	return 0;
+}
+
+// Create an empty registered file table. Client sockets are entered at the
+// index equal to their descriptor, which is unique within the process.
+// Without one (older kernels) operations just use the descriptors.
+static void setup_fixed_files(struct uring_worker *worker) {
+	struct rlimit limit;
+	unsigned count = MAX_FIXED_FILES;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < count) {
+		count = (unsigned)limit.rlim_cur;
+	}
+	struct io_uring_rsrc_register reg = {
+		.nr = count,
+		.flags = IORING_RSRC_REGISTER_SPARSE,
+	};
+	if (sys_io_uring_register(worker->ring.fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0) {
+		worker->fixed_files = (int)count;
+	}
+}
+
+// Put `fd` (or -1 to clear it) in slot `slot` of the registered file table
+static int fixed_file_set(struct uring_worker *worker, int slot, int fd) {
+	struct io_uring_files_update update = {
+		.offset = (uint32_t)slot,
+		.fds = (uint64_t)(uintptr_t)&fd,
+	};
+	return sys_io_uring_register(worker->ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+// --- Submitting operations ---
+
+static void sqe_set_socket(struct io_uring_sqe *sqe, struct connection *conn, enum ring_op op) {
+	if (conn->ring_slot >= 0) {
+		sqe->fd = conn->ring_slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = conn->io.fd;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+	conn->ring_inflight++;
+}
+
+// Accept on the plain listener (OP_ACCEPT) or the HTTPS one (OP_ACCEPT_TLS)
+static void arm_accept(struct uring_worker *worker, enum ring_op op) {
+	int fd = op == OP_ACCEPT_TLS ? worker->tls_listen_fd : worker->listen_fd;
+	if (fd < 0) {
+		return; // Closed for draining
+	}
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		log_error("Submission queue full, worker %d stops accepting", worker->id);
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	// One submission that keeps producing a completion per new client
+	if (worker->multishot_accept) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	sqe->user_data = op;
+}
+
+static void arm_accepts(struct uring_worker *worker) {
+	arm_accept(worker, OP_ACCEPT);
+	if (worker->tls_listen_fd >= 0) {
+		arm_accept(worker, OP_ACCEPT_TLS);
+	}
+}
+
+// Wait for the server to start draining. The eventfd is never read, so the
+// poll completes in every worker.
+static void arm_drain_poll(struct uring_worker *worker) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		log_error("Submission queue full, worker %d won't drain", worker->id);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = restart_drain_fd();
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = OP_DRAIN;
+}
+
+// Wait for the commit thread to return uploads. Taking them reads the
+// eventfd, after which the poll is armed again.
+static void arm_commit_poll(struct uring_worker *worker) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		log_error("Submission queue full, worker %d won't answer durable uploads", worker->id);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = commit_inbox_fd(worker->inbox);
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = OP_COMMIT;
+}
+
+// Cancel the multishot accept queued as `op`
+static void cancel_accept(struct uring_worker *worker, enum ring_op op) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return; // Its listener is closed anyway; it only lingers until this worker exits
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = op;
+	sqe->user_data = OP_DRAIN;
+}
+
+// Arm the listener again after ACCEPT_PAUSE_MS, when accept failed for lack
+// of file descriptors and retrying at once would just fail again
+static void pause_accept(struct uring_worker *worker, enum ring_op op) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		log_error("Submission queue full, worker %d stops accepting", worker->id);
+		return;
+	}
+	worker->accept_pause.tv_sec = ACCEPT_PAUSE_MS / 1000;
+	worker->accept_pause.tv_nsec = (long long)(ACCEPT_PAUSE_MS % 1000) * 1000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)&worker->accept_pause;
+	sqe->len = 1;
+	sqe->off = 0; // Expire on time only, not after a number of completions
+	// Which listener to re-arm rides along in the upper bits
+	sqe->user_data = OP_ACCEPT_PAUSE | (uint64_t)op << OP_BITS;
+}
+
+// Receive up to `len` bytes into whichever provided buffer the kernel picks
+static int arm_recv(struct uring_worker *worker, struct connection *conn, size_t len) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe_set_socket(sqe, conn, OP_RECV);
+	sqe->len = (uint32_t)(len < RECV_BUFFER_SIZE ? len : RECV_BUFFER_SIZE);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	conn->ring_recv_armed = 1;
+	return 0;
+}
+
+// Send conn->ring_iov, which stays untouched until the completion
+static int arm_send(struct uring_worker *worker, struct connection *conn, int iov_count, int send_flags) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	memset(&conn->ring_msg, 0, sizeof(conn->ring_msg));
+	conn->ring_msg.msg_iov = conn->ring_iov;
+	conn->ring_msg.msg_iovlen = (size_t)iov_count;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe_set_socket(sqe, conn, OP_SEND);
+	sqe->addr = (uint64_t)(uintptr_t)&conn->ring_msg;
+	sqe->len = 1;
+	sqe->msg_flags = (uint32_t)send_flags;
+	conn->ring_send_armed = 1;
+	return 0;
+}
+
+static int arm_poll_out(struct uring_worker *worker, struct connection *conn) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe_set_socket(sqe, conn, OP_POLL_OUT);
+	sqe->poll32_events = POLLOUT;
+	conn->ring_send_armed = 1;
+	return 0;
+}
+
+// Counts as the connection's receive: no recv may race the splice() it waits for
+static int arm_poll_in(struct uring_worker *worker, struct connection *conn) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe_set_socket(sqe, conn, OP_POLL_IN);
+	sqe->poll32_events = POLLIN | POLLRDHUP;
+	conn->ring_recv_armed = 1;
+	return 0;
+}
+
+// Have the next drive happen on the next round of completions, for an
+// HTTPS connection that yielded with input possibly left inside OpenSSL,
+// where no poll would see it. Counts as its receive.
+static int arm_nop(struct uring_worker *worker, struct connection *conn) {
+	struct io_uring_sqe *sqe = ring_get_sqe(&worker->ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_NOP;
+	sqe_set_socket(sqe, conn, OP_POLL_IN);
+	sqe->flags &= (uint8_t)~IOSQE_FIXED_FILE; // A NOP uses no file
+	conn->ring_recv_armed = 1;
+	return 0;
+}
+
+// --- Connection driver ---
+
+// Free a closed connection once the kernel is done with it. Operations still
+// in flight are woken by shutting the socket down; the last completion
+// brings us back here.
+static void ring_close(struct uring_worker *worker, struct connection *conn) {
+	timer_cancel(&conn->timer); // Closing already
+	if (conn->ring_inflight > 0) {
+		if (!conn->ring_closing) {
+			conn->ring_closing = 1;
+			shutdown(conn->io.fd, SHUT_RDWR);
+		}
+		return;
+	}
+	if (conn->ring_slot >= 0) {
+		fixed_file_set(worker, conn->ring_slot, -1);
+	}
+	connection_free(conn);
+}
+
+// Completion-based counterpart of connection_drive(): answer what is
+// buffered, then make sure a send is outstanding while there is output and a
+// receive while there is room for input.
+static void ring_drive(struct uring_worker *worker, struct connection *conn) {
+	while (conn->state != CONN_CLOSED) {
+		if (conn->state == CONN_LINGERING) {
+			if (!conn->ring_recv_armed && arm_recv(worker, conn, RECV_BUFFER_SIZE) != 0) {
+				conn->state = CONN_CLOSED;
+				break;
+			}
+			connection_update_timeout(conn, &worker->timers, worker->now_ms);
+			return;
+		}
+		if (!conn->ring_send_armed) {
+			// `out` belongs to the kernel while a send is in flight, so new
+			// requests are only answered between sends
+			connection_process(conn);
+			if (conn->state == CONN_CLOSED) {
+				break;
+			}
+			int send_flags;
+			int iov_count = connection_output_iov(conn, conn->ring_iov, &send_flags);
+			if (conn->state == CONN_CLOSED) {
+				break;
+			}
+			if (iov_count > 0) {
+				if (arm_send(worker, conn, iov_count, send_flags) != 0) {
+					conn->state = CONN_CLOSED;
+					break;
+				}
+			} else if (conn->file_fd >= 0) {
+				// io_uring has no sendfile(); with the headers out, call it
+				// directly and only involve the ring to wait for room
+				if (!connection_send_file(conn)) {
+					if (conn->state == CONN_CLOSED || arm_poll_out(worker, conn) != 0) {
+						conn->state = CONN_CLOSED;
+						break;
+					}
+				} else if (connection_has_pending_output(conn)) {
+					continue; // The next part of a multipart body
+				}
+			}
+			if (!conn->ring_send_armed && conn->state == CONN_WRITING && !connection_has_pending_output(conn)) {
+				connection_response_sent(conn);
+				continue;
+			}
+		}
+
+		if (!conn->ring_recv_armed && connection_body_spliceable(conn)) {
+			// Upload data skips the provided buffers: splice() moves it from
+			// the socket to the file and the ring only waits for more
+			if (connection_splice_body(conn)) {
+				continue;
+			}
+			if (conn->state == CONN_CLOSED) {
+				break;
+			}
+			if (!conn->peer_closed && arm_poll_in(worker, conn) != 0) {
+				conn->state = CONN_CLOSED;
+				break;
+			}
+		} else if (!conn->ring_recv_armed && connection_wants_input(conn) &&
+				   arm_recv(worker, conn, conn->in_cap - (conn->in_len - conn->in_start)) != 0) {
+			conn->state = CONN_CLOSED;
+			break;
+		}
+		// If the client has gone away and everything it asked for has been
+		// answered, finish
+		if (conn->peer_closed && !conn->ring_send_armed && !connection_has_pending_output(conn) &&
+			conn->state != CONN_COMMITTING) {
+			if (conn->state == CONN_READING_BODY) {
+				log_info("Client disconnected before sending the full body");
+			}
+			conn->state = CONN_CLOSED;
+			break;
+		}
+		if (!conn->ring_send_armed) {
+			connection_release_idle_buffers(conn);
+		}
+		connection_update_timeout(conn, &worker->timers, worker->now_ms);
+		return;
+	}
+	ring_close(worker, conn);
+}
+
+// HTTPS connections are driven the way the epoll backend drives every
+// connection: OpenSSL reads and writes the socket itself, so the ring only
+// waits for readiness, with polls, and connection_on_event() does the rest.
+// `events` are the poll bits, which equal epoll's.
+static void ring_drive_tls(struct uring_worker *worker, struct connection *conn, uint32_t events) {
+	if (conn->state != CONN_CLOSED) {
+		if (connection_on_event(conn, events)) {
+			if (!conn->ring_recv_armed && arm_nop(worker, conn) != 0) {
+				conn->state = CONN_CLOSED;
+			}
+		} else if (conn->state != CONN_CLOSED && !conn->readable && !conn->ring_recv_armed &&
+				   arm_poll_in(worker, conn) != 0) {
+			conn->state = CONN_CLOSED;
+		}
+		// Only cleared by a send (or the handshake) that found the socket full
+		if (conn->state != CONN_CLOSED && !conn->writable && !conn->ring_send_armed &&
+			arm_poll_out(worker, conn) != 0) {
+			conn->state = CONN_CLOSED;
+		}
+	}
+	if (conn->state == CONN_CLOSED) {
+		ring_close(worker, conn);
+		return;
+	}
+	connection_update_timeout(conn, &worker->timers, worker->now_ms);
+}
+
+static void on_accept(struct uring_worker *worker, const struct io_uring_cqe *cqe, enum ring_op op) {
+	int paused = 0;
+	if (cqe->res >= 0) {
+		int client_fd = cqe->res;
+		// Log client connection
+		log_debug("Client connected (FD: %d)", client_fd);
+		struct connection *conn = NULL;
+		if (!connection_admit(client_fd, op == OP_ACCEPT_TLS)) {
+			// Answered with a 503 and closed
+		} else if ((conn = connection_new(client_fd)) == NULL) {
+			close(client_fd);
+		} else if (op == OP_ACCEPT_TLS) {
+			if (connection_start_tls(conn) != 0) {
+				connection_free(conn);
+			} else {
+				if (client_fd < worker->fixed_files && fixed_file_set(worker, client_fd, client_fd) == 0) {
+					conn->ring_slot = client_fd;
+				}
+				ring_drive_tls(worker, conn, 0);
+			}
+		} else {
+			// Sends complete asynchronously, while `in` keeps changing:
+			// bodies must be copied into `out`
+			conn->body_refs = 0;
+			if (client_fd < worker->fixed_files && fixed_file_set(worker, client_fd, client_fd) == 0) {
+				conn->ring_slot = client_fd;
+			}
+			ring_drive(worker, conn);
+		}
+	} else if (cqe->res == -EINVAL && worker->multishot_accept) {
+		worker->multishot_accept = 0; // Before Linux 5.19: one accept per submission
+	} else if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+		errno = -cqe->res;
+		log_warn("Accept failed, pausing for %dms: %m", ACCEPT_PAUSE_MS);
+		metrics_accept_error();
+		paused = 1;
+	} else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN && cqe->res != -ECANCELED) {
+		errno = -cqe->res;
+		log_error("Accept failed: %m");
+		metrics_accept_error();
+	}
+	// A multishot accept stops (no IORING_CQE_F_MORE) on errors
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		if (paused) {
+			pause_accept(worker, op);
+		} else {
+			arm_accept(worker, op);
+		}
+	}
+}
+
+// The server is draining: stop accepting (the listeners live on in the new
+// instance, if any) and have every connection close after its current or
+// next response.
+static void ring_drain(struct uring_worker *worker) {
+	worker->draining = 1;
+	cancel_accept(worker, OP_ACCEPT);
+	close(worker->listen_fd);
+	worker->listen_fd = -1;
+	if (worker->tls_listen_fd >= 0) {
+		cancel_accept(worker, OP_ACCEPT_TLS);
+		close(worker->tls_listen_fd);
+		worker->tls_listen_fd = -1;
+	}
+
+	// As in the epoll loop, the connections are found through their timers
+	struct timer *timers = timer_wheel_take_all(&worker->timers);
+	while (timers != NULL) {
+		struct connection *conn = connection_from_timer(timers);
+		timers = timers->next;
+		connection_drain(conn);
+		if (conn->h2 != NULL) {
+			ring_drive(worker, conn); // To send its GOAWAY
+		} else {
+			connection_update_timeout(conn, &worker->timers, worker->now_ms);
+		}
+	}
+}
+
+// Answer the uploads the commit thread is done with
+static void ring_commits(struct uring_worker *worker) {
+	struct commit *commit = commit_inbox_take(worker->inbox);
+	while (commit != NULL) {
+		struct commit *next = commit->next;
+		struct connection *conn = connection_commit_done(commit);
+		if (conn != NULL) {
+			if (conn->tls != NULL) {
+				ring_drive_tls(worker, conn, 0);
+			} else {
+				ring_drive(worker, conn);
+			}
+		}
+		commit = next;
+	}
+}
+
+static void on_completion(struct uring_worker *worker, const struct io_uring_cqe *cqe) {
+	enum ring_op op = (enum ring_op)(cqe->user_data & OP_MASK);
+	if (op == OP_ACCEPT || op == OP_ACCEPT_TLS) {
+		on_accept(worker, cqe, op);
+		return;
+	}
+	if (op == OP_ACCEPT_PAUSE) {
+		arm_accept(worker, (enum ring_op)(cqe->user_data >> OP_BITS)); // -ETIME: the pause is over
+		return;
+	}
+	if (op == OP_DRAIN) {
+		if (!worker->draining) {
+			ring_drain(worker);
+		}
+		return; // Or the completion of a cancel
+	}
+	if (op == OP_COMMIT) {
+		ring_commits(worker);
+		arm_commit_poll(worker);
+		return;
+	}
+	struct connection *conn = (struct connection *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+	conn->ring_inflight--;
+	int res = cqe->res;
+
+	if (conn->tls != NULL) {
+		// Only polls (and NOPs, which complete with 0) are submitted for it;
+		// whatever the result, it is worth trying the direction again
+		if (op == OP_POLL_IN) {
+			conn->ring_recv_armed = 0;
+			ring_drive_tls(worker, conn, POLLIN | (res > 0 ? (uint32_t)res : 0));
+		} else {
+			conn->ring_send_armed = 0;
+			ring_drive_tls(worker, conn, POLLOUT | (res > 0 ? (uint32_t)res : 0));
+		}
+		return;
+	}
+
+	switch (op) {
+	case OP_RECV:
+		conn->ring_recv_armed = 0;
+		if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+			unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (!conn->ring_closing) {
+				connection_received(conn, worker->buffers + (size_t)bid * RECV_BUFFER_SIZE, (size_t)res);
+			}
+			recycle_buffer(worker, bid);
+		} else if (res == 0) {
+			connection_received(conn, NULL, 0);
+		} else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+			// ENOBUFS: all buffers were taken at once; the drive re-arms
+			if (!conn->ring_closing && res != -ECONNRESET) {
+				errno = -res;
+				log_error("Receive failed: %m");
+			}
+			conn->state = CONN_CLOSED;
+		}
+		break;
+	case OP_SEND:
+		conn->ring_send_armed = 0;
+		if (res >= 0) {
+			connection_output_sent(conn, (size_t)res);
+		} else if (res != -EINTR && res != -EAGAIN) {
+			if (!conn->ring_closing && res != -EPIPE && res != -ECONNRESET) {
+				errno = -res;
+				log_error("Send failed: %m");
+			}
+			conn->state = CONN_CLOSED;
+		}
+		break;
+	case OP_POLL_OUT:
+		// sendfile() is retried by the drive and reports any error itself
+		conn->ring_send_armed = 0;
+		break;
+	case OP_POLL_IN:
+		// Likewise for splice(), which also notices the peer closing
+		conn->ring_recv_armed = 0;
+		break;
+	case OP_ACCEPT:
+	case OP_ACCEPT_PAUSE:
+	case OP_ACCEPT_TLS:
+	case OP_DRAIN:
+	case OP_COMMIT:
+		break;
+	}
+	ring_drive(worker, conn);
+}
+
+// Milliseconds on the clock the timer wheels run on
+static uint64_t now_ms(void) {
+	return metrics_now() / 1000000u;
+}
+
+// Close every connection whose timeout has passed, all in one go
+static void expire_timeouts(struct uring_worker *worker) {
+	struct timer *expired = timer_wheel_expire(&worker->timers, worker->now_ms);
+	while (expired != NULL) {
+		struct connection *conn = connection_from_timer(expired);
+		expired = expired->next;
+		connection_timed_out(conn);
+		ring_close(worker, conn);
+	}
+}
+
+static void *uring_worker_main(void *arg) {
+	struct uring_worker *worker = arg;
+	// The ring is created by the thread that uses it (IORING_SETUP_SINGLE_ISSUER)
+	if (ring_init(&worker->ring, RING_ENTRIES) != 0 || setup_buffers(worker) != 0) {
+		log_error("io_uring setup failed in worker: %m");
+		exit(1); // Its listener would otherwise keep taking connections
+	}
+	setup_fixed_files(worker);
+	worker->multishot_accept = 1;
+	arm_accepts(worker);
+	arm_drain_poll(worker);
+	if (worker->inbox != NULL) {
+		commit_inbox_attach(worker->inbox);
+		arm_commit_poll(worker);
+	}
+	worker->now_ms = now_ms();
+	timer_wheel_init(&worker->timers, worker->now_ms);
+
+	struct ring *ring = &worker->ring;
+	while (1) {
+		// The one system call per iteration: submit everything queued while
+		// handling the previous batch, and wait for more completions or the
+		// next timeout
+		int wait_ms = timer_wheel_timeout_ms(&worker->timers, now_ms());
+		if (ring_submit(ring, 1, wait_ms) != 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+			errno != ETIME) {
+			log_error("io_uring_enter failed: %m");
+			return NULL;
+		}
+		// One reading of the clock serves the whole batch
+		worker->now_ms = now_ms();
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+			// Free the slot before handling, which may queue more work
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+			on_completion(worker, &cqe);
+		}
+		expire_timeouts(worker);
+	}
+	return NULL;
+}
+
+int uring_loop_supported(void) {
+	struct uring_worker probe;
+	memset(&probe, 0, sizeof(probe));
+	if (ring_init(&probe.ring, 8) != 0) {
+		return 0;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_entries = 1,
+		.bgid = RECV_BUFFER_GROUP,
+	};
+	// A one-entry ring needs a page of its own
+	void *buf_ring = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	int supported = 0;
+	if (buf_ring != MAP_FAILED) {
+		reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+		supported = sys_io_uring_register(probe.ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+		munmap(buf_ring, 4096);
+	}
+	ring_free(&probe.ring);
+	return supported;
+}
+
+int uring_loop_start(const int *listen_fds, const int *tls_listen_fds, int worker_count) {
+	struct uring_worker *workers = calloc((size_t)worker_count, sizeof(*workers));
+	if (workers == NULL) {
+		log_error("Failed to allocate workers: %m");
+		return 1;
+	}
+	for (int i = 0; i < worker_count; i++) {
+		workers[i].id = i;
+		workers[i].listen_fd = listen_fds[i];
+		workers[i].tls_listen_fd = tls_listen_fds != NULL ? tls_listen_fds[i] : -1;
+		if (g_durable_uploads) {
+			workers[i].inbox = commit_inbox_new();
+			if (workers[i].inbox == NULL) {
+				return 1;
+			}
+		}
+		if (worker_thread_start(&workers[i].thread, i, uring_worker_main, &workers[i]) != 0) {
+			return 1;
+		}
+	}
+	// The workers run until the process exits and own `workers` till then
+	return 0;
+}
+
+#else // !HAVE_IO_URING
+
+int uring_loop_supported(void) {
+	return 0;
+}
+
+int uring_loop_start(const int *listen_fds, const int *tls_listen_fds, int worker_count) {
+	(void)listen_fds;
+	(void)tls_listen_fds;
+	(void)worker_count;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+// Whether this build and kernel can run uring_loop_start(): it needs io_uring
+// with provided buffer rings (Linux 5.19 or later) and must not be disabled
+// by sysctl or a seccomp filter.
+int uring_loop_supported(void);
+
+// Same contract as event_loop_start(), but each worker drives its listener and
+// connections through its own io_uring instead of epoll: a multishot accept,
+// receives into a ring of provided buffers, and sends, all submitted and
+// reaped in batches with one io_uring_enter() per loop iteration. Client
+// sockets are registered as fixed files to skip the per-operation file
+// lookup. HTTPS connections leave their reads and writes to OpenSSL and
+// only use the ring to wait for their socket to be ready.
+int uring_loop_start(const int *listen_fds, const int *tls_listen_fds, int worker_count);
+
+#endif
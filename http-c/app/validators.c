@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#include "validators.h"
+#include "http_date.h"
+#include "server.h"
+
+void etag_format(char etag[ETAG_MAX], const struct stat *file_stat, int compressed) {
+	unsigned long long mtime_ns =
+		(unsigned long long)file_stat->st_mtim.tv_sec * 1000000000ULL + (unsigned long long)file_stat->st_mtim.tv_nsec;
+	snprintf(etag, ETAG_MAX, compressed ? "W/\"%llx-%llx-%llx-gz\"" : "\"%llx-%llx-%llx\"",
+			 (unsigned long long)file_stat->st_ino, (unsigned long long)file_stat->st_size, mtime_ns);
+}
+
+// Skip the W/ prefix of a weak tag
+static const char *opaque_tag(const char *etag, size_t *len) {
+	if (*len >= 2 && etag[0] == 'W' && etag[1] == '/') {
+		*len -= 2;
+		return etag + 2;
+	}
+	return etag;
+}
+
+int etag_list_matches(const char *value, size_t len, const char *etag) {
+	size_t etag_len = strlen(etag);
+	const char *opaque = opaque_tag(etag, &etag_len);
+	size_t pos = 0;
+	while (pos < len) {
+		// Elements are separated by commas and optional whitespace
+		if (value[pos] == ',' || value[pos] == ' ' || value[pos] == '\t') {
+			pos++;
+			continue;
+		}
+		size_t end = pos;
+		if (value[end] == '*') {
+			return 1;
+		}
+		if (end + 1 < len && value[end] == 'W' && value[end + 1] == '/') {
+			end += 2;
+		}
+		// The opaque part is quoted and can't contain quotes
+		if (end >= len || value[end] != '"') {
+			return 0;
+		}
+		const char *close = memchr(value + end + 1, '"', len - end - 1);
+		if (close == NULL) {
+			return 0;
+		}
+		size_t tag_len = (size_t)(close + 1 - value) - pos;
+		const char *tag = opaque_tag(value + pos, &tag_len);
+		if (tag_len == etag_len && memcmp(tag, opaque, etag_len) == 0) {
+			return 1;
+		}
+		pos = (size_t)(close + 1 - value);
+	}
+	return 0;
+}
+
+int validators_format(char *buf, size_t cap, const char *etag, time_t mtime) {
+	char last_modified[HTTP_DATE_LEN + 1];
+	http_date_format(mtime, last_modified);
+	int len = snprintf(buf, cap, "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s", etag, last_modified,
+					   g_cache_control != NULL ? "Cache-Control: " : "",
+					   g_cache_control != NULL ? g_cache_control : "", g_cache_control != NULL ? "\r\n" : "");
+	if (len < 0 || (size_t)len >= cap) {
+		return -1;
+	}
+	return len;
+}
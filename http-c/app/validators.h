@@ -0,0 +1,26 @@
+#ifndef VALIDATORS_H
+#define VALIDATORS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Room for an entity tag, quotes and W/ prefix included
+#define ETAG_MAX 64
+
+// Entity tag for a file's current contents, derived from its inode, size and
+// modification time (to the nanosecond). It is strong for the file's bytes
+// as stored. A body we compress ourselves gets a distinct weak tag, since its
+// bytes depend on the compression level.
+void etag_format(char etag[ETAG_MAX], const struct stat *file_stat, int compressed);
+
+// Whether an If-None-Match value is "*" or lists `etag`, compared weakly
+// (RFC 9110 8.8.3.2: W/ prefixes are ignored)
+int etag_list_matches(const char *value, size_t len, const char *etag);
+
+// Format the validator headers of a /files/ response into buf: ETag,
+// Last-Modified and, if configured, Cache-Control. Returns their length, or
+// -1 if they don't fit.
+int validators_format(char *buf, size_t cap, const char *etag, time_t mtime);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * Allocation benchmark for the request path: connection state machine
+ * (app/connection.c), buffer pool (app/pool.c) and per-connection arena
+ * (app/arena.c).
+ *
+ * Build and run from the http-c directory:
+ *   gcc -O2 -Iapp -o /tmp/alloc_bench bench/alloc_bench.c app/connection.c app/pool.c app/arena.c \
+ *       app/http_parser.c app/header_scan.c app/file_cache.c app/gzip.c app/upload.c app/range.c \
+ *       app/http_date.c app/validators.c app/metrics.c app/log.c app/timer_wheel.c app/router.c \
+ *       app/open_files.c app/tls.c app/http2.c app/hpack.c app/restart.c app/commit.c \
+ *       -lz -lssl -lcrypto \
+ *       && /tmp/alloc_bench
+ *
+ * Each scenario drives one connection over a socketpair through the same
+ * entry point epoll uses, request after request, and reports the time per
+ * request, the calls into malloc()/calloc()/realloc()/free() (counted by
+ * wrapping glibc's allocator) and the buffer pool traffic per request; a
+ * pipelined batch counts as one request. A last scenario holds many idle
+ * keep-alive connections open and reports the resident memory each one
+ * costs.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "file_cache.h"
+#include "header_scan.h"
+#include "open_files.h"
+#include "pool.h"
+#include "server.h"
+
+// The server's settings, normally defined next to main() in server.c
+char *g_directory_path = NULL;
+int g_worker_count = 1;
+int g_listen_backlog = 128;
+int g_max_connections = 0;
+size_t g_cache_size = 0;
+size_t g_open_files = 1024;
+const char *g_cache_control = NULL;
+enum io_backend g_io_backend = IO_BACKEND_EPOLL;
+enum log_level g_log_level = LOG_INFO;
+int g_access_log = 0;
+int g_http2 = 1;
+struct connection_timeouts g_timeouts;
+unsigned g_drain_timeout_ms;
+int g_durable_uploads = 0;
+unsigned g_commit_window_ms;
+struct http_parser_limits g_parser_limits = {
+	.max_header_bytes = HTTP_DEFAULT_MAX_HEADER_BYTES,
+	.max_headers = HTTP_DEFAULT_MAX_HEADERS,
+	.max_uri = HTTP_DEFAULT_MAX_URI,
+	.max_body = 0,
+};
+
+// --- Counting allocator ---
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long allocator_calls;
+
+void *malloc(size_t size) {
+	allocator_calls++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	allocator_calls++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocator_calls++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	if (ptr != NULL) {
+		allocator_calls++;
+	}
+	__libc_free(ptr);
+}
+
+// --- Driving a connection ---
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char sink[256 * 1024];
+
+// Read whatever the connection has sent so far
+static void drain(int peer) {
+	while (read(peer, sink, sizeof(sink)) > 0) {
+	}
+}
+
+// Open a connection whose client end is *peer
+static struct connection *open_connection(int *peer) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	struct connection *conn = connection_new(fds[0]);
+	if (conn == NULL) {
+		exit(1);
+	}
+	*peer = fds[1];
+	return conn;
+}
+
+// Send `request` from the client end and run the connection until it has
+// answered and is waiting for the next one
+static void exchange(struct connection *conn, int peer, const char *request, size_t len) {
+	if (write(peer, request, len) != (ssize_t)len) {
+		perror("write");
+		exit(1);
+	}
+	connection_on_event(conn, EPOLLIN | EPOLLOUT);
+	while (conn->state != CONN_CLOSED && (conn->state == CONN_WRITING || connection_has_pending_output(conn))) {
+		drain(peer);
+		connection_on_event(conn, EPOLLOUT);
+	}
+	drain(peer);
+	if (conn->state == CONN_CLOSED) {
+		fprintf(stderr, "connection closed during the benchmark\n");
+		exit(1);
+	}
+}
+
+struct counts {
+	unsigned long long allocator_calls;
+	struct pool_stats pool;
+};
+
+static void take_counts(struct counts *counts) {
+	counts->allocator_calls = allocator_calls;
+	pool_get_stats(&counts->pool);
+}
+
+static void report(const char *label, int iterations, double elapsed, const struct counts *before,
+				   const struct counts *after) {
+	unsigned long long acquired = (after->pool.reused - before->pool.reused) +
+								  (after->pool.carved - before->pool.carved) +
+								  (after->pool.fallback - before->pool.fallback);
+	printf("%-32s %8.1f ns/req %6.2f allocator calls/req %6.2f pool buffers/req (%llu fresh)\n", label,
+		   elapsed / iterations * 1e9, (double)(after->allocator_calls - before->allocator_calls) / iterations,
+		   (double)acquired / iterations, after->pool.carved - before->pool.carved);
+}
+
+// Send `request` `iterations` times on one keep-alive connection, after a
+// few warm-up rounds
+static void run(const char *label, const char *request, int iterations) {
+	int peer;
+	struct connection *conn = open_connection(&peer);
+	size_t len = strlen(request);
+	for (int i = 0; i < 16; i++) {
+		exchange(conn, peer, request, len);
+	}
+	struct counts before, after;
+	take_counts(&before);
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		exchange(conn, peer, request, len);
+	}
+	double elapsed = now_seconds() - start;
+	take_counts(&after);
+	report(label, iterations, elapsed, &before, &after);
+	connection_free(conn);
+	close(peer);
+}
+
+// A new connection for every request
+static void run_connections(const char *label, const char *request, int iterations) {
+	size_t len = strlen(request);
+	struct counts before, after;
+	take_counts(&before);
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		int peer;
+		struct connection *conn = open_connection(&peer);
+		exchange(conn, peer, request, len);
+		connection_free(conn);
+		close(peer);
+	}
+	double elapsed = now_seconds() - start;
+	take_counts(&after);
+	report(label, iterations, elapsed, &before, &after);
+}
+
+static long resident_bytes(void) {
+	long size = 0;
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &pages) != 2) {
+			pages = 0;
+		}
+		fclose(statm);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Open `count` connections that have each answered a request and now sit idle
+static void run_idle(int count) {
+	struct connection **conns = malloc((size_t)count * sizeof(*conns));
+	int *peers = malloc((size_t)count * sizeof(*peers));
+	const char *request = "GET /echo/idle HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	long before = resident_bytes();
+	for (int i = 0; i < count; i++) {
+		conns[i] = open_connection(&peers[i]);
+		exchange(conns[i], peers[i], request, strlen(request));
+	}
+	long after = resident_bytes();
+	printf("%-32s %d connections, %ld bytes resident each\n",
+		   "idle keep-alive connections", count, (after - before) / count);
+	for (int i = 0; i < count; i++) {
+		connection_free(conns[i]);
+		close(peers[i]);
+	}
+	free(conns);
+	free(peers);
+}
+
+static void write_file(const char *path, size_t size, int text) {
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	for (size_t i = 0; i < size; i++) {
+		fputc(text ? "the quick brown fox jumps over the lazy dog\n"[i % 44] : (int)(i * 2654435761u >> 24), file);
+	}
+	fclose(file);
+}
+
+int main(void) {
+	header_scan_init();
+	if (pool_init() != 0 || connection_routes_init() != 0) {
+		return 1;
+	}
+	char directory[] = "/tmp/alloc_bench.XXXXXX";
+	if (mkdtemp(directory) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	g_directory_path = directory;
+	if (open_files_init(directory, g_open_files) != 0) {
+		return 1;
+	}
+	char path[256];
+	snprintf(path, sizeof(path), "%s/small.bin", directory);
+	write_file(path, 4096, 0);
+	snprintf(path, sizeof(path), "%s/page.txt", directory);
+	write_file(path, 100 * 1024, 1);
+
+	static char upload[64 * 1024];
+	int n = snprintf(upload, sizeof(upload), "POST /files/upload.bin HTTP/1.1\r\nContent-Length: 4096\r\n\r\n");
+	memset(upload + n, 'u', 4096);
+	upload[n + 4096] = '\0';
+
+	static char pipelined[16 * 1024];
+	size_t used = 0;
+	for (int i = 0; i < 16; i++) {
+		used += (size_t)snprintf(pipelined + used, sizeof(pipelined) - used,
+								 "GET /user-agent HTTP/1.1\r\nUser-Agent: bench/%02d\r\n\r\n", i);
+	}
+
+	run("GET /", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n", 200000);
+	run("GET /echo/", "GET /echo/hello-world HTTP/1.1\r\nHost: localhost\r\n\r\n", 200000);
+	run("GET /echo/, gzip", "GET /echo/hello-world HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", 100000);
+	run("16 x GET /user-agent pipelined", pipelined, 20000);
+	run("GET /files/ 4K, sendfile", "GET /files/small.bin HTTP/1.1\r\n\r\n", 100000);
+	run("GET /files/ 100K text, gzip", "GET /files/page.txt HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n", 2000);
+	run("GET /files/ 2 ranges", "GET /files/small.bin HTTP/1.1\r\nRange: bytes=0-9,100-199\r\n\r\n", 100000);
+	run("POST /files/ 4K", upload, 20000);
+	run_connections("connection per GET /", "GET / HTTP/1.1\r\nConnection: close\r\n\r\n", 100000);
+
+	if (file_cache_init(1024 * 1024, directory) != 0) {
+		return 1;
+	}
+	run("GET /files/ 4K, cached", "GET /files/small.bin HTTP/1.1\r\n\r\n", 200000);
+
+	struct rlimit limit;
+	int idle = 10000;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		if ((rlim_t)idle * 2 + 64 > limit.rlim_cur) {
+			idle = (int)(limit.rlim_cur - 64) / 2;
+		}
+	}
+	run_idle(idle);
+
+	snprintf(path, sizeof(path), "rm -rf %s", directory);
+	if (system(path) != 0) {
+		return 1;
+	}
+	return 0;
+}
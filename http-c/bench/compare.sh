@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Compare two result files from bench/run_matrix.sh run by run:
+#
+#   bench/compare.sh before.jsonl after.jsonl
+#
+# Prints requests per second and p99 latency of both, matched by label,
+# with the change in percent.
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 before.jsonl after.jsonl" >&2
+	exit 1
+fi
+
+# label<TAB>rps<TAB>p99 from the JSON lines loadgen writes
+extract() {
+	sed -n 's/.*"label":"\([^"]*\)".*"rps":\([0-9.]*\).*"p99":\([0-9.]*\).*/\1\t\2\t\3/p' "$1"
+}
+
+extract "$1" > "${TMPDIR:-/tmp}/compare.$$.before"
+extract "$2" | awk -F '\t' -v before="${TMPDIR:-/tmp}/compare.$$.before" '
+	BEGIN {
+		while ((getline line < before) > 0) {
+			split(line, field, "\t")
+			rps[field[1]] = field[2]
+			p99[field[1]] = field[3]
+		}
+		printf "%-24s %12s %12s %8s %12s %12s %8s\n", "run", "rps before", "rps after", "change",
+			"p99 before", "p99 after", "change"
+	}
+	function change(old, new) {
+		return old > 0 ? sprintf("%+.1f%%", (new - old) / old * 100) : "-"
+	}
+	{
+		if (!($1 in rps)) {
+			printf "%-24s %12s %12.1f %8s %12s %10.1fus %8s\n", $1, "-", $2, "-", "-", $3, "-"
+			next
+		}
+		printf "%-24s %12.1f %12.1f %8s %10.1fus %10.1fus %8s\n", $1, rps[$1], $2, change(rps[$1], $2),
+			p99[$1], $3, change(p99[$1], $3)
+	}'
+status=$?
+rm -f "${TMPDIR:-/tmp}/compare.$$.before"
+exit $status
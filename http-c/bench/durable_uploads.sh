@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# What --durable-uploads costs: POST /files/ throughput and latency with
+# uploads answered straight after the rename (off) against answered only once
+# synced, for several --commit-window settings. Appends one JSON line per run
+# to a results file, like bench/run_matrix.sh, and prints how many uploads
+# shared each sync.
+#
+#   bench/durable_uploads.sh [results.jsonl]
+#
+# The served directory is created under DATA_DIR, which must be on the disk
+# to measure: on tmpfs a sync costs nothing.
+#
+# Environment:
+#   DATA_DIR     where the served directory is created (default bench/results)
+#   DURATION     seconds measured per run (default 5)
+#   WARMUP       seconds of load before measuring (default 1)
+#   CONNECTIONS  concurrency levels (default "1 16 64")
+#   SIZES        upload sizes in bytes (default "4096 65536")
+#   WINDOWS      --commit-window values in seconds (default "0 0.001 0.005")
+#   THREADS      load generator threads (default 2)
+#   SERVER_ARGS  extra server flags, e.g. "--io-backend io_uring"
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+DATA_DIR=${DATA_DIR:-bench/results}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNECTIONS=${CONNECTIONS:-"1 16 64"}
+SIZES=${SIZES:-"4096 65536"}
+WINDOWS=${WINDOWS:-"0 0.001 0.005"}
+THREADS=${THREADS:-2}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD 2>/dev/null; then
+	commit="$commit-dirty"
+fi
+results=${1:-bench/results/$(date -u +%Y%m%dT%H%M%SZ)-$commit-durable.jsonl}
+mkdir -p "$(dirname "$results")" "$DATA_DIR"
+
+work=$(mktemp -d)
+files=$(mktemp -d "$DATA_DIR/durable-files.XXXXXX")
+server_pid=
+stop_server() {
+	if [ -n "$server_pid" ]; then
+		kill "$server_pid" 2>/dev/null || true
+		wait "$server_pid" 2>/dev/null || true
+		server_pid=
+	fi
+}
+cleanup() {
+	stop_server
+	rm -rf "$work" "$files"
+}
+trap cleanup EXIT INT TERM
+
+gcc -O2 -o "$work/http-c" app/*.c -lz -lssl -lcrypto
+gcc -O2 -pthread -o "$work/loadgen" bench/loadgen.c
+
+# Start the server with the given flags and wait for its listening socket
+start_server() {
+	# shellcheck disable=SC2086 # SERVER_ARGS is a list of flags
+	"$work/http-c" --directory "$files" $SERVER_ARGS "$@" > "$work/server.log" 2>&1 &
+	server_pid=$!
+	tries=0
+	until "$work/loadgen" --duration 0.05 --warmup 0 --connections 1 --mix root > /dev/null 2>&1; do
+		tries=$((tries + 1))
+		if [ $tries -gt 50 ] || ! kill -0 "$server_pid" 2>/dev/null; then
+			echo "Server did not start:" >&2
+			cat "$work/server.log" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+# Spread the uploads over a few names, as separate clients would, rather
+# than have every one replace the same file
+mix() {
+	echo "post:a.bin:$1,post:b.bin:$1,post:c.bin:$1,post:d.bin:$1"
+}
+
+# mode label, then server flags
+run_mode() {
+	label=$1
+	shift
+	start_server "$@"
+	for size in $SIZES; do
+		for c in $CONNECTIONS; do
+			"$work/loadgen" --duration "$DURATION" --warmup "$WARMUP" --threads "$THREADS" \
+				--connections "$c" --label "post-$size $label c$c" --json "$results" --mix "$(mix "$size")"
+		done
+	done
+	# Read back from /metrics: how well the uploads were grouped
+	stats=$(curl -s http://localhost:4221/metrics | grep '^http_durable' || true)
+	if [ -n "$stats" ]; then
+		echo "$stats" | awk '{ v[$1] = $2 } END {
+			if (v["http_durable_commits_total"] > 0)
+				printf "  %d uploads in %d syncs, %.1f per sync\n", v["http_durable_uploads_total"],
+					v["http_durable_commits_total"], v["http_durable_uploads_total"] / v["http_durable_commits_total"]
+		}'
+	fi
+	stop_server
+}
+
+run_mode "off"
+for window in $WINDOWS; do
+	run_mode "durable window=$window" --durable-uploads on --commit-window "$window"
+done
+
+echo "Results: $results"
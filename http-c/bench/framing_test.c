@@ -0,0 +1,271 @@
+/*
+ * Tests that a request's body is never taken for the next request, whatever
+ * route answered it (app/connection.c). A body the route didn't read must be
+ * skipped, or the connection closed after the response; a request hidden in
+ * a body must not be answered.
+ *
+ * Build and run from the http-c directory:
+ *   gcc -O2 -Iapp -o /tmp/framing_test bench/framing_test.c app/connection.c app/pool.c app/arena.c \
+ *       app/http_parser.c app/header_scan.c app/file_cache.c app/gzip.c app/upload.c app/range.c \
+ *       app/http_date.c app/validators.c app/metrics.c app/log.c app/timer_wheel.c app/router.c \
+ *       app/open_files.c app/tls.c app/http2.c app/hpack.c app/restart.c app/commit.c \
+ *       -lz -lssl -lcrypto \
+ *       && /tmp/framing_test
+ *
+ * Each case drives one connection over a socketpair through the same entry
+ * point epoll uses, as bench/alloc_bench.c does. The input is sent whole,
+ * then again one byte at a time, and the responses that come back are
+ * compared with the expected ones. Prints each failure and exits non-zero if
+ * there was any.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "header_scan.h"
+#include "open_files.h"
+#include "pool.h"
+#include "server.h"
+
+// The server's settings, normally defined next to main() in server.c
+char *g_directory_path = NULL;
+int g_worker_count = 1;
+int g_listen_backlog = 128;
+int g_max_connections = 0;
+size_t g_cache_size = 0;
+size_t g_open_files = 1024;
+const char *g_cache_control = NULL;
+enum io_backend g_io_backend = IO_BACKEND_EPOLL;
+enum log_level g_log_level = LOG_INFO;
+int g_access_log = 0;
+int g_http2 = 1;
+struct connection_timeouts g_timeouts;
+unsigned g_drain_timeout_ms;
+int g_durable_uploads = 0;
+unsigned g_commit_window_ms;
+struct http_parser_limits g_parser_limits = {
+	.max_header_bytes = HTTP_DEFAULT_MAX_HEADER_BYTES,
+	.max_headers = HTTP_DEFAULT_MAX_HEADERS,
+	.max_uri = HTTP_DEFAULT_MAX_URI,
+	.max_body = 0,
+};
+
+static int failures;
+
+// Everything the connection sent back
+struct output {
+	char data[64 * 1024];
+	size_t len;
+	int closed; // the server half-closed (or closed) its end
+};
+
+static void collect(int peer, struct output *output) {
+	while (output->len < sizeof(output->data)) {
+		ssize_t got = read(peer, output->data + output->len, sizeof(output->data) - output->len);
+		if (got == 0) {
+			output->closed = 1;
+		}
+		if (got <= 0) {
+			return;
+		}
+		output->len += (size_t)got;
+	}
+}
+
+// Send `input` in pieces of `segment` bytes, letting the connection run after
+// each, then run it until it has nothing more to say
+static void drive(const char *input, size_t len, size_t segment, struct output *output) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	struct connection *conn = connection_new(fds[0]);
+	if (conn == NULL) {
+		exit(1);
+	}
+	int peer = fds[1];
+	output->len = 0;
+	output->closed = 0;
+	for (size_t sent = 0; sent < len && conn->state != CONN_CLOSED;) {
+		size_t piece = len - sent < segment ? len - sent : segment;
+		ssize_t written = write(peer, input + sent, piece);
+		if (written <= 0) {
+			break; // The server stopped reading: it is closing
+		}
+		sent += (size_t)written;
+		connection_on_event(conn, EPOLLIN | EPOLLOUT);
+		collect(peer, output);
+	}
+	for (int rounds = 0; rounds < 1000 && conn->state != CONN_CLOSED; rounds++) {
+		connection_on_event(conn, EPOLLIN | EPOLLOUT);
+		collect(peer, output);
+		if (conn->state != CONN_WRITING && !connection_has_pending_output(conn)) {
+			break;
+		}
+	}
+	collect(peer, output);
+	if (conn->state == CONN_LINGERING || conn->state == CONN_CLOSED) {
+		output->closed = 1;
+	}
+	connection_free(conn);
+	close(peer);
+}
+
+// The responses in `output`, as "<status> <body>" separated by '|', e.g.
+// "200 abc|404 "
+static void summarize(const struct output *output, char *summary, size_t size) {
+	size_t pos = 0;
+	size_t used = 0;
+	summary[0] = '\0';
+	while (pos < output->len) {
+		const char *start = output->data + pos;
+		const char *end = memmem(start, output->len - pos, "\r\n\r\n", 4);
+		if (end == NULL || output->len - pos < 12 || memcmp(start, "HTTP/1.1 ", 9) != 0) {
+			snprintf(summary + used, size - used, "%s<garbage>", used > 0 ? "|" : "");
+			return;
+		}
+		size_t body_len = 0;
+		const char *length = memmem(start, (size_t)(end - start), "Content-Length: ", 16);
+		if (length != NULL) {
+			body_len = strtoul(length + 16, NULL, 10);
+		}
+		size_t head_len = (size_t)(end + 4 - start);
+		if (body_len > output->len - pos - head_len) {
+			body_len = output->len - pos - head_len;
+		}
+		used += (size_t)snprintf(summary + used, size - used, "%s%.3s %.*s", used > 0 ? "|" : "", start + 9,
+								 (int)(body_len < 32 ? body_len : 32), end + 4);
+		if (used >= size) {
+			return;
+		}
+		pos += head_len + body_len;
+	}
+}
+
+// Send `input` whole and byte by byte; both must give `expected` (see
+// summarize()) and leave the connection open or closed as `closes` says
+static void check(const char *label, const char *input, const char *expected, int closes) {
+	static struct output output;
+	char summary[1024];
+	size_t segments[] = { strlen(input), 1 };
+	for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+		drive(input, strlen(input), segments[i], &output);
+		summarize(&output, summary, sizeof(summary));
+		if (strcmp(summary, expected) != 0 || output.closed != closes) {
+			printf("FAIL %s (%s): got \"%s\"%s, expected \"%s\"%s\n", label, i == 0 ? "whole" : "byte at a time",
+				   summary, output.closed ? " then close" : "", expected, closes ? " then close" : "");
+			failures++;
+		}
+	}
+}
+
+int main(void) {
+	header_scan_init();
+	if (pool_init() != 0 || connection_routes_init() != 0) {
+		return 1;
+	}
+	char directory[] = "/tmp/framing_test.XXXXXX";
+	if (mkdtemp(directory) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	g_directory_path = directory;
+	if (open_files_init(directory, g_open_files) != 0) {
+		return 1;
+	}
+	char path[256];
+	snprintf(path, sizeof(path), "%s/a.txt", directory);
+	FILE *file = fopen(path, "w");
+	if (file == NULL || fputs("secret\n", file) < 0 || fclose(file) != 0) {
+		perror(path);
+		return 1;
+	}
+
+	// Bodies no route reads
+	check("POST /, Content-Length",
+		  "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "200 |200 next", 0);
+	check("POST /echo/, request in the body",
+		  "POST /echo/abc HTTP/1.1\r\nContent-Length: 31\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n\r\n",
+		  "200 abc", 0);
+	check("POST /echo/, chunked, request in the body",
+		  "POST /echo/abc HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+		  "1d\r\nGET /files/a.txt HTTP/1.1\r\n\r\n\r\n0\r\n\r\n"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "200 abc|200 next", 0);
+	check("POST /user-agent, chunked with a trailer",
+		  "POST /user-agent HTTP/1.1\r\nUser-Agent: t\r\nTransfer-Encoding: chunked\r\n\r\n"
+		  "3;ext=1\r\nabc\r\n0\r\nX-Trailer: GET /files/a.txt HTTP/1.1\r\n\r\n"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "200 t|200 next", 0);
+	check("405, Content-Length",
+		  "POST /nowhere HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "405 |200 next", 0);
+	check("404, Content-Length",
+		  "GET /nowhere HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "404 |200 next", 0);
+
+	// No way to tell where the body ends: refused if the headers already say
+	// so, otherwise answered, and either way the connection closes
+	check("POST /echo/, Transfer-Encoding without chunked",
+		  "POST /echo/abc HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n",
+		  "400 ", 1);
+	check("POST /echo/, chunked overridden by a later Transfer-Encoding",
+		  "POST /echo/abc HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n",
+		  "400 ", 1);
+	check("POST /echo/, malformed chunk size",
+		  "POST /echo/abc HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+		  "zz\r\nGET /files/a.txt HTTP/1.1\r\n\r\n",
+		  "200 abc", 1);
+	// A file response goes out before the body could be skipped
+	check("GET /files/, Content-Length",
+		  "GET /files/a.txt HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n",
+		  "200 secret\n", 1);
+
+	// Uploads, and the answers that come before the upload starts
+	check("POST /files/, then a request",
+		  "POST /files/up.txt HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+		  "GET /files/up.txt HTTP/1.1\r\n\r\n",
+		  "201 |200 abc", 0);
+	check("POST /files/, chunked, then a request",
+		  "POST /files/up.txt HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nxy\r\n0\r\n\r\n"
+		  "GET /files/up.txt HTTP/1.1\r\n\r\n",
+		  "201 |200 xy", 0);
+	static char long_name[2048];
+	int n = snprintf(long_name, sizeof(long_name), "POST /files/");
+	memset(long_name + n, 'n', 600);
+	snprintf(long_name + n + 600, sizeof(long_name) - (size_t)n - 600,
+			 " HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+			 "GET /files/a.txt HTTP/1.1\r\n\r\n"
+			 "GET /echo/next HTTP/1.1\r\n\r\n");
+	check("POST /files/, name too long", long_name, "500 |200 next", 0);
+	g_directory_path = NULL;
+	check("POST /files/, no directory",
+		  "POST /files/up.txt HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+		  "GET /files/a.txt HTTP/1.1\r\n\r\n"
+		  "GET /echo/next HTTP/1.1\r\n\r\n",
+		  "500 |200 next", 0);
+	g_directory_path = directory;
+
+	snprintf(path, sizeof(path), "rm -rf %s", directory);
+	if (system(path) != 0) {
+		return 1;
+	}
+	printf("%s\n", failures == 0 ? "ok" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
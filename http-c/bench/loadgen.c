@@ -0,0 +1,801 @@
+/*
+ * Load generator for the server: keeps a number of connections busy with a
+ * weighted mix of requests and reports requests per second, throughput and
+ * latency percentiles.
+ *
+ * Build from the http-c directory:
+ *   gcc -O2 -pthread -o /tmp/loadgen bench/loadgen.c
+ *
+ * Example (the server must be running):
+ *   /tmp/loadgen --connections 64 --threads 2 --duration 10 --mix 'echo:64@3,get:small.bin@1'
+ *
+ * Each connection sends a request, waits for the whole response and sends
+ * the next one (a closed loop), so latencies are per-request service times at
+ * the given concurrency. Without keep-alive every request also connects, and
+ * its latency includes the connect. Latencies go into a log-linear
+ * (HDR-style) histogram with under 1% error per value.
+ *
+ * Requests in --mix, each optionally weighted with @n (default 1):
+ *   root               GET /
+ *   echo:<n>           GET /echo/ with an n-byte path
+ *   user-agent         GET /user-agent
+ *   get:<name>         GET /files/<name>
+ *   post:<name>:<n>    POST /files/<name> with an n-byte body
+ *
+ * With --json <path> a one-line JSON summary is appended to the file.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SCENARIOS 16
+#define HEAD_MAX 8192
+#define RECV_BUFFER_SIZE (64 * 1024)
+
+// --- Latency histogram ---
+
+// Values below HIST_LINEAR are counted exactly; above, each power of two is
+// split into HIST_SUB equal sub-buckets, so a value is off by under 1/HIST_SUB
+#define HIST_LINEAR 256
+#define HIST_SUB 128
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 8) * HIST_SUB)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+	double sum;
+};
+
+static int hist_index(uint64_t value) {
+	if (value < HIST_LINEAR) {
+		return (int)value;
+	}
+	int exponent = 63 - __builtin_clzll(value); // >= 8
+	int shift = exponent - 7;                   // value >> shift is in [128, 256)
+	return HIST_LINEAR + (exponent - 8) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+}
+
+// Highest value counted in bucket `index`
+static uint64_t hist_value(int index) {
+	if (index < HIST_LINEAR) {
+		return (uint64_t)index;
+	}
+	int exponent = 8 + (index - HIST_LINEAR) / HIST_SUB;
+	uint64_t mantissa = HIST_SUB + (uint64_t)((index - HIST_LINEAR) % HIST_SUB);
+	int shift = exponent - 7;
+	return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value) {
+	hist->counts[hist_index(value)]++;
+	hist->total++;
+	hist->sum += (double)value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *from) {
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		into->counts[i] += from->counts[i];
+	}
+	into->total += from->total;
+	into->sum += from->sum;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+// Value at `percentile` (0-100)
+static uint64_t hist_percentile(const struct histogram *hist, double percentile) {
+	if (hist->total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->total + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t value = hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+// --- Settings ---
+
+struct scenario {
+	char spec[128];  // as given in --mix, without the weight
+	unsigned weight;
+	char *request;   // complete request bytes
+	size_t request_len;
+};
+
+static const char *g_host = "127.0.0.1";
+static int g_port = 4221;
+static int g_connections = 16;
+static int g_threads = 1;
+static double g_duration = 10;
+static double g_warmup = 1;
+static int g_keep_alive = 1;
+static int g_gzip = 0;
+static const char *g_mix = "root";
+static const char *g_json_path = NULL;
+static const char *g_label = "";
+
+static struct scenario g_scenarios[MAX_SCENARIOS];
+static int g_scenario_count;
+static unsigned g_weight_total;
+static struct sockaddr_storage g_address;
+static socklen_t g_address_len;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Build the request for one --mix entry. Returns 0 on success, -1 if the
+// entry is malformed.
+static int build_scenario(struct scenario *scenario) {
+	char common[256];
+	snprintf(common, sizeof(common), "Host: %s:%d\r\n%s%s", g_host, g_port,
+			 g_keep_alive ? "" : "Connection: close\r\n", g_gzip ? "Accept-Encoding: gzip\r\n" : "");
+	const char *spec = scenario->spec;
+	char *request = NULL;
+	int len = -1;
+	if (strcmp(spec, "root") == 0) {
+		len = asprintf(&request, "GET / HTTP/1.1\r\n%s\r\n", common);
+	} else if (strncmp(spec, "echo:", 5) == 0) {
+		long size = strtol(spec + 5, NULL, 10);
+		if (size < 0 || size > 1 << 20) {
+			return -1;
+		}
+		char *path = malloc((size_t)size + 1);
+		if (path == NULL) {
+			return -1;
+		}
+		memset(path, 'a', (size_t)size);
+		path[size] = '\0';
+		len = asprintf(&request, "GET /echo/%s HTTP/1.1\r\n%s\r\n", path, common);
+		free(path);
+	} else if (strcmp(spec, "user-agent") == 0) {
+		len = asprintf(&request, "GET /user-agent HTTP/1.1\r\nUser-Agent: loadgen/1.0 (http-c benchmark)\r\n%s\r\n",
+					   common);
+	} else if (strncmp(spec, "get:", 4) == 0 && spec[4] != '\0') {
+		len = asprintf(&request, "GET /files/%s HTTP/1.1\r\n%s\r\n", spec + 4, common);
+	} else if (strncmp(spec, "post:", 5) == 0) {
+		const char *size_at = strrchr(spec + 5, ':');
+		long size = size_at != NULL ? strtol(size_at + 1, NULL, 10) : -1;
+		if (size_at == NULL || size_at == spec + 5 || size < 0 || size > 1L << 30) {
+			return -1;
+		}
+		char *head = NULL;
+		int head_len = asprintf(&head, "POST /files/%.*s HTTP/1.1\r\nContent-Length: %ld\r\n%s\r\n",
+								(int)(size_at - (spec + 5)), spec + 5, size, common);
+		if (head_len < 0) {
+			return -1;
+		}
+		request = malloc((size_t)head_len + (size_t)size);
+		if (request == NULL) {
+			free(head);
+			return -1;
+		}
+		memcpy(request, head, (size_t)head_len);
+		memset(request + head_len, 'x', (size_t)size);
+		len = head_len + (int)size;
+		free(head);
+	}
+	if (len < 0) {
+		return -1;
+	}
+	scenario->request = request;
+	scenario->request_len = (size_t)len;
+	return 0;
+}
+
+// Split --mix into scenarios. Returns 0 on success, -1 on error.
+static int parse_mix(const char *mix) {
+	char *copy = strdup(mix);
+	char *save = NULL;
+	for (char *entry = strtok_r(copy, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)) {
+		if (g_scenario_count == MAX_SCENARIOS) {
+			fprintf(stderr, "Too many entries in --mix (at most %d)\n", MAX_SCENARIOS);
+			free(copy);
+			return -1;
+		}
+		struct scenario *scenario = &g_scenarios[g_scenario_count];
+		scenario->weight = 1;
+		char *weight = strrchr(entry, '@');
+		if (weight != NULL) {
+			*weight++ = '\0';
+			long value = strtol(weight, NULL, 10);
+			if (value <= 0 || value > 1000000) {
+				fprintf(stderr, "Invalid weight in --mix: %s\n", weight);
+				free(copy);
+				return -1;
+			}
+			scenario->weight = (unsigned)value;
+		}
+		snprintf(scenario->spec, sizeof(scenario->spec), "%s", entry);
+		if (build_scenario(scenario) != 0) {
+			fprintf(stderr, "Invalid --mix entry: %s\n", entry);
+			free(copy);
+			return -1;
+		}
+		g_weight_total += scenario->weight;
+		g_scenario_count++;
+	}
+	free(copy);
+	if (g_scenario_count == 0) {
+		fprintf(stderr, "--mix is empty\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_int_flag(const char *flag, const char *value, int min, int *out) {
+	char *end;
+	errno = 0;
+	long parsed = strtol(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' || parsed < min || parsed > INT_MAX) {
+		fprintf(stderr, "Invalid value for %s: %s\n", flag, value);
+		return -1;
+	}
+	*out = (int)parsed;
+	return 0;
+}
+
+static int parse_seconds_flag(const char *flag, const char *value, double *out) {
+	char *end;
+	double parsed = strtod(value, &end);
+	if (end == value || *end != '\0' || parsed < 0) {
+		fprintf(stderr, "Invalid value for %s: %s\n", flag, value);
+		return -1;
+	}
+	*out = parsed;
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		const char *flag = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "Missing value for %s\n", flag);
+			return -1;
+		}
+		const char *value = argv[++i];
+		int result = 0;
+		if (strcmp(flag, "--host") == 0) {
+			g_host = value;
+		} else if (strcmp(flag, "--port") == 0) {
+			result = parse_int_flag(flag, value, 1, &g_port);
+		} else if (strcmp(flag, "--connections") == 0) {
+			result = parse_int_flag(flag, value, 1, &g_connections);
+		} else if (strcmp(flag, "--threads") == 0) {
+			result = parse_int_flag(flag, value, 1, &g_threads);
+		} else if (strcmp(flag, "--duration") == 0) {
+			result = parse_seconds_flag(flag, value, &g_duration);
+		} else if (strcmp(flag, "--warmup") == 0) {
+			result = parse_seconds_flag(flag, value, &g_warmup);
+		} else if (strcmp(flag, "--keep-alive") == 0) {
+			result = parse_int_flag(flag, value, 0, &g_keep_alive);
+		} else if (strcmp(flag, "--gzip") == 0) {
+			result = parse_int_flag(flag, value, 0, &g_gzip);
+		} else if (strcmp(flag, "--mix") == 0) {
+			g_mix = value;
+		} else if (strcmp(flag, "--json") == 0) {
+			g_json_path = value;
+		} else if (strcmp(flag, "--label") == 0) {
+			g_label = value;
+		} else {
+			fprintf(stderr, "Unknown flag: %s\n", flag);
+			return -1;
+		}
+		if (result != 0) {
+			return -1;
+		}
+	}
+	if (g_threads > g_connections) {
+		g_threads = g_connections;
+	}
+	return 0;
+}
+
+// --- Clients ---
+
+enum client_state {
+	CLIENT_IDLE,       // not connected
+	CLIENT_CONNECTING,
+	CLIENT_SENDING,
+	CLIENT_RECEIVING,
+};
+
+// Where we are in the response
+enum response_state {
+	RESPONSE_HEAD,
+	RESPONSE_BODY,       // Content-Length body
+	RESPONSE_CHUNK_SIZE, // chunked body, in the size line
+	RESPONSE_CHUNK_DATA,
+	RESPONSE_CHUNK_END,  // CRLF after the chunk data
+	RESPONSE_TRAILER,
+	RESPONSE_DONE,
+};
+
+struct client {
+	int fd;
+	enum client_state state;
+	const struct scenario *scenario;
+	size_t sent;
+	uint64_t started_ns;
+
+	enum response_state response;
+	char head[HEAD_MAX];
+	size_t head_len;
+	int status;
+	int server_closes;        // Connection: close
+	unsigned long long remaining;
+	int size_digits;
+	int size_done;            // past the chunk size digits (extension or CR)
+	size_t line_len;          // bytes in the current trailer line
+};
+
+struct worker {
+	pthread_t thread;
+	int connection_count;
+	unsigned long long rng;
+	uint64_t measure_from_ns;
+	uint64_t stop_ns;
+	// Results, only counted from measure_from_ns on
+	struct histogram latency;
+	unsigned long long requests;
+	unsigned long long errors;      // connect/IO failures and malformed responses
+	unsigned long long bad_status;  // complete responses that aren't 2xx
+	unsigned long long rx_bytes;
+	unsigned long long tx_bytes;
+};
+
+static const struct scenario *pick_scenario(struct worker *worker) {
+	if (g_scenario_count == 1) {
+		return &g_scenarios[0];
+	}
+	// xorshift64*
+	worker->rng ^= worker->rng >> 12;
+	worker->rng ^= worker->rng << 25;
+	worker->rng ^= worker->rng >> 27;
+	unsigned pick = (unsigned)((worker->rng * 2685821657736338717ull) >> 32) % g_weight_total;
+	for (int i = 0; i < g_scenario_count; i++) {
+		if (pick < g_scenarios[i].weight) {
+			return &g_scenarios[i];
+		}
+		pick -= g_scenarios[i].weight;
+	}
+	return &g_scenarios[g_scenario_count - 1];
+}
+
+static void client_close(struct client *client) {
+	if (client->fd >= 0) {
+		close(client->fd); // Also leaves the epoll set
+		client->fd = -1;
+	}
+	client->state = CLIENT_IDLE;
+}
+
+static void start_response(struct client *client) {
+	client->response = RESPONSE_HEAD;
+	client->head_len = 0;
+	client->status = 0;
+	client->server_closes = 0;
+	client->remaining = 0;
+}
+
+// The header block is complete in client->head[0, len): pick up the status
+// and how the body is framed. Returns 0 on success, -1 if malformed.
+static int parse_head(struct client *client, size_t len) {
+	if (len < 12 || strncmp(client->head, "HTTP/1.", 7) != 0) {
+		return -1;
+	}
+	client->status = atoi(client->head + 9);
+	int chunked = 0;
+	long long content_length = 0;
+	const char *line = memchr(client->head, '\n', len);
+	const char *end = client->head + len;
+	while (line != NULL && ++line < end) {
+		const char *line_end = memchr(line, '\n', (size_t)(end - line));
+		if (line_end == NULL) {
+			break;
+		}
+		if (strncasecmp(line, "content-length:", 15) == 0) {
+			content_length = atoll(line + 15);
+		} else if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+			chunked = memmem(line, (size_t)(line_end - line), "chunked", 7) != NULL;
+		} else if (strncasecmp(line, "connection:", 11) == 0) {
+			client->server_closes = memmem(line, (size_t)(line_end - line), "close", 5) != NULL;
+		}
+		line = line_end;
+	}
+	if (chunked) {
+		client->response = RESPONSE_CHUNK_SIZE;
+		client->remaining = 0;
+		client->size_digits = 0;
+		client->size_done = 0;
+	} else if (content_length > 0) {
+		client->response = RESPONSE_BODY;
+		client->remaining = (unsigned long long)content_length;
+	} else {
+		client->response = RESPONSE_DONE;
+	}
+	return 0;
+}
+
+// Consume received response bytes. Returns -1 if the response is
+// malformed, otherwise 0 (check client->response for RESPONSE_DONE).
+static int feed_response(struct client *client, const char *data, size_t len) {
+	size_t pos = 0;
+	while (pos < len && client->response != RESPONSE_DONE) {
+		switch (client->response) {
+		case RESPONSE_HEAD: {
+			size_t take = len - pos;
+			if (take > HEAD_MAX - client->head_len) {
+				take = HEAD_MAX - client->head_len;
+			}
+			if (take == 0) {
+				return -1; // Header block too large
+			}
+			size_t search_from = client->head_len > 3 ? client->head_len - 3 : 0;
+			memcpy(client->head + client->head_len, data + pos, take);
+			client->head_len += take;
+			char *blank = memmem(client->head + search_from, client->head_len - search_from, "\r\n\r\n", 4);
+			if (blank == NULL) {
+				pos += take;
+				break;
+			}
+			size_t head_len = (size_t)(blank + 4 - client->head);
+			// Bytes past the header block are body; hand them on
+			pos += take - (client->head_len - head_len);
+			if (parse_head(client, head_len) != 0) {
+				return -1;
+			}
+			break;
+		}
+		case RESPONSE_BODY:
+		case RESPONSE_CHUNK_DATA: {
+			size_t take = len - pos;
+			if (take > client->remaining) {
+				take = (size_t)client->remaining;
+			}
+			pos += take;
+			client->remaining -= take;
+			if (client->remaining == 0) {
+				client->response = client->response == RESPONSE_BODY ? RESPONSE_DONE : RESPONSE_CHUNK_END;
+			}
+			break;
+		}
+		case RESPONSE_CHUNK_SIZE: {
+			char c = data[pos++];
+			int digit = -1;
+			if (c >= '0' && c <= '9') {
+				digit = c - '0';
+			} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+				digit = (c | 0x20) - 'a' + 10;
+			}
+			if (c == '\n') {
+				if (client->size_digits == 0) {
+					return -1;
+				}
+				if (client->remaining == 0) {
+					client->response = RESPONSE_TRAILER;
+					client->line_len = 0;
+				} else {
+					client->response = RESPONSE_CHUNK_DATA;
+				}
+			} else if (digit >= 0 && !client->size_done) {
+				if (++client->size_digits > 15) {
+					return -1;
+				}
+				client->remaining = client->remaining * 16 + (unsigned long long)digit;
+			} else if (client->size_digits == 0) {
+				return -1;
+			} else {
+				client->size_done = 1; // An extension or the CR; skip to the LF
+			}
+			break;
+		}
+		case RESPONSE_CHUNK_END:
+			if (data[pos++] == '\n') {
+				client->response = RESPONSE_CHUNK_SIZE;
+				client->remaining = 0;
+				client->size_digits = 0;
+				client->size_done = 0;
+			}
+			break;
+		case RESPONSE_TRAILER: {
+			char c = data[pos++];
+			if (c == '\n') {
+				if (client->line_len == 0) {
+					client->response = RESPONSE_DONE;
+				}
+				client->line_len = 0;
+			} else if (c != '\r') {
+				client->line_len++;
+			}
+			break;
+		}
+		case RESPONSE_DONE:
+			break;
+		}
+	}
+	if (pos < len && client->response == RESPONSE_DONE) {
+		return -1; // More than one response: we never pipeline
+	}
+	return 0;
+}
+
+static int measuring(const struct worker *worker, uint64_t now) {
+	return now >= worker->measure_from_ns;
+}
+
+static void client_failed(struct worker *worker, struct client *client) {
+	if (measuring(worker, now_ns())) {
+		worker->errors++;
+	}
+	client_close(client);
+}
+
+// Start the next request on `client`: connect if needed, then send
+static void client_start(struct worker *worker, int epoll_fd, struct client *client) {
+	client->scenario = pick_scenario(worker);
+	client->sent = 0;
+	start_response(client);
+	if (client->fd >= 0) {
+		client->started_ns = now_ns();
+		client->state = CLIENT_SENDING;
+		struct epoll_event event = { .events = EPOLLOUT | EPOLLIN, .data.ptr = client };
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+		return;
+	}
+	client->started_ns = now_ns();
+	client->fd = socket(g_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		perror("socket");
+		client_failed(worker, client);
+		return;
+	}
+	int one = 1;
+	setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(client->fd, (struct sockaddr *)&g_address, g_address_len) != 0 && errno != EINPROGRESS) {
+		client_failed(worker, client);
+		return;
+	}
+	client->state = CLIENT_CONNECTING;
+	struct epoll_event event = { .events = EPOLLOUT | EPOLLIN, .data.ptr = client };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event) != 0) {
+		perror("epoll_ctl");
+		client_failed(worker, client);
+	}
+}
+
+static void client_finished(struct worker *worker, int epoll_fd, struct client *client) {
+	uint64_t now = now_ns();
+	if (measuring(worker, now) && client->started_ns >= worker->measure_from_ns) {
+		hist_record(&worker->latency, now - client->started_ns);
+		worker->requests++;
+		if (client->status < 200 || client->status > 299) {
+			worker->bad_status++;
+		}
+	}
+	if (!g_keep_alive || client->server_closes) {
+		client_close(client);
+	}
+	if (now < worker->stop_ns) {
+		client_start(worker, epoll_fd, client);
+	}
+}
+
+static void client_event(struct worker *worker, int epoll_fd, struct client *client, uint32_t events) {
+	static __thread char buffer[RECV_BUFFER_SIZE];
+	if (client->state == CLIENT_CONNECTING) {
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+		if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+			client_failed(worker, client);
+			return;
+		}
+		client->state = CLIENT_SENDING;
+	}
+	if (client->state == CLIENT_SENDING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+		while (client->sent < client->scenario->request_len) {
+			ssize_t written = send(client->fd, client->scenario->request + client->sent,
+								   client->scenario->request_len - client->sent, MSG_NOSIGNAL);
+			if (written < 0) {
+				if (errno == EAGAIN) {
+					return;
+				}
+				client_failed(worker, client);
+				return;
+			}
+			client->sent += (size_t)written;
+			if (measuring(worker, now_ns())) {
+				worker->tx_bytes += (unsigned long long)written;
+			}
+		}
+		client->state = CLIENT_RECEIVING;
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+	}
+	// The server may answer (e.g. 413) before the whole request is sent
+	if (client->state == CLIENT_SENDING || client->state == CLIENT_RECEIVING) {
+		while (1) {
+			ssize_t received = recv(client->fd, buffer, sizeof(buffer), 0);
+			if (received < 0) {
+				if (errno == EAGAIN) {
+					return;
+				}
+				client_failed(worker, client);
+				return;
+			}
+			if (received == 0) {
+				client_failed(worker, client); // Closed before the response was complete
+				return;
+			}
+			if (measuring(worker, now_ns())) {
+				worker->rx_bytes += (unsigned long long)received;
+			}
+			if (feed_response(client, buffer, (size_t)received) != 0) {
+				client_failed(worker, client);
+				return;
+			}
+			if (client->response == RESPONSE_DONE) {
+				client_finished(worker, epoll_fd, client);
+				return;
+			}
+		}
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct worker *worker = arg;
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct client *clients = calloc((size_t)worker->connection_count, sizeof(*clients));
+	if (epoll_fd < 0 || clients == NULL) {
+		perror("worker setup");
+		exit(1);
+	}
+	for (int i = 0; i < worker->connection_count; i++) {
+		clients[i].fd = -1;
+		client_start(worker, epoll_fd, &clients[i]);
+	}
+	struct epoll_event events[256];
+	while (now_ns() < worker->stop_ns) {
+		int count = epoll_wait(epoll_fd, events, 256, 50);
+		for (int i = 0; i < count; i++) {
+			client_event(worker, epoll_fd, events[i].data.ptr, events[i].events);
+		}
+		// Clients that failed start over (a refused connection is retried
+		// at most every 50ms per client)
+		for (int i = 0; i < worker->connection_count; i++) {
+			if (clients[i].state == CLIENT_IDLE && now_ns() < worker->stop_ns) {
+				client_start(worker, epoll_fd, &clients[i]);
+			}
+		}
+	}
+	for (int i = 0; i < worker->connection_count; i++) {
+		client_close(&clients[i]);
+	}
+	free(clients);
+	close(epoll_fd);
+	return NULL;
+}
+
+static int resolve(void) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *result;
+	char port[16];
+	snprintf(port, sizeof(port), "%d", g_port);
+	int error = getaddrinfo(g_host, port, &hints, &result);
+	if (error != 0) {
+		fprintf(stderr, "Cannot resolve %s: %s\n", g_host, gai_strerror(error));
+		return -1;
+	}
+	memcpy(&g_address, result->ai_addr, result->ai_addrlen);
+	g_address_len = result->ai_addrlen;
+	freeaddrinfo(result);
+	return 0;
+}
+
+static void write_json(FILE *out, const struct worker *total, const struct histogram *latency, double seconds) {
+	fprintf(out, "{\"label\":\"%s\",\"mix\":\"%s\",\"connections\":%d,\"threads\":%d,\"keep_alive\":%d,\"gzip\":%d,",
+			g_label, g_mix, g_connections, g_threads, g_keep_alive, g_gzip);
+	fprintf(out, "\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,\"rps\":%.1f,", seconds,
+			total->requests, total->errors, total->bad_status, (double)total->requests / seconds);
+	fprintf(out, "\"rx_bytes_per_s\":%.0f,\"tx_bytes_per_s\":%.0f,", (double)total->rx_bytes / seconds,
+			(double)total->tx_bytes / seconds);
+	fprintf(out,
+			"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"p9999\":%.1f,"
+			"\"max\":%.1f}}\n",
+			latency->total ? latency->sum / (double)latency->total / 1e3 : 0.0,
+			hist_percentile(latency, 50) / 1e3, hist_percentile(latency, 90) / 1e3,
+			hist_percentile(latency, 99) / 1e3, hist_percentile(latency, 99.9) / 1e3,
+			hist_percentile(latency, 99.99) / 1e3, latency->max / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+	if (parse_args(argc, argv) != 0 || parse_mix(g_mix) != 0 || resolve() != 0) {
+		return 1;
+	}
+	struct worker *workers = calloc((size_t)g_threads, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	uint64_t start = now_ns();
+	uint64_t measure_from = start + (uint64_t)(g_warmup * 1e9);
+	uint64_t stop = measure_from + (uint64_t)(g_duration * 1e9);
+	for (int i = 0; i < g_threads; i++) {
+		workers[i].connection_count = g_connections / g_threads + (i < g_connections % g_threads);
+		workers[i].rng = 0x9e3779b97f4a7c15ull * (uint64_t)(i + 1);
+		workers[i].measure_from_ns = measure_from;
+		workers[i].stop_ns = stop;
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	struct worker total = { 0 };
+	struct histogram *latency = calloc(1, sizeof(*latency));
+	for (int i = 0; i < g_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		hist_merge(latency, &workers[i].latency);
+		total.requests += workers[i].requests;
+		total.errors += workers[i].errors;
+		total.bad_status += workers[i].bad_status;
+		total.rx_bytes += workers[i].rx_bytes;
+		total.tx_bytes += workers[i].tx_bytes;
+	}
+	double seconds = g_duration > 0 ? g_duration : 1e-9;
+
+	printf("%s%s%d connections, %d threads, %s%s, %.1fs: %s\n", g_label, g_label[0] ? ": " : "", g_connections,
+		   g_threads, g_keep_alive ? "keep-alive" : "connection per request", g_gzip ? ", gzip" : "", seconds,
+		   g_mix);
+	printf("  requests  %llu (%.1f/s), errors %llu, non-2xx %llu\n", total.requests,
+		   (double)total.requests / seconds, total.errors, total.bad_status);
+	printf("  transfer  %.2f MB/s received, %.2f MB/s sent\n", (double)total.rx_bytes / seconds / 1e6,
+		   (double)total.tx_bytes / seconds / 1e6);
+	printf("  latency   mean %.1fus  p50 %.1fus  p90 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n",
+		   latency->total ? latency->sum / (double)latency->total / 1e3 : 0.0, hist_percentile(latency, 50) / 1e3,
+		   hist_percentile(latency, 90) / 1e3, hist_percentile(latency, 99) / 1e3,
+		   hist_percentile(latency, 99.9) / 1e3, latency->max / 1e3);
+
+	if (g_json_path != NULL) {
+		FILE *out = fopen(g_json_path, "a");
+		if (out == NULL) {
+			perror(g_json_path);
+			return 1;
+		}
+		write_json(out, &total, latency, seconds);
+		fclose(out);
+	}
+	free(latency);
+	free(workers);
+	return total.requests > 0 ? 0 : 1;
+}
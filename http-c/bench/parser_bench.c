@@ -0,0 +1,103 @@
+/*
+ * Microbenchmark for the incremental request parser (app/http_parser.c) and
+ * the vectorized scanning kernels it uses (app/header_scan.c).
+ *
+ * Build and run from the http-c directory:
+ *   gcc -O2 -Iapp -o /tmp/parser_bench bench/parser_bench.c app/http_parser.c app/header_scan.c && /tmp/parser_bench
+ *
+ * Each scenario parses the same request many times, either handed over whole or
+ * split into small segments as if it trickled in over several recv() calls, and
+ * reports the time per request and the parsing throughput. The scenarios run
+ * once with the scalar kernels and once with the ones picked for this CPU.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "header_scan.h"
+#include "http_parser.h"
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse `request` `iterations` times, feeding it `segment` bytes at a time
+// (0 = all at once)
+static void run(const char *label, const char *request, size_t segment, int iterations) {
+	struct http_parser_limits limits = {
+		.max_header_bytes = 64 * 1024,
+		.max_headers = HTTP_MAX_HEADERS_CAP,
+		.max_uri = HTTP_DEFAULT_MAX_URI,
+		.max_body = 0,
+	};
+	static struct http_request parsed;
+	struct http_parser parser;
+	http_parser_init(&parser, &parsed, &limits);
+	size_t len = strlen(request);
+	size_t checksum = 0;
+
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		http_parser_reset(&parser);
+		enum http_parse_result result = HTTP_PARSE_INCOMPLETE;
+		if (segment == 0) {
+			result = http_parser_execute(&parser, request, len);
+		} else {
+			for (size_t available = segment; result == HTTP_PARSE_INCOMPLETE; available += segment) {
+				result = http_parser_execute(&parser, request, available < len ? available : len);
+			}
+		}
+		if (result != HTTP_PARSE_DONE) {
+			fprintf(stderr, "%s: parse failed (status %d)\n", label, parser.error_status);
+			exit(1);
+		}
+		checksum += parsed.header_count; // Keep the work observable
+	}
+	double elapsed = now_seconds() - start;
+
+	printf("%-28s %8.1f ns/request %9.1f MB/s  (%zu headers)\n", label,
+		   elapsed / iterations * 1e9, (double)len * iterations / elapsed / 1e6,
+		   checksum / (size_t)iterations);
+}
+
+int main(void) {
+	const char *small =
+		"GET /echo/abc HTTP/1.1\r\n"
+		"Host: localhost:4221\r\n"
+		"User-Agent: curl/7.64.1\r\n"
+		"Accept: */*\r\n"
+		"\r\n";
+
+	// A browser-like request with a large cookie header
+	static char large[16 * 1024];
+	int n = snprintf(large, sizeof(large),
+					 "GET /files/report.bin HTTP/1.1\r\n"
+					 "Host: localhost:4221\r\n"
+					 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+					 "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+					 "Accept-Encoding: gzip, deflate, br\r\n"
+					 "Accept-Language: en-US,en;q=0.9\r\n"
+					 "Connection: keep-alive\r\n"
+					 "Cookie: ");
+	for (int i = 0; i < 60; i++) {
+		n += snprintf(large + n, sizeof(large) - n, "session_%02d=%s; ", i, "0123456789abcdef0123456789abcdef0123456789");
+	}
+	n += snprintf(large + n, sizeof(large) - n, "last=1\r\n");
+	for (int i = 0; i < 20; i++) {
+		n += snprintf(large + n, sizeof(large) - n, "X-Trace-Header-%02d: value-%08d-padding-padding\r\n", i, i * 7919);
+	}
+	snprintf(large + n, sizeof(large) - n, "\r\n");
+
+	// The scalar kernels are in use until header_scan_init() is called
+	for (int pass = 0; pass < 2; pass++) {
+		printf("--- %s kernels ---\n", pass == 0 ? "scalar" : header_scan_init());
+		run("small, whole", small, 0, 2000000);
+		run("small, 8-byte segments", small, 8, 1000000);
+		run("large cookies, whole", large, 0, 200000);
+		run("large cookies, 64-byte seg.", large, 64, 100000);
+	}
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Tests for the incremental request parser (app/http_parser.c).
+ *
+ * Build and run from the http-c directory:
+ *   gcc -O2 -Iapp -o /tmp/parser_test bench/parser_test.c app/http_parser.c app/header_scan.c && /tmp/parser_test
+ *
+ * Every request is parsed three ways: handed over whole, split in two at every
+ * possible point, and one byte at a time, and each must give the same result.
+ * This runs once with the scalar kernels and once with the ones picked for
+ * this CPU. Prints each failure and exits non-zero if there was any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "header_scan.h"
+#include "http_parser.h"
+
+// Small limits, so the boundaries are cheap to reach
+static const struct http_parser_limits limits = {
+	.max_header_bytes = 256,
+	.max_headers = 4,
+	.max_uri = 32,
+	.max_body = 1000,
+};
+
+static int failures;
+
+// Status the parser ended with: 0 once the header block is complete, -1 if
+// it still wants more, otherwise the error status
+static int parse_split(struct http_parser *parser, const char *request, size_t len, size_t first) {
+	http_parser_reset(parser);
+	enum http_parse_result result = http_parser_execute(parser, request, first);
+	if (result == HTTP_PARSE_INCOMPLETE) {
+		result = http_parser_execute(parser, request, len);
+	}
+	if (result == HTTP_PARSE_ERROR) {
+		return parser->error_status;
+	}
+	return result == HTTP_PARSE_DONE ? 0 : -1;
+}
+
+static int parse_bytewise(struct http_parser *parser, const char *request, size_t len) {
+	http_parser_reset(parser);
+	enum http_parse_result result = HTTP_PARSE_INCOMPLETE;
+	for (size_t available = 1; available <= len && result == HTTP_PARSE_INCOMPLETE; available++) {
+		result = http_parser_execute(parser, request, available);
+	}
+	if (result == HTTP_PARSE_ERROR) {
+		return parser->error_status;
+	}
+	return result == HTTP_PARSE_DONE ? 0 : -1;
+}
+
+// What a complete parse must have found
+struct expect {
+	size_t header_len;
+	long long content_length;
+	int chunked;
+};
+
+static void check_request(struct http_parser *parser, const char *label, const char *how, const struct expect *expect) {
+	const struct http_request *request = parser->request;
+	if (request->header_len != expect->header_len || request->content_length != expect->content_length ||
+		request->chunked != expect->chunked) {
+		printf("FAIL %s (%s): header_len %zu content_length %lld chunked %d, expected %zu %lld %d\n", label, how,
+			   request->header_len, request->content_length, request->chunked, expect->header_len,
+			   expect->content_length, expect->chunked);
+		failures++;
+	}
+}
+
+// Parse `len` bytes of `request` every way; each must end in `status` (as
+// parse_split() reports it) and, when complete, match `expect`
+static void check_len(const char *label, const char *request, size_t len, int status, const struct expect *expect) {
+	static struct http_request parsed;
+	struct http_parser parser;
+	http_parser_init(&parser, &parsed, &limits);
+
+	for (size_t first = len; first > 0; first--) {
+		int got = parse_split(&parser, request, len, first);
+		if (got != status) {
+			printf("FAIL %s: split at %zu gave %d, expected %d\n", label, first, got, status);
+			failures++;
+			return;
+		}
+		if (status == 0 && expect != NULL) {
+			check_request(&parser, label, first == len ? "whole" : "split", expect);
+		}
+	}
+	int got = parse_bytewise(&parser, request, len);
+	if (got != status) {
+		printf("FAIL %s: byte at a time gave %d, expected %d\n", label, got, status);
+		failures++;
+		return;
+	}
+	if (status == 0 && expect != NULL) {
+		check_request(&parser, label, "byte at a time", expect);
+	}
+}
+
+static void check(const char *label, const char *request, int status) {
+	check_len(label, request, strlen(request), status, NULL);
+}
+
+// A request of exactly `len` bytes: `head`, then a header padded out so the
+// whole block ends with the blank line at `len`
+static const char *padded_request(const char *head, size_t len) {
+	static char request[1024];
+	size_t head_len = strlen(head);
+	size_t fixed = head_len + strlen("X: \r\n\r\n");
+	if (len < fixed || len >= sizeof(request)) {
+		fprintf(stderr, "padded_request: %zu bytes don't fit\n", len);
+		exit(1);
+	}
+	size_t pad = len - fixed;
+	memcpy(request, head, head_len);
+	memcpy(request + head_len, "X: ", 3);
+	memset(request + head_len + 3, 'p', pad);
+	memcpy(request + head_len + 3 + pad, "\r\n\r\n", 5);
+	return request;
+}
+
+// "GET /<target_len - 1 'a's> HTTP/1.1"
+static const char *long_target(size_t target_len) {
+	static char request[256];
+	if (target_len + 32 > sizeof(request)) {
+		fprintf(stderr, "long_target: %zu bytes don't fit\n", target_len);
+		exit(1);
+	}
+	memcpy(request, "GET /", 5);
+	memset(request + 5, 'a', target_len - 1);
+	strcpy(request + 4 + target_len, " HTTP/1.1\r\n\r\n");
+	return request;
+}
+
+static const char *many_headers(int count) {
+	static char request[512];
+	size_t used = (size_t)snprintf(request, sizeof(request), "GET / HTTP/1.1\r\n");
+	for (int i = 0; i < count; i++) {
+		used += (size_t)snprintf(request + used, sizeof(request) - used, "H%d: v\r\n", i);
+	}
+	snprintf(request + used, sizeof(request) - used, "\r\n");
+	return request;
+}
+
+static void run_tests(void) {
+	// Well-formed requests, and where their header block ends
+	const char *get = "GET /echo/abc HTTP/1.1\r\nHost: localhost\r\nUser-Agent: test\r\n\r\n";
+	check_len("GET", get, strlen(get), 0, &(struct expect){ strlen(get), -1, 0 });
+	const char *bare_lf = "GET / HTTP/1.0\nHost: x\n\n";
+	check_len("bare LF line endings", bare_lf, strlen(bare_lf), 0, &(struct expect){ strlen(bare_lf), -1, 0 });
+	const char *leading_crlf = "\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+	check_len("CRLFs before the request line", leading_crlf, strlen(leading_crlf), 0,
+			  &(struct expect){ strlen(leading_crlf), -1, 0 });
+
+	// The body and the next request are not part of the header block
+	const char *with_body = "POST /files/a HTTP/1.1\r\nContent-Length: 5\r\n\r\nhelloGET / HTTP/1.1\r\n\r\n";
+	size_t head_len = strstr(with_body, "hello") - with_body;
+	check_len("POST, Content-Length", with_body, strlen(with_body), 0, &(struct expect){ head_len, 5, 0 });
+	const char *chunked = "POST /files/a HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n";
+	head_len = strstr(chunked, "5\r\n") - chunked;
+	check_len("POST, chunked", chunked, strlen(chunked), 0, &(struct expect){ head_len, -1, 1 });
+	const char *same_twice = "POST / HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 7\r\n\r\n";
+	check_len("duplicate equal Content-Length", same_twice, strlen(same_twice), 0,
+			  &(struct expect){ strlen(same_twice), 7, 0 });
+
+	// Incomplete requests ask for more
+	check("no blank line yet", "GET / HTTP/1.1\r\nHost: x\r\n", -1);
+	check("request line cut short", "GET /echo", -1);
+
+	// 400: malformed
+	check("space before the method", " GET / HTTP/1.1\r\n\r\n", 400);
+	check("no target", "GET  HTTP/1.1\r\n\r\n", 400);
+	check("control character in the target", "GET /a\x01 HTTP/1.1\r\n\r\n", 400);
+	check("bad version", "GET / HTTP/1.x\r\n\r\n", 400);
+	check("version too long", "GET / HTTP/1.10\r\n\r\n", 400);
+	check("space before the colon", "GET / HTTP/1.1\r\nHost : x\r\n\r\n", 400);
+	check("obsolete line folding", "GET / HTTP/1.1\r\nX: a\r\n b\r\n\r\n", 400);
+	check("control character in a value", "GET / HTTP/1.1\r\nX: a\x7f\r\n\r\n", 400);
+	check("CR without LF", "GET / HTTP/1.1\rX: a\r\n\r\n", 400);
+	check("Content-Length not a number", "POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\n", 400);
+	check("Content-Length negative", "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", 400);
+	check("Content-Length empty", "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n", 400);
+	check("Content-Length list", "POST / HTTP/1.1\r\nContent-Length: 5, 5\r\n\r\n", 400);
+
+	// 400: framings that could be read two ways
+	check("duplicate conflicting Content-Length", "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+		  400);
+	check("Content-Length and chunked", "POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n",
+		  400);
+	check("chunked and Content-Length", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n",
+		  400);
+	check("Transfer-Encoding without chunked", "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", 400);
+	check("chunked not last", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n", 400);
+	check("chunked overridden by a later line",
+		  "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n", 400);
+	check("chunked twice", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n",
+		  400);
+	check("Content-Length and other Transfer-Encoding",
+		  "POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: gzip\r\n\r\n", 400);
+
+	// 505: a version other than 1.x
+	check("HTTP/2.0 request line", "GET / HTTP/2.0\r\n\r\n", 505);
+	check("HTTP/0.9 request line", "GET / HTTP/0.9\r\n\r\n", 505);
+
+	// 413: Content-Length over max_body
+	check("Content-Length at max_body", "POST / HTTP/1.1\r\nContent-Length: 1000\r\n\r\n", 0);
+	check("Content-Length over max_body", "POST / HTTP/1.1\r\nContent-Length: 1001\r\n\r\n", 413);
+	check("Content-Length too large to parse", "POST / HTTP/1.1\r\nContent-Length: 1234567890123456789\r\n\r\n",
+		  400);
+
+	// 414: target over max_uri
+	check("target at max_uri", long_target(limits.max_uri), 0);
+	check("target over max_uri", long_target(limits.max_uri + 1), 414);
+	// 400, not 414: a method that runs into max_header_bytes
+	static char endless_method[512];
+	memset(endless_method, 'G', sizeof(endless_method) - 1);
+	check("method without end", endless_method, 400);
+
+	// 431: header block over max_header_bytes, or too many fields
+	check("header block at max_header_bytes", padded_request("GET / HTTP/1.1\r\n", limits.max_header_bytes), 0);
+	check("header block over max_header_bytes", padded_request("GET / HTTP/1.1\r\n", limits.max_header_bytes + 1),
+		  431);
+	check("headers at max_headers", many_headers((int)limits.max_headers), 0);
+	check("headers over max_headers", many_headers((int)limits.max_headers + 1), 431);
+}
+
+int main(void) {
+	// The scalar kernels are in use until header_scan_init() is called
+	for (int pass = 0; pass < 2; pass++) {
+		printf("--- %s kernels ---\n", pass == 0 ? "scalar" : header_scan_init());
+		int before = failures;
+		run_tests();
+		printf("%s\n", failures == before ? "ok" : "FAILED");
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Run the standard benchmark matrix against a freshly built server on
+# localhost and append one JSON line per run to a results file.
+#
+#   bench/run_matrix.sh [results.jsonl]
+#
+# The results file defaults to bench/results/<date>-<commit>.jsonl. Compare
+# two runs with bench/compare.sh.
+#
+# Environment:
+#   DURATION     seconds measured per run (default 5)
+#   WARMUP       seconds of load before measuring (default 1)
+#   CONNECTIONS  concurrency levels (default "1 64 256")
+#   THREADS      load generator threads (default 2)
+#   SERVER_ARGS  extra server flags, e.g. "--io-backend io_uring --cache-size 16M"
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNECTIONS=${CONNECTIONS:-"1 64 256"}
+THREADS=${THREADS:-2}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD 2>/dev/null; then
+	commit="$commit-dirty"
+fi
+results=${1:-bench/results/$(date -u +%Y%m%dT%H%M%SZ)-$commit.jsonl}
+mkdir -p "$(dirname "$results")"
+
+work=$(mktemp -d)
+server_pid=
+cleanup() {
+	if [ -n "$server_pid" ]; then
+		kill "$server_pid" 2>/dev/null || true
+		wait "$server_pid" 2>/dev/null || true
+	fi
+	rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+gcc -O2 -o "$work/http-c" app/*.c -lz -lssl -lcrypto
+gcc -O2 -pthread -o "$work/loadgen" bench/loadgen.c
+
+mkdir "$work/files"
+head -c 1024 /dev/urandom > "$work/files/1k.bin"
+head -c 65536 /dev/urandom > "$work/files/64k.bin"
+head -c 1048576 /dev/urandom > "$work/files/1m.bin"
+seq 1 20000 > "$work/files/page.txt"
+
+# shellcheck disable=SC2086 # SERVER_ARGS is a list of flags
+"$work/http-c" --directory "$work/files" $SERVER_ARGS > "$work/server.log" 2>&1 &
+server_pid=$!
+# Wait for the listening socket
+tries=0
+until "$work/loadgen" --duration 0.05 --warmup 0 --connections 1 --mix root > /dev/null 2>&1; do
+	tries=$((tries + 1))
+	if [ $tries -gt 50 ] || ! kill -0 "$server_pid" 2>/dev/null; then
+		echo "Server did not start:" >&2
+		cat "$work/server.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+# name, then loadgen flags
+run() {
+	name=$1
+	shift
+	"$work/loadgen" --duration "$DURATION" --warmup "$WARMUP" --threads "$THREADS" \
+		--label "$name" --json "$results" "$@"
+}
+
+mix="root@2,echo:64@4,user-agent@2,get:1k.bin@4,get:64k.bin@1,post:upload.bin:4096@1"
+for c in $CONNECTIONS; do
+	run "root c$c" --connections "$c" --mix root
+	run "echo-16 c$c" --connections "$c" --mix echo:16
+	run "echo-1k c$c" --connections "$c" --mix echo:1024
+	run "user-agent c$c" --connections "$c" --mix user-agent
+	run "get-1k c$c" --connections "$c" --mix get:1k.bin
+	run "get-64k c$c" --connections "$c" --mix get:64k.bin
+	run "get-1m c$c" --connections "$c" --mix get:1m.bin
+	run "get-gzip-text c$c" --connections "$c" --gzip 1 --mix get:page.txt
+	run "post-4k c$c" --connections "$c" --mix post:upload.bin:4096
+	run "post-1m c$c" --connections "$c" --mix post:upload.bin:1048576
+	run "mix c$c" --connections "$c" --mix "$mix"
+	run "root close c$c" --connections "$c" --keep-alive 0 --mix root
+	run "get-1k close c$c" --connections "$c" --keep-alive 0 --mix get:1k.bin
+done
+
+echo "Results: $results"
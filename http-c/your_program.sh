@@ -20,10 +20,11 @@ set -e # Exit early if any commands fail
   cd "$(dirname "$0")"
 
   # Use the gcc compiler to compile all C source files located in the 'app' directory.
-  # The '-lcurl' and '-lz' options link the compiled program with the libcurl and zlib libraries, respectively.
   # The '-o' option specifies the output file, which in this case is '/tmp/http-c'.
   # This means the compiled program will be saved in the '/tmp' directory with the name 'http-c'.
-  gcc -lcurl -lz -o /tmp/http-c app/*.c
+  # The '-lz' and '-lssl -lcrypto' options link the compiled program with zlib and OpenSSL, respectively.
+  # Libraries must come after the sources: the linker only keeps a library that something before it uses.
+  gcc -o /tmp/http-c app/*.c -lz -lssl -lcrypto
 )
 
 # The following command is responsible for executing the compiled program.